@@ -90,10 +90,12 @@ typedef enum {
     NABTO_COAP_OPTION_MAX_AGE = 14,
     NABTO_COAP_OPTION_URI_QUERY = 15,
     NABTO_COAP_OPTION_ACCEPT = 17,
+    NABTO_COAP_OPTION_QBLOCK1 = 19,
     NABTO_COAP_OPTION_LOCATION_QUERY = 20,
     NABTO_COAP_OPTION_BLOCK2 = 23,
     NABTO_COAP_OPTION_BLOCK1 = 27,
     NABTO_COAP_OPTION_SIZE2 = 28,
+    NABTO_COAP_OPTION_QBLOCK2 = 31,
     NABTO_COAP_OPTION_PROXY_URI = 35,
     NABTO_COAP_OPTION_PROXY_SCHEME = 39,
     NABTO_COAP_OPTION_SIZE1 = 60
@@ -104,6 +106,7 @@ typedef enum  {
     NABTO_COAP_CONTENT_FORMAT_APPLICATION_OCTET_STREAM = 42,
     NABTO_COAP_CONTENT_FORMAT_APPLICATION_JSON = 50,
     NABTO_COAP_CONTENT_FORMAT_APPLICATION_CBOR = 60,
+    NABTO_COAP_CONTENT_FORMAT_APPLICATION_MISSING_BLOCKS_CBOR_SEQ = 272,
 } nabto_coap_content_format;
 
 typedef struct {
@@ -136,6 +139,18 @@ struct nabto_coap_option_iterator* nabto_coap_get_next_option(struct nabto_coap_
  */
 struct nabto_coap_option_iterator* nabto_coap_get_option(nabto_coap_option option, struct nabto_coap_option_iterator* iterator);
 
+// Messages with more options than this are rejected by the parser.
+#define NABTO_COAP_MAX_OPTIONS 32
+
+/**
+ * An option of a parsed message, the data is at options + offset.
+ */
+struct nabto_coap_option_entry {
+    uint16_t number;
+    uint32_t offset;
+    uint32_t length;
+};
+
 struct nabto_coap_incoming_message {
     nabto_coap_type type;
     nabto_coap_code code;
@@ -143,6 +158,9 @@ struct nabto_coap_incoming_message {
     nabto_coap_token token;
     const uint8_t* options;
     size_t optionsLength;
+    // All options in the order they appear, i.e. sorted by number.
+    struct nabto_coap_option_entry optionTable[NABTO_COAP_MAX_OPTIONS];
+    size_t optionCount;
     const uint8_t* payload;
     size_t payloadLength;
     // some nonrepeatable options which is nice to have decoded.
@@ -154,12 +172,26 @@ struct nabto_coap_incoming_message {
     uint32_t block2;
     bool hasObserve;
     uint32_t observe;
+    bool hasSize1;
+    uint32_t size1;
+    bool hasSize2;
+    uint32_t size2;
+    // The first Q-Block option, a request for missing blocks can have
+    // more Q-Block2 options, they are found in the option table.
+    bool hasQBlock1;
+    uint32_t qBlock1;
+    bool hasQBlock2;
+    uint32_t qBlock2;
 };
 
 
 
 #define NABTO_COAP_BLOCK_SIZE(value) ((value) & 0x7u)
-#define NABTO_COAP_BLOCK_SIZE_ABSOLUTE(value) (16u << NABTO_COAP_BLOCK_SIZE(value))
+// SZX 7 is only used on reliable transports where it means BERT, a
+// block of one or more 1024 byte units, RFC 8323 section 6.
+#define NABTO_COAP_BLOCK_SZX_BERT 7u
+#define NABTO_COAP_BLOCK_BERT_UNIT 1024u
+#define NABTO_COAP_BLOCK_SIZE_ABSOLUTE(value) ((NABTO_COAP_BLOCK_SIZE(value) == NABTO_COAP_BLOCK_SZX_BERT) ? NABTO_COAP_BLOCK_BERT_UNIT : (16u << NABTO_COAP_BLOCK_SIZE(value)))
 #define NABTO_COAP_BLOCK_NUM(value) ((value) >> 4)
 #define NABTO_COAP_BLOCK_MORE(value) (((value) & 0xF) >> 3)
 #define NABTO_COAP_BLOCK_OFFSET(value) (NABTO_COAP_BLOCK_SIZE_ABSOLUTE(value) * NABTO_COAP_BLOCK_NUM(value))
@@ -167,6 +199,102 @@ struct nabto_coap_incoming_message {
 
 bool nabto_coap_parse_message(const uint8_t* packet, size_t packetSize, struct nabto_coap_incoming_message* message);
 
+/**
+ * The payload length of a block which is not the last has to be the
+ * block size, or a multiple of 1024 for a BERT block.
+ */
+bool nabto_coap_block_payload_valid(uint32_t block, size_t payloadLength);
+
+/**
+ * Number of blocks in a block payload, more than one for BERT.
+ */
+uint32_t nabto_coap_block_count(uint32_t block, size_t payloadLength);
+
+/**
+ * Q-Block1 and Q-Block2, RFC 9177.
+ *
+ * The blocks of a body are sent back to back in sets of MAX_PAYLOADS
+ * blocks without waiting for each block to be acknowledged. The
+ * receiver asks for missing blocks, the list of missing block numbers
+ * is a CBOR sequence of unsigned integers.
+ */
+#define NABTO_COAP_QBLOCK_MAX_PAYLOADS 10
+// Pause between two sets when the receiver does not ask for the next.
+#define NABTO_COAP_QBLOCK_NON_TIMEOUT 2000
+// How long the receiver waits for more blocks before asking again.
+#define NABTO_COAP_QBLOCK_NON_RECEIVE_TIMEOUT 4000
+// How long a sent body is kept for requests for missing blocks.
+#define NABTO_COAP_QBLOCK_NON_PARTIAL_TIMEOUT 247000
+// Largest body reassembled from blocks when no body size limit is set.
+#define NABTO_COAP_QBLOCK_DEFAULT_MAX_BODY_SIZE (1024*1024)
+// Blocks this far beyond the highest block received are not stored,
+// they are dropped as if lost and asked for again later.
+#define NABTO_COAP_QBLOCK_MAX_AHEAD (2*NABTO_COAP_QBLOCK_MAX_PAYLOADS)
+
+/**
+ * Encode an unsigned integer as CBOR, major type 0.
+ *
+ * @return NULL if it does not fit.
+ */
+uint8_t* nabto_coap_encode_cbor_uint(uint32_t value, uint8_t* buffer, uint8_t* end);
+
+/**
+ * Decode an unsigned integer encoded as CBOR.
+ *
+ * @return the byte after the integer, NULL if it is not a valid
+ * unsigned integer of at most 32 bits.
+ */
+const uint8_t* nabto_coap_decode_cbor_uint(const uint8_t* ptr, const uint8_t* end, uint32_t* value);
+
+/**
+ * CoAP over reliable byte streams, RFC 8323.
+ *
+ * A frame is a length prefixed message without type and message id.
+ * Messages are never acknowledged or retransmitted, the stream takes
+ * care of that. Instead the two ends exchange signalling messages,
+ * a CSM telling the max message size and whether BERT blocks are
+ * supported, and Ping/Pong.
+ */
+#define NABTO_COAP_FRAME_DEFAULT_MAX_MESSAGE_SIZE 1152
+
+enum {
+    NABTO_COAP_SIGNAL_CSM = NABTO_COAP_CODE(7,1),
+    NABTO_COAP_SIGNAL_PING = NABTO_COAP_CODE(7,2),
+    NABTO_COAP_SIGNAL_PONG = NABTO_COAP_CODE(7,3),
+    NABTO_COAP_SIGNAL_RELEASE = NABTO_COAP_CODE(7,4),
+    NABTO_COAP_SIGNAL_ABORT = NABTO_COAP_CODE(7,5)
+};
+
+// Options of the CSM signal.
+#define NABTO_COAP_SIGNAL_OPTION_MAX_MESSAGE_SIZE 2
+#define NABTO_COAP_SIGNAL_OPTION_BLOCK_WISE_TRANSFER 4
+
+/**
+ * Get the size of the frame starting at buffer, such that frames can be
+ * cut out of the bytes read from a stream.
+ *
+ * @return false if more bytes are needed to tell the size.
+ */
+bool nabto_coap_frame_size(const uint8_t* buffer, size_t available, size_t* frameSize);
+
+/**
+ * Parse a complete frame. The message gets type NON and message id 0.
+ */
+bool nabto_coap_parse_frame(const uint8_t* frame, size_t frameSize, struct nabto_coap_incoming_message* message);
+
+/**
+ * Turn the datagram encoded from buffer to ptr into a frame in place.
+ *
+ * @return the end of the frame, NULL if it does not fit before end.
+ */
+uint8_t* nabto_coap_datagram_to_frame(uint8_t* buffer, uint8_t* ptr, uint8_t* end);
+
+/**
+ * Index in the option table of the first option with the given number
+ * at or after start, optionCount if there is none.
+ */
+size_t nabto_coap_find_option(const struct nabto_coap_incoming_message* message, uint16_t number, size_t start);
+
 bool nabto_coap_is_stamp_less(uint32_t s1, uint32_t s2);
 bool nabto_coap_is_stamp_less_equal(uint32_t s1, uint32_t s2);
 
@@ -36,10 +36,15 @@ enum nabto_coap_client_status {
 struct nabto_coap_client_settings {
     uint32_t ackTimeoutMilliseconds;
     uint8_t maxRetransmits;
+    size_t maxResponseBodySize; // larger Block2 and Q-Block2 responses fail with a decode error
 };
 
 struct nabto_coap_client_response;
 struct nabto_coap_client_request;
+struct nabto_coap_index;
+struct nabto_coap_rtt_table;
+struct nabto_coap_path_table;
+struct nabto_coap_stream_table;
 
 // Called when a response to a request is ready and the request can be freed.
 typedef void (*nabto_coap_client_request_end_handler)(struct nabto_coap_client_request* request, void* userData);
@@ -49,9 +54,30 @@ struct nabto_coap_client {
     struct nn_allocator allocator;
     // list of requests in the client
     struct nabto_coap_client_request* requestsSentinel;
+
+    // requests indexed by (connection, token), such that responses can
+    // be matched to their request without walking the list.
+    struct nabto_coap_index* requestsByToken;
+
+    // requests indexed by (connection, messageId), such that ACKs and
+    // RSTs can be matched to them.
+    struct nabto_coap_index* requestsByMessageId;
+
     uint16_t messageIdCounter;
     uint64_t tokenCounter;
 
+    // Retransmission timeouts adapted to each connection,
+    // settings.ackTimeoutMilliseconds is the initial RTO.
+    struct nabto_coap_rtt_table* rtt;
+
+    // Block sizes of connections with an MTU hint, see
+    // nabto_coap_client_set_mtu.
+    struct nabto_coap_path_table* paths;
+
+    // Connections carrying frames over a reliable stream, see
+    // nabto_coap_client_stream_open.
+    struct nabto_coap_stream_table* streams;
+
     // Notify the implementer that an event has happened.
     nabto_coap_notify_event notifyEvent;
 
@@ -106,16 +132,60 @@ nabto_coap_error nabto_coap_client_request_set_payload(struct nabto_coap_client_
 
 void nabto_coap_client_request_set_nonconfirmable(struct nabto_coap_client_request* request);
 
+/**
+ * Send the request body with Q-Block1 and ask for the response with
+ * Q-Block2, RFC 9177. The blocks are NONs sent in sets of
+ * NABTO_COAP_QBLOCK_MAX_PAYLOADS without waiting for each block, and
+ * missing blocks are asked for again. If the server answers the first
+ * block with 4.02 or 4.00 the request starts over with Block1 and
+ * Block2. Q-Block is not used on streams. Must be called before
+ * nabto_coap_client_request_send().
+ */
+void nabto_coap_client_request_set_qblock(struct nabto_coap_client_request* request);
+
 /**
  * Sets the timeout for the server to provide a response within
  */
 void nabto_coap_client_request_set_timeout(struct nabto_coap_client_request* request, uint32_t timeout);
 
+/**
+ * Limit the size of response bodies received in blocks. A Block2 or
+ * Q-Block2 response whose body, or announced Size2, is larger fails
+ * with NABTO_COAP_CLIENT_STATUS_DECODE_ERROR before it is reserved.
+ * Default is no limit for Block2 responses, Q-Block2 responses are
+ * limited to NABTO_COAP_QBLOCK_DEFAULT_MAX_BODY_SIZE.
+ */
+void nabto_coap_client_limit_response_body_size(struct nabto_coap_client* client, size_t limit);
+
 /**
  * Remove a connection if it has been closed
  */
 void nabto_coap_client_remove_connection(struct nabto_coap_client* client, void *connection);
 
+/**
+ * Tell the largest CoAP message the transport can send to a connection
+ * in one datagram, after the IP, UDP and DTLS overhead, 0 forgets it.
+ * Requests sent afterwards use the largest block size which fits, 1024
+ * bytes at most, instead of 512 bytes, for Block1 and asked for in
+ * Block2. A smaller block size asked for by the server is honoured.
+ * When a block times out twice the block size of the connection is
+ * halved for the blocks which follow.
+ */
+nabto_coap_error nabto_coap_client_set_mtu(struct nabto_coap_client* client, void* connection, uint16_t mtu);
+
+/**
+ * Use CoAP over a reliable stream on a connection, RFC 8323. Packets
+ * given to and taken from the client for the connection are then
+ * frames, the caller cuts them out of the stream with
+ * nabto_coap_frame_size. Requests are never retransmitted and only
+ * time out by their configured timeout. Request bodies are sent in
+ * BERT blocks if the server supports them. A CSM telling
+ * maxMessageSize, 0 for the default 1152 bytes, is sent first. The
+ * stream ends with nabto_coap_client_remove_connection, or when the
+ * server sends a Release or Abort.
+ */
+nabto_coap_error nabto_coap_client_stream_open(struct nabto_coap_client* client, void* connection, uint32_t maxMessageSize);
+
 /**
  * set the expeched content format of the response body.
  * this can be called several times.
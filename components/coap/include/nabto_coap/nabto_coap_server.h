@@ -31,12 +31,126 @@ struct nabto_coap_server_response;
 struct nabto_coap_server_resource;
 struct nabto_coap_server_request_parameter;
 struct nabto_coap_server_observer;
+struct nabto_coap_index;
+struct nabto_coap_connection_table;
+struct nabto_coap_server_exchange;
+struct nabto_coap_server_send_lane;
+struct nabto_coap_rtt_table;
+struct nabto_coap_path_table;
+struct nabto_coap_stream_table;
+struct nabto_coap_server_completions;
+
+#define NABTO_COAP_SERVER_MAX_CONTROL_MESSAGES 16
+
+// Seconds a client is asked to wait when rejected for lack of memory.
+#define NABTO_COAP_SERVER_DEFAULT_MEMORY_RETRY_AFTER 2
+
+/**
+ * Order in which responses and notifications are sent. Empty ACKs and
+ * error responses are always sent first.
+ */
+enum nabto_coap_server_send_policy {
+    // Responses, then block2 continuations, then notifications. Within
+    // each of these the connections take turns.
+    NABTO_COAP_SERVER_SEND_POLICY_FAIR,
+    // In the order the packets became ready to be sent.
+    NABTO_COAP_SERVER_SEND_POLICY_FIFO
+};
+
+#define NABTO_COAP_SERVER_SEND_CLASSES 3
+
+/**
+ * An empty ACK (type NABTO_COAP_TYPE_ACK) or an error response (type
+ * NABTO_COAP_TYPE_NON) which is queued to be sent.
+ */
+struct nabto_coap_server_control_message {
+    void*            connection;
+    nabto_coap_type  type;
+    uint16_t         messageId;
+    uint8_t          code;
+    nabto_coap_token token;
+    const void*      payload;
+    size_t           payloadLength;
+    // Size1 option, used to tell the max body size in a 4.13 response.
+    bool             hasSize1;
+    uint32_t         size1;
+    // Max-Age option, used to tell when to retry after a 5.03 response.
+    bool             hasMaxAge;
+    uint32_t         maxAge;
+};
+
+/**
+ * Object types which are allocated from fixed size pools, see
+ * nabto_coap_server_limit_pool.
+ */
+enum nabto_coap_server_pool_type {
+    NABTO_COAP_SERVER_POOL_REQUESTS,
+    NABTO_COAP_SERVER_POOL_PARAMETERS,
+    NABTO_COAP_SERVER_POOL_PARAMETER_VALUES, // route parameter values up to 31 bytes
+    NABTO_COAP_SERVER_POOL_OBSERVERS,
+    NABTO_COAP_SERVER_POOL_SEND_LANES,
+    NABTO_COAP_SERVER_POOL_COUNT
+};
+
+struct nabto_coap_server_pool_stats {
+    size_t inUse;    // objects currently allocated
+    size_t peak;     // highest inUse seen
+    size_t capacity; // objects in the slabs taken from the allocator
+    size_t failures; // allocations refused by the limit or the allocator
+};
+
+struct nabto_coap_server_pool {
+    size_t objectSize;
+    size_t maxObjects; // 0 means no limit
+    void* slabs;
+    void* freeList;
+    struct nabto_coap_server_pool_stats stats;
+};
+
+#ifdef NABTO_COAP_SERVER_METRICS
+#define NABTO_COAP_SERVER_LATENCY_BUCKETS 12
+
+/**
+ * Counters of a requests context, enabled by building with
+ * NABTO_COAP_SERVER_METRICS. Rates are found by comparing two
+ * snapshots.
+ */
+struct nabto_coap_server_metrics {
+    uint64_t packetsReceived;
+    uint64_t invalidPackets;     // packets which could not be parsed
+    uint64_t requests;           // new requests
+    uint64_t duplicateRequests;  // retransmitted requests which were acked again
+    uint64_t acks;
+    uint64_t resets;
+    uint64_t block1Received;     // request packets with a Block1 option
+    uint64_t block2Sent;         // response packets with a Block2 option
+    uint64_t packetsSent;        // including empty ACKs and error responses
+    uint64_t retransmissions;    // responses and notifications resent after a timeout
+    uint64_t expired;            // responses and observers given up after the last retransmission
+    uint64_t controlDropped;     // empty ACKs and error responses dropped as the control ring was full
+    uint64_t notifications;      // notifications started by nabto_coap_server_resource_notify
+    uint64_t notificationsCoalesced; // notifications which replaced a pending one
+    // Current values and the highest value seen.
+    size_t observers;
+    size_t controlQueued;
+    size_t sendQueued;           // responses and notifications queued to be sent
+    size_t sendQueuedPeak;
+    size_t timers;               // responses and notifications waiting for a deadline
+    size_t activeRequests;
+    // Time from a request is given to its handler until the response is
+    // ready. Bucket i counts latencies below 2^i ms, the last bucket
+    // counts the rest.
+    uint64_t handlerLatency[NABTO_COAP_SERVER_LATENCY_BUCKETS];
+};
+#endif
 
 struct nabto_coap_server {
     struct nn_log* logger;
     struct nn_allocator allocator;
     struct nabto_coap_router_node* root;
     uint32_t ackTimeout;
+    // pools taking slabs from the allocator
+    struct nabto_coap_server_pool pools[NABTO_COAP_SERVER_POOL_COUNT];
 };
 
 /**
@@ -48,6 +162,27 @@ struct nabto_coap_server_requests {
     struct nabto_coap_server* server;
     struct nabto_coap_server_request* requestsSentinel;
 
+    // requests indexed by (connection, token), such that incoming
+    // packets can be matched to their request without walking the list.
+    struct nabto_coap_index* requestsByToken;
+
+    // responses and notifications indexed by (connection, messageId),
+    // such that ACKs and RSTs can be matched to them.
+    struct nabto_coap_index* exchangesByMessageId;
+
+    // min heap of exchanges waiting for a retransmission deadline.
+    struct nabto_coap_server_exchange** timers;
+    size_t timersSize;     // exchanges in the heap
+    size_t timersCapacity; // allocated slots
+    size_t timersReserved; // slots reserved by live requests and observers
+
+    // Exchanges which has a packet ready to be sent, queued in a lane
+    // per connection and send class. Each class has a ring of lanes.
+    enum nabto_coap_server_send_policy sendPolicy;
+    struct nabto_coap_server_send_lane* sendRings[NABTO_COAP_SERVER_SEND_CLASSES];
+    struct nabto_coap_server_send_lane* sharedLanes; // a lane per class not bound to a connection
+    struct nabto_coap_index* lanesByConnection;
+
     nabto_coap_get_stamp getStamp;
     // notify implementation that an event has potentially occured.
     nabto_coap_notify_event notifyEvent;
@@ -57,23 +192,50 @@ struct nabto_coap_server_requests {
 
     uint16_t messageId;
 
-    // if we need to send an error back. If errorConnection is non
-    // null we need to send an error back else there's no error to
-    // send back.
-    void*            errorConnection;
-    uint8_t          errorCode;
-    nabto_coap_token errorToken;
-    uint16_t         errorMessageId;
-    const void*      errorPayload;
-    size_t           errorPayloadLength;
+    // Retransmission timeouts adapted to each connection, the server
+    // ackTimeout is the initial RTO.
+    struct nabto_coap_rtt_table* rtt;
+
+    // Block sizes of connections with an MTU hint, see
+    // nabto_coap_server_set_mtu.
+    struct nabto_coap_path_table* paths;
+
+    // Connections carrying frames over a reliable stream, see
+    // nabto_coap_server_stream_open.
+    struct nabto_coap_stream_table* streams;
 
-    uint16_t ackMessageId;
-    void* ackConnection;
+    // Requests completed from other threads, see
+    // nabto_coap_server_response_ready_async.
+    struct nabto_coap_server_completions* completions;
+
+    // Ring of empty ACKs and error responses waiting to be sent, they
+    // are sent before any responses or notifications. If the ring is
+    // full new control messages are dropped and counted in
+    // controlDropped, the client will then retransmit its request.
+    struct nabto_coap_server_control_message controlMessages[NABTO_COAP_SERVER_MAX_CONTROL_MESSAGES];
+    size_t controlHead;
+    size_t controlCount;
+    size_t controlDropped;
 
     size_t maxRequests; // max concurrent requests
     size_t activeRequests;
+    size_t maxRequestBodySize; // requests with larger payloads are rejected with 4.13
+    bool borrowRequestPayloads; // see nabto_coap_server_borrow_request_payloads
+    struct nabto_coap_server_request* dispatchedRequest; // request whose handler is running
+
+    // Bytes of request bodies, response payloads and notifications held
+    // by the context, see nabto_coap_server_limit_memory.
+    size_t memoryBudget;
+    size_t connectionMemoryBudget;
+    uint32_t memoryRetryAfter; // Max-Age of 5.03 responses caused by the budget
+    size_t memoryUsed;
+    struct nabto_coap_connection_table* connectionUsage; // bytes used per connection
 
     struct nabto_coap_server_observer* observersSentinel;
+
+#ifdef NABTO_COAP_SERVER_METRICS
+    struct nabto_coap_server_metrics metrics;
+#endif
 };
 
 nabto_coap_error nabto_coap_server_init(struct nabto_coap_server* server, struct nn_log* logger, struct nn_allocator* allocator);
@@ -87,6 +249,66 @@ void nabto_coap_server_requests_destroy(struct nabto_coap_server_requests* reque
 
 void nabto_coap_server_limit_requests(struct nabto_coap_server_requests* requests, size_t limit);
 
+/**
+ * Set the order in which responses and notifications are sent, the
+ * default is NABTO_COAP_SERVER_SEND_POLICY_FAIR.
+ */
+void nabto_coap_server_set_send_policy(struct nabto_coap_server_requests* requests, enum nabto_coap_server_send_policy policy);
+
+/**
+ * Limit the number of objects of a type the server can have allocated
+ * at a time, across all requests contexts. When a pool is exhausted
+ * new requests are rejected with 5.03. Default is no limit.
+ */
+void nabto_coap_server_limit_pool(struct nabto_coap_server* server, enum nabto_coap_server_pool_type type, size_t maxObjects);
+
+void nabto_coap_server_get_pool_stats(struct nabto_coap_server* server, enum nabto_coap_server_pool_type type, struct nabto_coap_server_pool_stats* stats);
+
+/**
+ * Limit the size of request payloads, also when reassembled from
+ * block1 transfers. Larger requests are rejected with 4.13 Request
+ * Entity Too Large and a Size1 option telling the limit. Default is no
+ * limit, except for Q-Block1 transfers which are limited to
+ * NABTO_COAP_QBLOCK_DEFAULT_MAX_BODY_SIZE.
+ */
+void nabto_coap_server_limit_request_body_size(struct nabto_coap_server_requests* requests, size_t limit);
+
+/**
+ * Do not copy the payload of a request which fits in a single datagram
+ * before the handler is called. A handler can then read it in the
+ * received packet with nabto_coap_server_request_get_payload_view.
+ * nabto_coap_server_request_get_payload still gives a zero terminated
+ * copy, which is made when it is first called. If the request has not
+ * been freed when the handler returns, the payload is copied. The copy
+ * is charged to the memory budget before the handler is called, a
+ * request which does not fit is answered with 5.03 as without
+ * borrowing. If the allocator fails to make the copy the request is
+ * kept without a payload and nabto_coap_server_request_get_payload
+ * returns false, a handler which keeps a request with a body has to
+ * check that before it relies on it. Default is off.
+ */
+void nabto_coap_server_borrow_request_payloads(struct nabto_coap_server_requests* requests, bool enable);
+
+/**
+ * Limit the bytes held for request bodies, response payloads and
+ * pending notifications, in total and per connection. Requests which
+ * would exceed a limit are rejected with 5.03 Service Unavailable and a
+ * Max-Age of retryAfter seconds, and setting a payload or notifying
+ * which would exceed it fails with NABTO_COAP_ERROR_OUT_OF_MEMORY.
+ * Default is no limit.
+ */
+void nabto_coap_server_limit_memory(struct nabto_coap_server_requests* requests, size_t budget, size_t connectionBudget, uint32_t retryAfter);
+
+size_t nabto_coap_server_get_memory_usage(struct nabto_coap_server_requests* requests);
+size_t nabto_coap_server_get_connection_memory_usage(struct nabto_coap_server_requests* requests, void* connection);
+
+#ifdef NABTO_COAP_SERVER_METRICS
+/**
+ * Get a snapshot of the metrics of a requests context.
+ */
+void nabto_coap_server_get_metrics(struct nabto_coap_server_requests* requests, struct nabto_coap_server_metrics* metrics);
+#endif
+
 #define NABTO_COAP_SERVER_LOG_TRACE(fmt, args) do { printf(fmt, args); } while(0);
 
 /**
@@ -105,6 +327,49 @@ nabto_coap_error nabto_coap_server_add_resource(struct nabto_coap_server* server
 
 void nabto_coap_server_remove_resource(struct nabto_coap_server_resource* resource);
 
+/**
+ * Cache the GET responses of a resource.
+ *
+ * 2.05 responses from the handler are kept per combination of route
+ * parameters, up to maxEntries of them, together with a generated
+ * ETag. Later GETs with the same parameters are answered from the
+ * cache without calling the handler, and with 2.03 Valid if the client
+ * sends the ETag. Observe registrations always go to the handler.
+ * maxEntries 0 disables the cache.
+ *
+ * The entries are shared by all connections and a hit never calls the
+ * handler, so authorization done in the handler, e.g. from
+ * nabto_coap_server_request_get_connection, is skipped. Do not enable
+ * the cache on a resource whose response depends on the caller unless
+ * a check is set with nabto_coap_server_resource_set_cache_check.
+ *
+ * The cache belongs to the resource and is shared by all requests
+ * contexts of the server, it has no lock. Requests contexts using
+ * cached resources have to be driven from one thread.
+ */
+void nabto_coap_server_resource_enable_cache(struct nabto_coap_server* server, struct nabto_coap_server_resource* resource, size_t maxEntries);
+
+/**
+ * Called for a request which has a cached response before it is
+ * answered from the cache. Return true to send the cached response,
+ * false to call the handler as if nothing was cached. The check can
+ * read the connection and the parameters of the request, it must not
+ * answer or free it.
+ */
+typedef bool (*nabto_coap_server_cache_check)(struct nabto_coap_server_request* request, void* userData);
+
+/**
+ * Set the check asked on cache hits of a resource, NULL removes it.
+ */
+void nabto_coap_server_resource_set_cache_check(struct nabto_coap_server_resource* resource, nabto_coap_server_cache_check check, void* userData);
+
+/**
+ * Drop all cached responses of a resource, call it when the state the
+ * responses are made from changes. Notifying observers of the resource
+ * also invalidates the cache.
+ */
+void nabto_coap_server_resource_invalidate_cache(struct nabto_coap_server* server, struct nabto_coap_server_resource* resource);
+
 /**
  * Find the userdata of a previously added resource.
  * parameters must be an initialized string map
@@ -119,12 +384,86 @@ void nabto_coap_server_response_set_code_human(struct nabto_coap_server_request*
 
 nabto_coap_error nabto_coap_server_response_set_payload(struct nabto_coap_server_request* request, const void* data, size_t dataSize);
 
+/**
+ * Produce a part of a response body on demand.
+ *
+ * The producer is called each time a block of the response is sent,
+ * retransmissions included, so the same offset has to give the same
+ * bytes. A block which is not the last has to fill the buffer.
+ *
+ * @param userData    The userData given to set_payload_producer.
+ * @param offset      Offset of the block into the response body.
+ * @param buffer      Where the block is written.
+ * @param bufferSize  Max number of bytes to write, the block size.
+ * @param written     Set to the number of bytes written.
+ * @param more        Set to true if the body continues after this block.
+ * @return NABTO_COAP_ERROR_OK, any other value sends a 5.00 response without payload.
+ */
+typedef nabto_coap_error (*nabto_coap_server_payload_producer)(void* userData, size_t offset, uint8_t* buffer, size_t bufferSize, size_t* written, bool* more);
+
+/**
+ * Called when the server no longer needs the producer or the payload.
+ */
+typedef void (*nabto_coap_server_payload_release)(void* userData);
+
+/**
+ * Let the response body be produced a block at a time while it is
+ * sent, such that a large body never has to be held in memory. The
+ * producer replaces any payload set on the response. release is
+ * optional and called once when the request is freed.
+ */
+nabto_coap_error nabto_coap_server_response_set_payload_producer(struct nabto_coap_server_request* request, nabto_coap_server_payload_producer producer, nabto_coap_server_payload_release release, void* userData);
+
+/**
+ * Let the response point at memory owned by the caller instead of a
+ * copy. The data has to stay valid and unchanged until release is
+ * called, which happens when the payload is replaced or the request is
+ * freed. release is optional, e.g. for constant data.
+ */
+nabto_coap_error nabto_coap_server_response_set_payload_borrowed(struct nabto_coap_server_request* request, const void* data, size_t dataSize, nabto_coap_server_payload_release release, void* userData);
+
 void nabto_coap_server_response_set_content_format(struct nabto_coap_server_request* request, uint16_t format);
 
 nabto_coap_error nabto_coap_server_response_ready(struct nabto_coap_server_request* request);
 
 void nabto_coap_server_request_free(struct nabto_coap_server_request* request);
 
+/**
+ * Mark a request as passed on to another thread, e.g. a worker which
+ * completes it with nabto_coap_server_response_ready_async. Call it on
+ * the thread running the requests context, normally from the handler,
+ * before the request is passed on.
+ *
+ * Afterwards the worker may set the code, the content format and a
+ * borrowed payload or a payload producer. The payload or producer is
+ * only recorded, it replaces the payload of the response on the thread
+ * running the requests context when the request is completed. A
+ * copied payload is charged to the memory budget of the requests
+ * context, it can only be set before this call,
+ * nabto_coap_server_response_set_payload fails with
+ * NABTO_COAP_ERROR_INVALID_PARAMETER afterwards.
+ *
+ * No other request function may be called on the request after this
+ * call, from any thread, except those setting the response listed
+ * above. Read the payload, the parameters and anything else the worker
+ * needs before it. nabto_coap_server_response_ready fails with
+ * NABTO_COAP_ERROR_INVALID_PARAMETER and nabto_coap_server_request_free
+ * does nothing, the request is only completed and freed by
+ * nabto_coap_server_response_ready_async.
+ */
+void nabto_coap_server_request_begin_async(struct nabto_coap_server_request* request);
+
+/**
+ * Complete a request from any thread, e.g. a worker the handler has
+ * passed the request on to, see nabto_coap_server_request_begin_async.
+ * The response is made ready and the request freed on the thread
+ * running the requests context the next time it asks for an event or
+ * something to send, the request must not be used by the caller
+ * afterwards. notifyEvent is called from the calling thread to wake
+ * the event loop, so it has to be thread safe.
+ */
+void nabto_coap_server_response_ready_async(struct nabto_coap_server_request* request);
+
 /**
  * request functions
  */
@@ -137,6 +476,13 @@ int32_t nabto_coap_server_request_get_content_format(struct nabto_coap_server_re
 
 bool nabto_coap_server_request_get_payload(struct nabto_coap_server_request* request, void** payload, size_t* payloadLength);
 
+/**
+ * Get the payload without copying it, see
+ * nabto_coap_server_borrow_request_payloads. The view is only valid
+ * while the request handler runs and it is not zero terminated.
+ */
+bool nabto_coap_server_request_get_payload_view(struct nabto_coap_server_request* request, const void** payload, size_t* payloadLength);
+
 void* nabto_coap_server_request_get_connection(struct nabto_coap_server_request* request);
 
 const char* nabto_coap_server_request_get_parameter(struct nabto_coap_server_request* request, const char* parameter);
@@ -164,8 +510,36 @@ nabto_coap_error nabto_coap_server_request_accept_observe(struct nabto_coap_serv
 struct nabto_coap_server_observer* nabto_coap_server_request_get_observer(struct nabto_coap_server_request* request);
 
 /**
- * Push a notification to all observers of a resource.
- * Each observer receives a CON message with the given payload.
+ * How notifications are sent to an observer. The zero policy sends
+ * every notification at once as a CON.
+ */
+struct nabto_coap_server_notify_policy {
+    // Notifications less than minInterval ms after the previous one are
+    // coalesced, the latest is sent when the interval has passed.
+    uint32_t minInterval;
+    // If nothing has been sent for maxInterval ms the current state is
+    // sent again as a CON, such that a client which has gone away is
+    // detected. 0 disables.
+    uint32_t maxInterval;
+    // Send every conEvery'th notification as a CON and the rest as NON,
+    // see RFC 7641 section 4.5. 0 and 1 send all as CON.
+    uint32_t conEvery;
+};
+
+/**
+ * Set the notify policy of the current and future observers of a
+ * resource. It takes effect from the next notification.
+ */
+void nabto_coap_server_resource_set_notify_policy(struct nabto_coap_server_resource* resource, const struct nabto_coap_server_notify_policy* policy);
+
+/**
+ * Override the notify policy of one observer.
+ */
+void nabto_coap_server_observer_set_notify_policy(struct nabto_coap_server_observer* observer, const struct nabto_coap_server_notify_policy* policy);
+
+/**
+ * Push a notification to all observers of a resource. Each observer
+ * receives it according to its notify policy, by default as a CON.
  */
 nabto_coap_error nabto_coap_server_resource_notify(
     struct nabto_coap_server_requests* requests,
@@ -187,6 +561,29 @@ void nabto_coap_server_handle_packet(struct nabto_coap_server_requests* requests
 
 void nabto_coap_server_remove_connection(struct nabto_coap_server_requests* requests, void* connection);
 
+/**
+ * Tell the largest CoAP message the transport can send to a connection
+ * in one datagram, after the IP, UDP and DTLS overhead, 0 forgets it.
+ * Block2 responses to the connection then use the largest block size
+ * which fits, 1024 bytes at most, instead of 512 bytes. A smaller block
+ * size asked for by the client is honoured. When a block times out
+ * twice the block size of the connection is halved for the blocks
+ * which follow.
+ */
+nabto_coap_error nabto_coap_server_set_mtu(struct nabto_coap_server_requests* requests, void* connection, uint16_t mtu);
+
+/**
+ * Use CoAP over a reliable stream on a connection, RFC 8323. Packets
+ * given to and taken from the server for the connection are then
+ * frames, the caller cuts them out of the stream with
+ * nabto_coap_frame_size. Messages are never retransmitted or
+ * acknowledged, and blocks can be BERT blocks if the client supports
+ * them. A CSM telling maxMessageSize, 0 for the default 1152 bytes, is
+ * sent first. The stream ends with nabto_coap_server_remove_connection,
+ * or when the client sends a Release or Abort.
+ */
+nabto_coap_error nabto_coap_server_stream_open(struct nabto_coap_server_requests* requests, void* connection, uint32_t maxMessageSize);
+
 enum nabto_coap_server_next_event nabto_coap_server_next_event(struct nabto_coap_server_requests* requests);
 
 /**
@@ -100,6 +100,102 @@ struct nabto_coap_option_iterator* nabto_coap_get_option(nabto_coap_option optio
 }
 
 
+// Decode the extended delta or length of an option header.
+static bool nabto_coap_parse_option_extension(const uint8_t** ptr, const uint8_t* end, uint32_t* value)
+{
+    const uint8_t* p = *ptr;
+    if (*value == 13) {
+        // one extra byte
+        if (end - p < 1) {
+            return false;
+        }
+        *value = ((uint32_t)p[0]) + 13;
+        *ptr = p + 1;
+    } else if (*value == 14) {
+        // two extra bytes, 269 = 255 + 14
+        if (end - p < 2) {
+            return false;
+        }
+        *value = (((uint32_t)p[0]) << 8) + ((uint32_t)p[1]) + 269;
+        *ptr = p + 2;
+    } else if (*value == 15) {
+        return false;
+    }
+    return true;
+}
+
+static bool nabto_coap_parse_known_option(struct nabto_coap_incoming_message* msg, uint16_t number, const uint8_t* data, const uint8_t* dataEnd)
+{
+    uint32_t value;
+    switch (number) {
+        case NABTO_COAP_OPTION_OBSERVE:
+            if (!nabto_coap_parse_variable_int(data, dataEnd, 3, &value)) {
+                return false;
+            }
+            msg->hasObserve = true;
+            msg->observe = value;
+            break;
+        case NABTO_COAP_OPTION_CONTENT_FORMAT:
+            if (!nabto_coap_parse_variable_int(data, dataEnd, 2, &value)) {
+                return false;
+            }
+            msg->hasContentFormat = true;
+            msg->contentFormat = (uint16_t)value;
+            break;
+        case NABTO_COAP_OPTION_BLOCK1:
+            if (!nabto_coap_parse_variable_int(data, dataEnd, 3, &value)) {
+                return false;
+            }
+            msg->hasBlock1 = true;
+            msg->block1 = value;
+            break;
+        case NABTO_COAP_OPTION_BLOCK2:
+            if (!nabto_coap_parse_variable_int(data, dataEnd, 3, &value)) {
+                return false;
+            }
+            msg->hasBlock2 = true;
+            msg->block2 = value;
+            break;
+        case NABTO_COAP_OPTION_SIZE1:
+            if (!nabto_coap_parse_variable_int(data, dataEnd, 4, &value)) {
+                return false;
+            }
+            msg->hasSize1 = true;
+            msg->size1 = value;
+            break;
+        case NABTO_COAP_OPTION_SIZE2:
+            if (!nabto_coap_parse_variable_int(data, dataEnd, 4, &value)) {
+                return false;
+            }
+            msg->hasSize2 = true;
+            msg->size2 = value;
+            break;
+        case NABTO_COAP_OPTION_QBLOCK1:
+            if (!nabto_coap_parse_variable_int(data, dataEnd, 3, &value)) {
+                return false;
+            }
+            if (!msg->hasQBlock1) {
+                msg->hasQBlock1 = true;
+                msg->qBlock1 = value;
+            }
+            break;
+        case NABTO_COAP_OPTION_QBLOCK2:
+            if (!nabto_coap_parse_variable_int(data, dataEnd, 3, &value)) {
+                return false;
+            }
+            if (!msg->hasQBlock2) {
+                msg->hasQBlock2 = true;
+                msg->qBlock2 = value;
+            }
+            break;
+        default:
+            break;
+    }
+    return true;
+}
+
+static bool nabto_coap_parse_options_and_payload(struct nabto_coap_incoming_message* msg, const uint8_t* ptr, const uint8_t* end);
+
 bool nabto_coap_parse_message(const uint8_t* packet, size_t packetSize, struct nabto_coap_incoming_message* msg)
 {
     memset(msg, 0, sizeof(struct nabto_coap_incoming_message));
@@ -135,6 +231,13 @@ bool nabto_coap_parse_message(const uint8_t* packet, size_t packetSize, struct n
     memcpy(msg->token.token, ptr, tokenLength);
     ptr += tokenLength;
 
+    return nabto_coap_parse_options_and_payload(msg, ptr, end);
+}
+
+// Parse the part of a message after the token, the same in datagrams
+// and frames.
+static bool nabto_coap_parse_options_and_payload(struct nabto_coap_incoming_message* msg, const uint8_t* ptr, const uint8_t* end)
+{
     if (end - ptr < 1) {
         msg->options = NULL;
         msg->payload = NULL;
@@ -144,51 +247,29 @@ bool nabto_coap_parse_message(const uint8_t* packet, size_t packetSize, struct n
 
     msg->options = ptr;
 
-
-
-    while (true) {
-        if (end < ptr) {
-            return false;
-        }
-        if (end - ptr == 0 || *ptr == 0xFF) {
-            break;
-        }
-
+    // Decode every option once into the option table, the options which
+    // are needed by the server and client are also decoded into fields.
+    uint32_t number = 0;
+    while (end - ptr > 0 && *ptr != 0xFF) {
+        uint32_t delta = (*ptr) >> 4;
         uint32_t length = ((*ptr) & 0x0F);
-        uint16_t delta = (*ptr) >> 4;
-
         ptr += 1;
-
-        if (delta == 13) {
-            // one extra byte;
-            ptr += 1;
-        } else if (delta == 14) {
-            // two extra bytes
-            ptr += 2;
-        } else if (delta == 15) {
+        if (!nabto_coap_parse_option_extension(&ptr, end, &delta) ||
+            !nabto_coap_parse_option_extension(&ptr, end, &length) ||
+            length > (size_t)(end - ptr))
+        {
             return false;
         }
-
-        if (length == 13) {
-            // one extra bytes
-            if (end < ptr || end - ptr < 1) {
-                return false;
-            }
-            length = ((uint32_t)*ptr) + 13;
-            ptr += 1;
-        } else if (length == 14) {
-            // two extra bytes
-            if (end < ptr || end - ptr < 2) {
-                return false;
-            }
-            length = (((uint32_t)ptr[0]) << 8) + ((uint32_t)ptr[1]) + 269;
-            ptr += 2;
-        } else if (length == 15) {
-            // error
+        number += delta;
+        if (number > 0xFFFF || msg->optionCount == NABTO_COAP_MAX_OPTIONS) {
             return false;
         }
-        // skip payload length
-        if (end < ptr || end - ptr < length) {
+        struct nabto_coap_option_entry* option = &msg->optionTable[msg->optionCount];
+        msg->optionCount++;
+        option->number = (uint16_t)number;
+        option->offset = (uint32_t)(ptr - msg->options);
+        option->length = length;
+        if (!nabto_coap_parse_known_option(msg, option->number, ptr, ptr + length)) {
             return false;
         }
         ptr += length;
@@ -196,46 +277,6 @@ bool nabto_coap_parse_message(const uint8_t* packet, size_t packetSize, struct n
 
     msg->optionsLength = ptr - msg->options;
 
-    struct nabto_coap_option_iterator iteratorData;
-    struct nabto_coap_option_iterator* iterator = &iteratorData;
-
-    nabto_coap_option_iterator_init(iterator, msg->options, msg->options + msg->optionsLength);
-    iterator = nabto_coap_get_next_option(iterator);
-    while (iterator != NULL) {
-        uint32_t value;
-        if (iterator->option == NABTO_COAP_OPTION_OBSERVE) {
-            if (!nabto_coap_parse_variable_int(iterator->optionDataBegin, iterator->optionDataEnd, 3, &value)) {
-                return false;
-            } else {
-                msg->hasObserve = true;
-                msg->observe = value;
-            }
-        } else if (iterator->option == NABTO_COAP_OPTION_CONTENT_FORMAT) {
-            if (!nabto_coap_parse_variable_int(iterator->optionDataBegin, iterator->optionDataEnd, 2, &value)) {
-                return false;
-            } else {
-                msg->hasContentFormat = true;
-                msg->contentFormat = (uint16_t)value;
-            }
-        } else if (iterator->option == NABTO_COAP_OPTION_BLOCK1) {
-            if (!nabto_coap_parse_variable_int(iterator->optionDataBegin, iterator->optionDataEnd, 3, &value)) {
-                return false;
-            } else {
-                msg->hasBlock1 = true;
-                msg->block1 = value;
-            }
-        } else if (iterator->option == NABTO_COAP_OPTION_BLOCK2) {
-            if (!nabto_coap_parse_variable_int(iterator->optionDataBegin, iterator->optionDataEnd, 3, &value)) {
-                return false;
-            } else {
-                msg->hasBlock2 = true;
-                msg->block2 = value;
-            }
-        }
-        iterator = nabto_coap_get_next_option(iterator);
-    }
-
-
     if (end - ptr == 0) {
         // end of options no payload
         msg->payload = NULL;
@@ -260,6 +301,217 @@ bool nabto_coap_parse_message(const uint8_t* packet, size_t packetSize, struct n
     return false;
 }
 
+// Length of a frame body and the size of the extended length field
+// which encodes it, RFC 8323 section 3.2.
+static uint8_t nabto_coap_frame_length_nibble(size_t length, size_t* extendedSize)
+{
+    if (length < 13) {
+        *extendedSize = 0;
+        return (uint8_t)length;
+    } else if (length < 269) {
+        *extendedSize = 1;
+        return 13;
+    } else if (length < 65805) {
+        *extendedSize = 2;
+        return 14;
+    }
+    *extendedSize = 4;
+    return 15;
+}
+
+// Decode the frame header, the body (options and payload) follows the
+// token at headerSize.
+static bool nabto_coap_frame_header(const uint8_t* buffer, size_t available, size_t* headerSize, size_t* bodyLength)
+{
+    if (available < 1) {
+        return false;
+    }
+    uint8_t nibble = buffer[0] >> 4;
+    size_t tokenLength = buffer[0] & 0x0F;
+    size_t extendedSize = (nibble < 13) ? 0 : (nibble == 13) ? 1 : (nibble == 14) ? 2 : 4;
+    if (available < 1 + extendedSize) {
+        return false;
+    }
+    const uint8_t* ext = buffer + 1;
+    if (nibble < 13) {
+        *bodyLength = nibble;
+    } else if (nibble == 13) {
+        *bodyLength = (size_t)ext[0] + 13;
+    } else if (nibble == 14) {
+        *bodyLength = (((size_t)ext[0] << 8) | ext[1]) + 269;
+    } else {
+        *bodyLength = (((size_t)ext[0] << 24) | ((size_t)ext[1] << 16) | ((size_t)ext[2] << 8) | ext[3]) + 65805;
+    }
+    *headerSize = 1 + extendedSize + 1 + tokenLength;
+    return true;
+}
+
+bool nabto_coap_frame_size(const uint8_t* buffer, size_t available, size_t* frameSize)
+{
+    size_t headerSize;
+    size_t bodyLength;
+    if (!nabto_coap_frame_header(buffer, available, &headerSize, &bodyLength)) {
+        return false;
+    }
+    *frameSize = headerSize + bodyLength;
+    return true;
+}
+
+bool nabto_coap_parse_frame(const uint8_t* frame, size_t frameSize, struct nabto_coap_incoming_message* msg)
+{
+    memset(msg, 0, sizeof(struct nabto_coap_incoming_message));
+    size_t headerSize;
+    size_t bodyLength;
+    if (!nabto_coap_frame_header(frame, frameSize, &headerSize, &bodyLength) ||
+        headerSize + bodyLength != frameSize)
+    {
+        return false;
+    }
+    uint8_t tokenLength = frame[0] & 0x0F;
+    if (tokenLength > 8) {
+        return false;
+    }
+    const uint8_t* token = frame + headerSize - tokenLength;
+    // Frames carry no type or message id, the stream is reliable.
+    msg->type = NABTO_COAP_TYPE_NON;
+    msg->code = (nabto_coap_code)(token[-1]);
+    msg->token.tokenLength = tokenLength;
+    memcpy(msg->token.token, token, tokenLength);
+    return nabto_coap_parse_options_and_payload(msg, frame + headerSize, frame + frameSize);
+}
+
+uint8_t* nabto_coap_datagram_to_frame(uint8_t* buffer, uint8_t* ptr, uint8_t* end)
+{
+    if (ptr == NULL || ptr - buffer < 4) {
+        return NULL;
+    }
+    uint8_t tokenLength = buffer[0] & 0x0F;
+    if (tokenLength > 8 || ptr - buffer < 4 + tokenLength) {
+        return NULL;
+    }
+    uint8_t code = buffer[1];
+    uint8_t token[8];
+    memcpy(token, buffer + 4, tokenLength);
+
+    const uint8_t* body = buffer + 4 + tokenLength;
+    size_t bodyLength = ptr - body;
+    size_t extendedSize;
+    uint8_t nibble = nabto_coap_frame_length_nibble(bodyLength, &extendedSize);
+    size_t headerSize = 1 + extendedSize + 1 + tokenLength;
+    if ((size_t)(end - buffer) < headerSize + bodyLength) {
+        return NULL;
+    }
+    memmove(buffer + headerSize, body, bodyLength);
+
+    uint8_t* header = buffer;
+    *header++ = (uint8_t)((nibble << 4) | tokenLength);
+    if (extendedSize == 1) {
+        *header++ = (uint8_t)(bodyLength - 13);
+    } else if (extendedSize == 2) {
+        size_t extended = bodyLength - 269;
+        *header++ = (uint8_t)(extended >> 8);
+        *header++ = (uint8_t)(extended);
+    } else if (extendedSize == 4) {
+        size_t extended = bodyLength - 65805;
+        *header++ = (uint8_t)(extended >> 24);
+        *header++ = (uint8_t)(extended >> 16);
+        *header++ = (uint8_t)(extended >> 8);
+        *header++ = (uint8_t)(extended);
+    }
+    *header++ = code;
+    memcpy(header, token, tokenLength);
+    return buffer + headerSize + bodyLength;
+}
+
+bool nabto_coap_block_payload_valid(uint32_t block, size_t payloadLength)
+{
+    if (!NABTO_COAP_BLOCK_MORE(block)) {
+        return true;
+    }
+    if (NABTO_COAP_BLOCK_SIZE(block) == NABTO_COAP_BLOCK_SZX_BERT) {
+        return payloadLength > 0 && payloadLength % NABTO_COAP_BLOCK_BERT_UNIT == 0;
+    }
+    return payloadLength == NABTO_COAP_BLOCK_SIZE_ABSOLUTE(block);
+}
+
+uint32_t nabto_coap_block_count(uint32_t block, size_t payloadLength)
+{
+    if (NABTO_COAP_BLOCK_SIZE(block) == NABTO_COAP_BLOCK_SZX_BERT && payloadLength > NABTO_COAP_BLOCK_BERT_UNIT) {
+        return (uint32_t)((payloadLength + NABTO_COAP_BLOCK_BERT_UNIT - 1) / NABTO_COAP_BLOCK_BERT_UNIT);
+    }
+    return 1;
+}
+
+uint8_t* nabto_coap_encode_cbor_uint(uint32_t value, uint8_t* buffer, uint8_t* end)
+{
+    size_t extra;
+    uint8_t initial;
+    if (value < 24) {
+        extra = 0;
+        initial = (uint8_t)value;
+    } else if (value <= 0xFF) {
+        extra = 1;
+        initial = 24;
+    } else if (value <= 0xFFFF) {
+        extra = 2;
+        initial = 25;
+    } else {
+        extra = 4;
+        initial = 26;
+    }
+    if (buffer == NULL || (size_t)(end - buffer) < 1 + extra) {
+        return NULL;
+    }
+    *buffer++ = initial;
+    for (size_t i = extra; i > 0; i--) {
+        *buffer++ = (uint8_t)(value >> ((i - 1) * 8));
+    }
+    return buffer;
+}
+
+const uint8_t* nabto_coap_decode_cbor_uint(const uint8_t* ptr, const uint8_t* end, uint32_t* value)
+{
+    if (ptr >= end || (*ptr >> 5) != 0) {
+        return NULL;
+    }
+    uint8_t info = *ptr++ & 0x1F;
+    size_t extra;
+    if (info < 24) {
+        *value = info;
+        return ptr;
+    } else if (info == 24) {
+        extra = 1;
+    } else if (info == 25) {
+        extra = 2;
+    } else if (info == 26) {
+        extra = 4;
+    } else {
+        return NULL;
+    }
+    if ((size_t)(end - ptr) < extra) {
+        return NULL;
+    }
+    uint32_t v = 0;
+    for (size_t i = 0; i < extra; i++) {
+        v = (v << 8) | *ptr++;
+    }
+    *value = v;
+    return ptr;
+}
+
+size_t nabto_coap_find_option(const struct nabto_coap_incoming_message* message, uint16_t number, size_t start)
+{
+    for (size_t i = start; i < message->optionCount; i++) {
+        if (message->optionTable[i].number == number) {
+            return i;
+        }
+        if (message->optionTable[i].number > number) {
+            break;
+        }
+    }
+    return message->optionCount;
+}
+
 uint8_t* nabto_coap_encode_header(struct nabto_coap_message_header* header, uint8_t* buffer, uint8_t* bufferEnd)
 {
     if (buffer == NULL ||
@@ -0,0 +1,63 @@
+#include "nabto_coap_atomic.h"
+
+#if defined(NABTO_COAP_ATOMIC_MSVC)
+#include <intrin.h>
+#endif
+
+void nabto_coap_atomic_init(nabto_coap_atomic_ptr* ptr, void* value)
+{
+#if defined(NABTO_COAP_ATOMIC_C11)
+    atomic_init(ptr, value);
+#else
+    *ptr = value;
+#endif
+}
+
+void* nabto_coap_atomic_load_relaxed(nabto_coap_atomic_ptr* ptr)
+{
+#if defined(NABTO_COAP_ATOMIC_C11)
+    return atomic_load_explicit(ptr, memory_order_relaxed);
+#elif defined(NABTO_COAP_ATOMIC_GNUC)
+    return __atomic_load_n(ptr, __ATOMIC_RELAXED);
+#else
+    return *ptr;
+#endif
+}
+
+void* nabto_coap_atomic_exchange_acquire(nabto_coap_atomic_ptr* ptr, void* value)
+{
+#if defined(NABTO_COAP_ATOMIC_C11)
+    return atomic_exchange_explicit(ptr, value, memory_order_acquire);
+#elif defined(NABTO_COAP_ATOMIC_GNUC)
+    return __atomic_exchange_n(ptr, value, __ATOMIC_ACQUIRE);
+#elif defined(NABTO_COAP_ATOMIC_MSVC)
+    return _InterlockedExchangePointer(ptr, value);
+#else
+    void* old = *ptr;
+    *ptr = value;
+    return old;
+#endif
+}
+
+bool nabto_coap_atomic_compare_exchange_release(nabto_coap_atomic_ptr* ptr, void** expected, void* desired)
+{
+#if defined(NABTO_COAP_ATOMIC_C11)
+    return atomic_compare_exchange_weak_explicit(ptr, expected, desired, memory_order_release, memory_order_relaxed);
+#elif defined(NABTO_COAP_ATOMIC_GNUC)
+    return __atomic_compare_exchange_n(ptr, expected, desired, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+#elif defined(NABTO_COAP_ATOMIC_MSVC)
+    void* old = _InterlockedCompareExchangePointer(ptr, desired, *expected);
+    if (old == *expected) {
+        return true;
+    }
+    *expected = old;
+    return false;
+#else
+    if (*ptr != *expected) {
+        *expected = *ptr;
+        return false;
+    }
+    *ptr = desired;
+    return true;
+#endif
+}
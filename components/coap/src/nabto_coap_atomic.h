@@ -0,0 +1,59 @@
+#ifndef _NABTO_COAP_ATOMIC_H_
+#define _NABTO_COAP_ATOMIC_H_
+
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * An atomic pointer, the few operations completing requests from other
+ * threads needs.
+ *
+ * C11 atomics are used where the compiler has them, else the GCC
+ * builtins or the MSVC interlocked intrinsics. A toolchain with none of
+ * these can define NABTO_COAP_NO_ATOMICS, the operations are then
+ * plain loads and stores and nabto_coap_server_response_ready_async may
+ * only be called on the thread running the requests context.
+ */
+#if defined(NABTO_COAP_NO_ATOMICS)
+typedef void* nabto_coap_atomic_ptr;
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__) && !defined(__cplusplus)
+#include <stdatomic.h>
+#define NABTO_COAP_ATOMIC_C11
+typedef _Atomic(void*) nabto_coap_atomic_ptr;
+#elif defined(__GNUC__)
+#define NABTO_COAP_ATOMIC_GNUC
+typedef void* nabto_coap_atomic_ptr;
+#elif defined(_MSC_VER)
+#define NABTO_COAP_ATOMIC_MSVC
+typedef void* volatile nabto_coap_atomic_ptr;
+#else
+#error "No atomic pointer operations for this compiler, define NABTO_COAP_NO_ATOMICS if requests are completed on the owning thread only"
+#endif
+
+void nabto_coap_atomic_init(nabto_coap_atomic_ptr* ptr, void* value);
+
+/**
+ * Load without ordering, as a cheap check before an exchange.
+ */
+void* nabto_coap_atomic_load_relaxed(nabto_coap_atomic_ptr* ptr);
+
+/**
+ * Store value and return the old value, with acquire ordering.
+ */
+void* nabto_coap_atomic_exchange_acquire(nabto_coap_atomic_ptr* ptr, void* value);
+
+/**
+ * Store desired if ptr holds *expected, with release ordering. Else
+ * set *expected to the value held and return false. Can fail
+ * spuriously, call it in a loop.
+ */
+bool nabto_coap_atomic_compare_exchange_release(nabto_coap_atomic_ptr* ptr, void** expected, void* desired);
+
+#ifdef __cplusplus
+} // extern c
+#endif
+
+#endif
@@ -1,4 +1,9 @@
 #include "nabto_coap_client_impl.h"
+#include "nabto_coap_index.h"
+#include "nabto_coap_rtt.h"
+#include "nabto_coap_stream.h"
+#include "nabto_coap_qblock.h"
+#include "nabto_coap_path.h"
 
 static void nabto_coap_client_next_token(struct nabto_coap_client* client, nabto_coap_token* tokenOut);
 static struct nabto_coap_client_request* nabto_coap_client_find_request(struct nabto_coap_client* client, struct nabto_coap_incoming_message* message, void* connection);
@@ -6,21 +11,48 @@ static struct nabto_coap_client_request* nabto_coap_client_find_request(struct n
 static bool nabto_coap_client_request_need_send(struct nabto_coap_client_request* request, uint32_t now);
 static bool nabto_coap_client_request_need_wait(struct nabto_coap_client_request* requst);
 static void nabto_coap_client_response_free(struct nabto_coap_client_response* response);
+static void nabto_coap_client_request_free_qblock2_map(struct nabto_coap_client_request* request);
 
 static uint8_t* nabto_coap_client_request_create_packet(struct nabto_coap_client_request* request, uint32_t now, uint8_t* buffer, uint8_t* end, void** connection);
+static uint8_t* nabto_coap_client_request_create_qblock_packet(struct nabto_coap_client_request* request, uint32_t now, uint8_t* buffer, uint8_t* end);
+static enum nabto_coap_client_status nabto_coap_client_handle_qblock_response(struct nabto_coap_client_request* request, struct nabto_coap_incoming_message* message, void* connection, uint32_t now);
 
 static uint16_t nabto_coap_client_next_message_id(struct nabto_coap_client* client);
+static void nabto_coap_client_request_new_message_id(struct nabto_coap_client_request* request);
+static void nabto_coap_client_request_new_token(struct nabto_coap_client_request* request);
+static void nabto_coap_client_request_acked(struct nabto_coap_client_request* request, uint32_t now);
+static void nabto_coap_client_request_block1_acked(struct nabto_coap_client_request* request, struct nabto_coap_incoming_message* message);
+static bool nabto_coap_client_request_fit_blocks(struct nabto_coap_client_request* request);
+static void nabto_coap_client_request_block_timeout(struct nabto_coap_client_request* request);
 
 /********************************************************************
  * Implementation of functions used from the coap client integrator *
  ********************************************************************/
 
+static struct nabto_coap_index* nabto_coap_client_index_new(struct nabto_coap_client* client)
+{
+    struct nabto_coap_index* index = client->allocator.calloc(1, sizeof(struct nabto_coap_index));
+    if (index != NULL) {
+        nabto_coap_index_init(index, &client->allocator);
+    }
+    return index;
+}
+
+static void nabto_coap_client_index_free(struct nabto_coap_client* client, struct nabto_coap_index* index)
+{
+    if (index != NULL) {
+        nabto_coap_index_deinit(index);
+        client->allocator.free(index);
+    }
+}
+
 nabto_coap_error nabto_coap_client_init(struct nabto_coap_client* client, struct nn_allocator* allocator, nabto_coap_notify_event notifyEvent, void* userData)
 {
     memset(client, 0, sizeof(struct nabto_coap_client));
     client->allocator = *allocator;
     client->settings.ackTimeoutMilliseconds = 2000;
     client->settings.maxRetransmits = 6;
+    client->settings.maxResponseBodySize = SIZE_MAX;
     client->messageIdCounter = 0;
     client->tokenCounter = 0;
     client->notifyEvent = notifyEvent;
@@ -32,6 +64,28 @@ nabto_coap_error nabto_coap_client_init(struct nabto_coap_client* client, struct
     }
     client->requestsSentinel->next = client->requestsSentinel;
     client->requestsSentinel->prev = client->requestsSentinel;
+    client->requestsByToken = nabto_coap_client_index_new(client);
+    client->requestsByMessageId = nabto_coap_client_index_new(client);
+    client->rtt = nabto_coap_rtt_table_new(&client->allocator);
+    client->paths = nabto_coap_path_table_new(&client->allocator);
+    client->streams = nabto_coap_stream_table_new(&client->allocator);
+    if (client->requestsByToken == NULL || client->requestsByMessageId == NULL ||
+        client->rtt == NULL || client->paths == NULL || client->streams == NULL)
+    {
+        nabto_coap_client_index_free(client, client->requestsByToken);
+        client->requestsByToken = NULL;
+        nabto_coap_client_index_free(client, client->requestsByMessageId);
+        client->requestsByMessageId = NULL;
+        nabto_coap_stream_table_free(client->streams);
+        client->streams = NULL;
+        nabto_coap_path_table_free(client->paths);
+        client->paths = NULL;
+        nabto_coap_rtt_table_free(client->rtt);
+        client->rtt = NULL;
+        nn_allocator_free(&client->allocator, client->requestsSentinel);
+        client->requestsSentinel = NULL;
+        return NABTO_COAP_ERROR_OUT_OF_MEMORY;
+    }
     return NABTO_COAP_ERROR_OK;
 }
 
@@ -40,6 +94,16 @@ void nabto_coap_client_destroy(struct nabto_coap_client* client)
     nn_allocator_free(&client->allocator, client->requestsSentinel);
     //client->allocator.free(client->requestsSentinel);
     client->requestsSentinel = NULL;
+    nabto_coap_client_index_free(client, client->requestsByToken);
+    client->requestsByToken = NULL;
+    nabto_coap_client_index_free(client, client->requestsByMessageId);
+    client->requestsByMessageId = NULL;
+    nabto_coap_rtt_table_free(client->rtt);
+    client->rtt = NULL;
+    nabto_coap_path_table_free(client->paths);
+    client->paths = NULL;
+    nabto_coap_stream_table_free(client->streams);
+    client->streams = NULL;
 }
 
 // insert request after e1 such that the chain e1->e2->e3 emerges
@@ -62,6 +126,95 @@ void nabto_coap_client_remove_request_from_list(struct nabto_coap_client_request
     e2->prev = e1;
 }
 
+struct nabto_coap_client_request_key {
+    void* connection;
+    const nabto_coap_token* token;
+};
+
+static uint32_t nabto_coap_client_request_key_hash(void* connection, const nabto_coap_token* token)
+{
+    uint32_t hash = nabto_coap_hash_pointer(NABTO_COAP_HASH_INIT, connection);
+    return nabto_coap_hash_token(hash, token);
+}
+
+static bool nabto_coap_client_request_match_token(const void* item, const void* key)
+{
+    const struct nabto_coap_client_request* request = item;
+    const struct nabto_coap_client_request_key* k = key;
+    return request->connection == k->connection &&
+        nabto_coap_token_equal((nabto_coap_token*)&request->token, (nabto_coap_token*)k->token);
+}
+
+struct nabto_coap_client_message_id_key {
+    void* connection;
+    uint16_t messageId;
+    bool waitingForResponse; // also match requests in WAIT_RESPONSE
+};
+
+static uint32_t nabto_coap_client_message_id_hash(void* connection, uint16_t messageId)
+{
+    uint32_t hash = nabto_coap_hash_pointer(NABTO_COAP_HASH_INIT, connection);
+    uint8_t mid[2] = { (uint8_t)(messageId >> 8), (uint8_t)messageId };
+    return nabto_coap_hash_bytes(hash, mid, sizeof(mid));
+}
+
+// Message ids wrap, only a request waiting for its ACK, or response,
+// is a match.
+static bool nabto_coap_client_request_match_message_id(const void* item, const void* key)
+{
+    const struct nabto_coap_client_request* request = item;
+    const struct nabto_coap_client_message_id_key* k = key;
+    return request->connection == k->connection && request->messageId == k->messageId &&
+        (request->state == NABTO_COAP_CLIENT_REQUEST_STATE_WAIT_ACK ||
+         (k->waitingForResponse && request->state == NABTO_COAP_CLIENT_REQUEST_STATE_WAIT_RESPONSE));
+}
+
+static struct nabto_coap_client_request* nabto_coap_client_find_by_message_id(struct nabto_coap_client* client, void* connection, uint16_t messageId, bool waitingForResponse)
+{
+    struct nabto_coap_client_message_id_key key;
+    key.connection = connection;
+    key.messageId = messageId;
+    key.waitingForResponse = waitingForResponse;
+    uint32_t hash = nabto_coap_client_message_id_hash(connection, messageId);
+    return nabto_coap_index_find(client->requestsByMessageId, hash, nabto_coap_client_request_match_message_id, &key);
+}
+
+static void nabto_coap_client_request_unindex_message_id(struct nabto_coap_client_request* request)
+{
+    if (request->messageIdIndexed) {
+        uint32_t hash = nabto_coap_client_message_id_hash(request->connection, request->messageId);
+        nabto_coap_index_remove(request->client->requestsByMessageId, hash, request);
+        request->messageIdIndexed = false;
+    }
+}
+
+/**
+ * Give the request a new message id. If the index is full the request
+ * is still sent, but its ACK cannot be matched and it is retransmitted
+ * until it times out.
+ */
+void nabto_coap_client_request_new_message_id(struct nabto_coap_client_request* request)
+{
+    struct nabto_coap_client* client = request->client;
+    nabto_coap_client_request_unindex_message_id(request);
+    request->messageId = nabto_coap_client_next_message_id(client);
+    uint32_t hash = nabto_coap_client_message_id_hash(request->connection, request->messageId);
+    request->messageIdIndexed = (nabto_coap_index_insert(client->requestsByMessageId, hash, request) == NABTO_COAP_ERROR_OK);
+}
+
+/**
+ * Give a request in the index a new token, such that replies to the old
+ * token no longer match. If the index cannot grow the replies to the
+ * new token are not matched and the request times out.
+ */
+void nabto_coap_client_request_new_token(struct nabto_coap_client_request* request)
+{
+    struct nabto_coap_client* client = request->client;
+    nabto_coap_index_remove(client->requestsByToken, nabto_coap_client_request_key_hash(request->connection, &request->token), request);
+    nabto_coap_client_next_token(client, &request->token);
+    (void)nabto_coap_index_insert(client->requestsByToken, nabto_coap_client_request_key_hash(request->connection, &request->token), request);
+}
+
 void nabto_coap_client_handle_callback(struct nabto_coap_client* client)
 {
     struct nabto_coap_client_request* iterator = client->requestsSentinel->next;
@@ -105,6 +258,10 @@ enum nabto_coap_client_next_event nabto_coap_client_get_next_event(struct nabto_
         return NABTO_COAP_CLIENT_NEXT_EVENT_SEND;
     }
 
+    if (nabto_coap_stream_next_signal(client->streams) != NULL) {
+        return NABTO_COAP_CLIENT_NEXT_EVENT_SEND;
+    }
+
     if (client->requestsSentinel->next == client->requestsSentinel) {
         return NABTO_COAP_CLIENT_NEXT_EVENT_NOTHING;
     }
@@ -164,6 +321,7 @@ enum nabto_coap_client_status nabto_coap_client_parse_and_handle_response(struct
             response->payload = NULL;
         }
         response->payloadLength = 0;
+        response->payloadCapacity = 0;
         response->hasContentFormat = false;
         response->hasObserve = false;
         request->hasBlock2 = false;
@@ -191,7 +349,9 @@ enum nabto_coap_client_status nabto_coap_client_parse_and_handle_response(struct
             return NABTO_COAP_CLIENT_STATUS_DECODE_ERROR;
         }
 
-        if (NABTO_COAP_BLOCK_MORE(message->block2) && message->payloadLength != NABTO_COAP_BLOCK_SIZE_ABSOLUTE(message->block2)) {
+        if (!nabto_coap_block_payload_valid(message->block2, message->payloadLength) ||
+            response->payloadLength + message->payloadLength > client->settings.maxResponseBodySize)
+        {
             client->allocator.free(response);
             request->response = NULL;
             return NABTO_COAP_CLIENT_STATUS_DECODE_ERROR;
@@ -212,7 +372,8 @@ enum nabto_coap_client_status nabto_coap_client_parse_and_handle_response(struct
         response->payloadLength = response->payloadLength + message->payloadLength;
 
         request->hasBlock2 = true;
-        request->block2 = ((NABTO_COAP_BLOCK_NUM(message->block2) + 1) << 4) + (NABTO_COAP_BLOCK_SIZE(message->block2));
+        uint32_t blocks = nabto_coap_block_count(message->block2, message->payloadLength);
+        request->block2 = ((NABTO_COAP_BLOCK_NUM(message->block2) + blocks) << 4) + (NABTO_COAP_BLOCK_SIZE(message->block2));
     } else {
         if (message->payloadLength > 0) {
             response->payload = (uint8_t*)client->allocator.calloc(1, message->payloadLength + 1);
@@ -227,10 +388,11 @@ enum nabto_coap_client_status nabto_coap_client_parse_and_handle_response(struct
     }
 
     if (message->hasBlock1) {
-        request->block1Current += 1;
+        nabto_coap_client_request_block1_acked(request, message);
         if (request->block1Current * NABTO_COAP_BLOCK_SIZE_ABSOLUTE(request->block1Size) < request->payloadLength) {
             request->state = NABTO_COAP_CLIENT_REQUEST_STATE_SEND_REQUEST;
-            request->messageId = nabto_coap_client_next_message_id(client);
+            nabto_coap_client_request_new_message_id(request);
+            request->transmissions = 0;
             return NABTO_COAP_CLIENT_STATUS_OK;
         }
     }
@@ -240,12 +402,14 @@ enum nabto_coap_client_status nabto_coap_client_parse_and_handle_response(struct
             nabto_coap_client_send_ack(client, message, connection);
         }
         request->state = NABTO_COAP_CLIENT_REQUEST_STATE_SEND_REQUEST;
-        request->messageId = nabto_coap_client_next_message_id(client);
+        nabto_coap_client_request_new_message_id(request);
+        request->transmissions = 0;
     } else if (message->hasBlock1 && message->code == NABTO_COAP_CODE_CONTINUE) {
-        request->block1Current += 1;
+        nabto_coap_client_request_block1_acked(request, message);
         if (request->block1Current * NABTO_COAP_BLOCK_SIZE_ABSOLUTE(request->block1Size) < request->payloadLength) {
             request->state = NABTO_COAP_CLIENT_REQUEST_STATE_SEND_REQUEST;
-            request->messageId = nabto_coap_client_next_message_id(client);
+            nabto_coap_client_request_new_message_id(request);
+            request->transmissions = 0;
         }
     } else {
         if (message->type == NABTO_COAP_TYPE_CON) {
@@ -257,44 +421,362 @@ enum nabto_coap_client_status nabto_coap_client_parse_and_handle_response(struct
     return NABTO_COAP_CLIENT_STATUS_OK;
 }
 
+/**
+ * Feed the round trip time of an acknowledged request to the RTO of
+ * its connection.
+ */
+void nabto_coap_client_request_acked(struct nabto_coap_client_request* request, uint32_t now)
+{
+    struct nabto_coap_client* client = request->client;
+    nabto_coap_rtt_sample(client->rtt, request->connection, client->settings.ackTimeoutMilliseconds, request->transmissions, now - request->firstSent, now);
+}
+
+/**
+ * The server has the blocks of the last Block1 message. A smaller block
+ * size in its Block1 option is used for the blocks which follow.
+ */
+void nabto_coap_client_request_block1_acked(struct nabto_coap_client_request* request, struct nabto_coap_incoming_message* message)
+{
+    request->block1Current += request->block1Blocks;
+    uint32_t szx = NABTO_COAP_BLOCK_SIZE(message->block1);
+    if (request->block1Size != NABTO_COAP_BLOCK_SZX_BERT && szx < request->block1Size) {
+        request->block1Current = nabto_coap_path_rescale_block(request->block1Current, request->block1Size, szx);
+        request->block1Size = szx;
+    }
+}
+
+/**
+ * Shrink the blocks sent and asked for to the block size of the
+ * connection.
+ *
+ * @return true if the blocks changed.
+ */
+bool nabto_coap_client_request_fit_blocks(struct nabto_coap_client_request* request)
+{
+    struct nabto_coap_client* client = request->client;
+    bool changed = false;
+    uint32_t szx = nabto_coap_path_limit_szx(client->paths, request->connection, request->block1Size);
+    if (szx < request->block1Size) {
+        request->block1Current = nabto_coap_path_rescale_block(request->block1Current, request->block1Size, szx);
+        request->block1Size = szx;
+        changed = true;
+    }
+    if (request->hasBlock2) {
+        uint32_t block2Size = NABTO_COAP_BLOCK_SIZE(request->block2);
+        szx = nabto_coap_path_limit_szx(client->paths, request->connection, block2Size);
+        if (szx < block2Size) {
+            request->block2 = (nabto_coap_path_rescale_block(NABTO_COAP_BLOCK_NUM(request->block2), block2Size, szx) << 4) + szx;
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+/**
+ * The request has been sent twice without an ACK. The Block1 block it
+ * carries, or the Block2 block it asks for, may be too large for the
+ * connection.
+ */
+void nabto_coap_client_request_block_timeout(struct nabto_coap_client_request* request)
+{
+    struct nabto_coap_client* client = request->client;
+    size_t blockSize = NABTO_COAP_BLOCK_SIZE_ABSOLUTE(request->block1Size);
+    size_t offset = (size_t)request->block1Current * blockSize;
+    if (request->block1Size != NABTO_COAP_BLOCK_SZX_BERT && offset < request->payloadLength &&
+        request->payloadLength - offset > blockSize / 2)
+    {
+        nabto_coap_path_block_timeout(client->paths, request->connection, request->block1Size);
+    } else if (request->hasBlock2) {
+        nabto_coap_path_block_timeout(client->paths, request->connection, NABTO_COAP_BLOCK_SIZE(request->block2));
+    }
+}
+
 void nabto_coap_client_handle_ack(struct nabto_coap_client* client, struct nabto_coap_incoming_message* message, void* connection, uint32_t now)
 {
     // acks is only correlated by message id, not by tokens.
-    struct nabto_coap_client_request* iterator = client->requestsSentinel->next;
-    while(iterator != client->requestsSentinel) {
-        if (iterator->state == NABTO_COAP_CLIENT_REQUEST_STATE_WAIT_ACK) {
-            if (iterator->messageId == message->messageId && iterator->connection == connection) {
-                iterator->state = NABTO_COAP_CLIENT_REQUEST_STATE_WAIT_RESPONSE;
-                iterator->timeoutStamp = now + iterator->configuredTimeoutMilliseconds;
-                return;
-            }
-        }
-        iterator = iterator->next;
+    struct nabto_coap_client_request* request = nabto_coap_client_find_by_message_id(client, connection, message->messageId, false);
+    if (request != NULL) {
+        nabto_coap_client_request_acked(request, now);
+        request->state = NABTO_COAP_CLIENT_REQUEST_STATE_WAIT_RESPONSE;
+        request->timeoutStamp = now + request->configuredTimeoutMilliseconds;
     }
 }
 
 void nabto_coap_client_handle_rst(struct nabto_coap_client* client, struct nabto_coap_incoming_message* message, void* connection)
 {
     // reset's is only correlated by message id, not by tokens.
-    struct nabto_coap_client_request* iterator = client->requestsSentinel->next;
-    while(iterator != client->requestsSentinel) {
-        if (iterator->state == NABTO_COAP_CLIENT_REQUEST_STATE_WAIT_ACK ||
-            iterator->state == NABTO_COAP_CLIENT_REQUEST_STATE_WAIT_RESPONSE)
-        {
-            if (iterator->messageId == message->messageId && iterator->connection == connection) {
-                iterator->state = NABTO_COAP_CLIENT_REQUEST_STATE_DONE_CALLBACK;
-                return;
+    struct nabto_coap_client_request* request = nabto_coap_client_find_by_message_id(client, connection, message->messageId, true);
+    if (request != NULL) {
+        request->state = NABTO_COAP_CLIENT_REQUEST_STATE_DONE_CALLBACK;
+    }
+}
+
+/**
+ * Progress was made, the retransmission count starts over.
+ */
+static void nabto_coap_client_request_qblock_progress(struct nabto_coap_client_request* request)
+{
+    request->qBlockConfirmed = true;
+    request->retransmissions = 0;
+    request->transmissions = 0;
+}
+
+/**
+ * The server does not know Q-Block, start over with Block1 and Block2.
+ */
+static void nabto_coap_client_request_qblock_fallback(struct nabto_coap_client_request* request)
+{
+    request->qBlock = false;
+    // Replies to the blocks already sent must not match the new
+    // exchange.
+    nabto_coap_client_request_new_token(request);
+    nabto_coap_client_request_new_message_id(request);
+    request->retransmissions = 0;
+    request->transmissions = 0;
+    request->block1Current = 0;
+    request->state = NABTO_COAP_CLIENT_REQUEST_STATE_SEND_REQUEST;
+}
+
+/**
+ * Parse the CBOR sequence of block numbers of a 4.08 into the blocks
+ * to send again.
+ */
+static void nabto_coap_client_request_qblock1_missing(struct nabto_coap_client_request* request, struct nabto_coap_incoming_message* message)
+{
+    size_t blockSize = NABTO_COAP_BLOCK_SIZE_ABSOLUTE(request->block1Size);
+    size_t blocks = (request->payloadLength + blockSize - 1) / blockSize;
+    const uint8_t* ptr = message->payload;
+    const uint8_t* end = message->payload + message->payloadLength;
+    uint32_t num;
+    while (ptr != NULL && ptr < end &&
+           request->qBlock1MissingCount < NABTO_COAP_QBLOCK_MAX_PAYLOADS &&
+           (ptr = nabto_coap_decode_cbor_uint(ptr, end, &num)) != NULL)
+    {
+        bool queued = (num >= blocks);
+        for (uint8_t i = 0; i < request->qBlock1MissingCount; i++) {
+            queued = queued || (request->qBlock1Missing[i] == num);
+        }
+        if (!queued) {
+            request->qBlock1Missing[request->qBlock1MissingCount++] = num;
+        }
+    }
+}
+
+/**
+ * A block of a Q-Block2 response. Blocks are placed at their offset in
+ * any order. At the end of a set, at the last block, and when the
+ * missing blocks asked for have arrived, the next packet asks for the
+ * next set or for the blocks still missing.
+ */
+static enum nabto_coap_client_status nabto_coap_client_handle_qblock2(struct nabto_coap_client_request* request, struct nabto_coap_incoming_message* message, uint32_t now)
+{
+    struct nabto_coap_client* client = request->client;
+    uint32_t block = message->qBlock2;
+    uint32_t num = NABTO_COAP_BLOCK_NUM(block);
+    bool more = NABTO_COAP_BLOCK_MORE(block);
+    size_t blockSize = NABTO_COAP_BLOCK_SIZE_ABSOLUTE(block);
+    if (NABTO_COAP_BLOCK_SIZE(block) == NABTO_COAP_BLOCK_SZX_BERT ||
+        message->payloadLength > blockSize ||
+        (more && message->payloadLength != blockSize))
+    {
+        return NABTO_COAP_CLIENT_STATUS_DECODE_ERROR;
+    }
+
+    struct nabto_coap_client_response* response = request->response;
+    if (request->qBlock2Map == NULL) {
+        // The first block to arrive, not necessarily block 0.
+        if (response == NULL) {
+            response = client->allocator.calloc(1, sizeof(struct nabto_coap_client_response));
+            if (response == NULL) {
+                return NABTO_COAP_CLIENT_STATUS_DECODE_ERROR;
             }
+            response->request = request;
+            request->response = response;
+        } else {
+            client->allocator.free(response->payload);
+            response->payload = NULL;
+            response->payloadLength = 0;
+            response->payloadCapacity = 0;
+            response->hasContentFormat = false;
+            response->hasObserve = false;
+        }
+        request->qBlock2Map = client->allocator.calloc(1, sizeof(struct nabto_coap_qblock_map));
+        if (request->qBlock2Map == NULL) {
+            return NABTO_COAP_CLIENT_STATUS_DECODE_ERROR;
+        }
+        nabto_coap_qblock_map_init(request->qBlock2Map, &client->allocator);
+        request->qBlock2Size = NABTO_COAP_BLOCK_SIZE(block);
+        request->qBlock2Outstanding = 0;
+    }
+    struct nabto_coap_qblock_map* map = request->qBlock2Map;
+    if (NABTO_COAP_BLOCK_SIZE(block) != request->qBlock2Size ||
+        (map->total > 0 && num >= map->total))
+    {
+        return NABTO_COAP_CLIENT_STATUS_DECODE_ERROR;
+    }
+
+    bool isNew = !nabto_coap_qblock_map_has(map, num);
+    if (isNew && num >= map->highest + NABTO_COAP_QBLOCK_MAX_AHEAD) {
+        // Too far ahead of the blocks received to reserve room for, it
+        // is asked for again with the blocks before it.
+        return NABTO_COAP_CLIENT_STATUS_OK;
+    }
+    if (isNew) {
+        // Both the block number and Size2 come from the peer, neither
+        // may make the client reserve more than its limit.
+        size_t limit = client->settings.maxResponseBodySize;
+        if (limit == SIZE_MAX) {
+            limit = NABTO_COAP_QBLOCK_DEFAULT_MAX_BODY_SIZE;
+        }
+        uint64_t needed = (uint64_t)num * blockSize + message->payloadLength;
+        if (needed > limit || (message->hasSize2 && message->size2 > limit)) {
+            return NABTO_COAP_CLIENT_STATUS_DECODE_ERROR;
+        }
+        if (response->payload == NULL || needed > response->payloadCapacity) {
+            // Grow geometrically, or to the announced size as long as it
+            // is not far beyond the blocks received.
+            size_t capacity = response->payloadCapacity * 2;
+            if (message->hasSize2) {
+                size_t hint = (size_t)needed + NABTO_COAP_QBLOCK_MAX_AHEAD * blockSize;
+                if (message->size2 < hint) {
+                    hint = message->size2;
+                }
+                if (hint > capacity) {
+                    capacity = hint;
+                }
+            }
+            if (capacity < needed) {
+                capacity = (size_t)needed;
+            }
+            if (capacity > limit) {
+                capacity = limit;
+            }
+            uint8_t* payload = client->allocator.calloc(1, capacity + 1);
+            if (payload == NULL) {
+                return NABTO_COAP_CLIENT_STATUS_DECODE_ERROR;
+            }
+            if (response->payload != NULL) {
+                memcpy(payload, response->payload, response->payloadLength);
+                client->allocator.free(response->payload);
+            }
+            response->payload = payload;
+            response->payloadCapacity = capacity;
+        }
+        if (nabto_coap_qblock_map_set(map, num, !more, &isNew) != NABTO_COAP_ERROR_OK) {
+            return NABTO_COAP_CLIENT_STATUS_DECODE_ERROR;
+        }
+        if (message->payloadLength > 0) {
+            memcpy(response->payload + (size_t)num * blockSize, message->payload, message->payloadLength);
+        }
+        if (needed > response->payloadLength) {
+            response->payloadLength = (size_t)needed;
         }
-        iterator = iterator->next;
     }
 
+    response->code = message->code;
+    response->messageId = message->messageId;
+    if (message->hasContentFormat) {
+        response->hasContentFormat = true;
+        response->contentFormat = message->contentFormat;
+    }
+    if (message->hasObserve) {
+        response->hasObserve = true;
+        response->observe = message->observe;
+    }
+    nabto_coap_client_request_qblock_progress(request);
+
+    if (nabto_coap_qblock_map_complete(map)) {
+        nabto_coap_client_request_free_qblock2_map(request);
+        request->state = NABTO_COAP_CLIENT_REQUEST_STATE_DONE_CALLBACK;
+        return NABTO_COAP_CLIENT_STATUS_OK;
+    }
+
+    bool askAgain = false;
+    if (isNew && request->qBlock2Outstanding > 0) {
+        request->qBlock2Outstanding--;
+        askAgain = (request->qBlock2Outstanding == 0);
+    }
+    if (isNew && (!more || (num + 1) % NABTO_COAP_QBLOCK_MAX_PAYLOADS == 0)) {
+        askAgain = true;
+    }
+    if (askAgain) {
+        request->state = NABTO_COAP_CLIENT_REQUEST_STATE_SEND_REQUEST;
+    } else if (request->state != NABTO_COAP_CLIENT_REQUEST_STATE_SEND_REQUEST) {
+        // More blocks of the burst are on their way.
+        request->state = NABTO_COAP_CLIENT_REQUEST_STATE_WAIT_ACK;
+        request->timeoutStamp = now + NABTO_COAP_QBLOCK_NON_RECEIVE_TIMEOUT;
+    }
+    return NABTO_COAP_CLIENT_STATUS_OK;
+}
+
+/**
+ * A reply to a Q-Block request. 2.31 and 4.08 with a list of missing
+ * blocks steer the sending of the body, anything else is the response.
+ */
+enum nabto_coap_client_status nabto_coap_client_handle_qblock_response(struct nabto_coap_client_request* request, struct nabto_coap_incoming_message* message, void* connection, uint32_t now)
+{
+    struct nabto_coap_client* client = request->client;
+    size_t blockSize = NABTO_COAP_BLOCK_SIZE_ABSOLUTE(request->block1Size);
+    size_t blocks = (request->payloadLength + blockSize - 1) / blockSize;
+    bool sendingBody = (blocks > 1 && !request->qBlock1Done);
+
+    if (message->type == NABTO_COAP_TYPE_CON) {
+        nabto_coap_client_send_ack(client, message, connection);
+    }
+
+    if (!request->qBlockConfirmed && !message->hasQBlock1 && !message->hasQBlock2 &&
+        (message->code == NABTO_COAP_CODE_BAD_OPTION || message->code == NABTO_COAP_CODE_BAD_REQUEST))
+    {
+        nabto_coap_client_request_qblock_fallback(request);
+        return NABTO_COAP_CLIENT_STATUS_OK;
+    }
+
+    if (message->code == NABTO_COAP_CODE_CONTINUE && message->hasQBlock1) {
+        if (sendingBody) {
+            nabto_coap_client_request_qblock_progress(request);
+            request->state = NABTO_COAP_CLIENT_REQUEST_STATE_SEND_REQUEST;
+        }
+        return NABTO_COAP_CLIENT_STATUS_OK;
+    }
+
+    if (message->code == NABTO_COAP_CODE_REQUEST_ENTITY_INCOMPLETE && message->hasContentFormat &&
+        message->contentFormat == NABTO_COAP_CONTENT_FORMAT_APPLICATION_MISSING_BLOCKS_CBOR_SEQ)
+    {
+        if (sendingBody) {
+            nabto_coap_client_request_qblock_progress(request);
+            nabto_coap_client_request_qblock1_missing(request, message);
+            request->state = NABTO_COAP_CLIENT_REQUEST_STATE_SEND_REQUEST;
+        }
+        return NABTO_COAP_CLIENT_STATUS_OK;
+    }
+
+    // The response, the server has the whole body.
+    request->qBlock1Done = true;
+    request->qBlock1MissingCount = 0;
+    if (message->hasQBlock2) {
+        return nabto_coap_client_handle_qblock2(request, message, now);
+    }
+    // A response in one message, or in Block2 blocks which are asked
+    // for the usual way.
+    request->qBlock = false;
+    request->block1Current = (uint32_t)blocks;
+    nabto_coap_client_request_free_qblock2_map(request);
+    return nabto_coap_client_parse_and_handle_response(request, message, connection);
 }
 
-enum nabto_coap_client_status nabto_coap_client_handle_request_response(struct nabto_coap_client* client, struct nabto_coap_client_request* request, struct nabto_coap_incoming_message* message, void* connection)
+enum nabto_coap_client_status nabto_coap_client_handle_request_response(struct nabto_coap_client* client, struct nabto_coap_client_request* request, struct nabto_coap_incoming_message* message, void* connection, uint32_t now)
 {
     enum nabto_coap_client_status status;
 
+    if (request->qBlock &&
+        (request->state == NABTO_COAP_CLIENT_REQUEST_STATE_SEND_REQUEST ||
+         request->state == NABTO_COAP_CLIENT_REQUEST_STATE_WAIT_ACK ||
+         request->state == NABTO_COAP_CLIENT_REQUEST_STATE_WAIT_RESPONSE))
+    {
+        // Replies come while the blocks are still being sent.
+        return nabto_coap_client_handle_qblock_response(request, message, connection, now);
+    }
+
     if (request->state == NABTO_COAP_CLIENT_REQUEST_STATE_WAIT_ACK ||
         request->state == NABTO_COAP_CLIENT_REQUEST_STATE_WAIT_RESPONSE)
     {
@@ -317,10 +799,25 @@ enum nabto_coap_client_status nabto_coap_client_handle_request_response(struct n
 enum nabto_coap_client_status nabto_coap_client_handle_packet(struct nabto_coap_client* client, uint32_t now, const uint8_t* packet, size_t packetSize, void* connection)
 {
     struct nabto_coap_incoming_message message;
-    if (!nabto_coap_parse_message(packet, packetSize, &message)) {
+    struct nabto_coap_stream* stream = nabto_coap_stream_find(client->streams, connection);
+    bool parsed = (stream != NULL) ? nabto_coap_parse_frame(packet, packetSize, &message) : nabto_coap_parse_message(packet, packetSize, &message);
+    if (!parsed) {
         return NABTO_COAP_CLIENT_STATUS_DECODE_ERROR;
     }
 
+    if (stream != NULL) {
+        if (message.code >> 5 == 7) {
+            if (!nabto_coap_stream_handle_signal(client->streams, stream, &message)) {
+                nabto_coap_client_remove_connection(client, connection);
+            } else if (nabto_coap_stream_next_signal(client->streams) != NULL) {
+                client->notifyEvent(client->userData);
+            }
+            return NABTO_COAP_CLIENT_STATUS_OK;
+        }
+        // Responses on a stream are never acknowledged or reset.
+        nabto_coap_stream_received(stream, &message);
+    }
+
     // ack with empty is just acking a message but does not contain a response payload.
     if (message.type == NABTO_COAP_TYPE_ACK && message.code == NABTO_COAP_CODE_EMPTY) {
         nabto_coap_client_handle_ack(client, &message, connection, now);
@@ -336,7 +833,14 @@ enum nabto_coap_client_status nabto_coap_client_handle_packet(struct nabto_coap_
     struct nabto_coap_client_request* request = nabto_coap_client_find_request(client, &message, connection);
 
     if (request) {
-        return nabto_coap_client_handle_request_response(client, request, &message, connection);
+        if (message.type == NABTO_COAP_TYPE_ACK &&
+            request->state == NABTO_COAP_CLIENT_REQUEST_STATE_WAIT_ACK &&
+            message.messageId == request->messageId)
+        {
+            // piggybacked response
+            nabto_coap_client_request_acked(request, now);
+        }
+        return nabto_coap_client_handle_request_response(client, request, &message, connection, now);
     } else {
         if (message.type == NABTO_COAP_TYPE_NON || message.type == NABTO_COAP_TYPE_CON) {
             client->needSendRst = true;
@@ -351,16 +855,11 @@ enum nabto_coap_client_status nabto_coap_client_handle_packet(struct nabto_coap_
 
 struct nabto_coap_client_request* nabto_coap_client_find_request(struct nabto_coap_client* client, struct nabto_coap_incoming_message* message, void* connection)
 {
-    struct nabto_coap_client_request* request = client->requestsSentinel->next;
-    while(request != client->requestsSentinel) {
-        if (request->connection == connection &&
-            nabto_coap_token_equal(&request->token, &message->token))
-        {
-            return request;
-        }
-        request = request->next;
-    }
-    return NULL;
+    struct nabto_coap_client_request_key key;
+    key.connection = connection;
+    key.token = &message->token;
+    uint32_t hash = nabto_coap_client_request_key_hash(connection, &message->token);
+    return nabto_coap_index_find(client->requestsByToken, hash, nabto_coap_client_request_match_token, &key);
 }
 
 
@@ -386,6 +885,20 @@ uint8_t* nabto_coap_client_create_packet(struct nabto_coap_client* client, uint3
 {
     uint8_t* ptr = (uint8_t*)buffer;
 
+    // There are no RSTs or ACKs on streams.
+    if (client->needSendRst && nabto_coap_stream_find(client->streams, client->connectionRst) != NULL) {
+        client->needSendRst = false;
+    }
+    if (client->needSendAck && nabto_coap_stream_find(client->streams, client->connectionAck) != NULL) {
+        client->needSendAck = false;
+    }
+
+    struct nabto_coap_stream* signalStream = nabto_coap_stream_next_signal(client->streams);
+    if (signalStream != NULL) {
+        *connection = signalStream->connection;
+        return nabto_coap_stream_encode_signal(client->streams, signalStream, buffer, end);
+    }
+
     if (client->needSendRst) {
         struct nabto_coap_message_header header;
         memset(&header, 0, sizeof(struct nabto_coap_message_header));
@@ -420,55 +933,90 @@ uint8_t* nabto_coap_client_create_packet(struct nabto_coap_client* client, uint3
     return NULL;
 }
 
-uint8_t* nabto_coap_client_request_create_packet(struct nabto_coap_client_request* request, uint32_t now, uint8_t* buffer, uint8_t* end, void** connection)
+/**
+ * Encode the options every packet of a request has, up to and including
+ * Content-Format.
+ */
+static uint8_t* nabto_coap_client_request_encode_options(struct nabto_coap_client_request* request, uint8_t* ptr, uint8_t* end, uint16_t* currentOption)
 {
-    struct nabto_coap_message_header header;
-    memset(&header, 0, sizeof(struct nabto_coap_message_header));
-    header.type = NABTO_COAP_TYPE_CON;
-    header.code = request->method;
-    header.messageId = request->messageId;
-    header.token = request->token;
-    *connection = request->connection;
-
-    uint8_t* ptr = buffer;
-
-    ptr = nabto_coap_encode_header(&header, ptr, end);
-
-    uint16_t currentOption = 0;
-
     if (request->isObserve) {
         uint32_t observeValue = request->observeDeregister ? 1 : 0;
-        ptr = nabto_coap_encode_varint_option(NABTO_COAP_OPTION_OBSERVE - currentOption, observeValue, ptr, end);
-        currentOption = NABTO_COAP_OPTION_OBSERVE;
+        ptr = nabto_coap_encode_varint_option(NABTO_COAP_OPTION_OBSERVE - *currentOption, observeValue, ptr, end);
+        *currentOption = NABTO_COAP_OPTION_OBSERVE;
     }
 
     for (size_t i = 0; i < request->pathSegmentsLength; i++) {
-        uint16_t optionDelta = NABTO_COAP_OPTION_URI_PATH - currentOption;
+        uint16_t optionDelta = NABTO_COAP_OPTION_URI_PATH - *currentOption;
         const char* pathSegmentBegin = request->pathSegments[i];
         size_t pathSegmentLength = strlen(pathSegmentBegin);
         ptr = nabto_coap_encode_option(optionDelta, (const uint8_t*)pathSegmentBegin, pathSegmentLength, ptr, end);
 
-        currentOption = NABTO_COAP_OPTION_URI_PATH;
+        *currentOption = NABTO_COAP_OPTION_URI_PATH;
     }
 
     if (request->hasContentFormat) {
-        uint16_t optionDelta = NABTO_COAP_OPTION_CONTENT_FORMAT - currentOption;
+        uint16_t optionDelta = NABTO_COAP_OPTION_CONTENT_FORMAT - *currentOption;
         ptr = nabto_coap_encode_varint_option(optionDelta, request->contentFormat, ptr, end);
-        currentOption = NABTO_COAP_OPTION_CONTENT_FORMAT;
+        *currentOption = NABTO_COAP_OPTION_CONTENT_FORMAT;
+    }
+    return ptr;
+}
+
+uint8_t* nabto_coap_client_request_create_packet(struct nabto_coap_client_request* request, uint32_t now, uint8_t* buffer, uint8_t* end, void** connection)
+{
+    struct nabto_coap_message_header header;
+    memset(&header, 0, sizeof(struct nabto_coap_message_header));
+    header.type = NABTO_COAP_TYPE_CON;
+    header.code = request->method;
+    header.messageId = request->messageId;
+    header.token = request->token;
+    *connection = request->connection;
+
+    struct nabto_coap_client* client = request->client;
+    struct nabto_coap_stream* stream = nabto_coap_stream_find(client->streams, request->connection);
+    uint8_t* frameEnd = end;
+    if (request->qBlock && stream == NULL) {
+        return nabto_coap_client_request_create_qblock_packet(request, now, buffer, end);
+    }
+    if (stream != NULL) {
+        // The stream is reliable, there is nothing to gain from Q-Block.
+        request->qBlock = false;
+        end = nabto_coap_stream_message_end(stream, buffer, end);
+        if (stream->peerBert && request->block1Current == 0 && request->payloadLength > NABTO_COAP_BLOCK_BERT_UNIT) {
+            request->block1Size = NABTO_COAP_BLOCK_SZX_BERT;
+        }
     }
 
+    if (stream == NULL && nabto_coap_client_request_fit_blocks(request) && request->transmissions > 0) {
+        // The block is sent again in a smaller size, as a new message.
+        nabto_coap_client_request_new_message_id(request);
+        header.messageId = request->messageId;
+    }
+
+    uint8_t* ptr = buffer;
+
+    ptr = nabto_coap_encode_header(&header, ptr, end);
+
+    uint16_t currentOption = 0;
+    ptr = nabto_coap_client_request_encode_options(request, ptr, end, &currentOption);
+
     if (request->hasBlock2) {
         uint16_t optionDelta = NABTO_COAP_OPTION_BLOCK2 - currentOption;
         ptr = nabto_coap_encode_varint_option(optionDelta, request->block2, ptr, end);
         currentOption = NABTO_COAP_OPTION_BLOCK2;
     }
 
-    size_t blockSize = (16 << request->block1Size);
+    size_t blockSize = NABTO_COAP_BLOCK_SIZE_ABSOLUTE(request->block1Size);
     size_t payloadOffset = (request->block1Current * blockSize);
+    if (request->block1Size == NABTO_COAP_BLOCK_SZX_BERT) {
+        // As many 1024 byte blocks as fits the message.
+        blockSize = nabto_coap_stream_bert_size(stream, end - buffer);
+    }
+    request->block1Blocks = 1;
     if (payloadOffset < request->payloadLength) {
         size_t payloadRestLength = request->payloadLength - payloadOffset;
 
-        if (request->payloadLength > (16u << request->block1Size)) {
+        if (request->block1Current > 0 || payloadRestLength > blockSize) {
             // add block1 option
             uint32_t blockMore = 1;
             if (payloadRestLength <= blockSize) {
@@ -476,6 +1024,7 @@ uint8_t* nabto_coap_client_request_create_packet(struct nabto_coap_client_reques
             }
 
             uint32_t blockOption = (request->block1Current << 4) + (blockMore << 3) + request->block1Size;
+            request->block1Blocks = nabto_coap_block_count(blockOption, (payloadRestLength < blockSize) ? payloadRestLength : blockSize);
 
             uint16_t optionDelta = NABTO_COAP_OPTION_BLOCK1 - currentOption;
             ptr = nabto_coap_encode_varint_option(optionDelta, blockOption, ptr, end);
@@ -491,12 +1040,122 @@ uint8_t* nabto_coap_client_request_create_packet(struct nabto_coap_client_reques
         }
     }
 
-    struct nabto_coap_client* client = request->client;
+    if (stream != NULL) {
+        // The stream is reliable, only the timeout of the request applies.
+        request->state = NABTO_COAP_CLIENT_REQUEST_STATE_WAIT_RESPONSE;
+        request->timeoutStamp = now + request->configuredTimeoutMilliseconds;
+        return nabto_coap_datagram_to_frame(buffer, ptr, frameEnd);
+    }
 
+    if (request->transmissions == 0) {
+        request->rto = nabto_coap_rtt_get_rto(client->rtt, request->connection, client->settings.ackTimeoutMilliseconds, now);
+        request->firstSent = now;
+    }
     request->state = NABTO_COAP_CLIENT_REQUEST_STATE_WAIT_ACK;
-    request->timeoutStamp = now + client->settings.ackTimeoutMilliseconds;
+    request->timeoutStamp = now + nabto_coap_rtt_backoff(request->rto, request->transmissions);
     request->retransmissions += 1;
+    if (request->transmissions < UINT8_MAX) {
+        request->transmissions += 1;
+    }
+
+    return ptr;
+}
+
+/**
+ * Make the next packet of a Q-Block request, RFC 9177. Every packet is
+ * a NON with a new message id. While a body of more than one block is
+ * sent, the blocks the server asked for again go first, then the burst
+ * goes on until the end of a set of NABTO_COAP_QBLOCK_MAX_PAYLOADS
+ * blocks, where the client waits for a 2.31 or for
+ * NABTO_COAP_QBLOCK_NON_TIMEOUT. While a Q-Block2 response is received
+ * the packets ask for missing blocks or for the next set.
+ */
+uint8_t* nabto_coap_client_request_create_qblock_packet(struct nabto_coap_client_request* request, uint32_t now, uint8_t* buffer, uint8_t* end)
+{
+    struct nabto_coap_client* client = request->client;
+    uint32_t szx = request->block1Size;
+    size_t blockSize = NABTO_COAP_BLOCK_SIZE_ABSOLUTE(szx);
+    size_t blocks = (request->payloadLength + blockSize - 1) / blockSize;
+
+    struct nabto_coap_message_header header;
+    memset(&header, 0, sizeof(struct nabto_coap_message_header));
+    header.type = NABTO_COAP_TYPE_NON;
+    header.code = request->method;
+    nabto_coap_client_request_new_message_id(request);
+    header.messageId = request->messageId;
+    header.token = request->token;
+
+    uint8_t* ptr = nabto_coap_encode_header(&header, buffer, end);
+    uint16_t currentOption = 0;
+    ptr = nabto_coap_client_request_encode_options(request, ptr, end, &currentOption);
+
+    bool wait = true;
+    uint32_t timeout;
+    if (blocks > 1 && !request->qBlock1Done) {
+        uint32_t num;
+        bool burst = false;
+        if (request->qBlock1MissingCount > 0) {
+            num = request->qBlock1Missing[0];
+            request->qBlock1MissingCount--;
+            memmove(request->qBlock1Missing, request->qBlock1Missing + 1, request->qBlock1MissingCount * sizeof(uint32_t));
+        } else if (request->qBlock1Next < blocks) {
+            num = request->qBlock1Next++;
+            burst = true;
+        } else {
+            // The reply to the last block is missing, send it again.
+            num = (uint32_t)(blocks - 1);
+        }
+        bool more = (num + 1 < blocks);
+        ptr = nabto_coap_encode_varint_option(NABTO_COAP_OPTION_QBLOCK1 - currentOption, (num << 4) + ((more ? 1u : 0u) << 3) + szx, ptr, end);
+        // Tell the server that the response can be sent in bursts too.
+        ptr = nabto_coap_encode_varint_option(NABTO_COAP_OPTION_QBLOCK2 - NABTO_COAP_OPTION_QBLOCK1, szx, ptr, end);
+        currentOption = NABTO_COAP_OPTION_QBLOCK2;
+        if (num == 0 && request->payloadLength <= UINT32_MAX) {
+            ptr = nabto_coap_encode_varint_option(NABTO_COAP_OPTION_SIZE1 - currentOption, (uint32_t)request->payloadLength, ptr, end);
+            currentOption = NABTO_COAP_OPTION_SIZE1;
+        }
+        size_t offset = (size_t)num * blockSize;
+        size_t length = more ? blockSize : request->payloadLength - offset;
+        ptr = nabto_coap_encode_payload(request->payload + offset, length, ptr, end);
+
+        wait = (request->qBlock1MissingCount == 0 && !(burst && more && (num + 1) % NABTO_COAP_QBLOCK_MAX_PAYLOADS != 0));
+        timeout = NABTO_COAP_QBLOCK_NON_TIMEOUT;
+    } else if (request->qBlock2Map != NULL) {
+        struct nabto_coap_qblock_map* map = request->qBlock2Map;
+        uint32_t missing[NABTO_COAP_QBLOCK_MAX_PAYLOADS];
+        uint32_t limit = (map->total > 0) ? map->total : map->highest;
+        size_t count = nabto_coap_qblock_map_missing(map, limit, missing, NABTO_COAP_QBLOCK_MAX_PAYLOADS);
+        request->qBlock2Outstanding = (uint8_t)count;
+        if (count == 0) {
+            // Nothing is missing so far, ask for the next set.
+            ptr = nabto_coap_encode_varint_option(NABTO_COAP_OPTION_QBLOCK2 - currentOption, (map->highest << 4) + (1 << 3) + request->qBlock2Size, ptr, end);
+        }
+        for (size_t i = 0; i < count; i++) {
+            ptr = nabto_coap_encode_varint_option(NABTO_COAP_OPTION_QBLOCK2 - currentOption, (missing[i] << 4) + request->qBlock2Size, ptr, end);
+            currentOption = NABTO_COAP_OPTION_QBLOCK2;
+        }
+        timeout = NABTO_COAP_QBLOCK_NON_RECEIVE_TIMEOUT;
+    } else {
+        // The request itself, the body fits in one block.
+        ptr = nabto_coap_encode_varint_option(NABTO_COAP_OPTION_QBLOCK2 - currentOption, szx, ptr, end);
+        if (request->payloadLength > 0) {
+            ptr = nabto_coap_encode_payload(request->payload, request->payloadLength, ptr, end);
+        }
+        if (request->transmissions == 0) {
+            request->rto = nabto_coap_rtt_get_rto(client->rtt, request->connection, client->settings.ackTimeoutMilliseconds, now);
+            request->firstSent = now;
+        }
+        timeout = nabto_coap_rtt_backoff(request->rto, request->transmissions);
+    }
 
+    if (wait) {
+        // Timeouts are counted in handle_timeout, progress resets them.
+        request->state = NABTO_COAP_CLIENT_REQUEST_STATE_WAIT_ACK;
+        request->timeoutStamp = now + timeout;
+        if (request->transmissions < UINT8_MAX) {
+            request->transmissions += 1;
+        }
+    }
     return ptr;
 }
 
@@ -560,6 +1219,9 @@ void nabto_coap_client_handle_timeout(struct nabto_coap_client* client, uint32_t
                         request->status = NABTO_COAP_CLIENT_STATUS_TIMEOUT;
                         request->state = NABTO_COAP_CLIENT_REQUEST_STATE_DONE_CALLBACK;
                     } else {
+                        if (request->transmissions == 2 && !request->qBlock) {
+                            nabto_coap_client_request_block_timeout(request);
+                        }
                         request->retransmissions += 1;
                         request->state = NABTO_COAP_CLIENT_REQUEST_STATE_SEND_REQUEST;
                     }
@@ -620,7 +1282,13 @@ struct nabto_coap_client_request* nabto_coap_client_request_new(struct nabto_coa
 
     nabto_coap_client_next_token(client, &request->token);
     request->client = client;
-    request->messageId = nabto_coap_client_next_message_id(client);
+    request->connection = connection;
+    uint32_t hash = nabto_coap_client_request_key_hash(connection, &request->token);
+    if (nabto_coap_index_insert(client->requestsByToken, hash, request) != NABTO_COAP_ERROR_OK) {
+        client->allocator.free(request);
+        return NULL;
+    }
+    nabto_coap_client_request_new_message_id(request);
 
     nabto_coap_client_insert_request_into_list(client->requestsSentinel, request);
 
@@ -628,7 +1296,7 @@ struct nabto_coap_client_request* nabto_coap_client_request_new(struct nabto_coa
     request->endHandlerUserData = endHandlerUserData;
 
     request->block1Size = 5; // 512 byte blocks as default. 16 * 2^5.
-    request->connection = connection;
+    request->block1Blocks = 1;
 
     return request;
 }
@@ -636,6 +1304,16 @@ struct nabto_coap_client_request* nabto_coap_client_request_new(struct nabto_coa
 void nabto_coap_client_request_send(struct nabto_coap_client_request* request)
 {
     struct nabto_coap_client* client = request->client;
+    uint32_t szx;
+    if (nabto_coap_stream_find(client->streams, request->connection) == NULL &&
+        nabto_coap_path_get_szx(client->paths, request->connection, &szx))
+    {
+        // Send blocks which fit the connection and ask the server to
+        // do the same.
+        request->block1Size = szx;
+        request->hasBlock2 = true;
+        request->block2 = szx;
+    }
     request->state = NABTO_COAP_CLIENT_REQUEST_STATE_SEND_REQUEST;
     client->notifyEvent(client->userData);
 }
@@ -666,12 +1344,21 @@ void nabto_coap_client_request_cancel(struct nabto_coap_client_request* request)
 
 static void nabto_coap_client_response_free(struct nabto_coap_client_response* response) {
     struct nabto_coap_client* client = response->request->client;
-    if (response->payloadLength != 0) {
+    if (response->payload != NULL) {
         client->allocator.free(response->payload);
     }
     client->allocator.free(response);
 }
 
+static void nabto_coap_client_request_free_qblock2_map(struct nabto_coap_client_request* request)
+{
+    if (request->qBlock2Map != NULL) {
+        nabto_coap_qblock_map_deinit(request->qBlock2Map);
+        nn_allocator_free(&request->client->allocator, request->qBlock2Map);
+        request->qBlock2Map = NULL;
+    }
+}
+
 /**
  * free a request
  */
@@ -681,8 +1368,11 @@ void nabto_coap_client_request_free(struct nabto_coap_client_request* request)
     if (request->response != NULL) {
         nabto_coap_client_response_free(request->response);
     }
+    nabto_coap_client_request_free_qblock2_map(request);
 
     nabto_coap_client_remove_request_from_list(request);
+    nabto_coap_index_remove(client->requestsByToken, nabto_coap_client_request_key_hash(request->connection, &request->token), request);
+    nabto_coap_client_request_unindex_message_id(request);
 
     if (request->payloadLength) {
         client->allocator.free(request->payload);
@@ -723,6 +1413,11 @@ void nabto_coap_client_request_set_timeout(struct nabto_coap_client_request* req
     request->configuredTimeoutMilliseconds = timeout;
 }
 
+void nabto_coap_client_limit_response_body_size(struct nabto_coap_client* client, size_t limit)
+{
+    client->settings.maxResponseBodySize = limit;
+}
+
 void nabto_coap_client_remove_connection(struct nabto_coap_client* client, void *connection)
 {
     // Stop all outstanding requests for that connection. We assume
@@ -738,9 +1433,26 @@ void nabto_coap_client_remove_connection(struct nabto_coap_client* client, void
         }
         request = request->next;
     }
+    nabto_coap_rtt_remove_connection(client->rtt, connection);
+    nabto_coap_path_remove_connection(client->paths, connection);
+    nabto_coap_stream_close(client->streams, connection);
     client->notifyEvent(client->userData);
 }
 
+nabto_coap_error nabto_coap_client_set_mtu(struct nabto_coap_client* client, void* connection, uint16_t mtu)
+{
+    return nabto_coap_path_set_mtu(client->paths, connection, mtu);
+}
+
+nabto_coap_error nabto_coap_client_stream_open(struct nabto_coap_client* client, void* connection, uint32_t maxMessageSize)
+{
+    nabto_coap_error ec = nabto_coap_stream_open(client->streams, connection, maxMessageSize);
+    if (ec == NABTO_COAP_ERROR_OK) {
+        client->notifyEvent(client->userData);
+    }
+    return ec;
+}
+
 
 /**
  * set the expeched content format of the response body.
@@ -759,7 +1471,8 @@ void nabto_coap_client_request_observe_deregister(struct nabto_coap_client_reque
     struct nabto_coap_client* client = request->client;
     request->observeDeregister = true;
     if (request->state == NABTO_COAP_CLIENT_REQUEST_STATE_WAIT_RESPONSE) {
-        request->messageId = nabto_coap_client_next_message_id(client);
+        nabto_coap_client_request_new_message_id(request);
+        request->transmissions = 0;
         request->retransmissions = 0;
         request->state = NABTO_COAP_CLIENT_REQUEST_STATE_SEND_REQUEST;
         client->notifyEvent(client->userData);
@@ -796,6 +1509,11 @@ void nabto_coap_client_request_set_nonconfirmable(struct nabto_coap_client_reque
     request->type = NABTO_COAP_TYPE_NON;
 }
 
+void nabto_coap_client_request_set_qblock(struct nabto_coap_client_request* request)
+{
+    request->qBlock = true;
+}
+
 uint16_t nabto_coap_client_response_get_code(struct nabto_coap_client_response* response)
 {
     if (!response) {
@@ -24,6 +24,7 @@ enum nabto_coap_client_request_state {
 };
 
 struct nabto_coap_client_request;
+struct nabto_coap_qblock_map;
 
 struct nabto_coap_client_request {
     struct nabto_coap_client* client;
@@ -32,7 +33,15 @@ struct nabto_coap_client_request {
     enum nabto_coap_client_request_state state;
     uint32_t timeoutStamp;
     uint16_t messageId;
+    // false if the messageId could not be put in the index, ACKs and
+    // RSTs for it are then not matched.
+    bool messageIdIndexed;
     uint8_t retransmissions;
+    // Transmissions of the current messageId, the RTO it was first sent
+    // with and when, see nabto_coap_rtt.h.
+    uint8_t transmissions;
+    uint32_t rto;
+    uint32_t firstSent;
     nabto_coap_type type;
     nabto_coap_code method;
     nabto_coap_token token;
@@ -50,12 +59,27 @@ struct nabto_coap_client_request {
     uint8_t* payload;
     size_t payloadLength;
 
-    uint32_t block1Size; // (16 << block1size) is the actual block size.
+    uint32_t block1Size; // (16 << block1size) is the actual block size, 7 is BERT.
     uint32_t block1Current;
+    uint32_t block1Blocks; // blocks in the last block1 message, more than one for BERT.
 
     bool hasBlock2;
     uint32_t block2;
 
+    // Q-Block1 and Q-Block2, see nabto_coap_client_request_set_qblock.
+    bool qBlock;
+    bool qBlockConfirmed; // the server has answered with Q-Block
+    bool qBlock1Done; // the server has the whole body
+    uint32_t qBlock1Next; // next block of the burst
+    // Blocks the server asked for again, sent before the burst goes on.
+    uint32_t qBlock1Missing[NABTO_COAP_QBLOCK_MAX_PAYLOADS];
+    uint8_t qBlock1MissingCount;
+    // Set while a Q-Block2 response is received.
+    struct nabto_coap_qblock_map* qBlock2Map;
+    uint32_t qBlock2Size;
+    // Missing blocks asked for and not yet received.
+    uint8_t qBlock2Outstanding;
+
     bool isObserve;
     bool observeDeregister;
 
@@ -76,6 +100,7 @@ struct nabto_coap_client_response {
     uint16_t contentFormat;
     uint8_t* payload;
     size_t payloadLength;
+    size_t payloadCapacity; // only used for Q-Block2 responses
     uint16_t messageId;
     bool hasObserve;
     uint32_t observe;
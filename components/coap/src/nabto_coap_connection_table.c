@@ -0,0 +1,60 @@
+#include "nabto_coap_connection_table.h"
+
+static void* nabto_coap_connection_table_item_connection(const void* item)
+{
+    return *(void* const*)item;
+}
+
+static bool nabto_coap_connection_table_match(const void* item, const void* key)
+{
+    return nabto_coap_connection_table_item_connection(item) == key;
+}
+
+static uint32_t nabto_coap_connection_table_hash(void* connection)
+{
+    return nabto_coap_hash_pointer(NABTO_COAP_HASH_INIT, connection);
+}
+
+static void nabto_coap_connection_table_free_item(void* item, void* userData)
+{
+    struct nabto_coap_connection_table* table = userData;
+    nn_allocator_free(&table->allocator, item);
+}
+
+void nabto_coap_connection_table_init(struct nabto_coap_connection_table* table, struct nn_allocator* allocator, size_t itemSize)
+{
+    table->allocator = *allocator;
+    table->itemSize = itemSize;
+    nabto_coap_index_init(&table->index, allocator);
+}
+
+void nabto_coap_connection_table_deinit(struct nabto_coap_connection_table* table)
+{
+    nabto_coap_index_clear(&table->index, nabto_coap_connection_table_free_item, table);
+    nabto_coap_index_deinit(&table->index);
+}
+
+void* nabto_coap_connection_table_find(struct nabto_coap_connection_table* table, void* connection)
+{
+    return nabto_coap_index_find(&table->index, nabto_coap_connection_table_hash(connection), nabto_coap_connection_table_match, connection);
+}
+
+void* nabto_coap_connection_table_add(struct nabto_coap_connection_table* table, void* connection)
+{
+    void* item = nn_allocator_calloc(&table->allocator, 1, table->itemSize);
+    if (item == NULL) {
+        return NULL;
+    }
+    *(void**)item = connection;
+    if (nabto_coap_index_insert(&table->index, nabto_coap_connection_table_hash(connection), item) != NABTO_COAP_ERROR_OK) {
+        nn_allocator_free(&table->allocator, item);
+        return NULL;
+    }
+    return item;
+}
+
+void nabto_coap_connection_table_remove(struct nabto_coap_connection_table* table, void* item)
+{
+    nabto_coap_index_remove(&table->index, nabto_coap_connection_table_hash(nabto_coap_connection_table_item_connection(item)), item);
+    nn_allocator_free(&table->allocator, item);
+}
@@ -0,0 +1,53 @@
+#ifndef _NABTO_COAP_CONNECTION_TABLE_H_
+#define _NABTO_COAP_CONNECTION_TABLE_H_
+
+#include "nabto_coap_index.h"
+
+#include <nabto_coap/nabto_coap.h>
+#include <nn/allocator.h>
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * State kept for each connection, e.g. its RTT estimator or its block
+ * size.
+ *
+ * The table allocates the items, itemSize bytes each, and finds them
+ * by connection. An item has to start with the connection it belongs
+ * to, a void* connection as its first member.
+ */
+
+struct nabto_coap_connection_table {
+    struct nn_allocator allocator;
+    struct nabto_coap_index index; // items by connection
+    size_t itemSize;
+};
+
+void nabto_coap_connection_table_init(struct nabto_coap_connection_table* table, struct nn_allocator* allocator, size_t itemSize);
+
+// Frees the items left in the table.
+void nabto_coap_connection_table_deinit(struct nabto_coap_connection_table* table);
+
+/**
+ * @return the item of a connection, NULL if it has none.
+ */
+void* nabto_coap_connection_table_find(struct nabto_coap_connection_table* table, void* connection);
+
+/**
+ * Add a zeroed item for a connection which has none.
+ *
+ * @return the item, NULL if it could not be allocated or indexed.
+ */
+void* nabto_coap_connection_table_add(struct nabto_coap_connection_table* table, void* connection);
+
+void nabto_coap_connection_table_remove(struct nabto_coap_connection_table* table, void* item);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
@@ -0,0 +1,165 @@
+#include "nabto_coap_index.h"
+
+#include <stdint.h>
+
+#define NABTO_COAP_INDEX_MIN_CAPACITY 16
+
+// The address of this variable marks an entry as removed.
+static char nabto_coap_index_tombstone;
+#define NABTO_COAP_INDEX_TOMBSTONE ((void*)&nabto_coap_index_tombstone)
+
+static nabto_coap_error nabto_coap_index_rehash(struct nabto_coap_index* index, size_t newCapacity);
+
+void nabto_coap_index_init(struct nabto_coap_index* index, struct nn_allocator* allocator)
+{
+    memset(index, 0, sizeof(struct nabto_coap_index));
+    index->allocator = *allocator;
+}
+
+void nabto_coap_index_deinit(struct nabto_coap_index* index)
+{
+    nn_allocator_free(&index->allocator, index->entries);
+    index->entries = NULL;
+    index->capacity = 0;
+    index->used = 0;
+    index->deleted = 0;
+}
+
+nabto_coap_error nabto_coap_index_insert(struct nabto_coap_index* index, uint32_t hash, void* item)
+{
+    // Keep the load factor including tombstones below 3/4.
+    if ((index->used + index->deleted + 1) * 4 > index->capacity * 3) {
+        size_t newCapacity = NABTO_COAP_INDEX_MIN_CAPACITY;
+        while (newCapacity < (index->used + 1) * 2) {
+            newCapacity *= 2;
+        }
+        if (nabto_coap_index_rehash(index, newCapacity) != NABTO_COAP_ERROR_OK) {
+            // Continue in the current table as long as an empty slot
+            // is left to terminate probe sequences.
+            if (index->used + index->deleted + 1 >= index->capacity) {
+                return NABTO_COAP_ERROR_OUT_OF_MEMORY;
+            }
+        }
+    }
+
+    size_t mask = index->capacity - 1;
+    size_t i = hash & mask;
+    while (index->entries[i].item != NULL && index->entries[i].item != NABTO_COAP_INDEX_TOMBSTONE) {
+        i = (i + 1) & mask;
+    }
+    if (index->entries[i].item == NABTO_COAP_INDEX_TOMBSTONE) {
+        index->deleted--;
+    }
+    index->entries[i].item = item;
+    index->entries[i].hash = hash;
+    index->used++;
+    return NABTO_COAP_ERROR_OK;
+}
+
+void nabto_coap_index_remove(struct nabto_coap_index* index, uint32_t hash, void* item)
+{
+    if (index->capacity == 0) {
+        return;
+    }
+    size_t mask = index->capacity - 1;
+    size_t i = hash & mask;
+    size_t probes = 0;
+    while (index->entries[i].item != NULL && probes < index->capacity) {
+        if (index->entries[i].item == item) {
+            index->entries[i].item = NABTO_COAP_INDEX_TOMBSTONE;
+            index->used--;
+            index->deleted++;
+            if (index->used == 0) {
+                // Nothing left, drop all the tombstones.
+                memset(index->entries, 0, index->capacity * sizeof(struct nabto_coap_index_entry));
+                index->deleted = 0;
+            }
+            return;
+        }
+        i = (i + 1) & mask;
+        probes++;
+    }
+}
+
+void* nabto_coap_index_find(const struct nabto_coap_index* index, uint32_t hash, nabto_coap_index_match match, const void* key)
+{
+    if (index->used == 0) {
+        return NULL;
+    }
+    size_t mask = index->capacity - 1;
+    size_t i = hash & mask;
+    size_t probes = 0;
+    while (index->entries[i].item != NULL && probes < index->capacity) {
+        struct nabto_coap_index_entry* entry = &index->entries[i];
+        if (entry->item != NABTO_COAP_INDEX_TOMBSTONE &&
+            entry->hash == hash &&
+            match(entry->item, key))
+        {
+            return entry->item;
+        }
+        i = (i + 1) & mask;
+        probes++;
+    }
+    return NULL;
+}
+
+void nabto_coap_index_clear(struct nabto_coap_index* index, nabto_coap_index_visit visit, void* userData)
+{
+    for (size_t i = 0; i < index->capacity; i++) {
+        void* item = index->entries[i].item;
+        if (item != NULL && item != NABTO_COAP_INDEX_TOMBSTONE) {
+            visit(item, userData);
+        }
+    }
+    if (index->capacity > 0) {
+        memset(index->entries, 0, index->capacity * sizeof(struct nabto_coap_index_entry));
+    }
+    index->used = 0;
+    index->deleted = 0;
+}
+
+nabto_coap_error nabto_coap_index_rehash(struct nabto_coap_index* index, size_t newCapacity)
+{
+    struct nabto_coap_index_entry* entries = nn_allocator_calloc(&index->allocator, newCapacity, sizeof(struct nabto_coap_index_entry));
+    if (entries == NULL) {
+        return NABTO_COAP_ERROR_OUT_OF_MEMORY;
+    }
+    size_t mask = newCapacity - 1;
+    for (size_t i = 0; i < index->capacity; i++) {
+        struct nabto_coap_index_entry* old = &index->entries[i];
+        if (old->item != NULL && old->item != NABTO_COAP_INDEX_TOMBSTONE) {
+            size_t j = old->hash & mask;
+            while (entries[j].item != NULL) {
+                j = (j + 1) & mask;
+            }
+            entries[j] = *old;
+        }
+    }
+    nn_allocator_free(&index->allocator, index->entries);
+    index->entries = entries;
+    index->capacity = newCapacity;
+    index->deleted = 0;
+    return NABTO_COAP_ERROR_OK;
+}
+
+uint32_t nabto_coap_hash_bytes(uint32_t hash, const uint8_t* data, size_t dataLength)
+{
+    // FNV-1a
+    for (size_t i = 0; i < dataLength; i++) {
+        hash ^= data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+uint32_t nabto_coap_hash_pointer(uint32_t hash, const void* ptr)
+{
+    uintptr_t value = (uintptr_t)ptr;
+    return nabto_coap_hash_bytes(hash, (const uint8_t*)&value, sizeof(value));
+}
+
+uint32_t nabto_coap_hash_token(uint32_t hash, const nabto_coap_token* token)
+{
+    hash = nabto_coap_hash_bytes(hash, &token->tokenLength, 1);
+    return nabto_coap_hash_bytes(hash, token->token, token->tokenLength);
+}
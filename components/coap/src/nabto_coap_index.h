@@ -0,0 +1,93 @@
+#ifndef _NABTO_COAP_INDEX_H_
+#define _NABTO_COAP_INDEX_H_
+
+#include <nabto_coap/nabto_coap.h>
+#include <nn/allocator.h>
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Open addressing hash index over items owned by someone else.
+ *
+ * The index does not know how to hash an item, the caller supplies
+ * the hash on insert, remove and find. The hash is stored next to the
+ * item pointer such that the table can be rehashed without looking at
+ * the items, and such that most probes can be rejected without
+ * dereferencing the item.
+ *
+ * Removed entries are marked with a tombstone, tombstones are dropped
+ * when the table is rehashed.
+ */
+
+struct nabto_coap_index_entry {
+    void* item;
+    uint32_t hash;
+};
+
+struct nabto_coap_index {
+    struct nn_allocator allocator;
+    struct nabto_coap_index_entry* entries;
+    size_t capacity; // always 0 or a power of two
+    size_t used;     // number of live items
+    size_t deleted;  // number of tombstones
+};
+
+/**
+ * Test if an item in the index matches the key given to find.
+ */
+typedef bool (*nabto_coap_index_match)(const void* item, const void* key);
+
+/**
+ * Called for each item by nabto_coap_index_clear.
+ */
+typedef void (*nabto_coap_index_visit)(void* item, void* userData);
+
+void nabto_coap_index_init(struct nabto_coap_index* index, struct nn_allocator* allocator);
+void nabto_coap_index_deinit(struct nabto_coap_index* index);
+
+/**
+ * Insert an item. The same item must not be inserted twice.
+ *
+ * @return NABTO_COAP_ERROR_OUT_OF_MEMORY if the table is full and could not be grown.
+ */
+nabto_coap_error nabto_coap_index_insert(struct nabto_coap_index* index, uint32_t hash, void* item);
+
+/**
+ * Remove an item, the hash has to be the same as was used when the
+ * item was inserted. Removing an item which is not in the index is a
+ * noop.
+ */
+void nabto_coap_index_remove(struct nabto_coap_index* index, uint32_t hash, void* item);
+
+/**
+ * Find the first item with the given hash for which match(item, key) is true.
+ *
+ * @return the item or NULL if no item matched.
+ */
+void* nabto_coap_index_find(const struct nabto_coap_index* index, uint32_t hash, nabto_coap_index_match match, const void* key);
+
+/**
+ * Remove all items, visit is called for each of them, e.g. to free
+ * it. visit must not use the index.
+ */
+void nabto_coap_index_clear(struct nabto_coap_index* index, nabto_coap_index_visit visit, void* userData);
+
+/**
+ * Helpers for building hashes of composite keys. Start with
+ * NABTO_COAP_HASH_INIT and feed each part of the key.
+ */
+#define NABTO_COAP_HASH_INIT 2166136261u
+
+uint32_t nabto_coap_hash_pointer(uint32_t hash, const void* ptr);
+uint32_t nabto_coap_hash_bytes(uint32_t hash, const uint8_t* data, size_t dataLength);
+uint32_t nabto_coap_hash_token(uint32_t hash, const nabto_coap_token* token);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
@@ -0,0 +1,96 @@
+#include "nabto_coap_path.h"
+
+#include <stdint.h>
+
+struct nabto_coap_path_table* nabto_coap_path_table_new(struct nn_allocator* allocator)
+{
+    struct nabto_coap_path_table* table = nn_allocator_calloc(allocator, 1, sizeof(struct nabto_coap_path_table));
+    if (table == NULL) {
+        return NULL;
+    }
+    nabto_coap_connection_table_init(&table->paths, allocator, sizeof(struct nabto_coap_path));
+    return table;
+}
+
+void nabto_coap_path_table_free(struct nabto_coap_path_table* table)
+{
+    if (table == NULL) {
+        return;
+    }
+    struct nn_allocator allocator = table->paths.allocator;
+    nabto_coap_connection_table_deinit(&table->paths);
+    nn_allocator_free(&allocator, table);
+}
+
+static uint8_t nabto_coap_path_szx_for_mtu(uint16_t mtu)
+{
+    uint8_t szx = NABTO_COAP_PATH_MAX_SZX;
+    while (szx > 0 && (16u << szx) + NABTO_COAP_PATH_OVERHEAD > mtu) {
+        szx--;
+    }
+    return szx;
+}
+
+nabto_coap_error nabto_coap_path_set_mtu(struct nabto_coap_path_table* table, void* connection, uint16_t mtu)
+{
+    struct nabto_coap_path* path = nabto_coap_connection_table_find(&table->paths, connection);
+    if (mtu == 0) {
+        if (path != NULL) {
+            nabto_coap_connection_table_remove(&table->paths, path);
+        }
+        return NABTO_COAP_ERROR_OK;
+    }
+    if (path == NULL) {
+        path = nabto_coap_connection_table_add(&table->paths, connection);
+        if (path == NULL) {
+            return NABTO_COAP_ERROR_OUT_OF_MEMORY;
+        }
+    }
+    path->szx = nabto_coap_path_szx_for_mtu(mtu);
+    return NABTO_COAP_ERROR_OK;
+}
+
+bool nabto_coap_path_get_szx(struct nabto_coap_path_table* table, void* connection, uint32_t* szx)
+{
+    struct nabto_coap_path* path = nabto_coap_connection_table_find(&table->paths, connection);
+    if (path == NULL) {
+        return false;
+    }
+    *szx = path->szx;
+    return true;
+}
+
+uint32_t nabto_coap_path_limit_szx(struct nabto_coap_path_table* table, void* connection, uint32_t szx)
+{
+    uint32_t pathSzx;
+    if (szx != NABTO_COAP_BLOCK_SZX_BERT && nabto_coap_path_get_szx(table, connection, &pathSzx) && pathSzx < szx) {
+        return pathSzx;
+    }
+    return szx;
+}
+
+void nabto_coap_path_block_timeout(struct nabto_coap_path_table* table, void* connection, uint32_t szx)
+{
+    struct nabto_coap_path* path = nabto_coap_connection_table_find(&table->paths, connection);
+    // Only the first of several blocks timing out at the same size
+    // halves it.
+    if (path != NULL && szx == path->szx && path->szx > NABTO_COAP_PATH_MIN_SZX) {
+        path->szx--;
+    }
+}
+
+void nabto_coap_path_remove_connection(struct nabto_coap_path_table* table, void* connection)
+{
+    struct nabto_coap_path* path = nabto_coap_connection_table_find(&table->paths, connection);
+    if (path != NULL) {
+        nabto_coap_connection_table_remove(&table->paths, path);
+    }
+}
+
+uint32_t nabto_coap_path_rescale_block(uint32_t num, uint32_t fromSzx, uint32_t toSzx)
+{
+    if (fromSzx <= toSzx || fromSzx == NABTO_COAP_BLOCK_SZX_BERT) {
+        return num;
+    }
+    return num << (fromSzx - toSzx);
+}
@@ -0,0 +1,86 @@
+#ifndef _NABTO_COAP_PATH_H_
+#define _NABTO_COAP_PATH_H_
+
+#include "nabto_coap_connection_table.h"
+
+#include <nabto_coap/nabto_coap.h>
+#include <nn/allocator.h>
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * The block size to use on each connection, from an MTU hint given by
+ * the transport.
+ *
+ * The hint is the largest CoAP message the transport can send in one
+ * datagram, after the IP, UDP and DTLS overhead. The block size is the
+ * largest SZX which leaves NABTO_COAP_PATH_OVERHEAD bytes for the
+ * header, token and options of a block message. A block which times
+ * out twice in a row suggests that the hint is too optimistic, the
+ * block size of the connection is then halved, down to
+ * NABTO_COAP_PATH_MIN_SZX. Setting the hint again starts over.
+ *
+ * Connections without a hint have no entry, the callers then use their
+ * default block size.
+ */
+
+#define NABTO_COAP_PATH_OVERHEAD 64
+// 64 byte blocks.
+#define NABTO_COAP_PATH_MIN_SZX 2
+// 1024 byte blocks, the largest which is not BERT.
+#define NABTO_COAP_PATH_MAX_SZX 6
+
+struct nabto_coap_path {
+    void* connection; // first, see nabto_coap_connection_table
+    uint8_t szx;
+};
+
+struct nabto_coap_path_table {
+    struct nabto_coap_connection_table paths;
+};
+
+struct nabto_coap_path_table* nabto_coap_path_table_new(struct nn_allocator* allocator);
+// NULL is ignored.
+void nabto_coap_path_table_free(struct nabto_coap_path_table* table);
+
+/**
+ * Set the MTU hint of a connection, 0 removes it.
+ */
+nabto_coap_error nabto_coap_path_set_mtu(struct nabto_coap_path_table* table, void* connection, uint16_t mtu);
+
+/**
+ * Get the block size of a connection.
+ *
+ * @return false if the connection has no MTU hint.
+ */
+bool nabto_coap_path_get_szx(struct nabto_coap_path_table* table, void* connection, uint32_t* szx);
+
+/**
+ * Cap a block size asked for by the peer, or chosen by default, to the
+ * block size of the connection. BERT is left alone.
+ */
+uint32_t nabto_coap_path_limit_szx(struct nabto_coap_path_table* table, void* connection, uint32_t szx);
+
+/**
+ * A message carrying a block of size szx has timed out the second time
+ * in a row.
+ */
+void nabto_coap_path_block_timeout(struct nabto_coap_path_table* table, void* connection, uint32_t szx);
+
+void nabto_coap_path_remove_connection(struct nabto_coap_path_table* table, void* connection);
+
+/**
+ * Move a block number from one block size to a smaller one, such that
+ * the block starts at the same offset.
+ */
+uint32_t nabto_coap_path_rescale_block(uint32_t num, uint32_t fromSzx, uint32_t toSzx);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
@@ -0,0 +1,98 @@
+#include "nabto_coap_qblock.h"
+
+#include <stdint.h>
+
+void nabto_coap_qblock_map_init(struct nabto_coap_qblock_map* map, struct nn_allocator* allocator)
+{
+    memset(map, 0, sizeof(struct nabto_coap_qblock_map));
+    map->allocator = *allocator;
+}
+
+void nabto_coap_qblock_map_deinit(struct nabto_coap_qblock_map* map)
+{
+    nn_allocator_free(&map->allocator, map->bits);
+    map->bits = NULL;
+    map->capacity = 0;
+}
+
+static nabto_coap_error nabto_coap_qblock_map_grow(struct nabto_coap_qblock_map* map, uint32_t num)
+{
+    if (num < map->capacity) {
+        return NABTO_COAP_ERROR_OK;
+    }
+    // Double such that a body received in order is linear.
+    uint64_t capacity = (map->capacity < 64) ? 64 : (uint64_t)map->capacity * 2;
+    while (capacity <= num) {
+        capacity *= 2;
+    }
+    if (capacity > UINT32_MAX) {
+        capacity = (uint64_t)UINT32_MAX + 1 - 8;
+    }
+    uint8_t* bits = nn_allocator_calloc(&map->allocator, 1, (size_t)(capacity / 8));
+    if (bits == NULL) {
+        return NABTO_COAP_ERROR_OUT_OF_MEMORY;
+    }
+    if (map->bits != NULL) {
+        memcpy(bits, map->bits, map->capacity / 8);
+        nn_allocator_free(&map->allocator, map->bits);
+    }
+    map->bits = bits;
+    map->capacity = (uint32_t)capacity;
+    return NABTO_COAP_ERROR_OK;
+}
+
+nabto_coap_error nabto_coap_qblock_map_set(struct nabto_coap_qblock_map* map, uint32_t num, bool last, bool* isNew)
+{
+    *isNew = false;
+    if ((map->total > 0 && num >= map->total) ||
+        (last && num + 1 < map->highest))
+    {
+        return NABTO_COAP_ERROR_INVALID_PARAMETER;
+    }
+    nabto_coap_error ec = nabto_coap_qblock_map_grow(map, num);
+    if (ec != NABTO_COAP_ERROR_OK) {
+        return ec;
+    }
+    if (last) {
+        map->total = num + 1;
+    }
+    if (nabto_coap_qblock_map_has(map, num)) {
+        return NABTO_COAP_ERROR_OK;
+    }
+    map->bits[num / 8] |= (uint8_t)(1u << (num % 8));
+    map->received++;
+    if (num >= map->highest) {
+        map->highest = num + 1;
+    }
+    *isNew = true;
+    return NABTO_COAP_ERROR_OK;
+}
+
+bool nabto_coap_qblock_map_has(const struct nabto_coap_qblock_map* map, uint32_t num)
+{
+    if (num >= map->capacity) {
+        return false;
+    }
+    return (map->bits[num / 8] >> (num % 8)) & 1;
+}
+
+bool nabto_coap_qblock_map_complete(const struct nabto_coap_qblock_map* map)
+{
+    return map->total > 0 && map->received == map->total;
+}
+
+size_t nabto_coap_qblock_map_missing(const struct nabto_coap_qblock_map* map, uint32_t limit, uint32_t* missing, size_t max)
+{
+    size_t count = 0;
+    for (uint32_t num = 0; num < limit && count < max; num++) {
+        if (num % 8 == 0 && num + 8 <= limit && num < map->capacity && map->bits[num / 8] == 0xFF) {
+            // skip a full byte of received blocks.
+            num += 7;
+            continue;
+        }
+        if (!nabto_coap_qblock_map_has(map, num)) {
+            missing[count++] = num;
+        }
+    }
+    return count;
+}
@@ -0,0 +1,59 @@
+#ifndef _NABTO_COAP_QBLOCK_H_
+#define _NABTO_COAP_QBLOCK_H_
+
+#include <nabto_coap/nabto_coap.h>
+#include <nn/allocator.h>
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * The blocks received of a body sent with Q-Block1 or Q-Block2,
+ * RFC 9177.
+ *
+ * Blocks can arrive in any order and more than once. The number of
+ * blocks in the body is known when the block without the more flag has
+ * been received. The receiver asks for the missing blocks below that,
+ * or below the highest block seen, with nabto_coap_qblock_map_missing.
+ */
+struct nabto_coap_qblock_map {
+    struct nn_allocator allocator;
+    uint8_t* bits;
+    uint32_t capacity; // blocks the bits have room for
+    uint32_t received; // distinct blocks received
+    uint32_t highest;  // one more than the highest block number received
+    uint32_t total;    // blocks in the body, 0 until the last block is received
+};
+
+void nabto_coap_qblock_map_init(struct nabto_coap_qblock_map* map, struct nn_allocator* allocator);
+void nabto_coap_qblock_map_deinit(struct nabto_coap_qblock_map* map);
+
+/**
+ * Mark block num as received, last if it has no more flag.
+ *
+ * @param isNew  set to false if the block was received before.
+ * @return NABTO_COAP_ERROR_INVALID_PARAMETER if the block is beyond the
+ * last block, NABTO_COAP_ERROR_OUT_OF_MEMORY if the map cannot grow.
+ */
+nabto_coap_error nabto_coap_qblock_map_set(struct nabto_coap_qblock_map* map, uint32_t num, bool last, bool* isNew);
+
+bool nabto_coap_qblock_map_has(const struct nabto_coap_qblock_map* map, uint32_t num);
+
+// All blocks up to and including the last block are received.
+bool nabto_coap_qblock_map_complete(const struct nabto_coap_qblock_map* map);
+
+/**
+ * Get up to max missing block numbers below limit, in increasing order.
+ *
+ * @return the number of missing blocks written to missing.
+ */
+size_t nabto_coap_qblock_map_missing(const struct nabto_coap_qblock_map* map, uint32_t limit, uint32_t* missing, size_t max);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
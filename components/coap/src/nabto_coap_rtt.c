@@ -0,0 +1,131 @@
+#include "nabto_coap_rtt.h"
+
+#include <stdint.h>
+
+// Weight in 1/4 of a new strong and weak estimate in the overall RTO.
+#define NABTO_COAP_RTT_STRONG_WEIGHT 2
+#define NABTO_COAP_RTT_WEAK_WEIGHT 1
+
+struct nabto_coap_rtt_table* nabto_coap_rtt_table_new(struct nn_allocator* allocator)
+{
+    struct nabto_coap_rtt_table* table = nn_allocator_calloc(allocator, 1, sizeof(struct nabto_coap_rtt_table));
+    if (table == NULL) {
+        return NULL;
+    }
+    nabto_coap_connection_table_init(&table->estimators, allocator, sizeof(struct nabto_coap_rtt_estimator));
+    return table;
+}
+
+void nabto_coap_rtt_table_free(struct nabto_coap_rtt_table* table)
+{
+    if (table == NULL) {
+        return;
+    }
+    struct nn_allocator allocator = table->estimators.allocator;
+    nabto_coap_connection_table_deinit(&table->estimators);
+    nn_allocator_free(&allocator, table);
+}
+
+static uint32_t nabto_coap_rtt_clamp(uint32_t rto)
+{
+    if (rto < NABTO_COAP_RTT_MIN_RTO) {
+        return NABTO_COAP_RTT_MIN_RTO;
+    }
+    if (rto > NABTO_COAP_RTT_MAX_RTO) {
+        return NABTO_COAP_RTT_MAX_RTO;
+    }
+    return rto;
+}
+
+// Let an RTO which has not been updated for a while move towards the
+// initial RTO, a short one is doubled and a long one halved towards it.
+static void nabto_coap_rtt_age(struct nabto_coap_rtt_estimator* estimator, uint32_t initialRto, uint32_t now)
+{
+    uint32_t idle = now - estimator->updated;
+    if (estimator->rto < initialRto / 2 && idle > 16 * estimator->rto) {
+        estimator->rto = nabto_coap_rtt_clamp(estimator->rto * 2);
+        estimator->updated = now;
+    } else if (estimator->rto > initialRto + initialRto / 2 && idle > 4 * estimator->rto) {
+        estimator->rto = nabto_coap_rtt_clamp((initialRto + estimator->rto) / 2);
+        estimator->updated = now;
+    }
+}
+
+uint32_t nabto_coap_rtt_get_rto(struct nabto_coap_rtt_table* table, void* connection, uint32_t initialRto, uint32_t now)
+{
+    struct nabto_coap_rtt_estimator* estimator = nabto_coap_connection_table_find(&table->estimators, connection);
+    if (estimator == NULL) {
+        return initialRto;
+    }
+    nabto_coap_rtt_age(estimator, initialRto, now);
+    return estimator->rto;
+}
+
+/**
+ * RFC 6298 estimator, returns SRTT + k * RTTVAR.
+ */
+static uint32_t nabto_coap_rtt_estimate(bool* hasSample, uint32_t* srtt, uint32_t* rttvar, uint32_t k, uint32_t rtt)
+{
+    if (!*hasSample) {
+        *hasSample = true;
+        *srtt = rtt;
+        *rttvar = rtt / 2;
+    } else {
+        uint32_t delta = (*srtt > rtt) ? *srtt - rtt : rtt - *srtt;
+        *rttvar = (3 * *rttvar + delta) / 4;
+        *srtt = (7 * *srtt + rtt) / 8;
+    }
+    uint64_t estimate = (uint64_t)*srtt + (uint64_t)k * *rttvar;
+    return (estimate > NABTO_COAP_RTT_MAX_RTO) ? NABTO_COAP_RTT_MAX_RTO : (uint32_t)estimate;
+}
+
+void nabto_coap_rtt_sample(struct nabto_coap_rtt_table* table, void* connection, uint32_t initialRto, uint8_t transmissions, uint32_t rtt, uint32_t now)
+{
+    if (transmissions == 0 || transmissions > 3) {
+        return;
+    }
+    struct nabto_coap_rtt_estimator* estimator = nabto_coap_connection_table_find(&table->estimators, connection);
+    if (estimator == NULL) {
+        estimator = nabto_coap_connection_table_add(&table->estimators, connection);
+        if (estimator == NULL) {
+            return;
+        }
+        estimator->rto = initialRto;
+    }
+
+    uint32_t estimate;
+    uint32_t weight;
+    if (transmissions == 1) {
+        estimate = nabto_coap_rtt_estimate(&estimator->hasStrong, &estimator->strongSrtt, &estimator->strongRttvar, 4, rtt);
+        weight = NABTO_COAP_RTT_STRONG_WEIGHT;
+    } else {
+        estimate = nabto_coap_rtt_estimate(&estimator->hasWeak, &estimator->weakSrtt, &estimator->weakRttvar, 1, rtt);
+        weight = NABTO_COAP_RTT_WEAK_WEIGHT;
+    }
+    uint64_t rto = ((uint64_t)weight * estimate + (uint64_t)(4 - weight) * estimator->rto) / 4;
+    estimator->rto = nabto_coap_rtt_clamp((uint32_t)rto);
+    estimator->updated = now;
+}
+
+void nabto_coap_rtt_remove_connection(struct nabto_coap_rtt_table* table, void* connection)
+{
+    struct nabto_coap_rtt_estimator* estimator = nabto_coap_connection_table_find(&table->estimators, connection);
+    if (estimator != NULL) {
+        nabto_coap_connection_table_remove(&table->estimators, estimator);
+    }
+}
+
+uint32_t nabto_coap_rtt_backoff(uint32_t rto, uint8_t retransmissions)
+{
+    uint64_t timeout = rto;
+    for (uint8_t i = 0; i < retransmissions && timeout < NABTO_COAP_RTT_MAX_TIMEOUT; i++) {
+        if (rto < 1000) {
+            timeout *= 3;
+        } else if (rto > 3000) {
+            timeout += timeout / 2;
+        } else {
+            timeout *= 2;
+        }
+    }
+    return (timeout > NABTO_COAP_RTT_MAX_TIMEOUT) ? NABTO_COAP_RTT_MAX_TIMEOUT : (uint32_t)timeout;
+}
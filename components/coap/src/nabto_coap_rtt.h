@@ -0,0 +1,86 @@
+#ifndef _NABTO_COAP_RTT_H_
+#define _NABTO_COAP_RTT_H_
+
+#include "nabto_coap_connection_table.h"
+
+#include <nabto_coap/nabto_coap.h>
+#include <nn/allocator.h>
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Retransmission timeouts adapted to the round trip time of each
+ * connection, as in CoCoA (draft-ietf-core-cocoa).
+ *
+ * A connection has a strong estimator fed with the RTT of exchanges
+ * acknowledged without retransmissions, and a weak estimator fed with
+ * the time from the first transmission of exchanges acknowledged after
+ * one or two retransmissions. Each new estimate is blended into the
+ * RTO of the connection. The RTO drifts back towards the initial value
+ * when the connection has not been measured for a while.
+ *
+ * An exchange takes the RTO of its connection at its first
+ * transmission and backs off by a factor chosen from that RTO, 3 for
+ * short RTOs, 2 for normal and 1.5 for long ones.
+ *
+ * A connection without measurements uses the initial RTO given by the
+ * caller, with the default of 2 s the timeouts are then the classic
+ * initialRto << retransmissions.
+ */
+
+#define NABTO_COAP_RTT_MIN_RTO 100
+#define NABTO_COAP_RTT_MAX_RTO 60000
+// Upper bound for a backed off timeout.
+#define NABTO_COAP_RTT_MAX_TIMEOUT 60000
+
+struct nabto_coap_rtt_estimator {
+    void* connection; // first, see nabto_coap_connection_table
+    uint32_t rto;
+    uint32_t updated; // stamp of the last sample or aging of rto
+    bool hasStrong;
+    uint32_t strongSrtt;
+    uint32_t strongRttvar;
+    bool hasWeak;
+    uint32_t weakSrtt;
+    uint32_t weakRttvar;
+};
+
+struct nabto_coap_rtt_table {
+    struct nabto_coap_connection_table estimators;
+};
+
+struct nabto_coap_rtt_table* nabto_coap_rtt_table_new(struct nn_allocator* allocator);
+// NULL is ignored.
+void nabto_coap_rtt_table_free(struct nabto_coap_rtt_table* table);
+
+/**
+ * Get the RTO to use for a new exchange on a connection.
+ */
+uint32_t nabto_coap_rtt_get_rto(struct nabto_coap_rtt_table* table, void* connection, uint32_t initialRto, uint32_t now);
+
+/**
+ * Feed the ACK of an exchange. transmissions is the number of times
+ * the exchange was sent, rtt the time from its first transmission to
+ * the ACK. Exchanges sent more than 3 times are ignored as the
+ * transmission being acknowledged is too ambiguous. If no estimator
+ * can be allocated the sample is dropped.
+ */
+void nabto_coap_rtt_sample(struct nabto_coap_rtt_table* table, void* connection, uint32_t initialRto, uint8_t transmissions, uint32_t rtt, uint32_t now);
+
+void nabto_coap_rtt_remove_connection(struct nabto_coap_rtt_table* table, void* connection);
+
+/**
+ * Timeout of an exchange after it has been sent retransmissions + 1
+ * times with the given RTO.
+ */
+uint32_t nabto_coap_rtt_backoff(uint32_t rto, uint8_t retransmissions);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
@@ -1,5 +1,10 @@
 #include <nabto_coap/nabto_coap_server.h>
 #include "nabto_coap_server_impl.h"
+#include "nabto_coap_index.h"
+#include "nabto_coap_rtt.h"
+#include "nabto_coap_path.h"
+#include "nabto_coap_stream.h"
+#include "nabto_coap_qblock.h"
 
 #include <stdlib.h>
 #include <nn/string.h>
@@ -13,6 +18,7 @@ nabto_coap_error nabto_coap_server_init(struct nabto_coap_server* server, struct
     server->logger = logger;
     server->allocator = *allocator;
     server->ackTimeout = NABTO_COAP_ACK_TIMEOUT;
+    nabto_coap_server_pools_init(server);
 
     server->root = nabto_coap_router_node_new(server);
     if (server->root == NULL) {
@@ -24,6 +30,24 @@ nabto_coap_error nabto_coap_server_init(struct nabto_coap_server* server, struct
 void nabto_coap_server_destroy(struct nabto_coap_server* server)
 {
     nabto_coap_router_node_free(server, server->root);
+    nabto_coap_server_pools_deinit(server);
+}
+
+struct nabto_coap_index* nabto_coap_server_index_new(struct nabto_coap_server* server)
+{
+    struct nabto_coap_index* index = server->allocator.calloc(1, sizeof(struct nabto_coap_index));
+    if (index != NULL) {
+        nabto_coap_index_init(index, &server->allocator);
+    }
+    return index;
+}
+
+void nabto_coap_server_index_free(struct nabto_coap_server* server, struct nabto_coap_index* index)
+{
+    if (index != NULL) {
+        nabto_coap_index_deinit(index);
+        server->allocator.free(index);
+    }
 }
 
 nabto_coap_error nabto_coap_server_requests_init(struct nabto_coap_server_requests* requests, struct nabto_coap_server* server, nabto_coap_get_stamp getStamp, nabto_coap_notify_event notifyEvent, void* userData)
@@ -34,6 +58,7 @@ nabto_coap_error nabto_coap_server_requests_init(struct nabto_coap_server_reques
     requests->notifyEvent = notifyEvent;
     requests->userData = userData;
     requests->maxRequests = SIZE_MAX;
+    requests->maxRequestBodySize = SIZE_MAX;
 
     // init requests list
     requests->requestsSentinel = server->allocator.calloc(1, sizeof(struct nabto_coap_server_request));
@@ -53,6 +78,34 @@ nabto_coap_error nabto_coap_server_requests_init(struct nabto_coap_server_reques
     requests->observersSentinel->next = requests->observersSentinel;
     requests->observersSentinel->prev = requests->observersSentinel;
 
+    requests->requestsByToken = nabto_coap_server_index_new(server);
+    requests->exchangesByMessageId = nabto_coap_server_index_new(server);
+    if (requests->requestsByToken == NULL || requests->exchangesByMessageId == NULL ||
+        nabto_coap_server_scheduler_init(requests) != NABTO_COAP_ERROR_OK ||
+        nabto_coap_server_budget_init(requests) != NABTO_COAP_ERROR_OK ||
+        (requests->rtt = nabto_coap_rtt_table_new(&server->allocator)) == NULL ||
+        (requests->paths = nabto_coap_path_table_new(&server->allocator)) == NULL ||
+        (requests->streams = nabto_coap_stream_table_new(&server->allocator)) == NULL ||
+        nabto_coap_server_completions_init(requests) != NABTO_COAP_ERROR_OK)
+    {
+        nabto_coap_stream_table_free(requests->streams);
+        requests->streams = NULL;
+        nabto_coap_path_table_free(requests->paths);
+        requests->paths = NULL;
+        nabto_coap_rtt_table_free(requests->rtt);
+        requests->rtt = NULL;
+        nabto_coap_server_budget_deinit(requests);
+        nabto_coap_server_scheduler_deinit(requests);
+        nabto_coap_server_index_free(server, requests->requestsByToken);
+        requests->requestsByToken = NULL;
+        nabto_coap_server_index_free(server, requests->exchangesByMessageId);
+        requests->exchangesByMessageId = NULL;
+        server->allocator.free(requests->observersSentinel);
+        requests->observersSentinel = NULL;
+        server->allocator.free(requests->requestsSentinel);
+        requests->requestsSentinel = NULL;
+        return NABTO_COAP_ERROR_OUT_OF_MEMORY;
+    }
     return NABTO_COAP_ERROR_OK;
 }
 
@@ -76,6 +129,8 @@ void nabto_coap_server_requests_destroy(struct nabto_coap_server_requests* reque
         requests->observersSentinel = NULL;
     }
 
+    nabto_coap_server_completions_deinit(requests);
+
     struct nabto_coap_server_request* iterator = requests->requestsSentinel->next;
     while(iterator != requests->requestsSentinel) {
         struct nabto_coap_server_request* current = iterator;
@@ -92,6 +147,25 @@ void nabto_coap_server_requests_destroy(struct nabto_coap_server_requests* reque
     server->allocator.free(requests->requestsSentinel);
 
     requests->requestsSentinel = NULL;
+
+    nabto_coap_server_index_free(server, requests->requestsByToken);
+    requests->requestsByToken = NULL;
+    nabto_coap_server_index_free(server, requests->exchangesByMessageId);
+    requests->exchangesByMessageId = NULL;
+
+    nabto_coap_server_scheduler_deinit(requests);
+    nabto_coap_server_budget_deinit(requests);
+    nabto_coap_rtt_table_free(requests->rtt);
+    requests->rtt = NULL;
+    nabto_coap_path_table_free(requests->paths);
+    requests->paths = NULL;
+    nabto_coap_stream_table_free(requests->streams);
+    requests->streams = NULL;
+
+    server->allocator.free(requests->timers);
+    requests->timers = NULL;
+    requests->timersSize = 0;
+    requests->timersCapacity = 0;
 }
 
 void nabto_coap_server_limit_requests(struct nabto_coap_server_requests* requests, size_t limit)
@@ -99,17 +173,33 @@ void nabto_coap_server_limit_requests(struct nabto_coap_server_requests* request
     requests->maxRequests = limit;
 }
 
+void nabto_coap_server_limit_request_body_size(struct nabto_coap_server_requests* requests, size_t limit)
+{
+    requests->maxRequestBodySize = limit;
+}
+
+void nabto_coap_server_borrow_request_payloads(struct nabto_coap_server_requests* requests, bool enable)
+{
+    requests->borrowRequestPayloads = enable;
+}
+
 
 void nabto_coap_server_request_free(struct nabto_coap_server_request* request)
 {
+    if (request->async) {
+        // The worker owns the request, it is freed when it is completed.
+        NN_LOG_ERROR(request->requests->server->logger, NABTO_COAP_SERVER_LOG_MODULE, "request freed after begin_async, complete it with nabto_coap_server_response_ready_async");
+        return;
+    }
     if (request->state == NABTO_COAP_SERVER_REQUEST_STATE_REQUEST ||
         request->state == NABTO_COAP_SERVER_REQUEST_STATE_USER)
     {
+        nabto_coap_server_response_clear_payload(request);
         request->response.staticPayload = true;
         nabto_coap_server_response_set_code(request, NABTO_COAP_CODE_INTERNAL_SERVER_ERROR);
         request->response.payload = (void*)unhandledRequest;
         request->response.payloadLength = strlen(unhandledRequest);
-        if (strlen(unhandledRequest) > (16u << request->response.block2Size)) {
+        if (strlen(unhandledRequest) > NABTO_COAP_BLOCK_SIZE_ABSOLUTE(request->response.block2Size)) {
             request->response.hasBlock2 = true;
             request->response.block2Current = 0;
         }
@@ -130,6 +220,102 @@ void nabto_coap_server_insert_request_into_list(struct nabto_coap_server_request
     e2->prev = e1;
 }
 
+static bool nabto_coap_server_request_match_token(const void* item, const void* key)
+{
+    const struct nabto_coap_server_request* request = item;
+    const struct nabto_coap_server_request_key* k = key;
+    return request->connection == k->connection &&
+        nabto_coap_token_equal((nabto_coap_token*)&request->token, (nabto_coap_token*)k->token);
+}
+
+uint32_t nabto_coap_server_request_key_hash(void* connection, const nabto_coap_token* token)
+{
+    uint32_t hash = nabto_coap_hash_pointer(NABTO_COAP_HASH_INIT, connection);
+    return nabto_coap_hash_token(hash, token);
+}
+
+nabto_coap_error nabto_coap_server_add_request(struct nabto_coap_server_requests* requests, struct nabto_coap_server_request* request)
+{
+    uint32_t hash = nabto_coap_server_request_key_hash(request->connection, &request->token);
+    nabto_coap_error ec = nabto_coap_index_insert(requests->requestsByToken, hash, request);
+    if (ec != NABTO_COAP_ERROR_OK) {
+        return ec;
+    }
+    ec = nabto_coap_server_exchange_index(requests, &request->response.exchange, request->connection, request->response.messageId);
+    if (ec != NABTO_COAP_ERROR_OK) {
+        nabto_coap_index_remove(requests->requestsByToken, hash, request);
+        return ec;
+    }
+    nabto_coap_server_insert_request_into_list(requests->requestsSentinel, request);
+    return NABTO_COAP_ERROR_OK;
+}
+
+void nabto_coap_server_unindex_request(struct nabto_coap_server_request* request)
+{
+    uint32_t hash = nabto_coap_server_request_key_hash(request->connection, &request->token);
+    nabto_coap_index_remove(request->requests->requestsByToken, hash, request);
+    nabto_coap_server_exchange_unindex(request->requests, &request->response.exchange);
+}
+
+struct nabto_coap_server_exchange_key {
+    void* connection;
+    uint16_t messageId;
+};
+
+static uint32_t nabto_coap_server_exchange_key_hash(void* connection, uint16_t messageId)
+{
+    uint32_t hash = nabto_coap_hash_pointer(NABTO_COAP_HASH_INIT, connection);
+    uint8_t mid[2] = { (uint8_t)(messageId >> 8), (uint8_t)messageId };
+    return nabto_coap_hash_bytes(hash, mid, sizeof(mid));
+}
+
+static bool nabto_coap_server_exchange_match(const void* item, const void* key)
+{
+    const struct nabto_coap_server_exchange* exchange = item;
+    const struct nabto_coap_server_exchange_key* k = key;
+    return exchange->connection == k->connection && exchange->messageId == k->messageId;
+}
+
+nabto_coap_error nabto_coap_server_exchange_index(struct nabto_coap_server_requests* requests, struct nabto_coap_server_exchange* exchange, void* connection, uint16_t messageId)
+{
+    nabto_coap_server_exchange_unindex(requests, exchange);
+    uint32_t hash = nabto_coap_server_exchange_key_hash(connection, messageId);
+    exchange->connection = connection;
+    exchange->messageId = messageId;
+    nabto_coap_error ec = nabto_coap_index_insert(requests->exchangesByMessageId, hash, exchange);
+    if (ec == NABTO_COAP_ERROR_OK) {
+        exchange->indexed = true;
+    }
+    return ec;
+}
+
+void nabto_coap_server_exchange_unindex(struct nabto_coap_server_requests* requests, struct nabto_coap_server_exchange* exchange)
+{
+    if (exchange->indexed) {
+        uint32_t hash = nabto_coap_server_exchange_key_hash(exchange->connection, exchange->messageId);
+        nabto_coap_index_remove(requests->exchangesByMessageId, hash, exchange);
+        exchange->indexed = false;
+    }
+}
+
+struct nabto_coap_server_exchange* nabto_coap_server_find_exchange(struct nabto_coap_server_requests* requests, uint16_t messageId, void* connection)
+{
+    struct nabto_coap_server_exchange_key key;
+    key.connection = connection;
+    key.messageId = messageId;
+    uint32_t hash = nabto_coap_server_exchange_key_hash(connection, messageId);
+    return nabto_coap_index_find(requests->exchangesByMessageId, hash, nabto_coap_server_exchange_match, &key);
+}
+
+struct nabto_coap_server_request* nabto_coap_server_find_request(struct nabto_coap_server_requests* requests, nabto_coap_token* token, void* connection)
+{
+    struct nabto_coap_server_request_key key;
+    key.connection = connection;
+    key.token = token;
+    uint32_t hash = nabto_coap_server_request_key_hash(connection, token);
+    return nabto_coap_index_find(requests->requestsByToken, hash, nabto_coap_server_request_match_token, &key);
+}
+
 // remove request such that e1->request->e2 becomes e1->e2
 void nabto_coap_server_remove_request_from_list(struct nabto_coap_server_request* request)
 {
@@ -141,92 +327,115 @@ void nabto_coap_server_remove_request_from_list(struct nabto_coap_server_request
     request->next = request;
 }
 
+/**
+ * A response has been sent twice without an ACK. If it would be smaller
+ * in smaller blocks the block size of a connection with an MTU hint is
+ * halved, and the block is sent again in the new size as a new message.
+ */
+static void nabto_coap_server_response_block_timeout(struct nabto_coap_server_requests* requests, struct nabto_coap_server_response* response)
+{
+    void* connection = response->request->connection;
+    size_t blockSize = NABTO_COAP_BLOCK_SIZE_ABSOLUTE(response->block2Size);
+    size_t offset = (size_t)response->block2Current * blockSize;
+    if (response->qBlock2 || response->block2Size == NABTO_COAP_BLOCK_SZX_BERT ||
+        (response->producer == NULL && (offset >= response->payloadLength || response->payloadLength - offset <= blockSize / 2)))
+    {
+        return;
+    }
+    nabto_coap_path_block_timeout(requests->paths, connection, response->block2Size);
+    uint32_t szx = nabto_coap_path_limit_szx(requests->paths, connection, response->block2Size);
+    if (szx < response->block2Size) {
+        response->block2Current = nabto_coap_path_rescale_block(response->block2Current, response->block2Size, szx);
+        response->block2Size = szx;
+        response->messageId = nabto_coap_server_next_message_id(requests);
+        (void)nabto_coap_server_exchange_index(requests, &response->exchange, connection, response->messageId);
+    }
+}
+
 void nabto_coap_server_handle_timeout(struct nabto_coap_server_requests* requests)
 {
     uint32_t now = requests->getStamp(requests->userData);
-    struct nabto_coap_server_request* request = requests->requestsSentinel->next;
-    while(request != requests->requestsSentinel) {
-        if (nabto_coap_is_stamp_less_equal(request->response.timeout, now))
-        {
+    struct nabto_coap_server_exchange* exchange;
+    while ((exchange = nabto_coap_server_timer_next(requests)) != NULL &&
+           nabto_coap_is_stamp_less_equal(exchange->timerDeadline, now))
+    {
+        nabto_coap_server_timer_cancel(requests, exchange);
+        if (exchange->type == NABTO_COAP_SERVER_EXCHANGE_TYPE_RESPONSE) {
+            struct nabto_coap_server_request* request = exchange->owner;
+            if (request->state == NABTO_COAP_SERVER_REQUEST_STATE_REQUEST) {
+                // No new blocks of a Q-Block1 body for a while, the
+                // user never sees the request.
+                request->isFreed = true;
+                request->state = NABTO_COAP_SERVER_REQUEST_STATE_DONE;
+                nabto_coap_server_free_request(request);
+                continue;
+            }
+            if (request->response.qBlock2Paused) {
+                // The client did not ask for the next set, go on anyway.
+                request->response.qBlock2Paused = false;
+                request->response.sendNow = true;
+                nabto_coap_server_exchange_ready(requests, exchange);
+                continue;
+            }
+            if (request->response.lingering) {
+                request->state = NABTO_COAP_SERVER_REQUEST_STATE_DONE;
+                nabto_coap_server_free_request(request);
+                continue;
+            }
             if (request->response.retransmissions > NABTO_COAP_MAX_RETRANSMITS) {
+                if (request->type == NABTO_COAP_TYPE_CON) {
+                    NABTO_COAP_SERVER_METRIC_INC(requests, expired);
+                }
                 request->state = NABTO_COAP_SERVER_REQUEST_STATE_DONE;
                 nabto_coap_server_free_request(request);
-                return; // free modifies the pointer we need to
-                        // schedule a new timeout of more requests has
-                        // timed out.
+                continue;
+            }
+            NABTO_COAP_SERVER_METRIC_INC(requests, retransmissions);
+            if (request->response.retransmissions == 2) {
+                nabto_coap_server_response_block_timeout(requests, &request->response);
             }
             request->response.sendNow = true;
-
-        }
-        request = request->next;
-    }
-
-    // Handle observer notification timeouts
-    struct nabto_coap_server_observer* obs = requests->observersSentinel->next;
-    while (obs != requests->observersSentinel) {
-        struct nabto_coap_server_observer* current = obs;
-        obs = obs->next;
-        if (current->waitingForAck) {
-            if (nabto_coap_is_stamp_less_equal(current->timeout, now)) {
-                if (current->retransmissions > NABTO_COAP_MAX_RETRANSMITS) {
-                    // Client is unreachable, remove observer
-                    nabto_coap_server_observer_free(current);
-                    continue;
+            nabto_coap_server_exchange_ready(requests, exchange);
+        } else {
+            struct nabto_coap_server_observer* observer = exchange->owner;
+            if (!observer->waitingForAck) {
+                // The end of minInterval or the keepalive at maxInterval.
+                if (observer->pendingValid) {
+                    nabto_coap_server_observer_idle(requests, observer);
+                } else if (observer->policy.maxInterval > 0) {
+                    nabto_coap_server_observer_start(requests, observer, true);
                 }
-                current->waitingForAck = false;
-                current->sendNow = true;
+                continue;
             }
+            if (observer->retransmissions > NABTO_COAP_MAX_RETRANSMITS) {
+                // Client is unreachable, remove observer
+                NABTO_COAP_SERVER_METRIC_INC(requests, expired);
+                nabto_coap_server_observer_free(observer);
+                continue;
+            }
+            NABTO_COAP_SERVER_METRIC_INC(requests, retransmissions);
+            observer->waitingForAck = false;
+            observer->sendNow = true;
+            nabto_coap_server_exchange_ready(requests, exchange);
         }
     }
 }
 
 enum nabto_coap_server_next_event nabto_coap_server_next_event(struct nabto_coap_server_requests* requests)
 {
-    if (requests->errorConnection != NULL ||
-        requests->ackConnection != NULL) {
-        return NABTO_COAP_SERVER_NEXT_EVENT_SEND;
-    }
+    nabto_coap_server_completions_drain(requests);
 
-    struct nabto_coap_server_request* request = requests->requestsSentinel->next;
-    while(request != requests->requestsSentinel) {
-        if ((request->state == NABTO_COAP_SERVER_REQUEST_STATE_REQUEST ||
-             request->state == NABTO_COAP_SERVER_REQUEST_STATE_USER) &&
-            request->hasBlock1Ack)
-        {
-            return NABTO_COAP_SERVER_NEXT_EVENT_SEND;
-        } else if (request->state == NABTO_COAP_SERVER_REQUEST_STATE_RESPONSE &&
-                   request->response.sendNow)
-        {
-            return NABTO_COAP_SERVER_NEXT_EVENT_SEND;
-        }
-        request = request->next;
-    }
-
-    // Check observers for sendNow
-    struct nabto_coap_server_observer* obs = requests->observersSentinel->next;
-    while (obs != requests->observersSentinel) {
-        if (obs->sendNow) {
-            return NABTO_COAP_SERVER_NEXT_EVENT_SEND;
-        }
-        obs = obs->next;
+    if (requests->controlCount > 0 || nabto_coap_stream_next_signal(requests->streams) != NULL) {
+        return NABTO_COAP_SERVER_NEXT_EVENT_SEND;
     }
 
-    request = requests->requestsSentinel->next;
-    while(request != requests->requestsSentinel) {
-        if (request->state == NABTO_COAP_SERVER_REQUEST_STATE_RESPONSE) {
-            // a response has a timeout.
-            return NABTO_COAP_SERVER_NEXT_EVENT_WAIT;
-        }
-        request = request->next;
+    if (nabto_coap_server_next_ready(requests) != NULL) {
+        return NABTO_COAP_SERVER_NEXT_EVENT_SEND;
     }
 
-    // Check observers for pending timeouts
-    obs = requests->observersSentinel->next;
-    while (obs != requests->observersSentinel) {
-        if (obs->waitingForAck) {
-            return NABTO_COAP_SERVER_NEXT_EVENT_WAIT;
-        }
-        obs = obs->next;
+    if (requests->timersSize > 0) {
+        // a response or notification is waiting for an ack.
+        return NABTO_COAP_SERVER_NEXT_EVENT_WAIT;
     }
 
     return NABTO_COAP_SERVER_NEXT_EVENT_NOTHING;
@@ -234,125 +443,161 @@ enum nabto_coap_server_next_event nabto_coap_server_next_event(struct nabto_coap
 
 bool nabto_coap_server_get_next_timeout(struct nabto_coap_server_requests* requests, uint32_t* nextTimeout)
 {
-    bool first = true;
-    struct nabto_coap_server_request* request = requests->requestsSentinel->next;
-    while(request != requests->requestsSentinel) {
-        if (request->state == NABTO_COAP_SERVER_REQUEST_STATE_RESPONSE) {
-            if (first) {
-                first = false;
-                *nextTimeout = request->response.timeout;
-            } else {
-                *nextTimeout = nabto_coap_stamp_min(*nextTimeout, request->response.timeout);
-            }
-        }
-        request = request->next;
-    }
-
-    // Also check observer timeouts
-    struct nabto_coap_server_observer* obs = requests->observersSentinel->next;
-    while (obs != requests->observersSentinel) {
-        if (obs->waitingForAck) {
-            if (first) {
-                first = false;
-                *nextTimeout = obs->timeout;
-            } else {
-                *nextTimeout = nabto_coap_stamp_min(*nextTimeout, obs->timeout);
-            }
-        }
-        obs = obs->next;
+    struct nabto_coap_server_exchange* exchange = nabto_coap_server_timer_next(requests);
+    if (exchange == NULL) {
+        return false;
     }
-
-    return !first;
+    *nextTimeout = exchange->timerDeadline;
+    return true;
 }
 
 
 void* nabto_coap_server_get_connection_send(struct nabto_coap_server_requests* requests)
 {
-    if (requests->errorConnection) {
-        return requests->errorConnection;
+    nabto_coap_server_completions_drain(requests);
+
+    struct nabto_coap_stream* signalStream = nabto_coap_stream_next_signal(requests->streams);
+    if (signalStream != NULL) {
+        return signalStream->connection;
     }
 
-    if (requests->ackConnection) {
-        return requests->ackConnection;
+    if (requests->controlCount > 0) {
+        return requests->controlMessages[requests->controlHead].connection;
     }
 
-    struct nabto_coap_server_request* request = requests->requestsSentinel->next;
-    while(request != requests->requestsSentinel) {
-        if ((request->state == NABTO_COAP_SERVER_REQUEST_STATE_REQUEST ||
-             request->state == NABTO_COAP_SERVER_REQUEST_STATE_USER) &&
-            request->hasBlock1Ack)
-        {
-            return request->connection;
-        } else if (request->state == NABTO_COAP_SERVER_REQUEST_STATE_RESPONSE &&
-                   request->response.sendNow)
-        {
-            return request->connection;
-        }
-        request = request->next;
+    struct nabto_coap_server_exchange* exchange = nabto_coap_server_next_ready(requests);
+    if (exchange == NULL) {
+        return NULL;
     }
+    if (exchange->type == NABTO_COAP_SERVER_EXCHANGE_TYPE_RESPONSE) {
+        struct nabto_coap_server_request* request = exchange->owner;
+        return request->connection;
+    } else {
+        struct nabto_coap_server_observer* observer = exchange->owner;
+        return observer->connection;
+    }
+}
 
-    // Check observers
-    struct nabto_coap_server_observer* obs = requests->observersSentinel->next;
-    while (obs != requests->observersSentinel) {
-        if (obs->sendNow) {
-            return obs->connection;
-        }
-        obs = obs->next;
+struct nabto_coap_server_control_message* nabto_coap_server_control_push(struct nabto_coap_server_requests* requests)
+{
+    if (requests->controlCount == NABTO_COAP_SERVER_MAX_CONTROL_MESSAGES) {
+        requests->controlDropped++;
+        return NULL;
     }
+    size_t i = (requests->controlHead + requests->controlCount) % NABTO_COAP_SERVER_MAX_CONTROL_MESSAGES;
+    requests->controlCount++;
+    struct nabto_coap_server_control_message* message = &requests->controlMessages[i];
+    memset(message, 0, sizeof(struct nabto_coap_server_control_message));
+    return message;
+}
 
-    return NULL;
+void nabto_coap_server_queue_ack(struct nabto_coap_server_requests* requests, void* connection, uint16_t messageId)
+{
+    struct nabto_coap_server_control_message* message = nabto_coap_server_control_push(requests);
+    if (message == NULL) {
+        return;
+    }
+    message->connection = connection;
+    message->type = NABTO_COAP_TYPE_ACK;
+    message->code = NABTO_COAP_CODE_EMPTY;
+    message->messageId = messageId;
 }
 
-uint8_t* nabto_coap_server_send_ack(struct nabto_coap_server_requests* requests, uint8_t* buffer, uint8_t* end)
+static uint8_t* nabto_coap_server_send_control(struct nabto_coap_server_requests* requests, uint8_t* buffer, uint8_t* end)
 {
+    struct nabto_coap_server_control_message* message = &requests->controlMessages[requests->controlHead];
+    requests->controlHead = (requests->controlHead + 1) % NABTO_COAP_SERVER_MAX_CONTROL_MESSAGES;
+    requests->controlCount--;
+
     uint8_t* ptr = buffer;
 
     struct nabto_coap_message_header header;
     memset(&header, 0, sizeof(struct nabto_coap_message_header));
-    header.type = NABTO_COAP_TYPE_ACK;
-    header.code = NABTO_COAP_CODE_EMPTY;
-    header.messageId = requests->ackMessageId;
+    header.type = message->type;
+    header.code = (nabto_coap_code)message->code;
+    header.messageId = message->messageId;
+    header.token = message->token;
 
     ptr = nabto_coap_encode_header(&header, ptr, end);
 
-    requests->ackConnection = NULL;
+    uint16_t currentOption = 0;
+    if (message->hasMaxAge) {
+        ptr = nabto_coap_encode_varint_option(NABTO_COAP_OPTION_MAX_AGE, message->maxAge, ptr, end);
+        currentOption = NABTO_COAP_OPTION_MAX_AGE;
+    }
+
+    if (message->hasSize1) {
+        ptr = nabto_coap_encode_varint_option(NABTO_COAP_OPTION_SIZE1 - currentOption, message->size1, ptr, end);
+    }
 
+    if (message->type != NABTO_COAP_TYPE_ACK) {
+        ptr = nabto_coap_encode_payload(message->payload, message->payloadLength, ptr, end);
+    }
     return ptr;
 }
 
-uint8_t* nabto_coap_server_send_error(struct nabto_coap_server_requests* requests, uint8_t* buffer, uint8_t* end)
+// remove all control messages for a connection, keeping the order of the rest.
+static void nabto_coap_server_control_remove_connection(struct nabto_coap_server_requests* requests, void* connection)
 {
-    uint8_t* ptr = buffer;
-
-    struct nabto_coap_message_header header;
-    memset(&header, 0, sizeof(struct nabto_coap_message_header));
-    header.type = NABTO_COAP_TYPE_NON;
-    header.code = (nabto_coap_code)requests->errorCode;
-    header.messageId = requests->errorMessageId;
-    header.token = requests->errorToken;
-
-    ptr = nabto_coap_encode_header(&header, ptr, end);
-
-    ptr = nabto_coap_encode_payload(requests->errorPayload, requests->errorPayloadLength, ptr, end);
+    size_t kept = 0;
+    for (size_t i = 0; i < requests->controlCount; i++) {
+        size_t from = (requests->controlHead + i) % NABTO_COAP_SERVER_MAX_CONTROL_MESSAGES;
+        if (requests->controlMessages[from].connection != connection) {
+            size_t to = (requests->controlHead + kept) % NABTO_COAP_SERVER_MAX_CONTROL_MESSAGES;
+            if (to != from) {
+                requests->controlMessages[to] = requests->controlMessages[from];
+            }
+            kept++;
+        }
+    }
+    requests->controlCount = kept;
+}
 
-    requests->errorConnection = NULL;
-    requests->errorCode = 0;
-    requests->errorMessageId = 0;
-    requests->errorPayload = NULL;
-    requests->errorPayloadLength = 0;
+/**
+ * Encode the blocks missing below limit from a Q-Block1 body as a CBOR
+ * sequence, at most NABTO_COAP_QBLOCK_MAX_PAYLOADS of them.
+ */
+static uint8_t* nabto_coap_server_encode_missing(struct nabto_coap_qblock_map* map, uint32_t limit, uint8_t* ptr, uint8_t* end)
+{
+    uint32_t missing[NABTO_COAP_QBLOCK_MAX_PAYLOADS];
+    size_t count = nabto_coap_qblock_map_missing(map, limit, missing, NABTO_COAP_QBLOCK_MAX_PAYLOADS);
+    if (ptr == NULL || ptr >= end) {
+        return NULL;
+    }
+    *ptr = 0xFF;
+    ptr++;
+    for (size_t i = 0; i < count && ptr != NULL; i++) {
+        ptr = nabto_coap_encode_cbor_uint(missing[i], ptr, end);
+    }
     return ptr;
 }
 
-
 static uint8_t* nabto_coap_server_send_in_request_state(struct nabto_coap_server_requests* requests, struct nabto_coap_server_request* request, uint8_t* buffer, uint8_t* end)
 {
-    (void)requests;
     uint8_t* ptr = buffer;
     struct nabto_coap_message_header header;
     memset(&header, 0, sizeof(struct nabto_coap_message_header));
     header.type = request->type;
     header.token = request->token;
 
+    if (request->hasBlock1Ack && request->qBlock1Map != NULL) {
+        // A separate response while the blocks keep coming.
+        header.type = NABTO_COAP_TYPE_NON;
+        header.messageId = nabto_coap_server_next_message_id(requests);
+        if (request->qBlock1MissingLimit > 0) {
+            header.code = NABTO_COAP_CODE_REQUEST_ENTITY_INCOMPLETE;
+            ptr = nabto_coap_encode_header(&header, ptr, end);
+            ptr = nabto_coap_encode_varint_option(NABTO_COAP_OPTION_CONTENT_FORMAT, NABTO_COAP_CONTENT_FORMAT_APPLICATION_MISSING_BLOCKS_CBOR_SEQ, ptr, end);
+            ptr = nabto_coap_server_encode_missing(request->qBlock1Map, request->qBlock1MissingLimit, ptr, end);
+        } else {
+            header.code = NABTO_COAP_CODE_CONTINUE;
+            ptr = nabto_coap_encode_header(&header, ptr, end);
+            ptr = nabto_coap_encode_varint_option(NABTO_COAP_OPTION_QBLOCK1, request->block1Ack, ptr, end);
+        }
+        request->hasBlock1Ack = false;
+        return ptr;
+    }
+
     if (request->hasBlock1Ack) {
         header.type = NABTO_COAP_TYPE_ACK;
         header.code = NABTO_COAP_CODE_CONTINUE;
@@ -368,7 +613,40 @@ static uint8_t* nabto_coap_server_send_in_request_state(struct nabto_coap_server
     return NULL;
 }
 
-static uint8_t* nabto_coap_server_send_in_response_state(struct nabto_coap_server_requests* requests, struct nabto_coap_server_request* request, uint8_t* buffer, uint8_t* end)
+/**
+ * Decide what comes after a block of a Q-Block2 response. The blocks
+ * of a set are sent back to back, after a set the burst pauses until
+ * the client asks for the next set or NABTO_COAP_QBLOCK_NON_TIMEOUT
+ * has passed. When the last block has been sent the response is kept
+ * for a while for requests for missing blocks.
+ */
+static void nabto_coap_server_qblock2_sent(struct nabto_coap_server_requests* requests, struct nabto_coap_server_response* response, bool repair, bool blockMore)
+{
+    if (repair) {
+        response->qBlock2RepairCount--;
+        memmove(response->qBlock2Repair, response->qBlock2Repair + 1, response->qBlock2RepairCount * sizeof(uint32_t));
+    } else if (blockMore) {
+        response->block2Current += 1;
+        response->qBlock2Paused = (response->block2Current % NABTO_COAP_QBLOCK_MAX_PAYLOADS == 0);
+    } else {
+        response->qBlock2BurstDone = true;
+    }
+
+    uint32_t now = nabto_coap_server_stamp_now(requests);
+    if (response->qBlock2RepairCount > 0 || (!response->qBlock2BurstDone && !response->qBlock2Paused)) {
+        response->sendNow = true;
+        nabto_coap_server_timer_cancel(requests, &response->exchange);
+    } else if (response->qBlock2Paused) {
+        response->sendNow = false;
+        nabto_coap_server_timer_arm(requests, &response->exchange, now + NABTO_COAP_QBLOCK_NON_TIMEOUT);
+    } else {
+        response->sendNow = false;
+        response->lingering = true;
+        nabto_coap_server_timer_arm(requests, &response->exchange, now + NABTO_COAP_SERVER_QBLOCK_LINGER);
+    }
+}
+
+static uint8_t* nabto_coap_server_send_in_response_state(struct nabto_coap_server_requests* requests, struct nabto_coap_server_request* request, struct nabto_coap_stream* stream, uint8_t* buffer, uint8_t* end)
 {
     uint8_t* ptr = buffer;
     struct nabto_coap_server_response* response = &request->response;
@@ -379,60 +657,152 @@ static uint8_t* nabto_coap_server_send_in_response_state(struct nabto_coap_serve
     header.code = response->code;
     header.messageId = response->messageId;
 
-    ptr = nabto_coap_encode_header(&header, ptr, end);
+    // Blocks asked for again are sent before the burst goes on.
+    bool repair = (response->qBlock2RepairCount > 0);
+    uint32_t blockNum = repair ? response->qBlock2Repair[0] : response->block2Current;
+    if (response->qBlock2) {
+        // Each block of a burst is a NON of its own.
+        header.messageId = nabto_coap_server_next_message_id(requests);
+    }
+
+    size_t blockSize = NABTO_COAP_BLOCK_SIZE_ABSOLUTE(response->block2Size);
+    size_t payloadOffset = ((size_t)blockNum * blockSize);
+    if (response->block2Size == NABTO_COAP_BLOCK_SZX_BERT) {
+        // As many 1024 byte blocks as fits the message.
+        blockSize = nabto_coap_stream_bert_size(stream, end - buffer);
+    }
+    const uint8_t* payloadRestStart = NULL;
+    size_t payloadRestLength = 0;
+    bool blockMore = false;
+    bool hasBlock2Option = false;
+    // Where a produced block is staged, the header and options are
+    // encoded in front of it.
+    uint8_t* stage = NULL;
+    uint8_t* optionsEnd = end;
+
+    if (response->producer != NULL) {
+        if (end - buffer > (ptrdiff_t)blockSize) {
+            stage = end - blockSize;
+            // leave room for the payload marker.
+            optionsEnd = stage - 1;
+            if (response->producer(response->producerUserData, payloadOffset, stage, blockSize, &payloadRestLength, &blockMore) != NABTO_COAP_ERROR_OK ||
+                payloadRestLength > blockSize)
+            {
+                header.code = NABTO_COAP_CODE_INTERNAL_SERVER_ERROR;
+                payloadRestLength = 0;
+                blockMore = false;
+            }
+            payloadRestStart = stage;
+            hasBlock2Option = (blockNum > 0 || blockMore);
+        } else {
+            // Not room for a block, try again with a larger buffer.
+            ptr = NULL;
+        }
+    } else {
+        if (payloadOffset < response->payloadLength) {
+            payloadRestLength = response->payloadLength - payloadOffset;
+        }
+        if (payloadRestLength > blockSize) {
+            blockMore = true;
+            payloadRestLength = blockSize;
+        }
+        payloadRestStart = response->payload + payloadOffset;
+        hasBlock2Option = (blockNum > 0 || blockMore);
+    }
+    ptr = nabto_coap_encode_header(&header, ptr, optionsEnd);
 
     uint16_t currentOption = 0;
 
+    if (response->hasETag) {
+        ptr = nabto_coap_encode_option(NABTO_COAP_OPTION_ETAG - currentOption, response->etag, NABTO_COAP_SERVER_ETAG_LENGTH, ptr, optionsEnd);
+        currentOption = NABTO_COAP_OPTION_ETAG;
+    }
+
     // Include Observe option in initial response if observe was accepted
     if (request->observer != NULL) {
-        ptr = nabto_coap_encode_varint_option(NABTO_COAP_OPTION_OBSERVE - currentOption, request->observer->sequenceNumber, ptr, end);
+        ptr = nabto_coap_encode_varint_option(NABTO_COAP_OPTION_OBSERVE - currentOption, request->observer->sequenceNumber, ptr, optionsEnd);
         currentOption = NABTO_COAP_OPTION_OBSERVE;
     }
 
     if (response->hasContentFormat) {
         uint16_t optionDelta = NABTO_COAP_OPTION_CONTENT_FORMAT - currentOption;
-        ptr = nabto_coap_encode_varint_option(optionDelta, response->contentFormat, ptr, end);
+        ptr = nabto_coap_encode_varint_option(optionDelta, response->contentFormat, ptr, optionsEnd);
         currentOption = NABTO_COAP_OPTION_CONTENT_FORMAT;
     }
 
-    size_t blockSize = (16 << response->block2Size);
-    size_t payloadOffset = (response->block2Current * blockSize);
-    size_t payloadRestLength = response->payloadLength - payloadOffset;
-
-    if (response->payloadLength > blockSize) {
-        uint32_t blockMore = 1;
-        if (payloadRestLength <= blockSize) {
-            blockMore = 0;
-        }
+    if (request->qBlock1 && payloadOffset == 0) {
+        uint16_t optionDelta = NABTO_COAP_OPTION_QBLOCK1 - currentOption;
+        ptr = nabto_coap_encode_varint_option(optionDelta, request->block1Ack, ptr, optionsEnd);
+        currentOption = NABTO_COAP_OPTION_QBLOCK1;
+    }
 
-        uint32_t blockOption = (response->block2Current << 4) + (blockMore << 3) + response->block2Size;
+    uint32_t blockOption = (blockNum << 4) + ((blockMore ? 1 : 0) << 3) + response->block2Size;
+    if (hasBlock2Option && !response->qBlock2) {
         uint16_t optionDelta = NABTO_COAP_OPTION_BLOCK2 - currentOption;
-        ptr = nabto_coap_encode_varint_option(optionDelta, blockOption, ptr, end);
+        ptr = nabto_coap_encode_varint_option(optionDelta, blockOption, ptr, optionsEnd);
         currentOption = NABTO_COAP_OPTION_BLOCK2;
     }
 
     // we should send a block1 option back if the request had block1 options and this is the first packet in the response.
-    if (request->block1Ack > 0 && payloadOffset == 0) {
+    if (!request->qBlock1 && request->block1Ack > 0 && payloadOffset == 0) {
         uint16_t optionDelta = NABTO_COAP_OPTION_BLOCK1 - currentOption;
-        ptr = nabto_coap_encode_varint_option(optionDelta, request->block1Ack, ptr, end);
+        ptr = nabto_coap_encode_varint_option(optionDelta, request->block1Ack, ptr, optionsEnd);
         currentOption = NABTO_COAP_OPTION_BLOCK1;
     }
 
-    if (payloadRestLength > blockSize) {
-        payloadRestLength = blockSize;
+    if (hasBlock2Option && response->qBlock2) {
+        if (blockNum == 0 && response->producer == NULL && response->payloadLength <= UINT32_MAX) {
+            // The client can reserve room for the body at once.
+            uint16_t optionDelta = NABTO_COAP_OPTION_SIZE2 - currentOption;
+            ptr = nabto_coap_encode_varint_option(optionDelta, (uint32_t)response->payloadLength, ptr, optionsEnd);
+            currentOption = NABTO_COAP_OPTION_SIZE2;
+        }
+        uint16_t optionDelta = NABTO_COAP_OPTION_QBLOCK2 - currentOption;
+        ptr = nabto_coap_encode_varint_option(optionDelta, blockOption, ptr, optionsEnd);
+        currentOption = NABTO_COAP_OPTION_QBLOCK2;
     }
-    uint8_t* payloadRestStart = response->payload + payloadOffset;
-    ptr = nabto_coap_encode_payload(payloadRestStart, payloadRestLength, ptr, end);
 
-    if (request->type == NABTO_COAP_TYPE_NON) {
+    if (stage != NULL) {
+        if (ptr != NULL && payloadRestLength > 0) {
+            // optionsEnd guarantees the marker fits in front of the stage.
+            *ptr = 0xFF;
+            ptr++;
+            memmove(ptr, stage, payloadRestLength);
+            ptr += payloadRestLength;
+        }
+    } else {
+        ptr = nabto_coap_encode_payload(payloadRestStart, payloadRestLength, ptr, end);
+    }
+
+    if (ptr == NULL) {
+        // Encoding failed (e.g., buffer too small). Leave the response
+        // state unchanged so the caller can retry on a larger buffer.
+        return NULL;
+    }
+
+    response->lingering = false;
+    if (!repair) {
+        response->block2More = blockMore;
+    }
+    if (hasBlock2Option) {
+        NABTO_COAP_SERVER_METRIC_INC(requests, block2Sent);
+    }
+
+    if (response->qBlock2) {
+        nabto_coap_server_qblock2_sent(requests, response, repair, blockMore);
+    } else if (request->type == NABTO_COAP_TYPE_NON) {
         // NONs should not be retransmitted let it expire asap
         response->retransmissions += NABTO_COAP_MAX_RETRANSMITS + 2; // large enough to expire
-        response->timeout = nabto_coap_server_stamp_now(requests);
+        uint32_t expiry = nabto_coap_server_stamp_now(requests);
+        if (stream != NULL && blockMore) {
+            // Keep the response for the request of the next block.
+            expiry += NABTO_COAP_STREAM_BLOCK_TIMEOUT;
+        }
+        nabto_coap_server_timer_arm(requests, &response->exchange, expiry);
         response->sendNow = false;
     } else {
         response->sendNow = false;
-        response->timeout = nabto_coap_server_stamp_now(requests);
-        response->timeout += (requests->server->ackTimeout) << response->retransmissions;
+        nabto_coap_server_exchange_arm_retransmission(requests, &response->exchange, request->connection, response->retransmissions);
         response->retransmissions += 1;
     }
 
@@ -440,7 +810,7 @@ static uint8_t* nabto_coap_server_send_in_response_state(struct nabto_coap_serve
 }
 
 
-static uint8_t* nabto_coap_server_send_observer_notification(struct nabto_coap_server_requests* requests, struct nabto_coap_server_observer* observer, uint8_t* buffer, uint8_t* end)
+static uint8_t* nabto_coap_server_send_observer_notification(struct nabto_coap_server_requests* requests, struct nabto_coap_server_observer* observer, struct nabto_coap_stream* stream, uint8_t* buffer, uint8_t* end)
 {
     uint8_t* ptr = buffer;
     struct nabto_coap_message_header header;
@@ -466,7 +836,9 @@ static uint8_t* nabto_coap_server_send_observer_notification(struct nabto_coap_s
     }
 
     // Payload
-    ptr = nabto_coap_encode_payload(observer->payload, observer->payloadLength, ptr, end);
+    if (observer->payload != NULL) {
+        ptr = nabto_coap_encode_payload(observer->payload->data, observer->payload->length, ptr, end);
+    }
 
     if (ptr == NULL) {
         // Encoding failed (e.g., buffer too small). Leave observer state
@@ -474,19 +846,19 @@ static uint8_t* nabto_coap_server_send_observer_notification(struct nabto_coap_s
         return NULL;
     }
 
-    if (observer->notificationType == NABTO_COAP_TYPE_CON) {
+    if (observer->retransmissions == 0) {
+        observer->lastSent = nabto_coap_server_stamp_now(requests);
+    }
+    if (observer->notificationType == NABTO_COAP_TYPE_CON && stream == NULL) {
         observer->sendNow = false;
         observer->waitingForAck = true;
-        observer->timeout = nabto_coap_server_stamp_now(requests);
-        observer->timeout += (requests->server->ackTimeout) << observer->retransmissions;
+        nabto_coap_server_exchange_arm_retransmission(requests, &observer->exchange, observer->connection, observer->retransmissions);
         observer->retransmissions += 1;
     } else {
-        // NON: no retransmission needed, clear notification state
+        // NON or a stream: no retransmission needed, the payload is
+        // kept for a keepalive.
         observer->sendNow = false;
-        struct nabto_coap_server* server = requests->server;
-        server->allocator.free(observer->payload);
-        observer->payload = NULL;
-        observer->payloadLength = 0;
+        nabto_coap_server_observer_idle(requests, observer);
     }
 
     return ptr;
@@ -494,71 +866,129 @@ static uint8_t* nabto_coap_server_send_observer_notification(struct nabto_coap_s
 
 uint8_t* nabto_coap_server_handle_send(struct nabto_coap_server_requests* requests, uint8_t* buffer, uint8_t* end)
 {
-    if (requests->errorConnection) {
-        return nabto_coap_server_send_error(requests, buffer, end);
-    }
+    nabto_coap_server_completions_drain(requests);
 
-    if (requests->ackConnection) {
-        return nabto_coap_server_send_ack(requests, buffer, end);
+    struct nabto_coap_stream* stream = nabto_coap_stream_next_signal(requests->streams);
+    if (stream != NULL) {
+        return nabto_coap_stream_encode_signal(requests->streams, stream, buffer, end);
     }
 
-    struct nabto_coap_server_request* request = requests->requestsSentinel->next;
-    while(request != requests->requestsSentinel) {
-        if ((request->state == NABTO_COAP_SERVER_REQUEST_STATE_REQUEST ||
-             request->state == NABTO_COAP_SERVER_REQUEST_STATE_USER) &&
-            request->hasBlock1Ack)
-        {
-            return nabto_coap_server_send_in_request_state(requests, request, buffer, end);
-        } else if (request->state == NABTO_COAP_SERVER_REQUEST_STATE_RESPONSE &&
-                   request->response.sendNow)
-        {
-            return nabto_coap_server_send_in_response_state(requests, request, buffer, end);
+    if (requests->controlCount > 0) {
+        stream = nabto_coap_stream_find(requests->streams, requests->controlMessages[requests->controlHead].connection);
+        uint8_t* messageEnd = (stream != NULL) ? nabto_coap_stream_message_end(stream, buffer, end) : end;
+        uint8_t* ptr = nabto_coap_server_send_control(requests, buffer, messageEnd);
+        if (stream != NULL) {
+            ptr = nabto_coap_datagram_to_frame(buffer, ptr, end);
+        }
+        if (ptr != NULL) {
+            NABTO_COAP_SERVER_METRIC_INC(requests, packetsSent);
         }
-        request = request->next;
+        return ptr;
     }
 
-    // Check observers
-    struct nabto_coap_server_observer* obs = requests->observersSentinel->next;
-    while (obs != requests->observersSentinel) {
-        if (obs->sendNow) {
-            return nabto_coap_server_send_observer_notification(requests, obs, buffer, end);
+    struct nabto_coap_server_exchange* exchange = nabto_coap_server_next_ready(requests);
+    if (exchange == NULL) {
+        return NULL;
+    }
+
+    uint8_t* ptr;
+    if (exchange->type == NABTO_COAP_SERVER_EXCHANGE_TYPE_RESPONSE) {
+        struct nabto_coap_server_request* request = exchange->owner;
+        stream = nabto_coap_stream_find(requests->streams, request->connection);
+        uint8_t* messageEnd = (stream != NULL) ? nabto_coap_stream_message_end(stream, buffer, end) : end;
+        if (request->state == NABTO_COAP_SERVER_REQUEST_STATE_RESPONSE) {
+            ptr = nabto_coap_server_send_in_response_state(requests, request, stream, buffer, messageEnd);
+        } else {
+            ptr = nabto_coap_server_send_in_request_state(requests, request, buffer, messageEnd);
         }
-        obs = obs->next;
+    } else {
+        struct nabto_coap_server_observer* observer = exchange->owner;
+        stream = nabto_coap_stream_find(requests->streams, observer->connection);
+        uint8_t* messageEnd = (stream != NULL) ? nabto_coap_stream_message_end(stream, buffer, end) : end;
+        ptr = nabto_coap_server_send_observer_notification(requests, observer, stream, buffer, messageEnd);
+    }
+    if (stream != NULL) {
+        ptr = nabto_coap_datagram_to_frame(buffer, ptr, end);
     }
 
-    return NULL;
+    if (ptr != NULL) {
+        NABTO_COAP_SERVER_METRIC_INC(requests, packetsSent);
+    }
+    // the exchange stays queued if it has more to send.
+    nabto_coap_server_exchange_sent(requests, exchange);
+    return ptr;
 }
 
 void nabto_coap_server_free_request(struct nabto_coap_server_request* request)
 {
     struct nabto_coap_server* server = request->requests->server;
     struct nabto_coap_server_requests* requests = request->requests;
+    if (request->state == NABTO_COAP_SERVER_REQUEST_STATE_DONE) {
+        // a done response is never (re)transmitted.
+        nabto_coap_server_timer_cancel(requests, &request->response.exchange);
+        nabto_coap_server_exchange_unready(&request->response.exchange);
+    }
     if (!request->isFreed || request->state != NABTO_COAP_SERVER_REQUEST_STATE_DONE) {
         // dont free before user frees and server is done
         return;
     }
+    nabto_coap_server_unindex_request(request);
     nabto_coap_server_remove_request_from_list(request);
 
     if (request->payload) {
         server->allocator.free(request->payload);
     }
-
-    if (!request->response.staticPayload && request->response.payload) {
-        server->allocator.free(request->response.payload);
+    if (request->qBlock1Map != NULL) {
+        nabto_coap_qblock_map_deinit(request->qBlock1Map);
+        server->allocator.free(request->qBlock1Map);
+    }
+    nabto_coap_server_budget_release(requests, request->connection, request->payloadCharged);
+    if (requests->dispatchedRequest == request) {
+        requests->dispatchedRequest = NULL;
     }
 
-    struct nabto_coap_server_request_parameter* iterator = request->parameterSentinel.next;
-    while(iterator != &request->parameterSentinel) {
+    nabto_coap_server_response_clear_payload(request);
+    nabto_coap_server_async_payload_drop(&request->response.asyncPayload);
+
+    nabto_coap_server_request_parameters_free(server, &request->parameterSentinel);
+
+    nabto_coap_server_pool_free(server, NABTO_COAP_SERVER_POOL_REQUESTS, request);
+
+    nabto_coap_server_timers_release(requests);
+    requests->activeRequests--;
+}
+
+void nabto_coap_server_request_parameters_free(struct nabto_coap_server* server, struct nabto_coap_server_request_parameter* parameterSentinel)
+{
+    struct nabto_coap_server_request_parameter* iterator = parameterSentinel->next;
+    while(iterator != parameterSentinel) {
         struct nabto_coap_server_request_parameter* current = iterator;
         iterator = iterator->next;
-        server->allocator.free(current->value);
-        server->allocator.free(current);
+        nabto_coap_server_request_parameter_free(server, current);
     }
+    parameterSentinel->next = parameterSentinel;
+    parameterSentinel->prev = parameterSentinel;
+}
 
+void nabto_coap_server_exchange_arm_retransmission(struct nabto_coap_server_requests* requests, struct nabto_coap_server_exchange* exchange, void* connection, uint8_t retransmissions)
+{
+    uint32_t now = nabto_coap_server_stamp_now(requests);
+    if (retransmissions == 0) {
+        exchange->rto = nabto_coap_rtt_get_rto(requests->rtt, connection, requests->server->ackTimeout, now);
+        exchange->firstSent = now;
+        exchange->rttSampled = false;
+    }
+    nabto_coap_server_timer_arm(requests, exchange, now + nabto_coap_rtt_backoff(exchange->rto, retransmissions));
+}
 
-    server->allocator.free(request);
-
-    requests->activeRequests--;
+void nabto_coap_server_exchange_acked(struct nabto_coap_server_requests* requests, struct nabto_coap_server_exchange* exchange, uint8_t transmissions)
+{
+    if (exchange->rttSampled || !exchange->indexed) {
+        return;
+    }
+    exchange->rttSampled = true;
+    uint32_t now = nabto_coap_server_stamp_now(requests);
+    nabto_coap_rtt_sample(requests->rtt, exchange->connection, requests->server->ackTimeout, transmissions, now - exchange->firstSent, now);
 }
 
 uint32_t nabto_coap_server_stamp_now(struct nabto_coap_server_requests* requests)
@@ -570,6 +1000,8 @@ void nabto_coap_server_remove_resource(struct nabto_coap_server_resource* resour
 {
     resource->handler = NULL;
     resource->handlerUserData = NULL;
+    resource->cacheCheck = NULL;
+    resource->cacheCheckUserData = NULL;
 }
 
 nabto_coap_error nabto_coap_server_add_resource(struct nabto_coap_server* server, nabto_coap_code method, const char** segments, nabto_coap_server_resource_handler handler, void* userData, struct nabto_coap_server_resource** resource)
@@ -623,12 +1055,36 @@ void* nabto_coap_server_find_resource_data(struct nabto_coap_server* server, nab
 }
 
 
+static int nabto_coap_router_compare_segment(const struct nabto_coap_router_path_segment* pathSegment, const char* segment, size_t segmentLength)
+{
+    if (pathSegment->segmentLength != segmentLength) {
+        return pathSegment->segmentLength < segmentLength ? -1 : 1;
+    }
+    return memcmp(pathSegment->segment, segment, segmentLength);
+}
+
 struct nabto_coap_router_path_segment* nabto_coap_server_find_path_segment(struct nabto_coap_router_node* node, const char* segment, size_t segmentLength)
 {
+    if (node->sortedSegmentsValid) {
+        size_t low = 0;
+        size_t high = node->sortedSegmentsCount;
+        while (low < high) {
+            size_t mid = low + (high - low) / 2;
+            int cmp = nabto_coap_router_compare_segment(node->sortedSegments[mid], segment, segmentLength);
+            if (cmp == 0) {
+                return node->sortedSegments[mid];
+            } else if (cmp < 0) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+        return NULL;
+    }
+
     struct nabto_coap_router_path_segment* iterator = node->pathSegmentsSentinel.next;
     while(iterator != &node->pathSegmentsSentinel) {
-        size_t currentLength = strlen(iterator->segment);
-        if (currentLength == segmentLength && memcmp(iterator->segment, segment, segmentLength) == 0) {
+        if (nabto_coap_router_compare_segment(iterator, segment, segmentLength) == 0) {
             return iterator;
         }
         iterator = iterator->next;
@@ -636,6 +1092,45 @@ struct nabto_coap_router_path_segment* nabto_coap_server_find_path_segment(struc
     return NULL;
 }
 
+/**
+ * Rebuild the sorted array of path segments of a node after a segment
+ * has been added. If the array cannot be allocated it is dropped and
+ * lookups use the list.
+ */
+static void nabto_coap_router_sort_path_segments(struct nabto_coap_server* server, struct nabto_coap_router_node* node)
+{
+    size_t count = 0;
+    struct nabto_coap_router_path_segment* iterator = node->pathSegmentsSentinel.next;
+    while (iterator != &node->pathSegmentsSentinel) {
+        count++;
+        iterator = iterator->next;
+    }
+
+    struct nabto_coap_router_path_segment** sorted = server->allocator.calloc(count, sizeof(struct nabto_coap_router_path_segment*));
+    server->allocator.free(node->sortedSegments);
+    node->sortedSegments = sorted;
+    node->sortedSegmentsCount = 0;
+    node->sortedSegmentsValid = false;
+    if (sorted == NULL) {
+        return;
+    }
+
+    // insertion sort, nodes have few children and this only runs when
+    // resources are added.
+    iterator = node->pathSegmentsSentinel.next;
+    while (iterator != &node->pathSegmentsSentinel) {
+        size_t i = node->sortedSegmentsCount;
+        while (i > 0 && nabto_coap_router_compare_segment(sorted[i-1], iterator->segment, iterator->segmentLength) > 0) {
+            sorted[i] = sorted[i-1];
+            i--;
+        }
+        sorted[i] = iterator;
+        node->sortedSegmentsCount++;
+        iterator = iterator->next;
+    }
+    node->sortedSegmentsValid = true;
+}
+
 void nabto_coap_router_insert_path_segment(struct nabto_coap_router_path_segment* afterThis, struct nabto_coap_router_path_segment* segment)
 {
     struct nabto_coap_router_path_segment* before = afterThis;
@@ -703,6 +1198,7 @@ nabto_coap_error nabto_coap_server_add_resource_into_tree(struct nabto_coap_serv
                     server->allocator.free(pathSegment);
                     return NABTO_COAP_ERROR_OUT_OF_MEMORY;
                 }
+                pathSegment->segmentLength = strlen(segment);
                 pathSegment->node = nabto_coap_router_node_new(server);
                 if (pathSegment->node == NULL) {
                     server->allocator.free(pathSegment->segment);
@@ -710,6 +1206,7 @@ nabto_coap_error nabto_coap_server_add_resource_into_tree(struct nabto_coap_serv
                     return NABTO_COAP_ERROR_OUT_OF_MEMORY;
                 }
                 nabto_coap_router_insert_path_segment(parent->pathSegmentsSentinel.prev, pathSegment);
+                nabto_coap_router_sort_path_segments(server, parent);
             }
             child = pathSegment->node;
         }
@@ -747,20 +1244,94 @@ void nabto_coap_server_response_set_code_human(struct nabto_coap_server_request*
 
 nabto_coap_error nabto_coap_server_response_set_payload(struct nabto_coap_server_request* request, const void* data, size_t dataSize)
 {
-    struct nabto_coap_server* server = request->requests->server;
+    struct nabto_coap_server_requests* requests = request->requests;
+    struct nabto_coap_server* server = requests->server;
+    if (request->async) {
+        // The budget and the allocator belong to the thread running
+        // the requests context.
+        return NABTO_COAP_ERROR_INVALID_PARAMETER;
+    }
+    nabto_coap_server_response_clear_payload(request);
+    if (!nabto_coap_server_budget_charge(requests, request->connection, dataSize)) {
+        return NABTO_COAP_ERROR_OUT_OF_MEMORY;
+    }
     request->response.payload = server->allocator.calloc(1, dataSize + 1);
     if (request->response.payload == NULL) {
+        nabto_coap_server_budget_release(requests, request->connection, dataSize);
         return NABTO_COAP_ERROR_OUT_OF_MEMORY;
     }
+    request->response.chargedBytes = dataSize;
     memcpy(request->response.payload, data, dataSize);
     request->response.payloadLength = dataSize;
-    if (dataSize > (16u << request->response.block2Size)) {
+    if (dataSize > NABTO_COAP_BLOCK_SIZE_ABSOLUTE(request->response.block2Size)) {
         request->response.hasBlock2 = true;
         request->response.block2Current = 0;
     }
     return NABTO_COAP_ERROR_OK;
 }
 
+nabto_coap_error nabto_coap_server_response_set_payload_borrowed(struct nabto_coap_server_request* request, const void* data, size_t dataSize, nabto_coap_server_payload_release release, void* userData)
+{
+    if (request->async) {
+        return nabto_coap_server_async_payload_set(request, data, dataSize, NULL, release, userData);
+    }
+    nabto_coap_server_response_clear_payload(request);
+    request->response.staticPayload = true;
+    request->response.payload = (uint8_t*)data;
+    request->response.payloadLength = dataSize;
+    request->response.payloadRelease = release;
+    request->response.payloadReleaseUserData = userData;
+    if (dataSize > NABTO_COAP_BLOCK_SIZE_ABSOLUTE(request->response.block2Size)) {
+        request->response.hasBlock2 = true;
+        request->response.block2Current = 0;
+    }
+    return NABTO_COAP_ERROR_OK;
+}
+
+nabto_coap_error nabto_coap_server_response_set_payload_producer(struct nabto_coap_server_request* request, nabto_coap_server_payload_producer producer, nabto_coap_server_payload_release release, void* userData)
+{
+    if (producer == NULL) {
+        return NABTO_COAP_ERROR_INVALID_PARAMETER;
+    }
+    if (request->async) {
+        return nabto_coap_server_async_payload_set(request, NULL, 0, producer, release, userData);
+    }
+    nabto_coap_server_response_clear_payload(request);
+    request->response.producer = producer;
+    request->response.producerRelease = release;
+    request->response.producerUserData = userData;
+    request->response.block2Current = 0;
+    return NABTO_COAP_ERROR_OK;
+}
+
+void nabto_coap_server_response_clear_payload(struct nabto_coap_server_request* request)
+{
+    struct nabto_coap_server* server = request->requests->server;
+    struct nabto_coap_server_response* response = &request->response;
+    nabto_coap_server_budget_release(request->requests, request->connection, response->chargedBytes);
+    response->chargedBytes = 0;
+    if (!response->staticPayload && response->payload) {
+        server->allocator.free(response->payload);
+    }
+    if (response->staticPayload && response->payloadRelease != NULL) {
+        response->payloadRelease(response->payloadReleaseUserData);
+    }
+    response->payload = NULL;
+    response->payloadLength = 0;
+    response->staticPayload = false;
+    response->payloadRelease = NULL;
+    response->payloadReleaseUserData = NULL;
+    nabto_coap_server_payload_unref(server, response->sharedPayload);
+    response->sharedPayload = NULL;
+
+    if (response->producer != NULL && response->producerRelease != NULL) {
+        response->producerRelease(response->producerUserData);
+    }
+    response->producer = NULL;
+    response->producerRelease = NULL;
+    response->producerUserData = NULL;
+}
+
 void nabto_coap_server_response_set_content_format(struct nabto_coap_server_request* request, uint16_t contentFormat)
 {
     request->response.hasContentFormat = true;
@@ -770,14 +1341,26 @@ void nabto_coap_server_response_set_content_format(struct nabto_coap_server_requ
 
 nabto_coap_error nabto_coap_server_response_ready(struct nabto_coap_server_request* request)
 {
+    if (request->async) {
+        NN_LOG_ERROR(request->requests->server->logger, NABTO_COAP_SERVER_LOG_MODULE, "response ready after begin_async, use nabto_coap_server_response_ready_async");
+        return NABTO_COAP_ERROR_INVALID_PARAMETER;
+    }
     if (request->connection == NULL) {
         // the connection is removed.
         request->state = NABTO_COAP_SERVER_REQUEST_STATE_DONE;
         //nabto_coap_server_free_request(request);
         return NABTO_COAP_ERROR_NO_CONNECTION;
     } else {
+#ifdef NABTO_COAP_SERVER_METRICS
+        if (request->state == NABTO_COAP_SERVER_REQUEST_STATE_USER) {
+            struct nabto_coap_server_requests* requests = request->requests;
+            nabto_coap_server_metrics_latency(requests, nabto_coap_server_stamp_now(requests) - request->dispatchedAt);
+        }
+#endif
+        nabto_coap_server_cache_store(request);
         request->state = NABTO_COAP_SERVER_REQUEST_STATE_RESPONSE;
         request->response.sendNow = true;
+        nabto_coap_server_exchange_ready(request->requests, &request->response.exchange);
         request->requests->notifyEvent(request->requests->userData);
         return NABTO_COAP_ERROR_OK;
     }
@@ -793,6 +1376,19 @@ int32_t nabto_coap_server_request_get_content_format(struct nabto_coap_server_re
 
 bool nabto_coap_server_request_get_payload(struct nabto_coap_server_request* request, void** payload, size_t* payloadLength)
 {
+    nabto_coap_server_request_copy_payload_view(request);
+    *payload = request->payload;
+    *payloadLength = request->payloadLength;
+    return (request->payloadLength > 0);
+}
+
+bool nabto_coap_server_request_get_payload_view(struct nabto_coap_server_request* request, const void** payload, size_t* payloadLength)
+{
+    if (request->payloadView != NULL) {
+        *payload = request->payloadView;
+        *payloadLength = request->payloadViewLength;
+        return true;
+    }
     *payload = request->payload;
     *payloadLength = request->payloadLength;
     return (request->payloadLength > 0);
@@ -815,6 +1411,39 @@ const char* nabto_coap_server_request_get_parameter(struct nabto_coap_server_req
     return NULL;
 }
 
+struct nabto_coap_server_payload* nabto_coap_server_payload_new(struct nabto_coap_server* server, const void* data, size_t length)
+{
+    struct nabto_coap_server_payload* payload = server->allocator.calloc(1, sizeof(struct nabto_coap_server_payload) + length + 1);
+    if (payload == NULL) {
+        return NULL;
+    }
+    payload->refCount = 1;
+    payload->length = length;
+    if (length > 0) {
+        memcpy(payload->data, data, length);
+    }
+    return payload;
+}
+
+void nabto_coap_server_payload_ref(struct nabto_coap_server_payload* payload)
+{
+    payload->refCount++;
+}
+
+void nabto_coap_server_payload_unref(struct nabto_coap_server* server, struct nabto_coap_server_payload* payload)
+{
+    if (payload == NULL) {
+        return;
+    }
+    payload->refCount--;
+    if (payload->refCount == 0) {
+        if (payload->chargedTo != NULL) {
+            nabto_coap_server_budget_release(payload->chargedTo, NULL, payload->length);
+        }
+        server->allocator.free(payload);
+    }
+}
+
 void nabto_coap_server_observer_remove_from_list(struct nabto_coap_server_observer* observer)
 {
     struct nabto_coap_server_observer* prev = observer->prev;
@@ -823,19 +1452,63 @@ void nabto_coap_server_observer_remove_from_list(struct nabto_coap_server_observ
     next->prev = prev;
     observer->next = observer;
     observer->prev = observer;
+
+    struct nabto_coap_server_resource* resource = observer->resource;
+    if (resource != NULL) {
+        if (observer->resourcePrev != NULL) {
+            observer->resourcePrev->resourceNext = observer->resourceNext;
+        } else {
+            resource->observers = observer->resourceNext;
+        }
+        if (observer->resourceNext != NULL) {
+            observer->resourceNext->resourcePrev = observer->resourcePrev;
+        }
+        observer->resourceNext = NULL;
+        observer->resourcePrev = NULL;
+        observer->resource = NULL;
+    }
 }
 
 void nabto_coap_server_observer_free(struct nabto_coap_server_observer* observer)
 {
-    struct nabto_coap_server* server = observer->requests->server;
+    struct nabto_coap_server_requests* requests = observer->requests;
+    struct nabto_coap_server* server = requests->server;
+    nabto_coap_server_exchange_unindex(observer->requests, &observer->exchange);
+    nabto_coap_server_timer_cancel(observer->requests, &observer->exchange);
+    nabto_coap_server_exchange_unready(&observer->exchange);
     nabto_coap_server_observer_remove_from_list(observer);
-    if (observer->payload) {
-        server->allocator.free(observer->payload);
-    }
-    if (observer->pendingPayload) {
-        server->allocator.free(observer->pendingPayload);
+    nabto_coap_server_payload_unref(server, observer->payload);
+    nabto_coap_server_payload_unref(server, observer->pendingPayload);
+    nabto_coap_server_pool_free(server, NABTO_COAP_SERVER_POOL_OBSERVERS, observer);
+    nabto_coap_server_timers_release(requests);
+    NABTO_COAP_SERVER_METRIC_SUB(requests, observers, 1);
+}
+
+void nabto_coap_server_observer_start(struct nabto_coap_server_requests* requests, struct nabto_coap_server_observer* observer, bool confirmable)
+{
+    // A notification replacing one which is queued but not yet sent
+    // keeps its type.
+    uint32_t conEvery = observer->policy.conEvery;
+    if (confirmable || conEvery <= 1 || observer->nonCount + 1 >= conEvery) {
+        observer->notificationType = NABTO_COAP_TYPE_CON;
+        observer->nonCount = 0;
+    } else if (!observer->sendNow) {
+        observer->notificationType = NABTO_COAP_TYPE_NON;
+        observer->nonCount++;
     }
-    server->allocator.free(observer);
+
+    observer->sequenceNumber++;
+    observer->messageId = nabto_coap_server_next_message_id(requests);
+    // If the index is full the notification is still sent, it can just
+    // not be acknowledged and the observer expires after the
+    // retransmissions.
+    (void)nabto_coap_server_exchange_index(requests, &observer->exchange, observer->connection, observer->messageId);
+    // a minInterval or keepalive timer is no longer needed.
+    nabto_coap_server_timer_cancel(requests, &observer->exchange);
+    observer->retransmissions = 0;
+    observer->sendNow = true;
+    observer->waitingForAck = false;
+    nabto_coap_server_exchange_ready(requests, &observer->exchange);
 }
 
 void nabto_coap_server_observer_promote_pending(struct nabto_coap_server_requests* requests, struct nabto_coap_server_observer* observer)
@@ -845,25 +1518,55 @@ void nabto_coap_server_observer_promote_pending(struct nabto_coap_server_request
     }
     struct nabto_coap_server* server = requests->server;
 
-    if (observer->payload) {
-        server->allocator.free(observer->payload);
-    }
+    nabto_coap_server_payload_unref(server, observer->payload);
     observer->code = observer->pendingCode;
     observer->hasContentFormat = observer->pendingHasContentFormat;
     observer->contentFormat = observer->pendingContentFormat;
     observer->payload = observer->pendingPayload;
-    observer->payloadLength = observer->pendingPayloadLength;
-
-    observer->sequenceNumber++;
-    observer->messageId = nabto_coap_server_next_message_id(requests);
-    observer->retransmissions = 0;
-    observer->sendNow = true;
-    observer->waitingForAck = false;
 
     observer->pendingValid = false;
     observer->pendingPayload = NULL;
-    observer->pendingPayloadLength = 0;
     observer->pendingHasContentFormat = false;
+
+    nabto_coap_server_observer_start(requests, observer, false);
+}
+
+bool nabto_coap_server_observer_idle(struct nabto_coap_server_requests* requests, struct nabto_coap_server_observer* observer)
+{
+    uint32_t now = nabto_coap_server_stamp_now(requests);
+    if (observer->pendingValid) {
+        uint32_t due = observer->lastSent + observer->policy.minInterval;
+        if (nabto_coap_is_stamp_less_equal(due, now)) {
+            nabto_coap_server_observer_promote_pending(requests, observer);
+            return true;
+        }
+        nabto_coap_server_timer_arm(requests, &observer->exchange, due);
+    } else if (observer->policy.maxInterval > 0 && observer->sequenceNumber > 0) {
+        nabto_coap_server_timer_arm(requests, &observer->exchange, observer->lastSent + observer->policy.maxInterval);
+    }
+    return false;
+}
+
+// Notifications are held back until minInterval after the last one.
+static bool nabto_coap_server_observer_holding(struct nabto_coap_server_observer* observer, uint32_t now)
+{
+    return observer->policy.minInterval > 0 && !observer->sendNow &&
+        nabto_coap_is_stamp_less(now, observer->lastSent + observer->policy.minInterval);
+}
+
+void nabto_coap_server_resource_set_notify_policy(struct nabto_coap_server_resource* resource, const struct nabto_coap_server_notify_policy* policy)
+{
+    resource->notifyPolicy = *policy;
+    struct nabto_coap_server_observer* observer = resource->observers;
+    while (observer != NULL) {
+        observer->policy = *policy;
+        observer = observer->resourceNext;
+    }
+}
+
+void nabto_coap_server_observer_set_notify_policy(struct nabto_coap_server_observer* observer, const struct nabto_coap_server_notify_policy* policy)
+{
+    observer->policy = *policy;
 }
 
 bool nabto_coap_server_request_is_observe(struct nabto_coap_server_request* request)
@@ -892,16 +1595,26 @@ nabto_coap_error nabto_coap_server_request_accept_observe(struct nabto_coap_serv
         }
     }
 
-    struct nabto_coap_server_observer* observer = server->allocator.calloc(1, sizeof(struct nabto_coap_server_observer));
+    struct nabto_coap_server_observer* observer = nabto_coap_server_pool_alloc(server, NABTO_COAP_SERVER_POOL_OBSERVERS);
     if (observer == NULL) {
         return NABTO_COAP_ERROR_OUT_OF_MEMORY;
     }
+    if (nabto_coap_server_timers_reserve(requests) != NABTO_COAP_ERROR_OK) {
+        nabto_coap_server_pool_free(server, NABTO_COAP_SERVER_POOL_OBSERVERS, observer);
+        return NABTO_COAP_ERROR_OUT_OF_MEMORY;
+    }
+    NABTO_COAP_SERVER_METRIC_INC(requests, observers);
     observer->requests = requests;
+    observer->exchange.type = NABTO_COAP_SERVER_EXCHANGE_TYPE_NOTIFICATION;
+    observer->exchange.owner = observer;
     observer->resource = request->resource;
     observer->connection = request->connection;
     observer->token = request->token;
     observer->sequenceNumber = 0;
     observer->notificationType = NABTO_COAP_TYPE_CON;
+    observer->policy = request->resource->notifyPolicy;
+    // The registration response counts as the first notification.
+    observer->lastSent = nabto_coap_server_stamp_now(requests);
 
     // Insert into list
     struct nabto_coap_server_observer* sentinel = requests->observersSentinel;
@@ -911,6 +1624,13 @@ nabto_coap_error nabto_coap_server_request_accept_observe(struct nabto_coap_serv
     after->prev = observer;
     observer->prev = sentinel;
 
+    struct nabto_coap_server_resource* resource = observer->resource;
+    observer->resourceNext = resource->observers;
+    if (resource->observers != NULL) {
+        resource->observers->resourcePrev = observer;
+    }
+    resource->observers = observer;
+
     request->observer = observer;
     return NABTO_COAP_ERROR_OK;
 }
@@ -924,62 +1644,78 @@ nabto_coap_error nabto_coap_server_resource_notify(
     size_t payloadLength)
 {
     struct nabto_coap_server* server = requests->server;
-    nabto_coap_error result = NABTO_COAP_ERROR_OK;
     bool anyMarkedSendNow = false;
-    struct nabto_coap_server_observer* obs = requests->observersSentinel->next;
-    while (obs != requests->observersSentinel) {
-        if (obs->resource == resource) {
-            uint8_t* newPayload = NULL;
-            if (payloadLength > 0 && payload != NULL) {
-                newPayload = server->allocator.calloc(1, payloadLength + 1);
-                if (newPayload == NULL) {
-                    // Skip this observer; keep going so other observers
-                    // are still notified.
-                    result = NABTO_COAP_ERROR_OUT_OF_MEMORY;
-                    obs = obs->next;
-                    continue;
-                }
-                memcpy(newPayload, payload, payloadLength);
-            }
+    uint32_t now = nabto_coap_server_stamp_now(requests);
+
+    // The resource has changed so cached responses are stale.
+    nabto_coap_server_resource_invalidate_cache(server, resource);
+
+    // One copy of the payload is shared by all the observers.
+    struct nabto_coap_server_payload* newPayload = NULL;
+    if (payloadLength > 0 && payload != NULL) {
+        // Shared by connections, so only charged to the context.
+        if (!nabto_coap_server_budget_charge(requests, NULL, payloadLength)) {
+            return NABTO_COAP_ERROR_OUT_OF_MEMORY;
+        }
+        newPayload = nabto_coap_server_payload_new(server, payload, payloadLength);
+        if (newPayload == NULL) {
+            nabto_coap_server_budget_release(requests, NULL, payloadLength);
+            return NABTO_COAP_ERROR_OUT_OF_MEMORY;
+        }
+        newPayload->chargedTo = requests;
+    }
 
-            if (obs->waitingForAck) {
-                // A CON is currently in flight. Don't clobber its
+    // The resource is shared between all requests contexts of the
+    // server, only notify the observers belonging to this one.
+    struct nabto_coap_server_observer* obs = resource->observers;
+    while (obs != NULL) {
+        if (obs->requests == requests) {
+            NABTO_COAP_SERVER_METRIC_INC(requests, notifications);
+            if (newPayload != NULL) {
+                nabto_coap_server_payload_ref(newPayload);
+            }
+            if (obs->waitingForAck || nabto_coap_server_observer_holding(obs, now)) {
+                // A CON is currently in flight, or the last notification
+                // is too recent. Don't clobber its
                 // messageId/retransmission state — coalesce the new state
                 // into the pending slot. It will be promoted to the
-                // current notification once the in-flight CON is ACKed.
-                if (obs->pendingPayload) {
-                    server->allocator.free(obs->pendingPayload);
+                // current notification once the in-flight CON is ACKed
+                // and minInterval has passed.
+                if (obs->pendingValid) {
+                    NABTO_COAP_SERVER_METRIC_INC(requests, notificationsCoalesced);
                 }
+                nabto_coap_server_payload_unref(server, obs->pendingPayload);
                 obs->pendingValid = true;
                 obs->pendingCode = code;
                 obs->pendingHasContentFormat = true;
                 obs->pendingContentFormat = contentFormat;
                 obs->pendingPayload = newPayload;
-                obs->pendingPayloadLength = newPayload ? payloadLength : 0;
+                if (!obs->waitingForAck) {
+                    // arm the timer for the end of minInterval
+                    nabto_coap_server_observer_idle(requests, obs);
+                }
             } else {
-                if (obs->payload) {
-                    server->allocator.free(obs->payload);
-                    obs->payload = NULL;
-                    obs->payloadLength = 0;
+                if (obs->sendNow) {
+                    // the queued notification was not sent yet.
+                    NABTO_COAP_SERVER_METRIC_INC(requests, notificationsCoalesced);
                 }
-                obs->sequenceNumber++;
+                nabto_coap_server_payload_unref(server, obs->payload);
                 obs->code = code;
                 obs->hasContentFormat = true;
                 obs->contentFormat = contentFormat;
                 obs->payload = newPayload;
-                obs->payloadLength = newPayload ? payloadLength : 0;
-                obs->messageId = nabto_coap_server_next_message_id(requests);
-                obs->retransmissions = 0;
-                obs->sendNow = true;
+                nabto_coap_server_observer_start(requests, obs, false);
                 anyMarkedSendNow = true;
             }
         }
-        obs = obs->next;
+        obs = obs->resourceNext;
     }
+    // drop the reference taken when the payload was created.
+    nabto_coap_server_payload_unref(server, newPayload);
     if (anyMarkedSendNow) {
         requests->notifyEvent(requests->userData);
     }
-    return result;
+    return NABTO_COAP_ERROR_OK;
 }
 
 struct nabto_coap_server_observer* nabto_coap_server_request_get_observer(struct nabto_coap_server_request* request)
@@ -1022,18 +1758,32 @@ void nabto_coap_server_remove_connection(struct nabto_coap_server_requests* requ
                 current->state = NABTO_COAP_SERVER_REQUEST_STATE_DONE;
                 nabto_coap_server_free_request(current);
             } else {
+                // the request can no longer be found by incoming packets.
+                nabto_coap_server_unindex_request(current);
                 current->connection = NULL;
                 // remove the connection when the response is ready.
             }
         }
     }
-    if (requests->ackConnection == connection) {
-        requests->ackConnection = NULL;
-    }
+    nabto_coap_server_control_remove_connection(requests, connection);
+    nabto_coap_server_budget_remove_connection(requests, connection);
+    nabto_coap_rtt_remove_connection(requests->rtt, connection);
+    nabto_coap_path_remove_connection(requests->paths, connection);
+    nabto_coap_stream_close(requests->streams, connection);
+}
 
-    if (requests->errorConnection == connection) {
-        requests->errorConnection = NULL;
+nabto_coap_error nabto_coap_server_set_mtu(struct nabto_coap_server_requests* requests, void* connection, uint16_t mtu)
+{
+    return nabto_coap_path_set_mtu(requests->paths, connection, mtu);
+}
+
+nabto_coap_error nabto_coap_server_stream_open(struct nabto_coap_server_requests* requests, void* connection, uint32_t maxMessageSize)
+{
+    nabto_coap_error ec = nabto_coap_stream_open(requests->streams, connection, maxMessageSize);
+    if (ec == NABTO_COAP_ERROR_OK) {
+        requests->notifyEvent(requests->userData);
     }
+    return ec;
 }
 
 uint16_t nabto_coap_server_next_message_id(struct nabto_coap_server_requests* requests)
@@ -1069,6 +1819,12 @@ void nabto_coap_router_node_free(struct nabto_coap_server* server, struct nabto_
         server->allocator.free(current);
     }
 
+    nabto_coap_server_resource_invalidate_cache(server, &node->getHandler);
+    nabto_coap_server_resource_invalidate_cache(server, &node->postHandler);
+    nabto_coap_server_resource_invalidate_cache(server, &node->putHandler);
+    nabto_coap_server_resource_invalidate_cache(server, &node->deleteHandler);
+
+    server->allocator.free(node->sortedSegments);
     server->allocator.free(node);
 }
 
@@ -7,12 +7,92 @@
 extern "C" {
 #endif
 
+enum nabto_coap_server_exchange_type {
+    NABTO_COAP_SERVER_EXCHANGE_TYPE_RESPONSE, // owner is a struct nabto_coap_server_request
+    NABTO_COAP_SERVER_EXCHANGE_TYPE_NOTIFICATION // owner is a struct nabto_coap_server_observer
+};
+
+/**
+ * A message sent by the server which the client can ACK or RST, either
+ * a response or an observe notification. While the exchange has a
+ * message id it is indexed by (connection, messageId) such that ACKs
+ * and RSTs can be matched without scanning requests and observers.
+ */
+struct nabto_coap_server_exchange {
+    enum nabto_coap_server_exchange_type type;
+    void* owner;
+    // The key the exchange is indexed under, valid if indexed is true.
+    bool indexed;
+    void* connection;
+    uint16_t messageId;
+    // Retransmission deadline, the exchange is in the timer heap of
+    // the requests context at timerIndex while timerArmed is true.
+    bool timerArmed;
+    uint32_t timerDeadline;
+    size_t timerIndex;
+    // RTO taken from the connection at the first transmission of a CON,
+    // and when that was, such that the ACK can be timed.
+    uint32_t rto;
+    uint32_t firstSent;
+    bool rttSampled;
+    // Set while the exchange is queued in a send lane of the requests
+    // context. For a response the exchange is also used to queue the
+    // block1 continue ack of the request.
+    bool ready;
+    struct nabto_coap_server_send_lane* lane;
+    struct nabto_coap_server_exchange* readyNext;
+    struct nabto_coap_server_exchange* readyPrev;
+};
+
+enum nabto_coap_server_send_class {
+    NABTO_COAP_SERVER_SEND_CLASS_RESPONSE, // first block of a response or a block1 continue
+    NABTO_COAP_SERVER_SEND_CLASS_BLOCK2, // further blocks of a response
+    NABTO_COAP_SERVER_SEND_CLASS_NOTIFICATION
+};
+
+/**
+ * FIFO of the ready exchanges of a connection in a send class, see
+ * nabto_coap_server_impl_scheduler.c
+ */
+struct nabto_coap_server_send_lane {
+    struct nabto_coap_server_requests* requests;
+    void* connection;
+    enum nabto_coap_server_send_class sendClass;
+    bool shared; // one of the lanes in requests->sharedLanes
+    struct nabto_coap_server_exchange* first;
+    struct nabto_coap_server_exchange* last;
+    // links in the ring of the send class while the lane is not empty
+    struct nabto_coap_server_send_lane* next;
+    struct nabto_coap_server_send_lane* prev;
+};
+
+
+/**
+ * Immutable reference counted payload. A notification payload is
+ * created once and shared by all the observers it is sent to.
+ */
+struct nabto_coap_server_payload {
+    size_t refCount;
+    // Set if the payload is charged to the memory budget of a requests
+    // context, it is released when the payload is freed.
+    struct nabto_coap_server_requests* chargedTo;
+    size_t length;
+    uint8_t data[];
+};
+
+struct nabto_coap_server_payload* nabto_coap_server_payload_new(struct nabto_coap_server* server, const void* data, size_t length);
+void nabto_coap_server_payload_ref(struct nabto_coap_server_payload* payload);
+// NULL is ignored.
+void nabto_coap_server_payload_unref(struct nabto_coap_server* server, struct nabto_coap_server_payload* payload);
 
 struct nabto_coap_server_observer {
     struct nabto_coap_server_requests* requests;
     struct nabto_coap_server_observer* next;
     struct nabto_coap_server_observer* prev;
     struct nabto_coap_server_resource* resource;
+    // links in the observers list of the resource
+    struct nabto_coap_server_observer* resourceNext;
+    struct nabto_coap_server_observer* resourcePrev;
     void* connection;
     nabto_coap_token token;
     uint32_t sequenceNumber;
@@ -20,15 +100,21 @@ struct nabto_coap_server_observer {
     bool sendNow;
     bool waitingForAck; // CON notification sent, waiting for ACK/timeout/RST
     uint8_t retransmissions;
-    uint32_t timeout;
     uint16_t messageId;
+    struct nabto_coap_server_exchange exchange;
     nabto_coap_code code;
     bool hasContentFormat;
     uint16_t contentFormat;
-    uint8_t* payload;
-    size_t payloadLength;
+    struct nabto_coap_server_payload* payload; // NULL if empty, kept after sending for keepalives
     nabto_coap_type notificationType;
 
+    struct nabto_coap_server_notify_policy policy;
+    // When the last notification, or the registration response, was
+    // sent. While no CON is in flight the timer of the exchange is used
+    // for the end of minInterval and for the keepalive at maxInterval.
+    uint32_t lastSent;
+    uint32_t nonCount; // NON notifications since the last CON
+
     // Pending update: a notification that arrived while the current CON
     // was still waiting for ACK. Coalesced into a single slot — only the
     // most recent update is kept. Promoted to the "current" notification
@@ -38,8 +124,7 @@ struct nabto_coap_server_observer {
     nabto_coap_code pendingCode;
     bool pendingHasContentFormat;
     uint16_t pendingContentFormat;
-    uint8_t* pendingPayload;
-    size_t pendingPayloadLength;
+    struct nabto_coap_server_payload* pendingPayload; // NULL if empty
 };
 
 enum nabto_coap_server_request_state {
@@ -56,17 +141,35 @@ struct nabto_coap_server_request_parameter {
     struct nabto_coap_server_request_parameter* next;
     struct nabto_coap_server_request_parameter* prev;
     struct nabto_coap_router_parameter* parameter;
-    char* value;
+    char* value; // zero terminated, but can contain zero bytes
+    size_t valueLength;
+    bool valueInPool; // value is from the parameter values pool
 };
 
 struct nabto_coap_server_request;
+struct nabto_coap_qblock_map;
+
+#define NABTO_COAP_SERVER_ETAG_LENGTH 8
+
+/**
+ * A borrowed payload or a producer set by another thread, see
+ * nabto_coap_server_request_begin_async.
+ */
+struct nabto_coap_server_async_payload {
+    bool isSet;
+    const void* data;
+    size_t dataSize;
+    nabto_coap_server_payload_producer producer; // NULL for a borrowed payload
+    nabto_coap_server_payload_release release;
+    void* userData;
+};
 
 struct nabto_coap_server_response {
     struct nabto_coap_server_request* request;
     bool sendNow;
     uint8_t retransmissions;
-    uint32_t timeout;
     uint16_t messageId;
+    struct nabto_coap_server_exchange exchange;
     nabto_coap_code code;
     bool hasContentFormat;
     uint16_t contentFormat;
@@ -75,10 +178,47 @@ struct nabto_coap_server_response {
 
     uint8_t* payload;
     size_t payloadLength;
+    size_t chargedBytes; // charged to the memory budget for the payload
+    // The payload is not owned by the response, payloadRelease is
+    // called when it is no longer used.
     bool staticPayload;
+    nabto_coap_server_payload_release payloadRelease;
+    void* payloadReleaseUserData;
+
+    // Set if the payload is the payload of a cache entry.
+    struct nabto_coap_server_payload* sharedPayload;
+    bool hasETag;
+    uint8_t etag[NABTO_COAP_SERVER_ETAG_LENGTH];
+
+    // Set if the body is produced a block at a time.
+    nabto_coap_server_payload_producer producer;
+    nabto_coap_server_payload_release producerRelease;
+    void* producerUserData;
+
+    // Set by another thread, moved into the response when the request
+    // is drained from the completions.
+    struct nabto_coap_server_async_payload asyncPayload;
 
     uint32_t block2Size;
     uint32_t block2Current;
+    // The last sent block was not the final block.
+    bool block2More;
+    // Nothing is outstanding, the response only waits for the client to
+    // ask for more blocks. It is freed when the timer fires, which is
+    // not a failed exchange.
+    bool lingering;
+
+    // The request asked for Q-Block2, the blocks are sent in bursts of
+    // NABTO_COAP_QBLOCK_MAX_PAYLOADS, see nabto_coap_server_impl.c.
+    bool qBlock2;
+    // The burst waits NABTO_COAP_QBLOCK_NON_TIMEOUT for the client to
+    // ask for the next set.
+    bool qBlock2Paused;
+    // The last block has been sent in the burst.
+    bool qBlock2BurstDone;
+    // Blocks the client asked for again, sent before the burst goes on.
+    uint32_t qBlock2Repair[NABTO_COAP_QBLOCK_MAX_PAYLOADS];
+    uint8_t qBlock2RepairCount;
 };
 
 struct nabto_coap_server_request {
@@ -97,14 +237,33 @@ struct nabto_coap_server_request {
     uint8_t* payload;
 
     size_t payloadLength;
+    size_t payloadCapacity; // the payload buffer has room for payloadCapacity + 1 bytes
+    size_t payloadCharged; // bytes of the payload buffer charged to the memory budget
+    // Set while the handler runs if the payload was not copied, the
+    // payload is then in the packet being handled.
+    const uint8_t* payloadView;
+    size_t payloadViewLength;
 
     bool hasBlock1Ack;
     uint32_t block1Ack;
 
+    // Set while a body sent with Q-Block1 is received, the blocks can
+    // arrive in any order. hasBlock1Ack is then set for a 2.31 or, if
+    // qBlock1MissingLimit is not 0, a 4.08 telling the blocks missing
+    // below it.
+    struct nabto_coap_qblock_map* qBlock1Map;
+    bool qBlock1;
+    uint32_t qBlock1MissingLimit;
+
     bool handled;
     bool isFreed;
     bool isObserveRegister;
     struct nabto_coap_server_observer* observer; // set if observe was accepted
+    struct nabto_coap_server_request* completionNext; // see nabto_coap_server_response_ready_async
+    bool async; // passed on to another thread, see nabto_coap_server_request_begin_async
+#ifdef NABTO_COAP_SERVER_METRICS
+    uint32_t dispatchedAt; // stamp of when the handler was called
+#endif
 
     struct nabto_coap_server_response response;
     struct nabto_coap_server_resource* resource;
@@ -116,9 +275,48 @@ struct nabto_coap_server_request {
 
 struct nabto_coap_router_node;
 
+// How long a Q-Block2 response is kept after its last block for
+// requests for missing blocks, as long as a client asks again.
+#define NABTO_COAP_SERVER_QBLOCK_LINGER ((NABTO_COAP_MAX_RETRANSMITS + 1) * NABTO_COAP_QBLOCK_NON_RECEIVE_TIMEOUT)
+
+// How long a Block2 response waits for the request of the next block
+// after the previous block has been acked.
+#define NABTO_COAP_SERVER_BLOCK2_WAIT 30000
+
+// The Size1 option of a block1 request reserves at most this many
+// blocks beyond the data received, such that a peer cannot make the
+// server allocate for a body it never sends.
+#define NABTO_COAP_SERVER_BLOCK1_RESERVE_BLOCKS 16
+
+/**
+ * A cached GET response, see nabto_coap_server_resource_enable_cache.
+ */
+struct nabto_coap_server_cache_entry {
+    struct nabto_coap_server_cache_entry* next;
+    // the route parameter values, each after its length as a size_t.
+    uint8_t* key;
+    size_t keyLength;
+    bool hasContentFormat;
+    uint16_t contentFormat;
+    uint8_t etag[NABTO_COAP_SERVER_ETAG_LENGTH];
+    struct nabto_coap_server_payload* payload; // NULL if empty
+};
+
 struct nabto_coap_server_resource {
     nabto_coap_server_resource_handler handler;
     void* handlerUserData;
+    // observers of this resource from all requests contexts, NULL
+    // terminated.
+    struct nabto_coap_server_observer* observers;
+    // cached responses, most recently used first, NULL terminated.
+    struct nabto_coap_server_cache_entry* cache;
+    size_t cacheEntries;
+    size_t cacheMaxEntries; // 0 if the cache is disabled
+    // asked before a request is answered from the cache, may be NULL.
+    nabto_coap_server_cache_check cacheCheck;
+    void* cacheCheckUserData;
+    // copied to observers when they are accepted
+    struct nabto_coap_server_notify_policy notifyPolicy;
 };
 
 struct nabto_coap_router_path_segment;
@@ -127,6 +325,7 @@ struct nabto_coap_router_path_segment {
     struct nabto_coap_router_path_segment* next;
     struct nabto_coap_router_path_segment* prev;
     char* segment;
+    size_t segmentLength;
     struct nabto_coap_router_node* node;
 };
 
@@ -137,6 +336,12 @@ struct nabto_coap_router_parameter {
 
 struct nabto_coap_router_node {
     struct nabto_coap_router_path_segment pathSegmentsSentinel;
+    // The path segments sorted by (segmentLength, segment) such that
+    // lookups can binary search. The array is rebuilt when a segment is
+    // added, if that fails lookups fall back to the list.
+    struct nabto_coap_router_path_segment** sortedSegments;
+    size_t sortedSegmentsCount;
+    bool sortedSegmentsValid;
     struct nabto_coap_router_parameter parameter;
     struct nabto_coap_server_resource getHandler;
     struct nabto_coap_server_resource postHandler;
@@ -146,17 +351,146 @@ struct nabto_coap_router_node {
 
 void nabto_coap_server_insert_request_into_list(struct nabto_coap_server_request* e1, struct nabto_coap_server_request* request);
 
+/**
+ * Key used when looking up requests by (connection, token).
+ */
+struct nabto_coap_server_request_key {
+    void* connection;
+    const nabto_coap_token* token;
+};
+
+uint32_t nabto_coap_server_request_key_hash(void* connection, const nabto_coap_token* token);
+
+/**
+ * Insert a request into the list of requests and the token index.
+ */
+nabto_coap_error nabto_coap_server_add_request(struct nabto_coap_server_requests* requests, struct nabto_coap_server_request* request);
+
+/**
+ * Remove a request from the token index, e.g. before its connection
+ * or token is changed.
+ */
+void nabto_coap_server_unindex_request(struct nabto_coap_server_request* request);
+
 struct nabto_coap_server_request* nabto_coap_server_find_request(struct nabto_coap_server_requests* requests, nabto_coap_token* token, void* conneciton);
 
-struct nabto_coap_server_response* nabto_coap_server_find_response(struct nabto_coap_server_requests* requests, uint16_t messageId, void* conneciton);
+/**
+ * (Re)index an exchange under a new message id. If the index cannot
+ * be grown the exchange is left unindexed and an error is returned,
+ * ACKs and RSTs for it will then be ignored.
+ */
+nabto_coap_error nabto_coap_server_exchange_index(struct nabto_coap_server_requests* requests, struct nabto_coap_server_exchange* exchange, void* connection, uint16_t messageId);
+
+void nabto_coap_server_exchange_unindex(struct nabto_coap_server_requests* requests, struct nabto_coap_server_exchange* exchange);
+
+struct nabto_coap_server_exchange* nabto_coap_server_find_exchange(struct nabto_coap_server_requests* requests, uint16_t messageId, void* connection);
+
+/**
+ * Queue an exchange in its send lane when its owner gets something to
+ * send. Queueing an exchange which is already queued is a noop.
+ */
+void nabto_coap_server_exchange_ready(struct nabto_coap_server_requests* requests, struct nabto_coap_server_exchange* exchange);
+
+void nabto_coap_server_exchange_unready(struct nabto_coap_server_exchange* exchange);
+
+nabto_coap_error nabto_coap_server_scheduler_init(struct nabto_coap_server_requests* requests);
+void nabto_coap_server_scheduler_deinit(struct nabto_coap_server_requests* requests);
+
+/**
+ * Get the exchange to send from next. Exchanges which no longer has
+ * anything to send, e.g. because the request changed state while
+ * queued, are dropped.
+ */
+struct nabto_coap_server_exchange* nabto_coap_server_next_ready(struct nabto_coap_server_requests* requests);
+
+/**
+ * Called when a packet has been made from the exchange returned by
+ * next_ready, gives the next connection in the send class a turn.
+ */
+void nabto_coap_server_exchange_sent(struct nabto_coap_server_requests* requests, struct nabto_coap_server_exchange* exchange);
+
+/**
+ * Account bytes held on behalf of a connection, connection can be NULL
+ * for bytes not bound to one. Charging fails if it would exceed the
+ * budget, the caller then has to reject the request causing it.
+ */
+bool nabto_coap_server_budget_available(struct nabto_coap_server_requests* requests, void* connection, size_t bytes);
+bool nabto_coap_server_budget_charge(struct nabto_coap_server_requests* requests, void* connection, size_t bytes);
+void nabto_coap_server_budget_release(struct nabto_coap_server_requests* requests, void* connection, size_t bytes);
+void nabto_coap_server_budget_remove_connection(struct nabto_coap_server_requests* requests, void* connection);
+
+nabto_coap_error nabto_coap_server_budget_init(struct nabto_coap_server_requests* requests);
+void nabto_coap_server_budget_deinit(struct nabto_coap_server_requests* requests);
+
+/**
+ * Make the responses of requests completed from other threads ready and
+ * free the requests, on the thread running the requests context.
+ */
+void nabto_coap_server_completions_drain(struct nabto_coap_server_requests* requests);
+
+nabto_coap_error nabto_coap_server_completions_init(struct nabto_coap_server_requests* requests);
+// Requests not yet drained are only marked as freed.
+void nabto_coap_server_completions_deinit(struct nabto_coap_server_requests* requests);
+
+/**
+ * Record a payload set by another thread on a request passed on with
+ * nabto_coap_server_request_begin_async, without touching the response.
+ */
+nabto_coap_error nabto_coap_server_async_payload_set(struct nabto_coap_server_request* request, const void* data, size_t dataSize, nabto_coap_server_payload_producer producer, nabto_coap_server_payload_release release, void* userData);
+
+// Release a recorded payload which never made it into the response.
+void nabto_coap_server_async_payload_drop(struct nabto_coap_server_async_payload* payload);
+
+/**
+ * Arm the retransmission timer of a CON which has been sent
+ * retransmissions times before, see nabto_coap_rtt.h.
+ */
+void nabto_coap_server_exchange_arm_retransmission(struct nabto_coap_server_requests* requests, struct nabto_coap_server_exchange* exchange, void* connection, uint8_t retransmissions);
+
+/**
+ * Time the ACK of a CON which has been sent transmissions times. Only
+ * the first ACK of a transmission series is used.
+ */
+void nabto_coap_server_exchange_acked(struct nabto_coap_server_requests* requests, struct nabto_coap_server_exchange* exchange, uint8_t transmissions);
+
+#ifdef NABTO_COAP_SERVER_METRICS
+#define NABTO_COAP_SERVER_METRIC_ADD(requests, counter, n) ((requests)->metrics.counter += (n))
+#define NABTO_COAP_SERVER_METRIC_SUB(requests, counter, n) ((requests)->metrics.counter -= (n))
+/**
+ * Add a handler latency to the histogram.
+ */
+void nabto_coap_server_metrics_latency(struct nabto_coap_server_requests* requests, uint32_t latency);
+#else
+#define NABTO_COAP_SERVER_METRIC_ADD(requests, counter, n) do {} while (0)
+#define NABTO_COAP_SERVER_METRIC_SUB(requests, counter, n) do {} while (0)
+#endif
+#define NABTO_COAP_SERVER_METRIC_INC(requests, counter) NABTO_COAP_SERVER_METRIC_ADD(requests, counter, 1)
+
+struct nabto_coap_index* nabto_coap_server_index_new(struct nabto_coap_server* server);
+// NULL is ignored.
+void nabto_coap_server_index_free(struct nabto_coap_server* server, struct nabto_coap_index* index);
 
 bool nabto_coap_server_match_resource(struct nabto_coap_server_resource* resource, uint8_t* options);
 
 void nabto_coap_server_free_request(struct nabto_coap_server_request* request);
 
+/**
+ * Replace a payload view into the received packet with a zero
+ * terminated copy, unless the request has been freed.
+ */
+void nabto_coap_server_request_copy_payload_view(struct nabto_coap_server_request* request);
+
 
 uint16_t nabto_coap_server_next_message_id(struct nabto_coap_server_requests* requests);
 
+/**
+ * Reserve the next slot in the control message ring. The slot is
+ * zeroed. If the ring is full the drop is counted and NULL is returned.
+ */
+struct nabto_coap_server_control_message* nabto_coap_server_control_push(struct nabto_coap_server_requests* requests);
+
+void nabto_coap_server_queue_ack(struct nabto_coap_server_requests* requests, void* connection, uint16_t messageId);
+
 struct nabto_coap_router_node* nabto_coap_router_node_new(struct nabto_coap_server* server);
 void nabto_coap_router_node_free(struct nabto_coap_server* server, struct nabto_coap_router_node* node);
 
@@ -167,12 +501,78 @@ nabto_coap_error nabto_coap_server_add_resource_into_tree(struct nabto_coap_serv
 
 struct nabto_coap_router_path_segment* nabto_coap_server_find_path_segment(struct nabto_coap_router_node* node, const char* segment, size_t segmentLength);
 
+void nabto_coap_server_request_parameters_free(struct nabto_coap_server* server, struct nabto_coap_server_request_parameter* parameterSentinel);
+
+/**
+ * Free or release the response payload, or release its producer.
+ */
+void nabto_coap_server_response_clear_payload(struct nabto_coap_server_request* request);
+
+/**
+ * Answer a GET from the cache of its resource, returns false if the
+ * handler has to be called.
+ */
+bool nabto_coap_server_cache_answer(struct nabto_coap_server_request* request, struct nabto_coap_incoming_message* message);
+
+/**
+ * Store a ready response in the cache of its resource if it is cacheable.
+ */
+void nabto_coap_server_cache_store(struct nabto_coap_server_request* request);
+
 struct nabto_coap_server_request_parameter* nabto_coap_server_request_parameter_new(struct nabto_coap_server* server);
 
+/**
+ * Copy a value into a parameter, short values are kept in the
+ * parameter values pool.
+ */
+bool nabto_coap_server_request_parameter_set_value(struct nabto_coap_server* server, struct nabto_coap_server_request_parameter* parameter, const uint8_t* value, size_t valueLength);
+
+void nabto_coap_server_request_parameter_free(struct nabto_coap_server* server, struct nabto_coap_server_request_parameter* parameter);
+
+/**
+ * Fixed size object pools, see nabto_coap_server_impl_pool.c
+ */
+#define NABTO_COAP_SERVER_POOL_VALUE_SIZE 32
+
+void nabto_coap_server_pools_init(struct nabto_coap_server* server);
+void nabto_coap_server_pools_deinit(struct nabto_coap_server* server);
+// Returns a zeroed object or NULL.
+void* nabto_coap_server_pool_alloc(struct nabto_coap_server* server, enum nabto_coap_server_pool_type type);
+// NULL is ignored.
+void nabto_coap_server_pool_free(struct nabto_coap_server* server, enum nabto_coap_server_pool_type type, void* object);
+
+/**
+ * Retransmission timers, see nabto_coap_server_impl_timers.c
+ *
+ * Each request and observer reserves a slot in the timer heap for its
+ * lifetime, such that arming its timer cannot fail.
+ */
+nabto_coap_error nabto_coap_server_timers_reserve(struct nabto_coap_server_requests* requests);
+void nabto_coap_server_timers_release(struct nabto_coap_server_requests* requests);
+void nabto_coap_server_timer_arm(struct nabto_coap_server_requests* requests, struct nabto_coap_server_exchange* exchange, uint32_t deadline);
+void nabto_coap_server_timer_cancel(struct nabto_coap_server_requests* requests, struct nabto_coap_server_exchange* exchange);
+struct nabto_coap_server_exchange* nabto_coap_server_timer_next(struct nabto_coap_server_requests* requests);
+
 void nabto_coap_server_observer_free(struct nabto_coap_server_observer* observer);
 void nabto_coap_server_observer_remove_from_list(struct nabto_coap_server_observer* observer);
 void nabto_coap_server_observer_promote_pending(struct nabto_coap_server_requests* requests, struct nabto_coap_server_observer* observer);
 
+/**
+ * Start sending the current state of an observer as a new
+ * notification, as a CON if confirmable or if it is the turn of a CON
+ * in the notify policy.
+ */
+void nabto_coap_server_observer_start(struct nabto_coap_server_requests* requests, struct nabto_coap_server_observer* observer, bool confirmable);
+
+/**
+ * Called when an observer has no CON in flight. A coalesced
+ * notification is started if minInterval has passed, else the timer is
+ * armed for the end of minInterval or for the next keepalive.
+ *
+ * @return true if a notification was started.
+ */
+bool nabto_coap_server_observer_idle(struct nabto_coap_server_requests* requests, struct nabto_coap_server_observer* observer);
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
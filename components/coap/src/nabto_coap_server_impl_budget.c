@@ -0,0 +1,138 @@
+#include "nabto_coap_server_impl.h"
+#include "nabto_coap_connection_table.h"
+
+/**
+ * Memory budget of a requests context.
+ *
+ * Request bodies being received, response payloads owned by the server
+ * and notification payloads are charged to the requests context, and
+ * all but notification payloads also to the connection they belong
+ * to. A charge which would exceed the budget of either fails, and the
+ * request causing it is rejected with 5.03 Service Unavailable and a
+ * Max-Age option telling the client when to try again.
+ *
+ * The usage of a connection is kept in an index while it is non zero.
+ */
+
+struct nabto_coap_server_connection_usage {
+    void* connection; // first, see nabto_coap_connection_table
+    size_t used;
+};
+
+static struct nabto_coap_server_connection_usage* nabto_coap_server_connection_usage_find(struct nabto_coap_server_requests* requests, void* connection)
+{
+    return nabto_coap_connection_table_find(requests->connectionUsage, connection);
+}
+
+nabto_coap_error nabto_coap_server_budget_init(struct nabto_coap_server_requests* requests)
+{
+    struct nabto_coap_server* server = requests->server;
+    requests->memoryBudget = SIZE_MAX;
+    requests->connectionMemoryBudget = SIZE_MAX;
+    requests->memoryRetryAfter = NABTO_COAP_SERVER_DEFAULT_MEMORY_RETRY_AFTER;
+    requests->connectionUsage = server->allocator.calloc(1, sizeof(struct nabto_coap_connection_table));
+    if (requests->connectionUsage == NULL) {
+        return NABTO_COAP_ERROR_OUT_OF_MEMORY;
+    }
+    nabto_coap_connection_table_init(requests->connectionUsage, &server->allocator, sizeof(struct nabto_coap_server_connection_usage));
+    return NABTO_COAP_ERROR_OK;
+}
+
+void nabto_coap_server_budget_deinit(struct nabto_coap_server_requests* requests)
+{
+    if (requests->connectionUsage == NULL) {
+        return;
+    }
+    // Usage can be left by requests the application has not freed.
+    nabto_coap_connection_table_deinit(requests->connectionUsage);
+    requests->server->allocator.free(requests->connectionUsage);
+    requests->connectionUsage = NULL;
+}
+
+static bool nabto_coap_server_budget_fits(size_t used, size_t budget, size_t bytes)
+{
+    return used <= budget && bytes <= budget - used;
+}
+
+bool nabto_coap_server_budget_available(struct nabto_coap_server_requests* requests, void* connection, size_t bytes)
+{
+    if (!nabto_coap_server_budget_fits(requests->memoryUsed, requests->memoryBudget, bytes)) {
+        return false;
+    }
+    if (connection != NULL) {
+        struct nabto_coap_server_connection_usage* usage = nabto_coap_server_connection_usage_find(requests, connection);
+        size_t used = (usage != NULL) ? usage->used : 0;
+        if (!nabto_coap_server_budget_fits(used, requests->connectionMemoryBudget, bytes)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool nabto_coap_server_budget_charge(struct nabto_coap_server_requests* requests, void* connection, size_t bytes)
+{
+    if (bytes == 0) {
+        return true;
+    }
+    if (!nabto_coap_server_budget_available(requests, connection, bytes)) {
+        return false;
+    }
+    if (connection != NULL) {
+        struct nabto_coap_server_connection_usage* usage = nabto_coap_server_connection_usage_find(requests, connection);
+        if (usage == NULL) {
+            usage = nabto_coap_connection_table_add(requests->connectionUsage, connection);
+            if (usage == NULL) {
+                return false;
+            }
+        }
+        usage->used += bytes;
+    }
+    requests->memoryUsed += bytes;
+    return true;
+}
+
+void nabto_coap_server_budget_release(struct nabto_coap_server_requests* requests, void* connection, size_t bytes)
+{
+    if (bytes == 0) {
+        return;
+    }
+    requests->memoryUsed -= bytes;
+    if (connection != NULL) {
+        struct nabto_coap_server_connection_usage* usage = nabto_coap_server_connection_usage_find(requests, connection);
+        if (usage != NULL) {
+            usage->used -= (bytes < usage->used) ? bytes : usage->used;
+            if (usage->used == 0) {
+                nabto_coap_connection_table_remove(requests->connectionUsage, usage);
+            }
+        }
+    }
+}
+
+void nabto_coap_server_budget_remove_connection(struct nabto_coap_server_requests* requests, void* connection)
+{
+    // Requests kept by the application after the connection is removed
+    // no longer know their connection, they are released from the
+    // requests context only.
+    struct nabto_coap_server_connection_usage* usage = nabto_coap_server_connection_usage_find(requests, connection);
+    if (usage != NULL) {
+        nabto_coap_connection_table_remove(requests->connectionUsage, usage);
+    }
+}
+
+void nabto_coap_server_limit_memory(struct nabto_coap_server_requests* requests, size_t budget, size_t connectionBudget, uint32_t retryAfter)
+{
+    requests->memoryBudget = budget;
+    requests->connectionMemoryBudget = connectionBudget;
+    requests->memoryRetryAfter = retryAfter;
+}
+
+size_t nabto_coap_server_get_memory_usage(struct nabto_coap_server_requests* requests)
+{
+    return requests->memoryUsed;
+}
+
+size_t nabto_coap_server_get_connection_memory_usage(struct nabto_coap_server_requests* requests, void* connection)
+{
+    struct nabto_coap_server_connection_usage* usage = nabto_coap_server_connection_usage_find(requests, connection);
+    return (usage != NULL) ? usage->used : 0;
+}
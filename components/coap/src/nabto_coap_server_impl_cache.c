@@ -0,0 +1,275 @@
+#include "nabto_coap_server_impl.h"
+#include "nabto_coap_index.h"
+
+/**
+ * Cache of GET responses.
+ *
+ * A resource with the cache enabled keeps the last responses of its
+ * handler keyed by the values of the route parameters. A GET matching
+ * an entry is answered from the entry without calling the handler, and
+ * a GET carrying the ETag of the entry is answered with 2.03 Valid.
+ *
+ * Entries are kept most recently used first, when the resource has
+ * maxEntries entries the last one is dropped. The payload of an entry
+ * is shared with the responses sent from it. Entries are not per
+ * connection, a resource can set a check which decides whether a
+ * request may see the entry.
+ *
+ * Resources, and with them their caches, are shared by all requests
+ * contexts of a server. A hit reorders the entries, so like the router
+ * and the pools the cache is only safe to use from one thread.
+ */
+
+// The parameter values in route order, each after its length. Values
+// can contain zero bytes, the lengths keep the keys unambiguous.
+static size_t nabto_coap_server_cache_key_length(struct nabto_coap_server_request_parameter* sentinel)
+{
+    size_t length = 0;
+    struct nabto_coap_server_request_parameter* iterator = sentinel->next;
+    while (iterator != sentinel) {
+        length += sizeof(size_t) + iterator->valueLength;
+        iterator = iterator->next;
+    }
+    return length;
+}
+
+static bool nabto_coap_server_cache_key_match(struct nabto_coap_server_cache_entry* entry, struct nabto_coap_server_request_parameter* sentinel)
+{
+    const uint8_t* key = entry->key;
+    const uint8_t* keyEnd = entry->key + entry->keyLength;
+    struct nabto_coap_server_request_parameter* iterator = sentinel->next;
+    while (iterator != sentinel) {
+        size_t valueLength;
+        if ((size_t)(keyEnd - key) < sizeof(size_t)) {
+            return false;
+        }
+        memcpy(&valueLength, key, sizeof(size_t));
+        key += sizeof(size_t);
+        if (valueLength != iterator->valueLength ||
+            (size_t)(keyEnd - key) < valueLength ||
+            memcmp(key, iterator->value, valueLength) != 0)
+        {
+            return false;
+        }
+        key += valueLength;
+        iterator = iterator->next;
+    }
+    return key == keyEnd;
+}
+
+static void nabto_coap_server_cache_entry_free(struct nabto_coap_server* server, struct nabto_coap_server_cache_entry* entry)
+{
+    nabto_coap_server_payload_unref(server, entry->payload);
+    server->allocator.free(entry->key);
+    server->allocator.free(entry);
+}
+
+static struct nabto_coap_server_cache_entry* nabto_coap_server_cache_find(struct nabto_coap_server_resource* resource, struct nabto_coap_server_request_parameter* sentinel)
+{
+    struct nabto_coap_server_cache_entry* prev = NULL;
+    struct nabto_coap_server_cache_entry* entry = resource->cache;
+    while (entry != NULL) {
+        if (nabto_coap_server_cache_key_match(entry, sentinel)) {
+            if (prev != NULL) {
+                // move to front
+                prev->next = entry->next;
+                entry->next = resource->cache;
+                resource->cache = entry;
+            }
+            return entry;
+        }
+        prev = entry;
+        entry = entry->next;
+    }
+    return NULL;
+}
+
+static void nabto_coap_server_cache_remove(struct nabto_coap_server* server, struct nabto_coap_server_resource* resource, struct nabto_coap_server_cache_entry* entry)
+{
+    struct nabto_coap_server_cache_entry** link = &resource->cache;
+    while (*link != NULL) {
+        if (*link == entry) {
+            *link = entry->next;
+            resource->cacheEntries--;
+            nabto_coap_server_cache_entry_free(server, entry);
+            return;
+        }
+        link = &(*link)->next;
+    }
+}
+
+static void nabto_coap_server_cache_make_etag(struct nabto_coap_server_cache_entry* entry)
+{
+    uint8_t format[3];
+    format[0] = entry->hasContentFormat ? 1 : 0;
+    format[1] = (uint8_t)(entry->contentFormat >> 8);
+    format[2] = (uint8_t)(entry->contentFormat);
+    // Derived from the content such that an unchanged representation
+    // keeps its ETag after the cache is invalidated or the server is
+    // restarted. Two differently seeded hashes give 8 bytes.
+    uint32_t h1 = nabto_coap_hash_bytes(NABTO_COAP_HASH_INIT, format, sizeof(format));
+    uint32_t h2 = nabto_coap_hash_bytes(~NABTO_COAP_HASH_INIT, format, sizeof(format));
+    if (entry->payload != NULL) {
+        h1 = nabto_coap_hash_bytes(h1, entry->payload->data, entry->payload->length);
+        h2 = nabto_coap_hash_bytes(h2, entry->payload->data, entry->payload->length);
+    }
+    for (size_t i = 0; i < 4; i++) {
+        entry->etag[i] = (uint8_t)(h1 >> (24 - 8*i));
+        entry->etag[4+i] = (uint8_t)(h2 >> (24 - 8*i));
+    }
+}
+
+static bool nabto_coap_server_cache_etag_requested(struct nabto_coap_server_cache_entry* entry, struct nabto_coap_incoming_message* message)
+{
+    size_t i = nabto_coap_find_option(message, NABTO_COAP_OPTION_ETAG, 0);
+    while (i < message->optionCount && message->optionTable[i].number == NABTO_COAP_OPTION_ETAG) {
+        const struct nabto_coap_option_entry* option = &message->optionTable[i];
+        if (option->length == NABTO_COAP_SERVER_ETAG_LENGTH && memcmp(message->options + option->offset, entry->etag, option->length) == 0) {
+            return true;
+        }
+        i++;
+    }
+    return false;
+}
+
+void nabto_coap_server_resource_enable_cache(struct nabto_coap_server* server, struct nabto_coap_server_resource* resource, size_t maxEntries)
+{
+    resource->cacheMaxEntries = maxEntries;
+    while (resource->cacheEntries > maxEntries) {
+        // drop the least recently used entries
+        struct nabto_coap_server_cache_entry* last = resource->cache;
+        while (last->next != NULL) {
+            last = last->next;
+        }
+        nabto_coap_server_cache_remove(server, resource, last);
+    }
+}
+
+void nabto_coap_server_resource_set_cache_check(struct nabto_coap_server_resource* resource, nabto_coap_server_cache_check check, void* userData)
+{
+    resource->cacheCheck = check;
+    resource->cacheCheckUserData = userData;
+}
+
+void nabto_coap_server_resource_invalidate_cache(struct nabto_coap_server* server, struct nabto_coap_server_resource* resource)
+{
+    struct nabto_coap_server_cache_entry* entry = resource->cache;
+    while (entry != NULL) {
+        struct nabto_coap_server_cache_entry* current = entry;
+        entry = entry->next;
+        nabto_coap_server_cache_entry_free(server, current);
+    }
+    resource->cache = NULL;
+    resource->cacheEntries = 0;
+}
+
+static void nabto_coap_server_cache_set_response(struct nabto_coap_server_request* request, struct nabto_coap_server_cache_entry* entry)
+{
+    struct nabto_coap_server_response* response = &request->response;
+    nabto_coap_server_response_clear_payload(request);
+    if (entry->payload != NULL) {
+        nabto_coap_server_payload_ref(entry->payload);
+        response->sharedPayload = entry->payload;
+        response->staticPayload = true;
+        response->payload = entry->payload->data;
+        response->payloadLength = entry->payload->length;
+    }
+    response->hasETag = true;
+    memcpy(response->etag, entry->etag, NABTO_COAP_SERVER_ETAG_LENGTH);
+}
+
+bool nabto_coap_server_cache_answer(struct nabto_coap_server_request* request, struct nabto_coap_incoming_message* message)
+{
+    struct nabto_coap_server_resource* resource = request->resource;
+    if (resource->cache == NULL || request->method != NABTO_COAP_CODE_GET || request->isObserveRegister) {
+        return false;
+    }
+    struct nabto_coap_server_cache_entry* entry = nabto_coap_server_cache_find(resource, &request->parameterSentinel);
+    if (entry == NULL) {
+        return false;
+    }
+    if (resource->cacheCheck != NULL && !resource->cacheCheck(request, resource->cacheCheckUserData)) {
+        // The caller may not see the entry, let the handler decide.
+        return false;
+    }
+
+    struct nabto_coap_server_response* response = &request->response;
+    request->state = NABTO_COAP_SERVER_REQUEST_STATE_USER;
+    if (nabto_coap_server_cache_etag_requested(entry, message)) {
+        // The client has the representation, only confirm it.
+        response->code = NABTO_COAP_CODE_VALID;
+        response->hasETag = true;
+        memcpy(response->etag, entry->etag, NABTO_COAP_SERVER_ETAG_LENGTH);
+    } else {
+        response->code = NABTO_COAP_CODE_CONTENT;
+        response->hasContentFormat = entry->hasContentFormat;
+        response->contentFormat = entry->contentFormat;
+        nabto_coap_server_cache_set_response(request, entry);
+        if (response->payloadLength > NABTO_COAP_BLOCK_SIZE_ABSOLUTE(response->block2Size)) {
+            response->hasBlock2 = true;
+            response->block2Current = 0;
+        }
+    }
+    nabto_coap_server_response_ready(request);
+    // The user never sees this request.
+    nabto_coap_server_request_free(request);
+    return true;
+}
+
+void nabto_coap_server_cache_store(struct nabto_coap_server_request* request)
+{
+    struct nabto_coap_server_resource* resource = request->resource;
+    struct nabto_coap_server_response* response = &request->response;
+    if (resource == NULL || resource->cacheMaxEntries == 0 ||
+        request->method != NABTO_COAP_CODE_GET ||
+        request->observer != NULL ||
+        response->code != NABTO_COAP_CODE_CONTENT ||
+        response->producer != NULL ||
+        response->hasETag)
+    {
+        return;
+    }
+    struct nabto_coap_server* server = request->requests->server;
+
+    struct nabto_coap_server_cache_entry* entry = server->allocator.calloc(1, sizeof(struct nabto_coap_server_cache_entry));
+    if (entry == NULL) {
+        return;
+    }
+    entry->keyLength = nabto_coap_server_cache_key_length(&request->parameterSentinel);
+    entry->key = server->allocator.calloc(1, entry->keyLength + 1);
+    if (entry->key == NULL) {
+        server->allocator.free(entry);
+        return;
+    }
+    uint8_t* key = entry->key;
+    struct nabto_coap_server_request_parameter* iterator = request->parameterSentinel.next;
+    while (iterator != &request->parameterSentinel) {
+        memcpy(key, &iterator->valueLength, sizeof(size_t));
+        key += sizeof(size_t);
+        memcpy(key, iterator->value, iterator->valueLength);
+        key += iterator->valueLength;
+        iterator = iterator->next;
+    }
+    if (response->payloadLength > 0) {
+        entry->payload = nabto_coap_server_payload_new(server, response->payload, response->payloadLength);
+        if (entry->payload == NULL) {
+            nabto_coap_server_cache_entry_free(server, entry);
+            return;
+        }
+    }
+    entry->hasContentFormat = response->hasContentFormat;
+    entry->contentFormat = response->contentFormat;
+    nabto_coap_server_cache_make_etag(entry);
+
+    struct nabto_coap_server_cache_entry* old = nabto_coap_server_cache_find(resource, &request->parameterSentinel);
+    if (old != NULL) {
+        nabto_coap_server_cache_remove(server, resource, old);
+    }
+    entry->next = resource->cache;
+    resource->cache = entry;
+    resource->cacheEntries++;
+    nabto_coap_server_resource_enable_cache(server, resource, resource->cacheMaxEntries);
+
+    // Send the cached copy such that the payload is held only once.
+    nabto_coap_server_cache_set_response(request, entry);
+}
@@ -0,0 +1,134 @@
+#include "nabto_coap_server_impl.h"
+#include "nabto_coap_atomic.h"
+
+/**
+ * Requests completed from other threads.
+ *
+ * Completing threads push requests onto a lock free stack with a
+ * compare and swap. The thread running the requests context takes the
+ * whole stack in one exchange, so no element is ever popped while
+ * another thread pushes it, and handles the requests in the order they
+ * were completed.
+ *
+ * A borrowed payload or a producer set by another thread is only
+ * recorded, the payload it replaces is released and the new one put in
+ * the response when the request is drained, such that the allocator
+ * and the memory budget are only used by the owning thread.
+ */
+
+struct nabto_coap_server_completions {
+    nabto_coap_atomic_ptr head; // struct nabto_coap_server_request*
+};
+
+nabto_coap_error nabto_coap_server_completions_init(struct nabto_coap_server_requests* requests)
+{
+    struct nabto_coap_server_completions* completions = requests->server->allocator.calloc(1, sizeof(struct nabto_coap_server_completions));
+    if (completions == NULL) {
+        return NABTO_COAP_ERROR_OUT_OF_MEMORY;
+    }
+    nabto_coap_atomic_init(&completions->head, NULL);
+    requests->completions = completions;
+    return NABTO_COAP_ERROR_OK;
+}
+
+// Take the completed requests, oldest first.
+static struct nabto_coap_server_request* nabto_coap_server_completions_take(struct nabto_coap_server_completions* completions)
+{
+    if (nabto_coap_atomic_load_relaxed(&completions->head) == NULL) {
+        return NULL;
+    }
+    struct nabto_coap_server_request* stack = nabto_coap_atomic_exchange_acquire(&completions->head, NULL);
+    struct nabto_coap_server_request* list = NULL;
+    while (stack != NULL) {
+        struct nabto_coap_server_request* next = stack->completionNext;
+        stack->completionNext = list;
+        list = stack;
+        stack = next;
+    }
+    return list;
+}
+
+void nabto_coap_server_completions_deinit(struct nabto_coap_server_requests* requests)
+{
+    struct nabto_coap_server_completions* completions = requests->completions;
+    if (completions == NULL) {
+        return;
+    }
+    struct nabto_coap_server_request* request = nabto_coap_server_completions_take(completions);
+    while (request != NULL) {
+        struct nabto_coap_server_request* next = request->completionNext;
+        request->completionNext = NULL;
+        request->isFreed = true;
+        request = next;
+    }
+    requests->server->allocator.free(completions);
+    requests->completions = NULL;
+}
+
+void nabto_coap_server_request_begin_async(struct nabto_coap_server_request* request)
+{
+    request->async = true;
+}
+
+nabto_coap_error nabto_coap_server_async_payload_set(struct nabto_coap_server_request* request, const void* data, size_t dataSize, nabto_coap_server_payload_producer producer, nabto_coap_server_payload_release release, void* userData)
+{
+    struct nabto_coap_server_async_payload* payload = &request->response.asyncPayload;
+    // A payload replaced before the request is drained was never used
+    // by the server.
+    nabto_coap_server_async_payload_drop(payload);
+    payload->isSet = true;
+    payload->data = data;
+    payload->dataSize = dataSize;
+    payload->producer = producer;
+    payload->release = release;
+    payload->userData = userData;
+    return NABTO_COAP_ERROR_OK;
+}
+
+void nabto_coap_server_async_payload_drop(struct nabto_coap_server_async_payload* payload)
+{
+    if (payload->isSet && payload->release != NULL) {
+        payload->release(payload->userData);
+    }
+    memset(payload, 0, sizeof(struct nabto_coap_server_async_payload));
+}
+
+// Back on the owning thread, put the recorded payload in the response.
+static void nabto_coap_server_async_payload_apply(struct nabto_coap_server_request* request)
+{
+    struct nabto_coap_server_async_payload payload = request->response.asyncPayload;
+    memset(&request->response.asyncPayload, 0, sizeof(struct nabto_coap_server_async_payload));
+    request->async = false;
+    if (!payload.isSet) {
+        return;
+    }
+    if (payload.producer != NULL) {
+        nabto_coap_server_response_set_payload_producer(request, payload.producer, payload.release, payload.userData);
+    } else {
+        nabto_coap_server_response_set_payload_borrowed(request, payload.data, payload.dataSize, payload.release, payload.userData);
+    }
+}
+
+void nabto_coap_server_completions_drain(struct nabto_coap_server_requests* requests)
+{
+    struct nabto_coap_server_request* request = nabto_coap_server_completions_take(requests->completions);
+    while (request != NULL) {
+        struct nabto_coap_server_request* next = request->completionNext;
+        request->completionNext = NULL;
+        nabto_coap_server_async_payload_apply(request);
+        nabto_coap_server_response_ready(request);
+        nabto_coap_server_request_free(request);
+        request = next;
+    }
+}
+
+void nabto_coap_server_response_ready_async(struct nabto_coap_server_request* request)
+{
+    struct nabto_coap_server_requests* requests = request->requests;
+    struct nabto_coap_server_completions* completions = requests->completions;
+    void* head = nabto_coap_atomic_load_relaxed(&completions->head);
+    do {
+        request->completionNext = head;
+    } while (!nabto_coap_atomic_compare_exchange_release(&completions->head, &head, request));
+    requests->notifyEvent(requests->userData);
+}
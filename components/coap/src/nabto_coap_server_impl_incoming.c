@@ -1,4 +1,7 @@
 #include "nabto_coap_server_impl.h"
+#include "nabto_coap_stream.h"
+#include "nabto_coap_qblock.h"
+#include "nabto_coap_path.h"
 
 #include <stdlib.h>
 
@@ -9,33 +12,56 @@
 static const char* unsupportedCriticalOption = "Unsupported critical option";
 static const char* outOfResources = "Out of resources";
 static const char* wrongPayloadLength = "Wrong payload length";
+static const char* qBlockBodyGone = "Response body no longer available";
 
 
 static struct nabto_coap_server_request* nabto_coap_server_handle_new_request(struct nabto_coap_server_requests* requests, struct nabto_coap_incoming_message* message, void* connection);
 static void nabto_coap_server_handle_ack(struct nabto_coap_server_requests* requests, struct nabto_coap_server_request* request, struct nabto_coap_incoming_message* message);
 static void nabto_coap_server_handle_rst(struct nabto_coap_server_requests* requests, uint16_t messageId, void* connection);
 static struct nabto_coap_server_request* nabto_coap_server_request_new(struct nabto_coap_server_requests* requests);
-static struct nabto_coap_server_resource* nabto_coap_server_find_resource(struct nabto_coap_server* server, struct nabto_coap_incoming_message* message, struct nabto_coap_server_request_parameter* parameters);
+static nabto_coap_error nabto_coap_server_find_resource(struct nabto_coap_server* server, struct nabto_coap_incoming_message* message, struct nabto_coap_server_request_parameter* parameters, struct nabto_coap_server_resource** resource);
 
 static bool nabto_coap_server_validate_critical_options(struct nabto_coap_incoming_message* message);
 
 static void nabto_coap_server_handle_data_for_response(struct nabto_coap_server_requests* requests, struct nabto_coap_server_request* request, struct nabto_coap_incoming_message* message);
 static void nabto_coap_server_handle_data_for_request(struct nabto_coap_server_requests* requests, struct nabto_coap_server_request* request, struct nabto_coap_incoming_message* message);
+static bool nabto_coap_server_request_reserve_payload(struct nabto_coap_server* server, struct nabto_coap_server_request* request, size_t capacity);
+static void nabto_coap_server_make_busy_response(struct nabto_coap_server_requests* requests, void* connection, struct nabto_coap_incoming_message* message);
+static void nabto_coap_server_make_too_large_response(struct nabto_coap_server_requests* requests, struct nabto_coap_server_request* request, struct nabto_coap_incoming_message* message, size_t limit);
+static void nabto_coap_server_request_dispatch(struct nabto_coap_server_requests* requests, struct nabto_coap_server_request* request, struct nabto_coap_incoming_message* message);
+static bool nabto_coap_server_handle_qblock1(struct nabto_coap_server_requests* requests, struct nabto_coap_server_request* request, struct nabto_coap_incoming_message* message);
+static void nabto_coap_server_handle_qblock2(struct nabto_coap_server_requests* requests, struct nabto_coap_server_request* request, struct nabto_coap_incoming_message* message);
 
 /**
  * Make an error response to some condition
  * @param errorDescription  keep this pointer alive forever.
+ * @return the queued error or NULL if the control message ring is full.
  */
-static void nabto_coap_server_make_error_response(struct nabto_coap_server_requests* requests, void* connection, struct nabto_coap_incoming_message* message, nabto_coap_code code, const char* errorDescription);
+static struct nabto_coap_server_control_message* nabto_coap_server_make_error_response(struct nabto_coap_server_requests* requests, void* connection, struct nabto_coap_incoming_message* message, nabto_coap_code code, const char* errorDescription);
 
 
 void nabto_coap_server_handle_packet(struct nabto_coap_server_requests* requests, void* connection, const uint8_t* packet, size_t packetSize)
 {
     struct nabto_coap_incoming_message msg;
-    if (!nabto_coap_parse_message(packet, packetSize, &msg)) {
+    NABTO_COAP_SERVER_METRIC_INC(requests, packetsReceived);
+    struct nabto_coap_stream* stream = nabto_coap_stream_find(requests->streams, connection);
+    bool parsed = (stream != NULL) ? nabto_coap_parse_frame(packet, packetSize, &msg) : nabto_coap_parse_message(packet, packetSize, &msg);
+    if (!parsed) {
+        NABTO_COAP_SERVER_METRIC_INC(requests, invalidPackets);
         return;
     }
 
+    if (stream != NULL) {
+        if (msg.code >> 5 == 7) {
+            if (!nabto_coap_stream_handle_signal(requests->streams, stream, &msg)) {
+                nabto_coap_server_remove_connection(requests, connection);
+            } else if (nabto_coap_stream_next_signal(requests->streams) != NULL) {
+                requests->notifyEvent(requests->userData);
+            }
+            return;
+        }
+        nabto_coap_stream_received(stream, &msg);
+    }
 
     // validate options deny request if we do not know a critical option.
     if (msg.type == NABTO_COAP_TYPE_CON ||
@@ -54,19 +80,55 @@ void nabto_coap_server_handle_packet(struct nabto_coap_server_requests* requests
 
         if (request && request->messageId == msg.messageId) {
             // retransmission of a request.
+            NABTO_COAP_SERVER_METRIC_INC(requests, duplicateRequests);
             if (msg.type == NABTO_COAP_TYPE_CON) {
-                requests->ackConnection = connection;
-                requests->ackMessageId = msg.messageId;
+                nabto_coap_server_queue_ack(requests, connection, msg.messageId);
             }
             return;
         }
 
+        if (!request && stream == NULL && msg.hasQBlock2 && !msg.hasQBlock1 &&
+            (NABTO_COAP_BLOCK_NUM(msg.qBlock2) > 0 || NABTO_COAP_BLOCK_MORE(msg.qBlock2)) &&
+            msg.code != NABTO_COAP_CODE_GET)
+        {
+            // A request for more Q-Block2 blocks of a response which
+            // is gone. Only a GET is safe to run again.
+            nabto_coap_server_make_error_response(requests, connection, &msg, NABTO_COAP_CODE_REQUEST_ENTITY_INCOMPLETE, qBlockBodyGone);
+            return;
+        }
+
         if (!request) {
             request = nabto_coap_server_handle_new_request(requests, &msg, connection);
             if (!request) {
                 // error is handled inside the function.
                 return;
             }
+            NABTO_COAP_SERVER_METRIC_INC(requests, requests);
+            if (stream != NULL && stream->peerBert) {
+                request->response.block2Size = NABTO_COAP_BLOCK_SZX_BERT;
+            } else if (stream == NULL) {
+                // The block size fitting the connection, or a smaller
+                // one asked for by the client.
+                uint32_t szx = request->response.block2Size;
+                nabto_coap_path_get_szx(requests->paths, connection, &szx);
+                if (msg.hasQBlock2 && msg.type == NABTO_COAP_TYPE_NON &&
+                    NABTO_COAP_BLOCK_SIZE(msg.qBlock2) != NABTO_COAP_BLOCK_SZX_BERT)
+                {
+                    // The response is sent in bursts, a CON request is
+                    // answered with Block2.
+                    request->response.qBlock2 = true;
+                    szx = nabto_coap_path_limit_szx(requests->paths, connection, NABTO_COAP_BLOCK_SIZE(msg.qBlock2));
+                } else if (msg.hasBlock2 && NABTO_COAP_BLOCK_NUM(msg.block2) == 0 &&
+                           NABTO_COAP_BLOCK_SIZE(msg.block2) != NABTO_COAP_BLOCK_SZX_BERT)
+                {
+                    szx = nabto_coap_path_limit_szx(requests->paths, connection, NABTO_COAP_BLOCK_SIZE(msg.block2));
+                }
+                request->response.block2Size = szx;
+            }
+        }
+
+        if (msg.hasBlock1) {
+            NABTO_COAP_SERVER_METRIC_INC(requests, block1Received);
         }
 
         if (request->state == NABTO_COAP_SERVER_REQUEST_STATE_REQUEST) {
@@ -80,56 +142,54 @@ void nabto_coap_server_handle_packet(struct nabto_coap_server_requests* requests
             return;
         }
     } else if (msg.type == NABTO_COAP_TYPE_ACK) {
-        // acks does not contain tokens, so find the appropriate response using messageId and connection
-        struct nabto_coap_server_response* response = nabto_coap_server_find_response(requests, msg.messageId, connection);
-        if (response) {
-            nabto_coap_server_handle_ack(requests, response->request, &msg);
+        NABTO_COAP_SERVER_METRIC_INC(requests, acks);
+        // acks does not contain tokens, so find the appropriate response or notification using messageId and connection
+        struct nabto_coap_server_exchange* exchange = nabto_coap_server_find_exchange(requests, msg.messageId, connection);
+        if (exchange == NULL) {
             return;
         }
-        // Check if ACK is for an observer notification
-        struct nabto_coap_server_observer* obs = requests->observersSentinel->next;
-        while (obs != requests->observersSentinel) {
-            if (obs->connection == connection && obs->messageId == msg.messageId) {
-                // Notification was acknowledged, clear in-flight state.
-                struct nabto_coap_server* server = requests->server;
-                if (obs->payload) {
-                    server->allocator.free(obs->payload);
-                    obs->payload = NULL;
-                    obs->payloadLength = 0;
-                }
-                obs->sendNow = false;
-                obs->waitingForAck = false;
-
-                // If a newer notification was coalesced while the CON was
-                // in flight, promote it now and wake the event loop so
-                // it is sent as a fresh CON.
-                if (obs->pendingValid) {
-                    nabto_coap_server_observer_promote_pending(requests, obs);
-                    requests->notifyEvent(requests->userData);
-                }
-                return;
-            }
-            obs = obs->next;
+        if (exchange->type == NABTO_COAP_SERVER_EXCHANGE_TYPE_RESPONSE) {
+            nabto_coap_server_handle_ack(requests, exchange->owner, &msg);
+            return;
+        }
+        // Notification was acknowledged, clear in-flight state.
+        struct nabto_coap_server_observer* obs = exchange->owner;
+        if (obs->notificationType != NABTO_COAP_TYPE_CON) {
+            // NON notifications are not acknowledged.
+            return;
         }
+        nabto_coap_server_exchange_acked(requests, &obs->exchange, obs->retransmissions);
+        nabto_coap_server_exchange_unindex(requests, &obs->exchange);
+        nabto_coap_server_timer_cancel(requests, &obs->exchange);
+        obs->sendNow = false;
+        obs->waitingForAck = false;
+
+        // If a newer notification was coalesced while the CON was
+        // in flight, promote it now, or when minInterval has passed,
+        // and wake the event loop so it is sent as a fresh
+        // notification.
+        if (nabto_coap_server_observer_idle(requests, obs)) {
+            requests->notifyEvent(requests->userData);
+        }
+        return;
     } else if (msg.type == NABTO_COAP_TYPE_RST) {
+        NABTO_COAP_SERVER_METRIC_INC(requests, resets);
         nabto_coap_server_handle_rst(requests, msg.messageId, connection);
     }
 }
 
 bool nabto_coap_server_validate_critical_options(struct nabto_coap_incoming_message* message)
 {
-    struct nabto_coap_option_iterator iteratorData;
-    struct nabto_coap_option_iterator* iterator = &iteratorData;
-    nabto_coap_option_iterator_init(iterator, message->options, message->options + message->optionsLength);
-    iterator = nabto_coap_get_next_option(iterator);
-
-    while(iterator != NULL) {
-        if (iterator->option % 2 == 1) {
-            switch (iterator->option) {
+    for (size_t i = 0; i < message->optionCount; i++) {
+        uint16_t number = message->optionTable[i].number;
+        if (number % 2 == 1) {
+            switch (number) {
                 // handled options
                 case NABTO_COAP_OPTION_URI_PATH:
                 case NABTO_COAP_OPTION_BLOCK1:
                 case NABTO_COAP_OPTION_BLOCK2:
+                case NABTO_COAP_OPTION_QBLOCK1:
+                case NABTO_COAP_OPTION_QBLOCK2:
                     // accepted but ignored
                 case NABTO_COAP_OPTION_URI_HOST:
                 case NABTO_COAP_OPTION_URI_PORT:
@@ -137,32 +197,142 @@ bool nabto_coap_server_validate_critical_options(struct nabto_coap_incoming_mess
                 default: return false;
             }
         }
-        iterator = nabto_coap_get_next_option(iterator);
     }
     return true;
 }
 
-void nabto_coap_server_make_error_response(struct nabto_coap_server_requests* requests, void* connection, struct nabto_coap_incoming_message* message, nabto_coap_code code, const char* errorDescription)
+struct nabto_coap_server_control_message* nabto_coap_server_make_error_response(struct nabto_coap_server_requests* requests, void* connection, struct nabto_coap_incoming_message* message, nabto_coap_code code, const char* errorDescription)
 {
-    requests->errorConnection = connection;
-    requests->errorCode = code;
-    requests->errorToken = message->token;
-    requests->errorMessageId = message->messageId;
+    struct nabto_coap_server_control_message* error = nabto_coap_server_control_push(requests);
+    if (error == NULL) {
+        // the client retransmits the request if it was a CON.
+        return NULL;
+    }
+    error->connection = connection;
+    error->type = NABTO_COAP_TYPE_NON;
+    error->code = code;
+    error->token = message->token;
+    error->messageId = message->messageId;
     if (errorDescription != NULL) {
-        requests->errorPayload = errorDescription;
-        requests->errorPayloadLength = strlen(errorDescription);
+        error->payload = errorDescription;
+        error->payloadLength = strlen(errorDescription);
     }
-    return;
+    return error;
 
 }
 
+void nabto_coap_server_make_too_large_response(struct nabto_coap_server_requests* requests, struct nabto_coap_server_request* request, struct nabto_coap_incoming_message* message, size_t limit)
+{
+    struct nabto_coap_server_control_message* error = nabto_coap_server_make_error_response(requests, request->connection, message, NABTO_COAP_CODE_REQUEST_ENTITY_TOO_LARGE, NULL);
+    if (error != NULL && limit <= UINT32_MAX) {
+        error->hasSize1 = true;
+        error->size1 = (uint32_t)limit;
+    }
+    // User will never see this request, so we free for him
+    request->isFreed = true;
+    request->state = NABTO_COAP_SERVER_REQUEST_STATE_DONE;
+    nabto_coap_server_free_request(request);
+}
+
+/**
+ * Reject a request for lack of memory, the client is told when to try
+ * again.
+ */
+void nabto_coap_server_make_busy_response(struct nabto_coap_server_requests* requests, void* connection, struct nabto_coap_incoming_message* message)
+{
+    struct nabto_coap_server_control_message* error = nabto_coap_server_make_error_response(requests, connection, message, NABTO_COAP_CODE_SERVICE_UNAVAILABLE, outOfResources);
+    if (error != NULL) {
+        error->hasMaxAge = true;
+        error->maxAge = requests->memoryRetryAfter;
+    }
+}
+
+/**
+ * Make room for at least capacity payload bytes. The buffer always has
+ * an extra zero byte after the payload.
+ */
+bool nabto_coap_server_request_reserve_payload(struct nabto_coap_server* server, struct nabto_coap_server_request* request, size_t capacity)
+{
+    if (request->payload != NULL && capacity <= request->payloadCapacity) {
+        return true;
+    }
+    size_t charge = (capacity > request->payloadCharged) ? capacity - request->payloadCharged : 0;
+    if (!nabto_coap_server_budget_charge(request->requests, request->connection, charge)) {
+        return false;
+    }
+    uint8_t* newPayload = server->allocator.calloc(1, capacity + 1);
+    if (newPayload == NULL) {
+        nabto_coap_server_budget_release(request->requests, request->connection, charge);
+        return false;
+    }
+    request->payloadCharged += charge;
+    if (request->payloadLength > 0) {
+        memcpy(newPayload, request->payload, request->payloadLength);
+    }
+    server->allocator.free(request->payload);
+    request->payload = newPayload;
+    request->payloadCapacity = capacity;
+    return true;
+}
+
+/**
+ * Stop pointing into the packet, when the handler asks for a copy or
+ * has returned. The budget was charged before the handler was called,
+ * only the allocation can fail, and then the request has no payload.
+ */
+void nabto_coap_server_request_copy_payload_view(struct nabto_coap_server_request* request)
+{
+    if (request->payloadView == NULL) {
+        return;
+    }
+    const uint8_t* view = request->payloadView;
+    size_t viewLength = request->payloadViewLength;
+    request->payloadView = NULL;
+    request->payloadViewLength = 0;
+    if (request->isFreed) {
+        return;
+    }
+    if (nabto_coap_server_request_reserve_payload(request->requests->server, request, viewLength)) {
+        memcpy(request->payload, view, viewLength);
+        request->payloadLength = viewLength;
+        request->payload[viewLength] = 0;
+    }
+}
+
 void nabto_coap_server_handle_data_for_request(struct nabto_coap_server_requests* requests, struct nabto_coap_server_request* request, struct nabto_coap_incoming_message* message)
 {
     struct nabto_coap_server* server = requests->server;
     bool block1Done = true;
+    size_t maxBodySize = requests->maxRequestBodySize;
+
+    if (message->hasQBlock1) {
+        if (message->hasContentFormat) {
+            request->hasContentFormat = true;
+            request->contentFormat = message->contentFormat;
+        }
+        if (message->type == NABTO_COAP_TYPE_CON) {
+            // The 2.31 and 4.08 replies are separate NONs.
+            nabto_coap_server_queue_ack(requests, request->connection, message->messageId);
+        }
+        if (nabto_coap_server_handle_qblock1(requests, request, message)) {
+            nabto_coap_server_request_dispatch(requests, request, message);
+        }
+        return;
+    }
 
     if (message->hasBlock1) {
         uint32_t offset = NABTO_COAP_BLOCK_OFFSET(message->block1);
+        if (offset < request->payloadLength && NABTO_COAP_BLOCK_MORE(message->block1) &&
+            message->payloadLength <= request->payloadLength - offset)
+        {
+            // A block received before, sent again in a smaller block
+            // size as its ACK was lost. Acknowledge it again.
+            request->messageId = message->messageId;
+            request->block1Ack = (NABTO_COAP_BLOCK_NUM(message->block1) << 4) + (1 << 3) + nabto_coap_path_limit_szx(requests->paths, request->connection, NABTO_COAP_BLOCK_SIZE(message->block1));
+            request->hasBlock1Ack = true;
+            nabto_coap_server_exchange_ready(requests, &request->response.exchange);
+            return;
+        }
         if (request->payloadLength != offset) {
             nabto_coap_server_make_error_response(requests, request->connection, message, NABTO_COAP_CODE_REQUEST_ENTITY_INCOMPLETE, NULL);
             request->isFreed = true;
@@ -173,7 +343,7 @@ void nabto_coap_server_handle_data_for_request(struct nabto_coap_server_requests
 
         uint32_t more = NABTO_COAP_BLOCK_MORE(message->block1);
         if (more) {
-            if (message->payloadLength != NABTO_COAP_BLOCK_SIZE_ABSOLUTE(message->block1)) {
+            if (!nabto_coap_block_payload_valid(message->block1, message->payloadLength)) {
                 nabto_coap_server_make_error_response(requests, request->connection, message, NABTO_COAP_CODE_BAD_REQUEST, wrongPayloadLength);
                 // User will never see this request, so we free for him
                 request->isFreed = true;
@@ -182,49 +352,97 @@ void nabto_coap_server_handle_data_for_request(struct nabto_coap_server_requests
                 return;
             }
         }
-        void* newPayload = server->allocator.calloc(1, request->payloadLength + message->payloadLength + 1);
-        if (!newPayload) {
-            nabto_coap_server_make_error_response(requests, request->connection, message, NABTO_COAP_CODE_SERVICE_UNAVAILABLE, outOfResources);
-            // User will never see this request, so we free for him
-            request->isFreed = true;
-            request->state = NABTO_COAP_SERVER_REQUEST_STATE_DONE;
-            nabto_coap_server_free_request(request);
+
+        size_t needed = request->payloadLength + message->payloadLength;
+        if (needed > maxBodySize || (message->hasSize1 && message->size1 > maxBodySize)) {
+            // Reject as early as possible, the Size1 option of the
+            // first block tells the size of the whole body.
+            nabto_coap_server_make_too_large_response(requests, request, message, maxBodySize);
             return;
         }
 
-        if (request->payloadLength > 0) {
-            memcpy(newPayload, request->payload, request->payloadLength);
-            server->allocator.free(request->payload);
+        if (request->payload == NULL || needed > request->payloadCapacity) {
+            // Reserve towards the announced size or grow geometrically
+            // such that the reassembly is linear in the body size.
+            size_t capacity = request->payloadCapacity * 2;
+            if (message->hasSize1 && message->size1 > capacity) {
+                size_t hint = needed + NABTO_COAP_SERVER_BLOCK1_RESERVE_BLOCKS * (size_t)NABTO_COAP_BLOCK_SIZE_ABSOLUTE(message->block1);
+                if (message->size1 < hint) {
+                    hint = message->size1;
+                }
+                if (hint > capacity) {
+                    capacity = hint;
+                }
+            }
+            if (capacity < needed) {
+                capacity = needed;
+            }
+            if (capacity > maxBodySize) {
+                capacity = maxBodySize;
+            }
+            if (!nabto_coap_server_request_reserve_payload(server, request, capacity)) {
+                nabto_coap_server_make_busy_response(requests, request->connection, message);
+                // User will never see this request, so we free for him
+                request->isFreed = true;
+                request->state = NABTO_COAP_SERVER_REQUEST_STATE_DONE;
+                nabto_coap_server_free_request(request);
+                return;
+            }
+        }
+
+        if (message->payloadLength > 0) {
+            memcpy(request->payload + request->payloadLength, message->payload, message->payloadLength);
         }
-        memcpy((uint8_t*)newPayload+request->payloadLength, message->payload, message->payloadLength);
-        request->payload = newPayload;
-        request->payloadLength = request->payloadLength + message->payloadLength;
+        request->payloadLength = needed;
 
         request->messageId = message->messageId;
         // Send continue as the ack code so setting the more bit to 1
         // even in the last chunk.  The more bit means that the
         // response code will come in another response from the
         // server.
-        request->block1Ack = (NABTO_COAP_BLOCK_NUM(message->block1) << 4) + (NABTO_COAP_BLOCK_SIZE(message->block1));
+        // A smaller block size in the ack asks the client to use it for
+        // the blocks which follow.
+        request->block1Ack = (NABTO_COAP_BLOCK_NUM(message->block1) << 4) + nabto_coap_path_limit_szx(requests->paths, request->connection, NABTO_COAP_BLOCK_SIZE(message->block1));
         if (more) {
             request->block1Ack += (1 << 3);
             request->hasBlock1Ack = true;
+            nabto_coap_server_exchange_ready(requests, &request->response.exchange);
             block1Done = false;
         }
     } else {
         if (message->payload && message->payloadLength) {
-            if (request->payload != NULL) {
-                server->allocator.free(request->payload);
-            }
-            request->payload = server->allocator.calloc(1, message->payloadLength+1);
-            if (request->payload == NULL) {
-                request->isFreed = true;
-                request->state = NABTO_COAP_SERVER_REQUEST_STATE_DONE;
-                nabto_coap_server_free_request(request);
+            if (message->payloadLength > maxBodySize) {
+                nabto_coap_server_make_too_large_response(requests, request, message, maxBodySize);
                 return;
             }
-            memcpy(request->payload, message->payload, message->payloadLength);
-            request->payloadLength = message->payloadLength;
+            if (requests->borrowRequestPayloads) {
+                // The packet outlives the handler call, the payload is
+                // copied afterwards if the request is kept. The copy is
+                // charged now, such that the budget cannot refuse it
+                // once the handler has seen the request.
+                if (!nabto_coap_server_budget_charge(requests, request->connection, message->payloadLength)) {
+                    nabto_coap_server_make_busy_response(requests, request->connection, message);
+                    request->isFreed = true;
+                    request->state = NABTO_COAP_SERVER_REQUEST_STATE_DONE;
+                    nabto_coap_server_free_request(request);
+                    return;
+                }
+                request->payloadCharged = message->payloadLength;
+                request->payloadView = message->payload;
+                request->payloadViewLength = message->payloadLength;
+            } else {
+                request->payloadLength = 0;
+                if (!nabto_coap_server_request_reserve_payload(server, request, message->payloadLength)) {
+                    nabto_coap_server_make_busy_response(requests, request->connection, message);
+                    request->isFreed = true;
+                    request->state = NABTO_COAP_SERVER_REQUEST_STATE_DONE;
+                    nabto_coap_server_free_request(request);
+                    return;
+                }
+                memcpy(request->payload, message->payload, message->payloadLength);
+                request->payloadLength = message->payloadLength;
+                request->payload[request->payloadLength] = 0;
+            }
         }
     }
 
@@ -234,26 +452,254 @@ void nabto_coap_server_handle_data_for_request(struct nabto_coap_server_requests
     }
 
     if (message->type == NABTO_COAP_TYPE_CON && !request->hasBlock1Ack) {
-        requests->ackConnection = request->connection;
-        requests->ackMessageId = message->messageId;
+        nabto_coap_server_queue_ack(requests, request->connection, message->messageId);
     }
 
     if (block1Done) {
-        struct nabto_coap_server_resource* resource = request->resource;
-        request->state = NABTO_COAP_SERVER_REQUEST_STATE_USER;
-        resource->handler(request, resource->handlerUserData);
+        nabto_coap_server_request_dispatch(requests, request, message);
+    }
+}
+
+/**
+ * The whole body has been received, answer from the cache or call the
+ * handler.
+ */
+void nabto_coap_server_request_dispatch(struct nabto_coap_server_requests* requests, struct nabto_coap_server_request* request, struct nabto_coap_incoming_message* message)
+{
+    if (nabto_coap_server_cache_answer(request, message)) {
+        nabto_coap_server_request_copy_payload_view(request);
+        return;
+    }
+    struct nabto_coap_server_resource* resource = request->resource;
+    request->state = NABTO_COAP_SERVER_REQUEST_STATE_USER;
+    requests->dispatchedRequest = request;
+#ifdef NABTO_COAP_SERVER_METRICS
+    request->dispatchedAt = nabto_coap_server_stamp_now(requests);
+#endif
+    resource->handler(request, resource->handlerUserData);
+    if (requests->dispatchedRequest == request) {
+        // The request was not freed by the handler.
+        requests->dispatchedRequest = NULL;
+        nabto_coap_server_request_copy_payload_view(request);
+    }
+}
+
+// The user never sees a request which is rejected while it is received.
+static void nabto_coap_server_request_reject(struct nabto_coap_server_request* request)
+{
+    request->isFreed = true;
+    request->state = NABTO_COAP_SERVER_REQUEST_STATE_DONE;
+    nabto_coap_server_free_request(request);
+}
+
+/**
+ * Store a block of a body sent with Q-Block1, RFC 9177. The blocks can
+ * arrive in any order, they are copied to their offset in the body. At
+ * the end of each set of NABTO_COAP_QBLOCK_MAX_PAYLOADS blocks, and at
+ * the last block, the client is told to go on with a 2.31 or which
+ * blocks are missing with a 4.08. A partial body is dropped after
+ * NABTO_COAP_QBLOCK_NON_PARTIAL_TIMEOUT without new blocks. Without a
+ * request body limit the body is limited to
+ * NABTO_COAP_QBLOCK_DEFAULT_MAX_BODY_SIZE.
+ *
+ * @return true if the body is complete, false if more blocks are needed
+ * or the request has been rejected.
+ */
+bool nabto_coap_server_handle_qblock1(struct nabto_coap_server_requests* requests, struct nabto_coap_server_request* request, struct nabto_coap_incoming_message* message)
+{
+    struct nabto_coap_server* server = requests->server;
+    size_t maxBodySize = requests->maxRequestBodySize;
+    if (maxBodySize == SIZE_MAX) {
+        maxBodySize = NABTO_COAP_QBLOCK_DEFAULT_MAX_BODY_SIZE;
+    }
+    uint32_t block = message->qBlock1;
+    uint32_t num = NABTO_COAP_BLOCK_NUM(block);
+    bool more = NABTO_COAP_BLOCK_MORE(block);
+    size_t blockSize = NABTO_COAP_BLOCK_SIZE_ABSOLUTE(block);
+
+    // BERT is only for reliable transports.
+    if (NABTO_COAP_BLOCK_SIZE(block) == NABTO_COAP_BLOCK_SZX_BERT ||
+        message->payloadLength > blockSize ||
+        (more && message->payloadLength != blockSize))
+    {
+        nabto_coap_server_make_error_response(requests, request->connection, message, NABTO_COAP_CODE_BAD_REQUEST, wrongPayloadLength);
+        nabto_coap_server_request_reject(request);
+        return false;
+    }
+
+    uint64_t offset = (uint64_t)num * blockSize;
+    uint64_t needed = offset + message->payloadLength;
+    if (needed > maxBodySize || (message->hasSize1 && message->size1 > maxBodySize)) {
+        nabto_coap_server_make_too_large_response(requests, request, message, maxBodySize);
+        return false;
+    }
+
+    if (request->qBlock1Map == NULL) {
+        request->qBlock1Map = server->allocator.calloc(1, sizeof(struct nabto_coap_qblock_map));
+        if (request->qBlock1Map == NULL) {
+            nabto_coap_server_make_busy_response(requests, request->connection, message);
+            nabto_coap_server_request_reject(request);
+            return false;
+        }
+        nabto_coap_qblock_map_init(request->qBlock1Map, &server->allocator);
+        request->qBlock1 = true;
+    }
+    struct nabto_coap_qblock_map* map = request->qBlock1Map;
+
+    uint32_t ahead = map->highest + NABTO_COAP_QBLOCK_MAX_AHEAD;
+    if (num >= ahead) {
+        // Too far beyond the blocks received to reserve room for. It is
+        // dropped and the client is asked for the blocks before it.
+        request->qBlock1MissingLimit = ahead;
+        request->block1Ack = (num << 4) + (1 << 3) + NABTO_COAP_BLOCK_SIZE(block);
+        request->hasBlock1Ack = true;
+        request->messageId = message->messageId;
+        nabto_coap_server_timer_arm(requests, &request->response.exchange, nabto_coap_server_stamp_now(requests) + NABTO_COAP_QBLOCK_NON_PARTIAL_TIMEOUT);
+        nabto_coap_server_exchange_ready(requests, &request->response.exchange);
+        return false;
+    }
+
+    bool isNew;
+    nabto_coap_error ec = nabto_coap_qblock_map_set(map, num, !more, &isNew);
+    if (ec == NABTO_COAP_ERROR_INVALID_PARAMETER) {
+        // A block after the last block.
+        nabto_coap_server_make_error_response(requests, request->connection, message, NABTO_COAP_CODE_BAD_REQUEST, wrongPayloadLength);
+        nabto_coap_server_request_reject(request);
+        return false;
+    }
+    if (ec == NABTO_COAP_ERROR_OK && isNew) {
+        if (request->payload == NULL || needed > request->payloadCapacity) {
+            size_t capacity = request->payloadCapacity * 2;
+            if (message->hasSize1) {
+                // Size1 is a hint, it does not reserve far beyond the
+                // blocks received.
+                size_t hint = (size_t)needed + NABTO_COAP_SERVER_BLOCK1_RESERVE_BLOCKS * blockSize;
+                if (message->size1 < hint) {
+                    hint = message->size1;
+                }
+                if (hint > capacity) {
+                    capacity = hint;
+                }
+            }
+            if (capacity < needed) {
+                capacity = (size_t)needed;
+            }
+            if (capacity > maxBodySize) {
+                capacity = maxBodySize;
+            }
+            if (!nabto_coap_server_request_reserve_payload(server, request, capacity)) {
+                ec = NABTO_COAP_ERROR_OUT_OF_MEMORY;
+            }
+        }
+    }
+    if (ec != NABTO_COAP_ERROR_OK) {
+        nabto_coap_server_make_busy_response(requests, request->connection, message);
+        nabto_coap_server_request_reject(request);
+        return false;
+    }
+    if (isNew) {
+        // The holes of the body are zero until their blocks arrive.
+        if (message->payloadLength > 0) {
+            memcpy(request->payload + offset, message->payload, message->payloadLength);
+        }
+        if (needed > request->payloadLength) {
+            request->payloadLength = (size_t)needed;
+        }
+    }
+    request->messageId = message->messageId;
+
+    if (nabto_coap_qblock_map_complete(map)) {
+        // The response echoes the last block.
+        request->block1Ack = ((map->total - 1) << 4) + NABTO_COAP_BLOCK_SIZE(block);
+        request->hasBlock1Ack = false;
+        nabto_coap_qblock_map_deinit(map);
+        server->allocator.free(map);
+        request->qBlock1Map = NULL;
+        nabto_coap_server_timer_cancel(requests, &request->response.exchange);
+        return true;
+    }
+
+    nabto_coap_server_timer_arm(requests, &request->response.exchange, nabto_coap_server_stamp_now(requests) + NABTO_COAP_QBLOCK_NON_PARTIAL_TIMEOUT);
+    if (!more || (num + 1) % NABTO_COAP_QBLOCK_MAX_PAYLOADS == 0) {
+        uint32_t limit = (map->total > 0) ? map->total : map->highest;
+        uint32_t missing;
+        request->qBlock1MissingLimit = (nabto_coap_qblock_map_missing(map, limit, &missing, 1) > 0) ? limit : 0;
+        request->block1Ack = (num << 4) + (1 << 3) + NABTO_COAP_BLOCK_SIZE(block);
+        request->hasBlock1Ack = true;
+        nabto_coap_server_exchange_ready(requests, &request->response.exchange);
+    }
+    return false;
+}
+
+/**
+ * A request for the blocks of a Q-Block2 response. A Q-Block2 option
+ * with the more flag asks the burst to go on from that block, options
+ * without ask for single missing blocks. A Q-Block1 block means the
+ * client has not got the response to its last block.
+ */
+void nabto_coap_server_handle_qblock2(struct nabto_coap_server_requests* requests, struct nabto_coap_server_request* request, struct nabto_coap_incoming_message* message)
+{
+    struct nabto_coap_server_response* response = &request->response;
+    size_t blockSize = NABTO_COAP_BLOCK_SIZE_ABSOLUTE(response->block2Size);
+    bool resend = false;
+    size_t i = nabto_coap_find_option(message, NABTO_COAP_OPTION_QBLOCK2, 0);
+    for (; i < message->optionCount && message->optionTable[i].number == NABTO_COAP_OPTION_QBLOCK2; i++) {
+        const uint8_t* data = message->options + message->optionTable[i].offset;
+        uint32_t block;
+        if (!nabto_coap_parse_variable_int(data, data + message->optionTable[i].length, 3, &block)) {
+            continue;
+        }
+        uint32_t num = NABTO_COAP_BLOCK_NUM(block);
+        if (num > 0 && response->producer == NULL && (uint64_t)num * blockSize >= response->payloadLength) {
+            // Beyond the end of the body.
+            continue;
+        }
+        if (NABTO_COAP_BLOCK_MORE(block)) {
+            response->block2Current = num;
+            response->qBlock2Paused = false;
+            response->qBlock2BurstDone = false;
+            resend = true;
+            continue;
+        }
+        bool queued = false;
+        for (uint8_t j = 0; j < response->qBlock2RepairCount; j++) {
+            queued = queued || (response->qBlock2Repair[j] == num);
+        }
+        if (!queued && response->qBlock2RepairCount < NABTO_COAP_QBLOCK_MAX_PAYLOADS) {
+            response->qBlock2Repair[response->qBlock2RepairCount++] = num;
+        }
+        resend = true;
+    }
+    if (!message->hasQBlock2 && message->hasQBlock1 && response->qBlock2RepairCount == 0) {
+        response->qBlock2Repair[response->qBlock2RepairCount++] = 0;
+        resend = true;
+    }
+    if (resend) {
+        nabto_coap_server_timer_cancel(requests, &response->exchange);
+        response->sendNow = true;
+        nabto_coap_server_exchange_ready(requests, &response->exchange);
     }
 }
 
 void nabto_coap_server_handle_data_for_response(struct nabto_coap_server_requests* requests, struct nabto_coap_server_request* request, struct nabto_coap_incoming_message* message)
 {
+    if (request->response.qBlock2 && (message->hasQBlock2 || message->hasQBlock1)) {
+        nabto_coap_server_handle_qblock2(requests, request, message);
+        return;
+    }
     if (message->hasBlock2) {
         struct nabto_coap_server_response* response = &request->response;
-        response->block2Current = NABTO_COAP_BLOCK_NUM(message->block2);
-        response->block2Size = NABTO_COAP_BLOCK_SIZE(message->block2);
+        uint32_t szx = nabto_coap_path_limit_szx(requests->paths, request->connection, NABTO_COAP_BLOCK_SIZE(message->block2));
+        response->block2Current = nabto_coap_path_rescale_block(NABTO_COAP_BLOCK_NUM(message->block2), NABTO_COAP_BLOCK_SIZE(message->block2), szx);
+        response->block2Size = szx;
         response->messageId = nabto_coap_server_next_message_id(requests);
+        // If the index is full the block is still sent, but its ACK
+        // cannot be matched, see nabto_coap_server_exchange_index.
+        (void)nabto_coap_server_exchange_index(requests, &response->exchange, request->connection, response->messageId);
         response->sendNow = true;
         response->retransmissions = 0;
+        response->lingering = false;
+        nabto_coap_server_exchange_ready(requests, &response->exchange);
     }
 }
 
@@ -261,35 +707,59 @@ void nabto_coap_server_handle_data_for_response(struct nabto_coap_server_request
 struct nabto_coap_server_request* nabto_coap_server_handle_new_request(struct nabto_coap_server_requests* requests, struct nabto_coap_incoming_message* message, void* connection)
 {
     struct nabto_coap_server* server = requests->server;
-    {
-        struct nabto_coap_server_resource* resource = nabto_coap_server_find_resource(server, message, NULL);
 
-        if (!resource) {
-            nabto_coap_server_make_error_response(requests, connection, message, NABTO_COAP_CODE_NOT_FOUND, NULL);
-            return NULL;
-        }
+    // Resolve the route and capture the parameters in one pass before
+    // the request exists, such that a missing resource is reported as
+    // not found regardless of the request limits.
+    struct nabto_coap_server_request_parameter parameters;
+    parameters.next = &parameters;
+    parameters.prev = &parameters;
+    struct nabto_coap_server_resource* resource = NULL;
+    if (nabto_coap_server_find_resource(server, message, &parameters, &resource) != NABTO_COAP_ERROR_OK) {
+        nabto_coap_server_request_parameters_free(server, &parameters);
+        nabto_coap_server_make_error_response(requests, connection, message, NABTO_COAP_CODE_SERVICE_UNAVAILABLE, outOfResources);
+        return NULL;
+    }
+    if (resource == NULL) {
+        nabto_coap_server_request_parameters_free(server, &parameters);
+        nabto_coap_server_make_error_response(requests, connection, message, NABTO_COAP_CODE_NOT_FOUND, NULL);
+        return NULL;
+    }
+
+    // Reject a request whose body does not fit in the memory budget
+    // before anything is allocated for it. Bodies over the size limit
+    // are rejected with 4.13 later.
+    size_t bodySize = message->payloadLength;
+    if ((message->hasBlock1 || message->hasQBlock1) && message->hasSize1 && message->size1 > bodySize) {
+        bodySize = message->size1;
+    }
+    if (bodySize <= requests->maxRequestBodySize &&
+        !nabto_coap_server_budget_available(requests, connection, bodySize))
+    {
+        nabto_coap_server_request_parameters_free(server, &parameters);
+        nabto_coap_server_make_busy_response(requests, connection, message);
+        return NULL;
     }
 
     if(requests->activeRequests >= requests->maxRequests) {
+        nabto_coap_server_request_parameters_free(server, &parameters);
         nabto_coap_server_make_error_response(requests, connection, message, NABTO_COAP_CODE_SERVICE_UNAVAILABLE, outOfResources);
         return NULL;
     }
     struct nabto_coap_server_request* request = nabto_coap_server_request_new(requests);
     if (!request) {
+        nabto_coap_server_request_parameters_free(server, &parameters);
         nabto_coap_server_make_error_response(requests, connection, message, NABTO_COAP_CODE_SERVICE_UNAVAILABLE, outOfResources);
         return NULL;
     }
     requests->activeRequests++;
 
-    struct nabto_coap_server_resource* resource = nabto_coap_server_find_resource(server, message, &request->parameterSentinel);
-    if (resource == NULL) {
-        // we already know the resource exist, so NULL can only mean the parameter value could not be allocated.
-        nabto_coap_server_make_error_response(requests, connection, message, NABTO_COAP_CODE_SERVICE_UNAVAILABLE, outOfResources);
-        // User will never see this request, so we free for him
-        request->isFreed = true;
-        request->state = NABTO_COAP_SERVER_REQUEST_STATE_DONE;
-        nabto_coap_server_free_request(request);
-        return NULL;
+    // move the captured parameters to the request.
+    if (parameters.next != &parameters) {
+        request->parameterSentinel.next = parameters.next;
+        request->parameterSentinel.prev = parameters.prev;
+        parameters.next->prev = &request->parameterSentinel;
+        parameters.prev->next = &request->parameterSentinel;
     }
 
     request->connection = connection;
@@ -319,22 +789,29 @@ struct nabto_coap_server_request* nabto_coap_server_handle_new_request(struct na
         }
     }
 
-    nabto_coap_server_insert_request_into_list(requests->requestsSentinel, request);
+    if (nabto_coap_server_add_request(requests, request) != NABTO_COAP_ERROR_OK) {
+        nabto_coap_server_make_error_response(requests, connection, message, NABTO_COAP_CODE_SERVICE_UNAVAILABLE, outOfResources);
+        request->isFreed = true;
+        request->state = NABTO_COAP_SERVER_REQUEST_STATE_DONE;
+        nabto_coap_server_free_request(request);
+        return NULL;
+    }
 
     return request;
 }
 
 void nabto_coap_server_handle_ack(struct nabto_coap_server_requests* requests, struct nabto_coap_server_request* request, struct nabto_coap_incoming_message* message)
 {
-    (void)requests;
     struct nabto_coap_server_response* response = &request->response;
 
     if (response->messageId != message->messageId) {
         return;
     }
 
-    size_t blockSize = (16 << response->block2Size);
-    if (response->payloadLength <= blockSize) {
+    nabto_coap_server_exchange_acked(requests, &response->exchange, response->retransmissions);
+
+    if (!response->block2More) {
+        // The last block, or the only one, has been acked.
         request->state = NABTO_COAP_SERVER_REQUEST_STATE_DONE;
         nabto_coap_server_free_request(request);
         return;
@@ -343,140 +820,102 @@ void nabto_coap_server_handle_ack(struct nabto_coap_server_requests* requests, s
     // handle block2 ack
     response->block2Current += 1;
 
-    if (response->block2Current * blockSize > response->payloadLength) {
-        request->state = NABTO_COAP_SERVER_REQUEST_STATE_DONE;
-        nabto_coap_server_free_request(request);
-        return;
-    }
-
-    // else wait for the client to ask for the next block.
+    // wait for the client to ask for the next block. The block is
+    // acked, so it is not retransmitted and does not count as a
+    // timeout of the path, the response is just freed if the client
+    // never asks.
+    nabto_coap_server_timer_cancel(requests, &response->exchange);
+    response->lingering = true;
+    nabto_coap_server_timer_arm(requests, &response->exchange, nabto_coap_server_stamp_now(requests) + NABTO_COAP_SERVER_BLOCK2_WAIT);
 }
 
 
 void nabto_coap_server_handle_rst(struct nabto_coap_server_requests* requests, uint16_t messageId, void* connection)
 {
-    struct nabto_coap_server_request* request = requests->requestsSentinel->next;
-    while(request != requests->requestsSentinel) {
-        if (request->connection == connection) {
-            if (request->response.messageId == messageId) {
-                request->state = NABTO_COAP_SERVER_REQUEST_STATE_DONE;
-                nabto_coap_server_free_request(request);
-                return;
-            }
-        }
-        request = request->next;
-    }
-
-    // Check if RST matches an observer notification
-    struct nabto_coap_server_observer* obs = requests->observersSentinel->next;
-    while (obs != requests->observersSentinel) {
-        struct nabto_coap_server_observer* current = obs;
-        obs = obs->next;
-        if (current->connection == connection && current->messageId == messageId) {
-            nabto_coap_server_observer_free(current);
-            return;
-        }
-    }
-}
-
-struct nabto_coap_server_request* nabto_coap_server_find_request(struct nabto_coap_server_requests* requests, nabto_coap_token* token, void* connection)
-{
-    struct nabto_coap_server_request* request = requests->requestsSentinel->next;
-    while(request != requests->requestsSentinel) {
-        if (nabto_coap_token_equal(&request->token, token) &&
-            connection == request->connection)
-        {
-            return request;
-        }
-        request = request->next;
+    struct nabto_coap_server_exchange* exchange = nabto_coap_server_find_exchange(requests, messageId, connection);
+    if (exchange == NULL) {
+        return;
     }
-    return NULL;
-}
-
-struct nabto_coap_server_response* nabto_coap_server_find_response(struct nabto_coap_server_requests* requests, uint16_t messageId, void* connection)
-{
-    struct nabto_coap_server_request* request = requests->requestsSentinel->next;
-    while(request != requests->requestsSentinel) {
-        if(request->connection == connection &&
-           request->response.messageId == messageId)
-        {
-            return &request->response;
-        }
-        request = request->next;
+    if (exchange->type == NABTO_COAP_SERVER_EXCHANGE_TYPE_RESPONSE) {
+        struct nabto_coap_server_request* request = exchange->owner;
+        request->state = NABTO_COAP_SERVER_REQUEST_STATE_DONE;
+        nabto_coap_server_free_request(request);
+    } else {
+        // The client rejected a notification, stop observing.
+        nabto_coap_server_observer_free(exchange->owner);
     }
-    return NULL;
 }
 
-struct nabto_coap_server_resource* nabto_coap_server_find_resource(struct nabto_coap_server* server, struct nabto_coap_incoming_message* msg, struct nabto_coap_server_request_parameter* parameters)
+nabto_coap_error nabto_coap_server_find_resource(struct nabto_coap_server* server, struct nabto_coap_incoming_message* msg, struct nabto_coap_server_request_parameter* parameters, struct nabto_coap_server_resource** resource)
 {
-    struct nabto_coap_option_iterator itData;
-    struct nabto_coap_option_iterator* iterator = &itData;
     struct nabto_coap_router_node* currentNode = server->root;
-    nabto_coap_option_iterator_init(iterator, msg->options, msg->options+msg->optionsLength);
-    iterator = nabto_coap_get_option(NABTO_COAP_OPTION_URI_PATH, iterator);
-    while (iterator != NULL) {
+    *resource = NULL;
+    size_t i = nabto_coap_find_option(msg, NABTO_COAP_OPTION_URI_PATH, 0);
+    while (i < msg->optionCount && msg->optionTable[i].number == NABTO_COAP_OPTION_URI_PATH) {
 
-        size_t optionLength = iterator->optionDataEnd - iterator->optionDataBegin;
+        const uint8_t* optionData = msg->options + msg->optionTable[i].offset;
+        size_t optionLength = msg->optionTable[i].length;
 
-        struct nabto_coap_router_path_segment* segment = nabto_coap_server_find_path_segment(currentNode, (const char*)iterator->optionDataBegin, optionLength);
+        struct nabto_coap_router_path_segment* segment = nabto_coap_server_find_path_segment(currentNode, (const char*)optionData, optionLength);
         if (segment) {
             currentNode = segment->node;
         } else {
             // test if currentNode has a parameter
             if (currentNode->parameter.name != NULL) {
-                if (parameters != NULL) {
-                    struct nabto_coap_server_request_parameter* parameter = nabto_coap_server_request_parameter_new(server);
-                    if (parameter == NULL) {
-                        // calloc failed, return NULL to signal this. This only happens if we already found the resource in a previous call with parameters == NULL, so it is possible to return meaningfull error.
-                        return NULL;
-                    }
-                    parameter->parameter = &currentNode->parameter;
-                    parameter->value = server->allocator.calloc(1, optionLength + 1);
-                    if (parameter->value == NULL) {
-                        // calloc failed, return NULL to signal this. This only happens if we already found the resource in a previous call with parameters == NULL, so it is possible to return meaningfull error.
-                        server->allocator.free(parameter);
-                        return NULL;
-                    }
-                    memcpy(parameter->value, iterator->optionDataBegin, optionLength);
-
-                    struct nabto_coap_server_request_parameter* before = parameters->prev;
-                    struct nabto_coap_server_request_parameter* after = before->next;
-                    before->next = parameter;
-                    parameter->next = after;
-                    after->prev = parameter;
-                    parameter->prev = before;
+                struct nabto_coap_server_request_parameter* parameter = nabto_coap_server_request_parameter_new(server);
+                if (parameter == NULL) {
+                    return NABTO_COAP_ERROR_OUT_OF_MEMORY;
                 }
+                parameter->parameter = &currentNode->parameter;
+                if (!nabto_coap_server_request_parameter_set_value(server, parameter, optionData, optionLength)) {
+                    nabto_coap_server_request_parameter_free(server, parameter);
+                    return NABTO_COAP_ERROR_OUT_OF_MEMORY;
+                }
+
+                struct nabto_coap_server_request_parameter* before = parameters->prev;
+                struct nabto_coap_server_request_parameter* after = before->next;
+                before->next = parameter;
+                parameter->next = after;
+                after->prev = parameter;
+                parameter->prev = before;
+
                 currentNode = currentNode->parameter.node;
             } else {
                 // no name match nor a parameter at this level, conclude the resource does not exists.
-                return NULL;
+                return NABTO_COAP_ERROR_OK;
             }
         }
 
-        iterator = nabto_coap_get_option(NABTO_COAP_OPTION_URI_PATH, iterator);
+        i++;
     }
 
     if (msg->code == NABTO_COAP_CODE_GET && currentNode->getHandler.handler) {
-        return &currentNode->getHandler;
+        *resource = &currentNode->getHandler;
     } else if (msg->code == NABTO_COAP_CODE_POST && currentNode->postHandler.handler) {
-        return &currentNode->postHandler;
+        *resource = &currentNode->postHandler;
     } else if (msg->code == NABTO_COAP_CODE_PUT && currentNode->putHandler.handler) {
-        return &currentNode->putHandler;
+        *resource = &currentNode->putHandler;
     } else if (msg->code == NABTO_COAP_CODE_DELETE && currentNode->deleteHandler.handler) {
-        return &currentNode->deleteHandler;
-    } else {
-        return NULL;
+        *resource = &currentNode->deleteHandler;
     }
+    return NABTO_COAP_ERROR_OK;
 }
 
 struct nabto_coap_server_request* nabto_coap_server_request_new(struct nabto_coap_server_requests* requests)
 {
     struct nabto_coap_server* server = requests->server;
-    struct nabto_coap_server_request* request = server->allocator.calloc(1, sizeof(struct nabto_coap_server_request));
+    struct nabto_coap_server_request* request = nabto_coap_server_pool_alloc(server, NABTO_COAP_SERVER_POOL_REQUESTS);
     if (request == NULL) {
         return NULL;
     }
+    if (nabto_coap_server_timers_reserve(requests) != NABTO_COAP_ERROR_OK) {
+        nabto_coap_server_pool_free(server, NABTO_COAP_SERVER_POOL_REQUESTS, request);
+        return NULL;
+    }
 
+    // not in the requests list yet, removing it is a noop.
+    request->next = request;
+    request->prev = request;
     request->parameterSentinel.next = &request->parameterSentinel;
     request->parameterSentinel.prev = &request->parameterSentinel;
     request->isFreed = false;
@@ -484,6 +923,8 @@ struct nabto_coap_server_request* nabto_coap_server_request_new(struct nabto_coa
 
     request->response.request = request;
     request->response.messageId = nabto_coap_server_next_message_id(requests);
+    request->response.exchange.type = NABTO_COAP_SERVER_EXCHANGE_TYPE_RESPONSE;
+    request->response.exchange.owner = request;
     request->response.block2Size = 5; // 512 byte blocks
     return request;
 }
@@ -491,5 +932,33 @@ struct nabto_coap_server_request* nabto_coap_server_request_new(struct nabto_coa
 
 struct nabto_coap_server_request_parameter* nabto_coap_server_request_parameter_new(struct nabto_coap_server* server)
 {
-    return (struct nabto_coap_server_request_parameter*)server->allocator.calloc(1, sizeof(struct nabto_coap_server_request_parameter));
+    return (struct nabto_coap_server_request_parameter*)nabto_coap_server_pool_alloc(server, NABTO_COAP_SERVER_POOL_PARAMETERS);
+}
+
+bool nabto_coap_server_request_parameter_set_value(struct nabto_coap_server* server, struct nabto_coap_server_request_parameter* parameter, const uint8_t* value, size_t valueLength)
+{
+    if (valueLength < NABTO_COAP_SERVER_POOL_VALUE_SIZE) {
+        parameter->value = nabto_coap_server_pool_alloc(server, NABTO_COAP_SERVER_POOL_PARAMETER_VALUES);
+        parameter->valueInPool = true;
+    } else {
+        parameter->value = server->allocator.calloc(1, valueLength + 1);
+        parameter->valueInPool = false;
+    }
+    if (parameter->value == NULL) {
+        return false;
+    }
+    memcpy(parameter->value, value, valueLength);
+    parameter->value[valueLength] = 0;
+    parameter->valueLength = valueLength;
+    return true;
+}
+
+void nabto_coap_server_request_parameter_free(struct nabto_coap_server* server, struct nabto_coap_server_request_parameter* parameter)
+{
+    if (parameter->valueInPool) {
+        nabto_coap_server_pool_free(server, NABTO_COAP_SERVER_POOL_PARAMETER_VALUES, parameter->value);
+    } else {
+        server->allocator.free(parameter->value);
+    }
+    nabto_coap_server_pool_free(server, NABTO_COAP_SERVER_POOL_PARAMETERS, parameter);
 }
@@ -0,0 +1,37 @@
+#include "nabto_coap_server_impl.h"
+
+/**
+ * Metrics of a requests context.
+ *
+ * Counters are updated where packets are received, sent and timed out,
+ * gauges which the requests context already keeps are read when a
+ * snapshot is taken. Without NABTO_COAP_SERVER_METRICS nothing is
+ * counted and this file is empty.
+ */
+
+#ifdef NABTO_COAP_SERVER_METRICS
+
+void nabto_coap_server_metrics_latency(struct nabto_coap_server_requests* requests, uint32_t latency)
+{
+    size_t bucket = 0;
+    while (bucket < NABTO_COAP_SERVER_LATENCY_BUCKETS - 1 && latency >= ((uint32_t)1 << bucket)) {
+        bucket++;
+    }
+    requests->metrics.handlerLatency[bucket]++;
+}
+
+void nabto_coap_server_get_metrics(struct nabto_coap_server_requests* requests, struct nabto_coap_server_metrics* metrics)
+{
+    *metrics = requests->metrics;
+    metrics->controlDropped = requests->controlDropped;
+    metrics->controlQueued = requests->controlCount;
+    metrics->timers = requests->timersSize;
+    metrics->activeRequests = requests->activeRequests;
+}
+
+#else
+
+// ISO C does not allow an empty translation unit.
+typedef int nabto_coap_server_metrics_disabled;
+
+#endif
@@ -0,0 +1,134 @@
+#include "nabto_coap_server_impl.h"
+
+/**
+ * Fixed size object pools.
+ *
+ * Requests, request parameters, short parameter values, observers and
+ * send lanes are allocated from a pool per type instead of from the
+ * allocator of the server. A pool gets memory from the allocator a slab
+ * of objects at a time, freed objects are put on a free list and
+ * reused. Slabs are kept until the server is destroyed, such that the
+ * memory used by the server stays at its high water mark instead of
+ * being fragmented.
+ */
+
+#define NABTO_COAP_SERVER_POOL_SLAB_OBJECTS 16
+
+// Objects in a slab are aligned for any of the types stored in them.
+union nabto_coap_server_pool_align {
+    void* pointer;
+    uint64_t integer;
+    long double floating;
+};
+
+#define NABTO_COAP_SERVER_POOL_ALIGN sizeof(union nabto_coap_server_pool_align)
+#define NABTO_COAP_SERVER_POOL_ROUND(size) (((size) + NABTO_COAP_SERVER_POOL_ALIGN - 1) / NABTO_COAP_SERVER_POOL_ALIGN * NABTO_COAP_SERVER_POOL_ALIGN)
+
+// A slab starts with a link to the next slab followed by the objects,
+// a free object starts with a link to the next free object.
+struct nabto_coap_server_pool_link {
+    struct nabto_coap_server_pool_link* next;
+};
+
+static void nabto_coap_server_pool_init(struct nabto_coap_server_pool* pool, size_t objectSize)
+{
+    memset(pool, 0, sizeof(struct nabto_coap_server_pool));
+    pool->objectSize = NABTO_COAP_SERVER_POOL_ROUND(objectSize);
+}
+
+void nabto_coap_server_pools_init(struct nabto_coap_server* server)
+{
+    nabto_coap_server_pool_init(&server->pools[NABTO_COAP_SERVER_POOL_REQUESTS], sizeof(struct nabto_coap_server_request));
+    nabto_coap_server_pool_init(&server->pools[NABTO_COAP_SERVER_POOL_PARAMETERS], sizeof(struct nabto_coap_server_request_parameter));
+    nabto_coap_server_pool_init(&server->pools[NABTO_COAP_SERVER_POOL_PARAMETER_VALUES], NABTO_COAP_SERVER_POOL_VALUE_SIZE);
+    nabto_coap_server_pool_init(&server->pools[NABTO_COAP_SERVER_POOL_OBSERVERS], sizeof(struct nabto_coap_server_observer));
+    nabto_coap_server_pool_init(&server->pools[NABTO_COAP_SERVER_POOL_SEND_LANES], sizeof(struct nabto_coap_server_send_lane));
+}
+
+void nabto_coap_server_pools_deinit(struct nabto_coap_server* server)
+{
+    for (size_t i = 0; i < NABTO_COAP_SERVER_POOL_COUNT; i++) {
+        struct nabto_coap_server_pool* pool = &server->pools[i];
+        struct nabto_coap_server_pool_link* slab = pool->slabs;
+        while (slab != NULL) {
+            struct nabto_coap_server_pool_link* current = slab;
+            slab = slab->next;
+            server->allocator.free(current);
+        }
+        pool->slabs = NULL;
+        pool->freeList = NULL;
+        pool->stats.capacity = 0;
+    }
+}
+
+static bool nabto_coap_server_pool_grow(struct nabto_coap_server* server, struct nabto_coap_server_pool* pool)
+{
+    size_t count = NABTO_COAP_SERVER_POOL_SLAB_OBJECTS;
+    if (pool->maxObjects != 0) {
+        if (pool->stats.capacity >= pool->maxObjects) {
+            return false;
+        }
+        if (pool->maxObjects - pool->stats.capacity < count) {
+            count = pool->maxObjects - pool->stats.capacity;
+        }
+    }
+    size_t headerSize = NABTO_COAP_SERVER_POOL_ROUND(sizeof(struct nabto_coap_server_pool_link));
+    uint8_t* slab = server->allocator.calloc(1, headerSize + count * pool->objectSize);
+    if (slab == NULL) {
+        return false;
+    }
+    struct nabto_coap_server_pool_link* slabLink = (struct nabto_coap_server_pool_link*)slab;
+    slabLink->next = pool->slabs;
+    pool->slabs = slabLink;
+
+    for (size_t i = count; i > 0; i--) {
+        struct nabto_coap_server_pool_link* object = (struct nabto_coap_server_pool_link*)(slab + headerSize + (i-1) * pool->objectSize);
+        object->next = pool->freeList;
+        pool->freeList = object;
+    }
+    pool->stats.capacity += count;
+    return true;
+}
+
+void* nabto_coap_server_pool_alloc(struct nabto_coap_server* server, enum nabto_coap_server_pool_type type)
+{
+    struct nabto_coap_server_pool* pool = &server->pools[type];
+    if (pool->maxObjects != 0 && pool->stats.inUse >= pool->maxObjects) {
+        pool->stats.failures++;
+        return NULL;
+    }
+    if (pool->freeList == NULL && !nabto_coap_server_pool_grow(server, pool)) {
+        pool->stats.failures++;
+        return NULL;
+    }
+    struct nabto_coap_server_pool_link* object = pool->freeList;
+    pool->freeList = object->next;
+    pool->stats.inUse++;
+    if (pool->stats.inUse > pool->stats.peak) {
+        pool->stats.peak = pool->stats.inUse;
+    }
+    memset(object, 0, pool->objectSize);
+    return object;
+}
+
+void nabto_coap_server_pool_free(struct nabto_coap_server* server, enum nabto_coap_server_pool_type type, void* object)
+{
+    if (object == NULL) {
+        return;
+    }
+    struct nabto_coap_server_pool* pool = &server->pools[type];
+    struct nabto_coap_server_pool_link* link = object;
+    link->next = pool->freeList;
+    pool->freeList = link;
+    pool->stats.inUse--;
+}
+
+void nabto_coap_server_limit_pool(struct nabto_coap_server* server, enum nabto_coap_server_pool_type type, size_t maxObjects)
+{
+    server->pools[type].maxObjects = maxObjects;
+}
+
+void nabto_coap_server_get_pool_stats(struct nabto_coap_server* server, enum nabto_coap_server_pool_type type, struct nabto_coap_server_pool_stats* stats)
+{
+    *stats = server->pools[type].stats;
+}
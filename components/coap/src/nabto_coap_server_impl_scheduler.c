@@ -0,0 +1,265 @@
+#include "nabto_coap_server_impl.h"
+#include "nabto_coap_index.h"
+
+/**
+ * Order in which responses and notifications are sent.
+ *
+ * An exchange with a packet ready to be sent is queued in a lane. A
+ * lane is a FIFO of the ready exchanges of one connection in one send
+ * class. The lanes of a class which have ready exchanges are in a ring,
+ * and each time a packet is sent from a lane the ring is rotated such
+ * that connections take turns. Classes are served in priority order:
+ * first responses and block1 continues, then block2 continuations and
+ * last notifications. Empty ACKs and error responses are sent from the
+ * control message ring before any of these.
+ *
+ * With the FIFO policy all exchanges are queued in one shared lane and
+ * sent in the order they became ready. The shared lanes are also used
+ * if a lane for a connection cannot be allocated.
+ */
+
+struct nabto_coap_server_send_lane_key {
+    void* connection;
+    enum nabto_coap_server_send_class sendClass;
+};
+
+static bool nabto_coap_server_send_lane_match(const void* item, const void* key)
+{
+    const struct nabto_coap_server_send_lane* lane = item;
+    const struct nabto_coap_server_send_lane_key* k = key;
+    return lane->connection == k->connection && lane->sendClass == k->sendClass;
+}
+
+static uint32_t nabto_coap_server_send_lane_hash(void* connection, enum nabto_coap_server_send_class sendClass)
+{
+    uint8_t c = (uint8_t)sendClass;
+    uint32_t hash = nabto_coap_hash_pointer(NABTO_COAP_HASH_INIT, connection);
+    return nabto_coap_hash_bytes(hash, &c, 1);
+}
+
+nabto_coap_error nabto_coap_server_scheduler_init(struct nabto_coap_server_requests* requests)
+{
+    struct nabto_coap_server* server = requests->server;
+    requests->sendPolicy = NABTO_COAP_SERVER_SEND_POLICY_FAIR;
+    requests->lanesByConnection = nabto_coap_server_index_new(server);
+    requests->sharedLanes = server->allocator.calloc(NABTO_COAP_SERVER_SEND_CLASSES, sizeof(struct nabto_coap_server_send_lane));
+    if (requests->lanesByConnection == NULL || requests->sharedLanes == NULL) {
+        nabto_coap_server_index_free(server, requests->lanesByConnection);
+        requests->lanesByConnection = NULL;
+        server->allocator.free(requests->sharedLanes);
+        requests->sharedLanes = NULL;
+        return NABTO_COAP_ERROR_OUT_OF_MEMORY;
+    }
+    for (size_t i = 0; i < NABTO_COAP_SERVER_SEND_CLASSES; i++) {
+        requests->sharedLanes[i].requests = requests;
+        requests->sharedLanes[i].sendClass = (enum nabto_coap_server_send_class)i;
+        requests->sharedLanes[i].shared = true;
+    }
+    return NABTO_COAP_ERROR_OK;
+}
+
+void nabto_coap_server_scheduler_deinit(struct nabto_coap_server_requests* requests)
+{
+    struct nabto_coap_server* server = requests->server;
+    // Exchanges of requests still owned by the application can be
+    // queued, detach them such that freeing them later is safe.
+    for (size_t i = 0; i < NABTO_COAP_SERVER_SEND_CLASSES; i++) {
+        while (requests->sendRings[i] != NULL) {
+            struct nabto_coap_server_send_lane* lane = requests->sendRings[i];
+            while (lane->first != NULL) {
+                nabto_coap_server_exchange_unready(lane->first);
+            }
+        }
+    }
+    nabto_coap_server_index_free(server, requests->lanesByConnection);
+    requests->lanesByConnection = NULL;
+    server->allocator.free(requests->sharedLanes);
+    requests->sharedLanes = NULL;
+}
+
+void nabto_coap_server_set_send_policy(struct nabto_coap_server_requests* requests, enum nabto_coap_server_send_policy policy)
+{
+    requests->sendPolicy = policy;
+}
+
+static void* nabto_coap_server_exchange_connection(struct nabto_coap_server_exchange* exchange)
+{
+    if (exchange->type == NABTO_COAP_SERVER_EXCHANGE_TYPE_RESPONSE) {
+        struct nabto_coap_server_request* request = exchange->owner;
+        return request->connection;
+    } else {
+        struct nabto_coap_server_observer* observer = exchange->owner;
+        return observer->connection;
+    }
+}
+
+static enum nabto_coap_server_send_class nabto_coap_server_exchange_send_class(struct nabto_coap_server_exchange* exchange)
+{
+    if (exchange->type == NABTO_COAP_SERVER_EXCHANGE_TYPE_NOTIFICATION) {
+        return NABTO_COAP_SERVER_SEND_CLASS_NOTIFICATION;
+    }
+    struct nabto_coap_server_request* request = exchange->owner;
+    if (request->state == NABTO_COAP_SERVER_REQUEST_STATE_RESPONSE && request->response.block2Current > 0) {
+        return NABTO_COAP_SERVER_SEND_CLASS_BLOCK2;
+    }
+    return NABTO_COAP_SERVER_SEND_CLASS_RESPONSE;
+}
+
+static struct nabto_coap_server_send_lane* nabto_coap_server_send_lane_get(struct nabto_coap_server_requests* requests, struct nabto_coap_server_exchange* exchange)
+{
+    if (requests->sendPolicy == NABTO_COAP_SERVER_SEND_POLICY_FIFO) {
+        return &requests->sharedLanes[0];
+    }
+    struct nabto_coap_server* server = requests->server;
+    struct nabto_coap_server_send_lane_key key;
+    key.connection = nabto_coap_server_exchange_connection(exchange);
+    key.sendClass = nabto_coap_server_exchange_send_class(exchange);
+    uint32_t hash = nabto_coap_server_send_lane_hash(key.connection, key.sendClass);
+    struct nabto_coap_server_send_lane* lane = nabto_coap_index_find(requests->lanesByConnection, hash, nabto_coap_server_send_lane_match, &key);
+    if (lane != NULL) {
+        return lane;
+    }
+    lane = nabto_coap_server_pool_alloc(server, NABTO_COAP_SERVER_POOL_SEND_LANES);
+    if (lane == NULL) {
+        return &requests->sharedLanes[key.sendClass];
+    }
+    lane->requests = requests;
+    lane->connection = key.connection;
+    lane->sendClass = key.sendClass;
+    if (nabto_coap_index_insert(requests->lanesByConnection, hash, lane) != NABTO_COAP_ERROR_OK) {
+        nabto_coap_server_pool_free(server, NABTO_COAP_SERVER_POOL_SEND_LANES, lane);
+        return &requests->sharedLanes[key.sendClass];
+    }
+    return lane;
+}
+
+void nabto_coap_server_exchange_ready(struct nabto_coap_server_requests* requests, struct nabto_coap_server_exchange* exchange)
+{
+    if (exchange->ready) {
+        return;
+    }
+    struct nabto_coap_server_send_lane* lane = nabto_coap_server_send_lane_get(requests, exchange);
+    exchange->lane = lane;
+    exchange->readyNext = NULL;
+    exchange->readyPrev = lane->last;
+    if (lane->last != NULL) {
+        lane->last->readyNext = exchange;
+    } else {
+        lane->first = exchange;
+    }
+    lane->last = exchange;
+    exchange->ready = true;
+#ifdef NABTO_COAP_SERVER_METRICS
+    requests->metrics.sendQueued++;
+    if (requests->metrics.sendQueued > requests->metrics.sendQueuedPeak) {
+        requests->metrics.sendQueuedPeak = requests->metrics.sendQueued;
+    }
+#endif
+
+    if (lane->first == exchange) {
+        // The lane was empty, add it at the end of the ring of its class.
+        struct nabto_coap_server_send_lane** ring = &requests->sendRings[lane->sendClass];
+        if (*ring == NULL) {
+            lane->next = lane;
+            lane->prev = lane;
+            *ring = lane;
+        } else {
+            struct nabto_coap_server_send_lane* head = *ring;
+            lane->next = head;
+            lane->prev = head->prev;
+            head->prev->next = lane;
+            head->prev = lane;
+        }
+    }
+}
+
+void nabto_coap_server_exchange_unready(struct nabto_coap_server_exchange* exchange)
+{
+    if (!exchange->ready) {
+        return;
+    }
+    struct nabto_coap_server_send_lane* lane = exchange->lane;
+    if (exchange->readyPrev != NULL) {
+        exchange->readyPrev->readyNext = exchange->readyNext;
+    } else {
+        lane->first = exchange->readyNext;
+    }
+    if (exchange->readyNext != NULL) {
+        exchange->readyNext->readyPrev = exchange->readyPrev;
+    } else {
+        lane->last = exchange->readyPrev;
+    }
+    exchange->readyNext = NULL;
+    exchange->readyPrev = NULL;
+    exchange->lane = NULL;
+    exchange->ready = false;
+    NABTO_COAP_SERVER_METRIC_SUB(lane->requests, sendQueued, 1);
+
+    if (lane->first == NULL) {
+        // Remove the empty lane from the ring.
+        struct nabto_coap_server_requests* requests = lane->requests;
+        struct nabto_coap_server_send_lane** ring = &requests->sendRings[lane->sendClass];
+        if (lane->next == lane) {
+            *ring = NULL;
+        } else {
+            lane->prev->next = lane->next;
+            lane->next->prev = lane->prev;
+            if (*ring == lane) {
+                *ring = lane->next;
+            }
+        }
+        lane->next = NULL;
+        lane->prev = NULL;
+        if (!lane->shared) {
+            struct nabto_coap_server* server = requests->server;
+            nabto_coap_index_remove(requests->lanesByConnection, nabto_coap_server_send_lane_hash(lane->connection, lane->sendClass), lane);
+            nabto_coap_server_pool_free(server, NABTO_COAP_SERVER_POOL_SEND_LANES, lane);
+        }
+    }
+}
+
+static bool nabto_coap_server_exchange_has_data(struct nabto_coap_server_exchange* exchange)
+{
+    if (exchange->type == NABTO_COAP_SERVER_EXCHANGE_TYPE_RESPONSE) {
+        struct nabto_coap_server_request* request = exchange->owner;
+        if ((request->state == NABTO_COAP_SERVER_REQUEST_STATE_REQUEST ||
+             request->state == NABTO_COAP_SERVER_REQUEST_STATE_USER) &&
+            request->hasBlock1Ack)
+        {
+            return true;
+        }
+        return (request->state == NABTO_COAP_SERVER_REQUEST_STATE_RESPONSE &&
+                request->response.sendNow);
+    } else {
+        struct nabto_coap_server_observer* observer = exchange->owner;
+        return observer->sendNow;
+    }
+}
+
+struct nabto_coap_server_exchange* nabto_coap_server_next_ready(struct nabto_coap_server_requests* requests)
+{
+    for (size_t i = 0; i < NABTO_COAP_SERVER_SEND_CLASSES; i++) {
+        while (requests->sendRings[i] != NULL) {
+            struct nabto_coap_server_exchange* exchange = requests->sendRings[i]->first;
+            if (nabto_coap_server_exchange_has_data(exchange)) {
+                return exchange;
+            }
+            // Unreading the last exchange of a lane removes the lane.
+            nabto_coap_server_exchange_unready(exchange);
+        }
+    }
+    return NULL;
+}
+
+void nabto_coap_server_exchange_sent(struct nabto_coap_server_requests* requests, struct nabto_coap_server_exchange* exchange)
+{
+    struct nabto_coap_server_send_lane* lane = exchange->lane;
+    if (lane == NULL) {
+        return;
+    }
+    // Let the next connection in the class have a turn.
+    requests->sendRings[lane->sendClass] = lane->next;
+    if (!nabto_coap_server_exchange_has_data(exchange)) {
+        nabto_coap_server_exchange_unready(exchange);
+    }
+}
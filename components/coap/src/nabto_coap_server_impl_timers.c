@@ -0,0 +1,140 @@
+#include "nabto_coap_server_impl.h"
+
+/**
+ * Retransmission deadlines of responses and notifications.
+ *
+ * The deadlines are kept in a binary min heap on the requests context.
+ * Each exchange knows its position in the heap, such that a deadline
+ * can be moved or cancelled in O(log n) when the exchange is ACKed or
+ * freed.
+ *
+ * Every request and observer reserves a heap slot when it is created,
+ * so arming a timer never has to allocate.
+ */
+
+#define NABTO_COAP_SERVER_TIMERS_MIN_CAPACITY 16
+
+static bool nabto_coap_server_timer_less(struct nabto_coap_server_exchange** heap, size_t a, size_t b)
+{
+    return nabto_coap_is_stamp_less(heap[a]->timerDeadline, heap[b]->timerDeadline);
+}
+
+static void nabto_coap_server_timer_swap(struct nabto_coap_server_exchange** heap, size_t a, size_t b)
+{
+    struct nabto_coap_server_exchange* tmp = heap[a];
+    heap[a] = heap[b];
+    heap[b] = tmp;
+    heap[a]->timerIndex = a;
+    heap[b]->timerIndex = b;
+}
+
+static void nabto_coap_server_timer_sift_up(struct nabto_coap_server_requests* requests, size_t i)
+{
+    struct nabto_coap_server_exchange** heap = requests->timers;
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (!nabto_coap_server_timer_less(heap, i, parent)) {
+            return;
+        }
+        nabto_coap_server_timer_swap(heap, i, parent);
+        i = parent;
+    }
+}
+
+static void nabto_coap_server_timer_sift_down(struct nabto_coap_server_requests* requests, size_t i)
+{
+    struct nabto_coap_server_exchange** heap = requests->timers;
+    size_t size = requests->timersSize;
+    while (true) {
+        size_t smallest = i;
+        size_t left = 2 * i + 1;
+        size_t right = 2 * i + 2;
+        if (left < size && nabto_coap_server_timer_less(heap, left, smallest)) {
+            smallest = left;
+        }
+        if (right < size && nabto_coap_server_timer_less(heap, right, smallest)) {
+            smallest = right;
+        }
+        if (smallest == i) {
+            return;
+        }
+        nabto_coap_server_timer_swap(heap, i, smallest);
+        i = smallest;
+    }
+}
+
+nabto_coap_error nabto_coap_server_timers_reserve(struct nabto_coap_server_requests* requests)
+{
+    if (requests->timersReserved + 1 > requests->timersCapacity) {
+        struct nabto_coap_server* server = requests->server;
+        size_t newCapacity = requests->timersCapacity * 2;
+        if (newCapacity < NABTO_COAP_SERVER_TIMERS_MIN_CAPACITY) {
+            newCapacity = NABTO_COAP_SERVER_TIMERS_MIN_CAPACITY;
+        }
+        struct nabto_coap_server_exchange** timers = server->allocator.calloc(newCapacity, sizeof(struct nabto_coap_server_exchange*));
+        if (timers == NULL) {
+            return NABTO_COAP_ERROR_OUT_OF_MEMORY;
+        }
+        if (requests->timersSize > 0) {
+            memcpy(timers, requests->timers, requests->timersSize * sizeof(struct nabto_coap_server_exchange*));
+        }
+        server->allocator.free(requests->timers);
+        requests->timers = timers;
+        requests->timersCapacity = newCapacity;
+    }
+    requests->timersReserved++;
+    return NABTO_COAP_ERROR_OK;
+}
+
+void nabto_coap_server_timers_release(struct nabto_coap_server_requests* requests)
+{
+    requests->timersReserved--;
+}
+
+void nabto_coap_server_timer_arm(struct nabto_coap_server_requests* requests, struct nabto_coap_server_exchange* exchange, uint32_t deadline)
+{
+    if (exchange->timerArmed) {
+        bool earlier = nabto_coap_is_stamp_less(deadline, exchange->timerDeadline);
+        exchange->timerDeadline = deadline;
+        if (earlier) {
+            nabto_coap_server_timer_sift_up(requests, exchange->timerIndex);
+        } else {
+            nabto_coap_server_timer_sift_down(requests, exchange->timerIndex);
+        }
+        return;
+    }
+    // A slot was reserved when the owner of the exchange was created.
+    size_t i = requests->timersSize;
+    requests->timersSize++;
+    requests->timers[i] = exchange;
+    exchange->timerIndex = i;
+    exchange->timerDeadline = deadline;
+    exchange->timerArmed = true;
+    nabto_coap_server_timer_sift_up(requests, i);
+}
+
+void nabto_coap_server_timer_cancel(struct nabto_coap_server_requests* requests, struct nabto_coap_server_exchange* exchange)
+{
+    if (!exchange->timerArmed) {
+        return;
+    }
+    size_t i = exchange->timerIndex;
+    size_t last = requests->timersSize - 1;
+    exchange->timerArmed = false;
+    requests->timersSize--;
+    if (i == last) {
+        return;
+    }
+    requests->timers[i] = requests->timers[last];
+    requests->timers[i]->timerIndex = i;
+    nabto_coap_server_timer_sift_down(requests, i);
+    nabto_coap_server_timer_sift_up(requests, i);
+}
+
+struct nabto_coap_server_exchange* nabto_coap_server_timer_next(struct nabto_coap_server_requests* requests)
+{
+    if (requests->timersSize == 0) {
+        return NULL;
+    }
+    return requests->timers[0];
+}
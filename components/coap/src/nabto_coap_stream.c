@@ -0,0 +1,201 @@
+#include "nabto_coap_stream.h"
+
+#include <stdint.h>
+
+static void nabto_coap_stream_set_pending(struct nabto_coap_stream_table* table, struct nabto_coap_stream* stream)
+{
+    if (stream->pending) {
+        return;
+    }
+    stream->pending = true;
+    stream->pendingNext = table->pendingHead;
+    table->pendingHead = stream;
+}
+
+static void nabto_coap_stream_clear_pending(struct nabto_coap_stream_table* table, struct nabto_coap_stream* stream)
+{
+    if (!stream->pending) {
+        return;
+    }
+    struct nabto_coap_stream** link = &table->pendingHead;
+    while (*link != stream) {
+        link = &(*link)->pendingNext;
+    }
+    *link = stream->pendingNext;
+    stream->pending = false;
+    stream->pendingNext = NULL;
+}
+
+static void nabto_coap_stream_free(struct nabto_coap_stream_table* table, struct nabto_coap_stream* stream)
+{
+    nabto_coap_stream_clear_pending(table, stream);
+    nabto_coap_connection_table_remove(&table->streams, stream);
+}
+
+struct nabto_coap_stream_table* nabto_coap_stream_table_new(struct nn_allocator* allocator)
+{
+    struct nabto_coap_stream_table* table = nn_allocator_calloc(allocator, 1, sizeof(struct nabto_coap_stream_table));
+    if (table == NULL) {
+        return NULL;
+    }
+    nabto_coap_connection_table_init(&table->streams, allocator, sizeof(struct nabto_coap_stream));
+    return table;
+}
+
+void nabto_coap_stream_table_free(struct nabto_coap_stream_table* table)
+{
+    if (table == NULL) {
+        return;
+    }
+    // The pending list only links streams which are freed with the table.
+    struct nn_allocator allocator = table->streams.allocator;
+    nabto_coap_connection_table_deinit(&table->streams);
+    nn_allocator_free(&allocator, table);
+}
+
+nabto_coap_error nabto_coap_stream_open(struct nabto_coap_stream_table* table, void* connection, uint32_t maxMessageSize)
+{
+    if (maxMessageSize == 0) {
+        maxMessageSize = NABTO_COAP_FRAME_DEFAULT_MAX_MESSAGE_SIZE;
+    }
+    struct nabto_coap_stream* stream = nabto_coap_stream_find(table, connection);
+    if (stream == NULL) {
+        stream = nabto_coap_connection_table_add(&table->streams, connection);
+        if (stream == NULL) {
+            return NABTO_COAP_ERROR_OUT_OF_MEMORY;
+        }
+        // Until the CSM of the peer arrives only the base values of
+        // RFC 8323 section 5.3 can be assumed.
+        stream->peerMaxMessageSize = NABTO_COAP_FRAME_DEFAULT_MAX_MESSAGE_SIZE;
+    }
+    stream->maxMessageSize = maxMessageSize;
+    stream->sendCsm = true;
+    nabto_coap_stream_set_pending(table, stream);
+    return NABTO_COAP_ERROR_OK;
+}
+
+struct nabto_coap_stream* nabto_coap_stream_find(struct nabto_coap_stream_table* table, void* connection)
+{
+    // Datagram only connections, the common case, are rejected by the
+    // empty index without hashing.
+    return nabto_coap_connection_table_find(&table->streams, connection);
+}
+
+void nabto_coap_stream_close(struct nabto_coap_stream_table* table, void* connection)
+{
+    struct nabto_coap_stream* stream = nabto_coap_stream_find(table, connection);
+    if (stream != NULL) {
+        nabto_coap_stream_free(table, stream);
+    }
+}
+
+void nabto_coap_stream_received(struct nabto_coap_stream* stream, struct nabto_coap_incoming_message* message)
+{
+    stream->messageId++;
+    message->type = NABTO_COAP_TYPE_NON;
+    message->messageId = stream->messageId;
+}
+
+static void nabto_coap_stream_handle_csm(struct nabto_coap_stream* stream, struct nabto_coap_incoming_message* message)
+{
+    for (size_t i = 0; i < message->optionCount; i++) {
+        const struct nabto_coap_option_entry* option = &message->optionTable[i];
+        const uint8_t* data = message->options + option->offset;
+        if (option->number == NABTO_COAP_SIGNAL_OPTION_MAX_MESSAGE_SIZE) {
+            uint32_t value;
+            if (nabto_coap_parse_variable_int(data, data + option->length, 4, &value) &&
+                value >= NABTO_COAP_FRAME_DEFAULT_MAX_MESSAGE_SIZE)
+            {
+                stream->peerMaxMessageSize = value;
+            }
+        } else if (option->number == NABTO_COAP_SIGNAL_OPTION_BLOCK_WISE_TRANSFER) {
+            stream->peerBert = true;
+        }
+    }
+}
+
+bool nabto_coap_stream_handle_signal(struct nabto_coap_stream_table* table, struct nabto_coap_stream* stream, struct nabto_coap_incoming_message* message)
+{
+    switch ((int)message->code) {
+        case NABTO_COAP_SIGNAL_CSM:
+            nabto_coap_stream_handle_csm(stream, message);
+            return true;
+        case NABTO_COAP_SIGNAL_PING:
+            // Only the latest ping is answered.
+            stream->sendPong = true;
+            stream->pongToken = message->token;
+            nabto_coap_stream_set_pending(table, stream);
+            return true;
+        case NABTO_COAP_SIGNAL_RELEASE:
+        case NABTO_COAP_SIGNAL_ABORT:
+            return false;
+        default:
+            // Pongs and unknown signals.
+            return true;
+    }
+}
+
+struct nabto_coap_stream* nabto_coap_stream_next_signal(struct nabto_coap_stream_table* table)
+{
+    return table->pendingHead;
+}
+
+uint8_t* nabto_coap_stream_encode_signal(struct nabto_coap_stream_table* table, struct nabto_coap_stream* stream, uint8_t* buffer, uint8_t* end)
+{
+    struct nabto_coap_message_header header;
+    memset(&header, 0, sizeof(struct nabto_coap_message_header));
+    header.type = NABTO_COAP_TYPE_NON;
+
+    if (end - buffer < NABTO_COAP_STREAM_FRAME_OVERHEAD) {
+        return NULL;
+    }
+    uint8_t* messageEnd = end - NABTO_COAP_STREAM_FRAME_OVERHEAD;
+    uint8_t* ptr;
+    if (stream->sendCsm) {
+        header.code = (nabto_coap_code)NABTO_COAP_SIGNAL_CSM;
+        ptr = nabto_coap_encode_header(&header, buffer, messageEnd);
+        ptr = nabto_coap_encode_varint_option(NABTO_COAP_SIGNAL_OPTION_MAX_MESSAGE_SIZE, stream->maxMessageSize, ptr, messageEnd);
+        ptr = nabto_coap_encode_option(NABTO_COAP_SIGNAL_OPTION_BLOCK_WISE_TRANSFER - NABTO_COAP_SIGNAL_OPTION_MAX_MESSAGE_SIZE, (const uint8_t*)"", 0, ptr, messageEnd);
+    } else {
+        header.code = (nabto_coap_code)NABTO_COAP_SIGNAL_PONG;
+        header.token = stream->pongToken;
+        ptr = nabto_coap_encode_header(&header, buffer, messageEnd);
+    }
+
+    ptr = nabto_coap_datagram_to_frame(buffer, ptr, end);
+    if (ptr == NULL) {
+        return NULL;
+    }
+    if (stream->sendCsm) {
+        stream->sendCsm = false;
+    } else {
+        stream->sendPong = false;
+    }
+    if (!stream->sendCsm && !stream->sendPong) {
+        nabto_coap_stream_clear_pending(table, stream);
+    }
+    return ptr;
+}
+
+uint8_t* nabto_coap_stream_message_end(struct nabto_coap_stream* stream, uint8_t* buffer, uint8_t* end)
+{
+    if ((size_t)(end - buffer) > stream->peerMaxMessageSize) {
+        end = buffer + stream->peerMaxMessageSize;
+    }
+    if (end - buffer < NABTO_COAP_STREAM_FRAME_OVERHEAD) {
+        return buffer;
+    }
+    return end - NABTO_COAP_STREAM_FRAME_OVERHEAD;
+}
+
+size_t nabto_coap_stream_bert_size(struct nabto_coap_stream* stream, size_t room)
+{
+    if (stream != NULL && room > stream->peerMaxMessageSize) {
+        room = stream->peerMaxMessageSize;
+    }
+    if (room < NABTO_COAP_BLOCK_BERT_UNIT + NABTO_COAP_STREAM_BERT_MARGIN) {
+        return NABTO_COAP_BLOCK_BERT_UNIT;
+    }
+    room -= NABTO_COAP_STREAM_BERT_MARGIN;
+    return room - (room % NABTO_COAP_BLOCK_BERT_UNIT);
+}
@@ -0,0 +1,116 @@
+#ifndef _NABTO_COAP_STREAM_H_
+#define _NABTO_COAP_STREAM_H_
+
+#include "nabto_coap_connection_table.h"
+
+#include <nabto_coap/nabto_coap.h>
+#include <nn/allocator.h>
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Connections which carry CoAP over a reliable byte stream, RFC 8323.
+ *
+ * The client and the server keep a stream for each such connection.
+ * Outgoing messages are encoded as datagrams as usual and turned into
+ * frames just before they are handed to the user, incoming frames are
+ * parsed into messages of type NON. As frames have no message id, each
+ * received message gets a synthesized one such that the duplicate
+ * detection of the datagram path never matches.
+ *
+ * A CSM is queued when the stream is opened, a Pong is queued for each
+ * Ping. Pending signals are sent before any other message.
+ */
+
+// The header of a frame can be this much longer than the header of
+// the datagram it is made from.
+#define NABTO_COAP_STREAM_FRAME_OVERHEAD 2
+
+// Room reserved for the header and options of a BERT block.
+#define NABTO_COAP_STREAM_BERT_MARGIN 64
+
+// How long a response with more blocks waits for the request of the
+// next block. There is no ACK to wait for on a stream.
+#define NABTO_COAP_STREAM_BLOCK_TIMEOUT 30000
+
+struct nabto_coap_stream {
+    void* connection; // first, see nabto_coap_connection_table
+    uint32_t maxMessageSize;     // advertised in our CSM
+    uint32_t peerMaxMessageSize; // from the CSM of the peer
+    bool peerBert;
+    bool sendCsm;
+    bool sendPong;
+    nabto_coap_token pongToken;
+    uint16_t messageId; // last synthesized message id
+    bool pending;       // in the list of streams with signals to send
+    struct nabto_coap_stream* pendingNext;
+};
+
+struct nabto_coap_stream_table {
+    struct nabto_coap_connection_table streams;
+    struct nabto_coap_stream* pendingHead;
+};
+
+struct nabto_coap_stream_table* nabto_coap_stream_table_new(struct nn_allocator* allocator);
+// NULL is ignored.
+void nabto_coap_stream_table_free(struct nabto_coap_stream_table* table);
+
+/**
+ * Make a connection a stream. maxMessageSize is the largest frame we
+ * accept, 0 for the default of 1152 bytes.
+ */
+nabto_coap_error nabto_coap_stream_open(struct nabto_coap_stream_table* table, void* connection, uint32_t maxMessageSize);
+
+/**
+ * @return NULL if the connection is not a stream.
+ */
+struct nabto_coap_stream* nabto_coap_stream_find(struct nabto_coap_stream_table* table, void* connection);
+
+void nabto_coap_stream_close(struct nabto_coap_stream_table* table, void* connection);
+
+/**
+ * Give a received message its synthesized message id.
+ */
+void nabto_coap_stream_received(struct nabto_coap_stream* stream, struct nabto_coap_incoming_message* message);
+
+/**
+ * Handle a signalling message (code class 7).
+ *
+ * @return false if the peer released or aborted the connection.
+ */
+bool nabto_coap_stream_handle_signal(struct nabto_coap_stream_table* table, struct nabto_coap_stream* stream, struct nabto_coap_incoming_message* message);
+
+/**
+ * @return a stream with a signal to send, NULL if there is none.
+ */
+struct nabto_coap_stream* nabto_coap_stream_next_signal(struct nabto_coap_stream_table* table);
+
+/**
+ * Encode the next pending signal of a stream as a frame.
+ *
+ * @return the end of the frame, NULL if it does not fit. The signal
+ * stays pending if it does not fit.
+ */
+uint8_t* nabto_coap_stream_encode_signal(struct nabto_coap_stream_table* table, struct nabto_coap_stream* stream, uint8_t* buffer, uint8_t* end);
+
+/**
+ * Where a message for the stream has to end such that it and its frame
+ * header fit both the buffer and the limit of the peer.
+ */
+uint8_t* nabto_coap_stream_message_end(struct nabto_coap_stream* stream, uint8_t* buffer, uint8_t* end);
+
+/**
+ * Payload size of a BERT block sent in a buffer with the given room,
+ * a multiple of 1024 and at least 1024. stream can be NULL.
+ */
+size_t nabto_coap_stream_bert_size(struct nabto_coap_stream* stream, size_t room);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
@@ -0,0 +1,257 @@
+#pragma once
+
+#include <boost/test/unit_test.hpp>
+
+#include <nabto_coap/nabto_coap_server.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <vector>
+
+namespace nabto {
+namespace test {
+
+/**
+ * Build a CoAP datagram. Options can be added in any order, they are
+ * sorted by number when the packet is built.
+ */
+class CoapPacket {
+ public:
+    CoapPacket(nabto_coap_type type, nabto_coap_code code, uint16_t messageId, uint8_t token)
+    {
+        memset(&header_, 0, sizeof(struct nabto_coap_message_header));
+        header_.type = type;
+        header_.code = code;
+        header_.messageId = messageId;
+        header_.token.tokenLength = 1;
+        header_.token.token[0] = token;
+    }
+
+    // A path like "a/b/c" becomes a Uri-Path option for each segment.
+    CoapPacket& path(const std::string& path)
+    {
+        size_t start = 0;
+        while (start <= path.size()) {
+            size_t end = path.find('/', start);
+            if (end == std::string::npos) {
+                end = path.size();
+            }
+            std::string segment = path.substr(start, end - start);
+            option(NABTO_COAP_OPTION_URI_PATH, std::vector<uint8_t>(segment.begin(), segment.end()));
+            start = end + 1;
+        }
+        return *this;
+    }
+
+    CoapPacket& option(uint16_t number, uint32_t value)
+    {
+        uint8_t encoded[4];
+        size_t length;
+        nabto_coap_encode_variable_int(encoded, sizeof(encoded), value, &length);
+        return option(number, std::vector<uint8_t>(encoded, encoded + length));
+    }
+
+    CoapPacket& option(uint16_t number, const std::vector<uint8_t>& value)
+    {
+        options_.push_back(Option{ number, value });
+        return *this;
+    }
+
+    CoapPacket& payload(const std::vector<uint8_t>& payload)
+    {
+        payload_ = payload;
+        return *this;
+    }
+
+    CoapPacket& payload(const std::string& payload)
+    {
+        payload_ = std::vector<uint8_t>(payload.begin(), payload.end());
+        return *this;
+    }
+
+    std::vector<uint8_t> build() const
+    {
+        std::vector<Option> options = options_;
+        std::stable_sort(options.begin(), options.end(), [](const Option& a, const Option& b) { return a.number < b.number; });
+        size_t size = 16 + payload_.size();
+        for (const Option& o : options) {
+            size += 5 + o.value.size();
+        }
+        std::vector<uint8_t> buffer(size);
+        uint8_t* end = buffer.data() + buffer.size();
+        struct nabto_coap_message_header header = header_;
+        uint8_t* ptr = nabto_coap_encode_header(&header, buffer.data(), end);
+        uint16_t number = 0;
+        for (const Option& o : options) {
+            ptr = nabto_coap_encode_option((uint16_t)(o.number - number), o.value.data(), o.value.size(), ptr, end);
+            number = o.number;
+        }
+        ptr = nabto_coap_encode_payload(payload_.data(), payload_.size(), ptr, end);
+        BOOST_REQUIRE(ptr != (uint8_t*)NULL);
+        buffer.resize(ptr - buffer.data());
+        return buffer;
+    }
+
+ private:
+    struct Option {
+        uint16_t number;
+        std::vector<uint8_t> value;
+    };
+    struct nabto_coap_message_header header_;
+    std::vector<Option> options_;
+    std::vector<uint8_t> payload_;
+};
+
+/**
+ * A packet taken from the server with nabto_coap_server_handle_send.
+ */
+class SentPacket {
+ public:
+    void* connection;
+    std::vector<uint8_t> data;
+
+    // The message points into data, so it is parsed when asked for.
+    struct nabto_coap_incoming_message message() const
+    {
+        struct nabto_coap_incoming_message message;
+        BOOST_REQUIRE(nabto_coap_parse_message(data.data(), data.size(), &message));
+        return message;
+    }
+
+    nabto_coap_code code() const { return message().code; }
+    nabto_coap_type type() const { return message().type; }
+    uint16_t messageId() const { return message().messageId; }
+
+    std::string payload() const
+    {
+        struct nabto_coap_incoming_message m = message();
+        return std::string((const char*)m.payload, m.payloadLength);
+    }
+
+    bool hasOption(uint16_t number) const
+    {
+        struct nabto_coap_incoming_message m = message();
+        return nabto_coap_find_option(&m, number, 0) < m.optionCount;
+    }
+
+    std::vector<uint8_t> optionValue(uint16_t number) const
+    {
+        struct nabto_coap_incoming_message m = message();
+        size_t i = nabto_coap_find_option(&m, number, 0);
+        BOOST_REQUIRE(i < m.optionCount);
+        const uint8_t* data = m.options + m.optionTable[i].offset;
+        return std::vector<uint8_t>(data, data + m.optionTable[i].length);
+    }
+
+    uint32_t uintOption(uint16_t number) const
+    {
+        std::vector<uint8_t> value = optionValue(number);
+        uint32_t result = 0;
+        for (uint8_t b : value) {
+            result = (result << 8) | b;
+        }
+        return result;
+    }
+};
+
+/**
+ * A server with one requests context driven by a fake clock, packets
+ * are given to it with receive and taken from it with send.
+ */
+class CoapServerFixture {
+ public:
+    CoapServerFixture()
+    {
+        allocator_.calloc = &calloc;
+        allocator_.free = &free;
+        BOOST_REQUIRE(nabto_coap_server_init(&server_, NULL, &allocator_) == NABTO_COAP_ERROR_OK);
+        BOOST_REQUIRE(nabto_coap_server_requests_init(&requests_, &server_, &CoapServerFixture::getStamp, &CoapServerFixture::notifyEvent, this) == NABTO_COAP_ERROR_OK);
+    }
+
+    ~CoapServerFixture()
+    {
+        nabto_coap_server_requests_destroy(&requests_);
+        nabto_coap_server_destroy(&server_);
+    }
+
+    struct nabto_coap_server_resource* addResource(nabto_coap_code method, std::vector<const char*> segments, nabto_coap_server_resource_handler handler, void* userData)
+    {
+        segments.push_back(NULL);
+        struct nabto_coap_server_resource* resource = NULL;
+        BOOST_REQUIRE(nabto_coap_server_add_resource(&server_, method, segments.data(), handler, userData, &resource) == NABTO_COAP_ERROR_OK);
+        return resource;
+    }
+
+    void receive(void* connection, const CoapPacket& packet)
+    {
+        std::vector<uint8_t> data = packet.build();
+        nabto_coap_server_handle_packet(&requests_, connection, data.data(), data.size());
+    }
+
+    // Take all the packets the server has ready to send.
+    std::vector<SentPacket> send(size_t bufferSize = 1500)
+    {
+        std::vector<SentPacket> sent;
+        while (nabto_coap_server_next_event(&requests_) == NABTO_COAP_SERVER_NEXT_EVENT_SEND) {
+            void* connection = nabto_coap_server_get_connection_send(&requests_);
+            std::vector<uint8_t> buffer(bufferSize);
+            uint8_t* ptr = nabto_coap_server_handle_send(&requests_, buffer.data(), buffer.data() + buffer.size());
+            if (ptr == NULL) {
+                continue;
+            }
+            buffer.resize(ptr - buffer.data());
+            sent.push_back(SentPacket{ connection, buffer });
+        }
+        return sent;
+    }
+
+    // Move the clock and let the server handle the timers which expired.
+    void advance(uint32_t ms)
+    {
+        now_ += ms;
+        nabto_coap_server_handle_timeout(&requests_);
+    }
+
+    static uint32_t getStamp(void* userData)
+    {
+        return ((CoapServerFixture*)userData)->now_;
+    }
+
+    static void notifyEvent(void* userData)
+    {
+        ((CoapServerFixture*)userData)->events_++;
+    }
+
+    struct nn_allocator allocator_;
+    struct nabto_coap_server server_;
+    struct nabto_coap_server_requests requests_;
+    uint32_t now_ = 1000;
+    // notifyEvent is called from the threads completing async requests.
+    std::atomic<size_t> events_{ 0 };
+};
+
+// Handlers used by several tests.
+
+// Answer 2.05 with the payload given as userData, a const char*.
+static inline void respondWithText(struct nabto_coap_server_request* request, void* userData)
+{
+    const char* text = (const char*)userData;
+    nabto_coap_server_response_set_code(request, NABTO_COAP_CODE_CONTENT);
+    if (text != NULL) {
+        nabto_coap_server_response_set_payload(request, text, strlen(text));
+    }
+    nabto_coap_server_response_ready(request);
+    nabto_coap_server_request_free(request);
+}
+
+// Keep the requests in the vector given as userData.
+static inline void keepRequest(struct nabto_coap_server_request* request, void* userData)
+{
+    ((std::vector<struct nabto_coap_server_request*>*)userData)->push_back(request);
+}
+
+} } // namespace
@@ -0,0 +1,142 @@
+#include <boost/test/unit_test.hpp>
+
+#include <nabto_coap/nabto_coap.h>
+
+#include <string.h>
+
+#include <vector>
+
+// Encode a datagram whose body, the options and payload after the
+// token, is bodyLength bytes, and turn it into a frame in place.
+static std::vector<uint8_t> make_frame(size_t bodyLength, uint8_t** frameEnd)
+{
+    // The frame header is at most two bytes longer than the datagram header.
+    std::vector<uint8_t> buffer(4 + 1 + bodyLength + 2);
+    uint8_t* begin = buffer.data();
+    uint8_t* end = begin + buffer.size();
+
+    struct nabto_coap_message_header header;
+    memset(&header, 0, sizeof(struct nabto_coap_message_header));
+    header.type = NABTO_COAP_TYPE_CON;
+    header.code = NABTO_COAP_CODE_POST;
+    header.messageId = 17;
+    header.token.tokenLength = 1;
+    header.token.token[0] = 0x5A;
+    uint8_t* ptr = nabto_coap_encode_header(&header, begin, end);
+
+    std::vector<uint8_t> payload(bodyLength - 1);
+    for (size_t i = 0; i < payload.size(); i++) {
+        payload[i] = (uint8_t)i;
+    }
+    ptr = nabto_coap_encode_payload(payload.data(), payload.size(), ptr, end);
+    BOOST_REQUIRE(ptr != (uint8_t*)NULL);
+    BOOST_REQUIRE((size_t)(ptr - begin) == 4 + 1 + bodyLength);
+
+    *frameEnd = nabto_coap_datagram_to_frame(begin, ptr, end);
+    BOOST_REQUIRE(*frameEnd != (uint8_t*)NULL);
+    buffer.resize(*frameEnd - begin);
+    return buffer;
+}
+
+BOOST_AUTO_TEST_SUITE(frame)
+
+BOOST_AUTO_TEST_CASE(length_boundaries)
+{
+    // RFC 8323 section 3.2, the length nibble and extended length field
+    // change at 13, 269 and 65805 bytes.
+    struct {
+        size_t bodyLength;
+        uint8_t nibble;
+        size_t extendedSize;
+    } cases[] = {
+        { 12, 12, 0 },
+        { 13, 13, 1 },
+        { 268, 13, 1 },
+        { 269, 14, 2 },
+        { 65804, 14, 2 },
+        { 65805, 15, 4 },
+        { 70000, 15, 4 }
+    };
+    for (auto& c : cases) {
+        uint8_t* frameEnd;
+        std::vector<uint8_t> frame = make_frame(c.bodyLength, &frameEnd);
+        size_t headerSize = 1 + c.extendedSize + 1 + 1;
+        BOOST_TEST(frame.size() == headerSize + c.bodyLength);
+        BOOST_TEST((frame[0] >> 4) == c.nibble);
+        BOOST_TEST((frame[0] & 0x0F) == 1);
+        BOOST_TEST(frame[1 + c.extendedSize] == NABTO_COAP_CODE_POST);
+        BOOST_TEST(frame[2 + c.extendedSize] == 0x5A);
+
+        // The size is known once the extended length field is available.
+        size_t frameSize = 0;
+        if (c.extendedSize > 0) {
+            BOOST_TEST(!nabto_coap_frame_size(frame.data(), c.extendedSize, &frameSize));
+        }
+        BOOST_TEST(nabto_coap_frame_size(frame.data(), 1 + c.extendedSize, &frameSize));
+        BOOST_TEST(frameSize == frame.size());
+
+        struct nabto_coap_incoming_message message;
+        BOOST_REQUIRE(nabto_coap_parse_frame(frame.data(), frame.size(), &message));
+        BOOST_TEST(message.type == NABTO_COAP_TYPE_NON);
+        BOOST_TEST(message.code == NABTO_COAP_CODE_POST);
+        BOOST_TEST(message.messageId == 0);
+        BOOST_TEST(message.token.tokenLength == 1);
+        BOOST_TEST(message.token.token[0] == 0x5A);
+        BOOST_TEST(message.payloadLength == c.bodyLength - 1);
+        BOOST_TEST(message.payload[message.payloadLength - 1] == (uint8_t)(c.bodyLength - 2));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(parse_wrong_size)
+{
+    uint8_t* frameEnd;
+    std::vector<uint8_t> frame = make_frame(300, &frameEnd);
+    struct nabto_coap_incoming_message message;
+    BOOST_TEST(!nabto_coap_parse_frame(frame.data(), frame.size() - 1, &message));
+    frame.push_back(0);
+    BOOST_TEST(!nabto_coap_parse_frame(frame.data(), frame.size(), &message));
+    BOOST_TEST(!nabto_coap_parse_frame(frame.data(), 0, &message));
+}
+
+BOOST_AUTO_TEST_CASE(empty_body)
+{
+    uint8_t buffer[16];
+    struct nabto_coap_message_header header;
+    memset(&header, 0, sizeof(struct nabto_coap_message_header));
+    header.type = NABTO_COAP_TYPE_NON;
+    header.code = (nabto_coap_code)NABTO_COAP_SIGNAL_PING;
+    uint8_t* ptr = nabto_coap_encode_header(&header, buffer, buffer + sizeof(buffer));
+    uint8_t* frameEnd = nabto_coap_datagram_to_frame(buffer, ptr, buffer + sizeof(buffer));
+    BOOST_REQUIRE(frameEnd != (uint8_t*)NULL);
+    BOOST_TEST(frameEnd - buffer == 2);
+    BOOST_TEST(buffer[0] == 0x00);
+    BOOST_TEST(buffer[1] == NABTO_COAP_SIGNAL_PING);
+
+    size_t frameSize;
+    BOOST_TEST(!nabto_coap_frame_size(buffer, 0, &frameSize));
+    BOOST_TEST(nabto_coap_frame_size(buffer, 1, &frameSize));
+    BOOST_TEST(frameSize == (size_t)2);
+}
+
+BOOST_AUTO_TEST_CASE(frame_does_not_fit)
+{
+    // A frame with a four byte extended length is two bytes longer than
+    // the datagram it is made from.
+    size_t bodyLength = 65805;
+    std::vector<uint8_t> buffer(4 + 1 + bodyLength);
+    struct nabto_coap_message_header header;
+    memset(&header, 0, sizeof(struct nabto_coap_message_header));
+    header.type = NABTO_COAP_TYPE_CON;
+    header.code = NABTO_COAP_CODE_POST;
+    header.token.tokenLength = 1;
+    uint8_t* begin = buffer.data();
+    uint8_t* end = begin + buffer.size();
+    uint8_t* ptr = nabto_coap_encode_header(&header, begin, end);
+    std::vector<uint8_t> payload(bodyLength - 1);
+    ptr = nabto_coap_encode_payload(payload.data(), payload.size(), ptr, end);
+    BOOST_REQUIRE(ptr == end);
+    BOOST_TEST(nabto_coap_datagram_to_frame(begin, ptr, end) == (uint8_t*)NULL);
+    BOOST_TEST(nabto_coap_datagram_to_frame(begin, NULL, end) == (uint8_t*)NULL);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
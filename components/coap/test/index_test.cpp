@@ -0,0 +1,167 @@
+#include <boost/test/unit_test.hpp>
+
+#include "nabto_coap_index.h"
+
+#include <stdlib.h>
+
+#include <vector>
+
+static struct nn_allocator defaultAllocator = {
+    .calloc = &calloc,
+    .free = &free
+};
+
+struct item {
+    uint32_t key;
+};
+
+static bool item_match(const void* i, const void* key)
+{
+    return ((const struct item*)i)->key == *(const uint32_t*)key;
+}
+
+static uint32_t item_hash(uint32_t key)
+{
+    return nabto_coap_hash_bytes(NABTO_COAP_HASH_INIT, (const uint8_t*)&key, sizeof(key));
+}
+
+static void count_visit(void* i, void* userData)
+{
+    (void)i;
+    (*(size_t*)userData)++;
+}
+
+BOOST_AUTO_TEST_SUITE(coap_index)
+
+BOOST_AUTO_TEST_CASE(empty)
+{
+    struct nabto_coap_index index;
+    nabto_coap_index_init(&index, &defaultAllocator);
+    uint32_t key = 42;
+    BOOST_TEST(nabto_coap_index_find(&index, item_hash(key), &item_match, &key) == (void*)NULL);
+    struct item i = { 42 };
+    nabto_coap_index_remove(&index, item_hash(key), &i);
+    BOOST_TEST(index.capacity == (size_t)0);
+    nabto_coap_index_deinit(&index);
+}
+
+BOOST_AUTO_TEST_CASE(insert_find_remove)
+{
+    struct nabto_coap_index index;
+    nabto_coap_index_init(&index, &defaultAllocator);
+    struct item a = { 1 };
+    struct item b = { 2 };
+    BOOST_TEST(nabto_coap_index_insert(&index, item_hash(a.key), &a) == NABTO_COAP_ERROR_OK);
+    BOOST_TEST(nabto_coap_index_insert(&index, item_hash(b.key), &b) == NABTO_COAP_ERROR_OK);
+
+    uint32_t key = 1;
+    BOOST_TEST(nabto_coap_index_find(&index, item_hash(key), &item_match, &key) == (void*)&a);
+    key = 2;
+    BOOST_TEST(nabto_coap_index_find(&index, item_hash(key), &item_match, &key) == (void*)&b);
+    key = 3;
+    BOOST_TEST(nabto_coap_index_find(&index, item_hash(key), &item_match, &key) == (void*)NULL);
+
+    nabto_coap_index_remove(&index, item_hash(a.key), &a);
+    key = 1;
+    BOOST_TEST(nabto_coap_index_find(&index, item_hash(key), &item_match, &key) == (void*)NULL);
+    key = 2;
+    BOOST_TEST(nabto_coap_index_find(&index, item_hash(key), &item_match, &key) == (void*)&b);
+    BOOST_TEST(index.used == (size_t)1);
+    BOOST_TEST(index.deleted == (size_t)1);
+
+    // Removing the last item drops the tombstones.
+    nabto_coap_index_remove(&index, item_hash(b.key), &b);
+    BOOST_TEST(index.used == (size_t)0);
+    BOOST_TEST(index.deleted == (size_t)0);
+    nabto_coap_index_deinit(&index);
+}
+
+BOOST_AUTO_TEST_CASE(duplicate_hashes)
+{
+    // All items share one hash, find has to use match to tell them apart
+    // and probe past the removed ones.
+    struct nabto_coap_index index;
+    nabto_coap_index_init(&index, &defaultAllocator);
+    std::vector<struct item> items(10);
+    for (uint32_t i = 0; i < items.size(); i++) {
+        items[i].key = i;
+        BOOST_TEST(nabto_coap_index_insert(&index, 7, &items[i]) == NABTO_COAP_ERROR_OK);
+    }
+    for (uint32_t i = 0; i < items.size(); i += 2) {
+        nabto_coap_index_remove(&index, 7, &items[i]);
+    }
+    for (uint32_t i = 0; i < items.size(); i++) {
+        void* expected = (i % 2 == 0) ? NULL : &items[i];
+        BOOST_TEST(nabto_coap_index_find(&index, 7, &item_match, &i) == expected);
+    }
+    nabto_coap_index_deinit(&index);
+}
+
+BOOST_AUTO_TEST_CASE(growth)
+{
+    struct nabto_coap_index index;
+    nabto_coap_index_init(&index, &defaultAllocator);
+    std::vector<struct item> items(1000);
+    for (uint32_t i = 0; i < items.size(); i++) {
+        items[i].key = i;
+        BOOST_TEST(nabto_coap_index_insert(&index, item_hash(i), &items[i]) == NABTO_COAP_ERROR_OK);
+        BOOST_TEST(index.used * 4 <= index.capacity * 3);
+    }
+    BOOST_TEST(index.capacity == (size_t)2048);
+    for (uint32_t i = 0; i < items.size(); i++) {
+        BOOST_TEST(nabto_coap_index_find(&index, item_hash(i), &item_match, &i) == (void*)&items[i]);
+    }
+    nabto_coap_index_deinit(&index);
+}
+
+BOOST_AUTO_TEST_CASE(tombstones)
+{
+    // Inserting and removing items without the index ever becoming empty
+    // leaves tombstones, they are dropped by a rehash before the table
+    // can fill up.
+    struct nabto_coap_index index;
+    nabto_coap_index_init(&index, &defaultAllocator);
+    struct item anchor = { 100000 };
+    BOOST_TEST(nabto_coap_index_insert(&index, item_hash(anchor.key), &anchor) == NABTO_COAP_ERROR_OK);
+    std::vector<struct item> items(1000);
+    for (uint32_t i = 0; i < items.size(); i++) {
+        items[i].key = i;
+        BOOST_TEST(nabto_coap_index_insert(&index, item_hash(i), &items[i]) == NABTO_COAP_ERROR_OK);
+        nabto_coap_index_remove(&index, item_hash(i), &items[i]);
+        BOOST_TEST((index.used + index.deleted) * 4 <= index.capacity * 3);
+    }
+    BOOST_TEST(index.used == (size_t)1);
+    BOOST_TEST(index.capacity == (size_t)16);
+    uint32_t key = anchor.key;
+    BOOST_TEST(nabto_coap_index_find(&index, item_hash(key), &item_match, &key) == (void*)&anchor);
+    key = 5;
+    BOOST_TEST(nabto_coap_index_find(&index, item_hash(key), &item_match, &key) == (void*)NULL);
+    nabto_coap_index_deinit(&index);
+}
+
+BOOST_AUTO_TEST_CASE(clear)
+{
+    struct nabto_coap_index index;
+    nabto_coap_index_init(&index, &defaultAllocator);
+    std::vector<struct item> items(20);
+    for (uint32_t i = 0; i < items.size(); i++) {
+        items[i].key = i;
+        nabto_coap_index_insert(&index, item_hash(i), &items[i]);
+    }
+    nabto_coap_index_remove(&index, item_hash(3), &items[3]);
+
+    size_t visited = 0;
+    nabto_coap_index_clear(&index, &count_visit, &visited);
+    BOOST_TEST(visited == (size_t)19);
+    BOOST_TEST(index.used == (size_t)0);
+    BOOST_TEST(index.deleted == (size_t)0);
+    uint32_t key = 4;
+    BOOST_TEST(nabto_coap_index_find(&index, item_hash(key), &item_match, &key) == (void*)NULL);
+
+    // The index can be used again after a clear.
+    BOOST_TEST(nabto_coap_index_insert(&index, item_hash(key), &items[4]) == NABTO_COAP_ERROR_OK);
+    BOOST_TEST(nabto_coap_index_find(&index, item_hash(key), &item_match, &key) == (void*)&items[4]);
+    nabto_coap_index_deinit(&index);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
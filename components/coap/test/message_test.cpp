@@ -0,0 +1,159 @@
+#include <boost/test/unit_test.hpp>
+
+#include <nabto_coap/nabto_coap.h>
+
+#include <string.h>
+
+#include <vector>
+
+// Encode a confirmable GET with the given options and payload.
+static size_t encode_request(uint8_t* buffer, size_t bufferSize, const std::vector<uint16_t>& numbers, const uint8_t* payload, size_t payloadLength)
+{
+    uint8_t* end = buffer + bufferSize;
+    struct nabto_coap_message_header header;
+    memset(&header, 0, sizeof(struct nabto_coap_message_header));
+    header.type = NABTO_COAP_TYPE_CON;
+    header.code = NABTO_COAP_CODE_GET;
+    header.messageId = 4242;
+    header.token.tokenLength = 2;
+    header.token.token[0] = 0xAB;
+    header.token.token[1] = 0xCD;
+    uint8_t* ptr = nabto_coap_encode_header(&header, buffer, end);
+    uint16_t number = 0;
+    for (uint16_t n : numbers) {
+        ptr = nabto_coap_encode_varint_option((uint16_t)(n - number), n, ptr, end);
+        number = n;
+    }
+    ptr = nabto_coap_encode_payload(payload, payloadLength, ptr, end);
+    BOOST_REQUIRE(ptr != (uint8_t*)NULL);
+    return ptr - buffer;
+}
+
+BOOST_AUTO_TEST_SUITE(message)
+
+BOOST_AUTO_TEST_CASE(cbor_uint)
+{
+    struct {
+        uint32_t value;
+        size_t size;
+        uint8_t first;
+    } cases[] = {
+        { 0, 1, 0x00 },
+        { 23, 1, 0x17 },
+        { 24, 2, 0x18 },
+        { 255, 2, 0x18 },
+        { 256, 3, 0x19 },
+        { 65535, 3, 0x19 },
+        { 65536, 5, 0x1A },
+        { 0xFFFFFFFF, 5, 0x1A }
+    };
+    for (auto& c : cases) {
+        uint8_t buffer[8];
+        uint8_t* ptr = nabto_coap_encode_cbor_uint(c.value, buffer, buffer + sizeof(buffer));
+        BOOST_REQUIRE(ptr != (uint8_t*)NULL);
+        BOOST_TEST((size_t)(ptr - buffer) == c.size);
+        BOOST_TEST(buffer[0] == c.first);
+
+        // It does not fit one byte shorter.
+        BOOST_TEST(nabto_coap_encode_cbor_uint(c.value, buffer, buffer + c.size - 1) == (uint8_t*)NULL);
+
+        uint32_t value = 0;
+        BOOST_TEST(nabto_coap_decode_cbor_uint(buffer, ptr, &value) == (const uint8_t*)ptr);
+        BOOST_TEST(value == c.value);
+
+        // Truncated integers are rejected.
+        if (c.size > 1) {
+            BOOST_TEST(nabto_coap_decode_cbor_uint(buffer, ptr - 1, &value) == (const uint8_t*)NULL);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(cbor_uint_sequence)
+{
+    uint32_t values[] = { 1, 30, 300, 70000 };
+    uint8_t buffer[32];
+    uint8_t* ptr = buffer;
+    for (uint32_t v : values) {
+        ptr = nabto_coap_encode_cbor_uint(v, ptr, buffer + sizeof(buffer));
+    }
+    BOOST_REQUIRE(ptr != (uint8_t*)NULL);
+    BOOST_TEST((size_t)(ptr - buffer) == (size_t)(1 + 2 + 3 + 5));
+
+    const uint8_t* p = buffer;
+    for (uint32_t v : values) {
+        uint32_t value;
+        p = nabto_coap_decode_cbor_uint(p, ptr, &value);
+        BOOST_REQUIRE(p != (const uint8_t*)NULL);
+        BOOST_TEST(value == v);
+    }
+    BOOST_TEST(p == (const uint8_t*)ptr);
+}
+
+BOOST_AUTO_TEST_CASE(cbor_uint_invalid)
+{
+    uint32_t value;
+    // Negative integer, major type 1.
+    uint8_t negative[] = { 0x20 };
+    BOOST_TEST(nabto_coap_decode_cbor_uint(negative, negative + sizeof(negative), &value) == (const uint8_t*)NULL);
+    // 64 bit integers are not supported.
+    uint8_t wide[] = { 0x1B, 0, 0, 0, 0, 0, 0, 0, 1 };
+    BOOST_TEST(nabto_coap_decode_cbor_uint(wide, wide + sizeof(wide), &value) == (const uint8_t*)NULL);
+    BOOST_TEST(nabto_coap_decode_cbor_uint(wide, wide, &value) == (const uint8_t*)NULL);
+}
+
+BOOST_AUTO_TEST_CASE(option_table)
+{
+    std::vector<uint16_t> numbers = {
+        NABTO_COAP_OPTION_URI_PATH,
+        NABTO_COAP_OPTION_URI_PATH,
+        NABTO_COAP_OPTION_CONTENT_FORMAT,
+        NABTO_COAP_OPTION_BLOCK2,
+        NABTO_COAP_OPTION_BLOCK2,
+        NABTO_COAP_OPTION_SIZE1
+    };
+    uint8_t payload[] = { 1, 2, 3 };
+    uint8_t buffer[128];
+    size_t size = encode_request(buffer, sizeof(buffer), numbers, payload, sizeof(payload));
+
+    struct nabto_coap_incoming_message message;
+    BOOST_REQUIRE(nabto_coap_parse_message(buffer, size, &message));
+    BOOST_TEST(message.messageId == 4242);
+    BOOST_TEST(message.token.tokenLength == 2);
+    BOOST_TEST(message.optionCount == numbers.size());
+    for (size_t i = 0; i < numbers.size(); i++) {
+        BOOST_TEST(message.optionTable[i].number == numbers[i]);
+        uint32_t value;
+        const uint8_t* data = message.options + message.optionTable[i].offset;
+        BOOST_TEST(nabto_coap_parse_variable_int(data, data + message.optionTable[i].length, 4, &value));
+        BOOST_TEST(value == numbers[i]);
+    }
+    BOOST_TEST(message.hasContentFormat);
+    BOOST_TEST(message.contentFormat == NABTO_COAP_OPTION_CONTENT_FORMAT);
+    BOOST_TEST(message.hasBlock2);
+    BOOST_TEST(message.hasSize1);
+    BOOST_TEST(message.payloadLength == sizeof(payload));
+
+    BOOST_TEST(nabto_coap_find_option(&message, NABTO_COAP_OPTION_URI_PATH, 0) == (size_t)0);
+    BOOST_TEST(nabto_coap_find_option(&message, NABTO_COAP_OPTION_URI_PATH, 1) == (size_t)1);
+    BOOST_TEST(nabto_coap_find_option(&message, NABTO_COAP_OPTION_URI_PATH, 2) == message.optionCount);
+    BOOST_TEST(nabto_coap_find_option(&message, NABTO_COAP_OPTION_BLOCK2, 0) == (size_t)3);
+    BOOST_TEST(nabto_coap_find_option(&message, NABTO_COAP_OPTION_BLOCK2, 4) == (size_t)4);
+    BOOST_TEST(nabto_coap_find_option(&message, NABTO_COAP_OPTION_BLOCK1, 0) == message.optionCount);
+}
+
+BOOST_AUTO_TEST_CASE(max_options)
+{
+    uint8_t buffer[256];
+    std::vector<uint16_t> numbers(NABTO_COAP_MAX_OPTIONS, NABTO_COAP_OPTION_URI_PATH);
+    size_t size = encode_request(buffer, sizeof(buffer), numbers, NULL, 0);
+    struct nabto_coap_incoming_message message;
+    BOOST_TEST(nabto_coap_parse_message(buffer, size, &message));
+    BOOST_TEST(message.optionCount == (size_t)NABTO_COAP_MAX_OPTIONS);
+
+    // One more option than the table has room for.
+    numbers.push_back(NABTO_COAP_OPTION_URI_PATH);
+    size = encode_request(buffer, sizeof(buffer), numbers, NULL, 0);
+    BOOST_TEST(!nabto_coap_parse_message(buffer, size, &message));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
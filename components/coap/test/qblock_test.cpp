@@ -0,0 +1,103 @@
+#include <boost/test/unit_test.hpp>
+
+#include "nabto_coap_qblock.h"
+
+#include <stdlib.h>
+
+static struct nn_allocator defaultAllocator = {
+    .calloc = &calloc,
+    .free = &free
+};
+
+BOOST_AUTO_TEST_SUITE(qblock_map)
+
+BOOST_AUTO_TEST_CASE(in_order)
+{
+    struct nabto_coap_qblock_map map;
+    nabto_coap_qblock_map_init(&map, &defaultAllocator);
+    bool isNew;
+    for (uint32_t i = 0; i < 5; i++) {
+        BOOST_TEST(!nabto_coap_qblock_map_complete(&map));
+        BOOST_TEST(nabto_coap_qblock_map_set(&map, i, i == 4, &isNew) == NABTO_COAP_ERROR_OK);
+        BOOST_TEST(isNew);
+    }
+    BOOST_TEST(map.total == (uint32_t)5);
+    BOOST_TEST(nabto_coap_qblock_map_complete(&map));
+    uint32_t missing[4];
+    BOOST_TEST(nabto_coap_qblock_map_missing(&map, map.total, missing, 4) == (size_t)0);
+    nabto_coap_qblock_map_deinit(&map);
+}
+
+BOOST_AUTO_TEST_CASE(out_of_order)
+{
+    struct nabto_coap_qblock_map map;
+    nabto_coap_qblock_map_init(&map, &defaultAllocator);
+    bool isNew;
+    BOOST_TEST(nabto_coap_qblock_map_set(&map, 3, false, &isNew) == NABTO_COAP_ERROR_OK);
+    BOOST_TEST(nabto_coap_qblock_map_set(&map, 0, false, &isNew) == NABTO_COAP_ERROR_OK);
+    BOOST_TEST(nabto_coap_qblock_map_set(&map, 5, true, &isNew) == NABTO_COAP_ERROR_OK);
+    BOOST_TEST(!nabto_coap_qblock_map_complete(&map));
+    BOOST_TEST(nabto_coap_qblock_map_has(&map, 3));
+    BOOST_TEST(!nabto_coap_qblock_map_has(&map, 4));
+    BOOST_TEST(!nabto_coap_qblock_map_has(&map, 100000));
+
+    uint32_t missing[8];
+    BOOST_TEST(nabto_coap_qblock_map_missing(&map, map.total, missing, 8) == (size_t)3);
+    BOOST_TEST(missing[0] == (uint32_t)1);
+    BOOST_TEST(missing[1] == (uint32_t)2);
+    BOOST_TEST(missing[2] == (uint32_t)4);
+    // At most max blocks are returned.
+    BOOST_TEST(nabto_coap_qblock_map_missing(&map, map.total, missing, 2) == (size_t)2);
+
+    // A block received twice is not new.
+    BOOST_TEST(nabto_coap_qblock_map_set(&map, 3, false, &isNew) == NABTO_COAP_ERROR_OK);
+    BOOST_TEST(!isNew);
+
+    BOOST_TEST(nabto_coap_qblock_map_set(&map, 1, false, &isNew) == NABTO_COAP_ERROR_OK);
+    BOOST_TEST(nabto_coap_qblock_map_set(&map, 2, false, &isNew) == NABTO_COAP_ERROR_OK);
+    BOOST_TEST(nabto_coap_qblock_map_set(&map, 4, false, &isNew) == NABTO_COAP_ERROR_OK);
+    BOOST_TEST(nabto_coap_qblock_map_complete(&map));
+    nabto_coap_qblock_map_deinit(&map);
+}
+
+BOOST_AUTO_TEST_CASE(beyond_last)
+{
+    struct nabto_coap_qblock_map map;
+    nabto_coap_qblock_map_init(&map, &defaultAllocator);
+    bool isNew;
+    BOOST_TEST(nabto_coap_qblock_map_set(&map, 6, false, &isNew) == NABTO_COAP_ERROR_OK);
+    // The last block cannot be below a block already received.
+    BOOST_TEST(nabto_coap_qblock_map_set(&map, 3, true, &isNew) == NABTO_COAP_ERROR_INVALID_PARAMETER);
+    BOOST_TEST(nabto_coap_qblock_map_set(&map, 7, true, &isNew) == NABTO_COAP_ERROR_OK);
+    BOOST_TEST(nabto_coap_qblock_map_set(&map, 8, false, &isNew) == NABTO_COAP_ERROR_INVALID_PARAMETER);
+    BOOST_TEST(!isNew);
+    BOOST_TEST(map.total == (uint32_t)8);
+    nabto_coap_qblock_map_deinit(&map);
+}
+
+BOOST_AUTO_TEST_CASE(growth)
+{
+    struct nabto_coap_qblock_map map;
+    nabto_coap_qblock_map_init(&map, &defaultAllocator);
+    bool isNew;
+    for (uint32_t i = 0; i < 16; i++) {
+        if (i != 9) {
+            BOOST_TEST(nabto_coap_qblock_map_set(&map, i, false, &isNew) == NABTO_COAP_ERROR_OK);
+        }
+    }
+    BOOST_TEST(nabto_coap_qblock_map_set(&map, 1000, false, &isNew) == NABTO_COAP_ERROR_OK);
+    BOOST_TEST(map.capacity > (uint32_t)1000);
+    BOOST_TEST(map.highest == (uint32_t)1001);
+    BOOST_TEST(nabto_coap_qblock_map_has(&map, 15));
+    BOOST_TEST(nabto_coap_qblock_map_has(&map, 1000));
+
+    // Blocks received before growing are kept.
+    uint32_t missing[3];
+    BOOST_TEST(nabto_coap_qblock_map_missing(&map, map.highest, missing, 3) == (size_t)3);
+    BOOST_TEST(missing[0] == (uint32_t)9);
+    BOOST_TEST(missing[1] == (uint32_t)16);
+    BOOST_TEST(missing[2] == (uint32_t)17);
+    nabto_coap_qblock_map_deinit(&map);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,81 @@
+#include <boost/test/unit_test.hpp>
+
+#include "nabto_coap_rtt.h"
+
+#include <stdlib.h>
+
+static struct nn_allocator defaultAllocator = {
+    .calloc = &calloc,
+    .free = &free
+};
+
+BOOST_AUTO_TEST_SUITE(rtt)
+
+BOOST_AUTO_TEST_CASE(unmeasured)
+{
+    struct nabto_coap_rtt_table* table = nabto_coap_rtt_table_new(&defaultAllocator);
+    BOOST_REQUIRE(table != (struct nabto_coap_rtt_table*)NULL);
+    int connection;
+    BOOST_TEST(nabto_coap_rtt_get_rto(table, &connection, 2000, 0) == (uint32_t)2000);
+
+    // Ambiguous samples are ignored.
+    nabto_coap_rtt_sample(table, &connection, 2000, 0, 100, 0);
+    nabto_coap_rtt_sample(table, &connection, 2000, 4, 100, 0);
+    BOOST_TEST(nabto_coap_rtt_get_rto(table, &connection, 2000, 0) == (uint32_t)2000);
+    nabto_coap_rtt_table_free(table);
+}
+
+BOOST_AUTO_TEST_CASE(strong_and_weak)
+{
+    struct nabto_coap_rtt_table* table = nabto_coap_rtt_table_new(&defaultAllocator);
+    int strong;
+    int weak;
+
+    // A first strong estimate is rtt + 4 * rtt/2 and weighs 2/4.
+    nabto_coap_rtt_sample(table, &strong, 2000, 1, 100, 0);
+    BOOST_TEST(nabto_coap_rtt_get_rto(table, &strong, 2000, 0) == (uint32_t)((2 * 300 + 2 * 2000) / 4));
+
+    // A first weak estimate is rtt + rtt/2 and weighs 1/4.
+    nabto_coap_rtt_sample(table, &weak, 2000, 2, 3000, 0);
+    BOOST_TEST(nabto_coap_rtt_get_rto(table, &weak, 2000, 0) == (uint32_t)((4500 + 3 * 2000) / 4));
+
+    nabto_coap_rtt_remove_connection(table, &strong);
+    BOOST_TEST(nabto_coap_rtt_get_rto(table, &strong, 2000, 0) == (uint32_t)2000);
+    BOOST_TEST(nabto_coap_rtt_get_rto(table, &weak, 2000, 0) == (uint32_t)((4500 + 3 * 2000) / 4));
+    nabto_coap_rtt_table_free(table);
+}
+
+BOOST_AUTO_TEST_CASE(limits_and_aging)
+{
+    struct nabto_coap_rtt_table* table = nabto_coap_rtt_table_new(&defaultAllocator);
+    int fast;
+    int slow;
+    for (int i = 0; i < 20; i++) {
+        nabto_coap_rtt_sample(table, &fast, 2000, 1, 1, 0);
+    }
+    nabto_coap_rtt_sample(table, &slow, 100000, 1, 100000, 0);
+    BOOST_TEST(nabto_coap_rtt_get_rto(table, &fast, 2000, 0) == (uint32_t)NABTO_COAP_RTT_MIN_RTO);
+    BOOST_TEST(nabto_coap_rtt_get_rto(table, &slow, 2000, 0) == (uint32_t)NABTO_COAP_RTT_MAX_RTO);
+
+    // An idle connection drifts back towards the initial RTO.
+    BOOST_TEST(nabto_coap_rtt_get_rto(table, &fast, 2000, 16 * NABTO_COAP_RTT_MIN_RTO + 1) == (uint32_t)(2 * NABTO_COAP_RTT_MIN_RTO));
+    BOOST_TEST(nabto_coap_rtt_get_rto(table, &slow, 2000, 4 * NABTO_COAP_RTT_MAX_RTO + 1) == (uint32_t)((2000 + NABTO_COAP_RTT_MAX_RTO) / 2));
+    nabto_coap_rtt_table_free(table);
+}
+
+BOOST_AUTO_TEST_CASE(backoff)
+{
+    // The classic doubling for a normal RTO.
+    BOOST_TEST(nabto_coap_rtt_backoff(2000, 0) == (uint32_t)2000);
+    BOOST_TEST(nabto_coap_rtt_backoff(2000, 1) == (uint32_t)4000);
+    BOOST_TEST(nabto_coap_rtt_backoff(2000, 3) == (uint32_t)16000);
+
+    // Short RTOs back off by 3, long ones by 1.5.
+    BOOST_TEST(nabto_coap_rtt_backoff(500, 2) == (uint32_t)4500);
+    BOOST_TEST(nabto_coap_rtt_backoff(4000, 2) == (uint32_t)9000);
+
+    BOOST_TEST(nabto_coap_rtt_backoff(40000, 1) == (uint32_t)NABTO_COAP_RTT_MAX_TIMEOUT);
+    BOOST_TEST(nabto_coap_rtt_backoff(2000, 255) == (uint32_t)NABTO_COAP_RTT_MAX_TIMEOUT);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,108 @@
+#include "coap_server_fixture.hpp"
+
+#include <thread>
+
+using namespace nabto::test;
+
+namespace {
+
+const char* asyncText = "done";
+
+void beginAsync(struct nabto_coap_server_request* request, void* userData)
+{
+    nabto_coap_server_request_begin_async(request);
+    ((std::vector<struct nabto_coap_server_request*>*)userData)->push_back(request);
+}
+
+// What a worker thread does with a request.
+void complete(struct nabto_coap_server_request* request)
+{
+    nabto_coap_server_response_set_code(request, NABTO_COAP_CODE_CONTENT);
+    nabto_coap_server_response_set_payload_borrowed(request, asyncText, strlen(asyncText), NULL, NULL);
+    nabto_coap_server_response_ready_async(request);
+}
+
+} // namespace
+
+BOOST_AUTO_TEST_SUITE(server_async)
+
+BOOST_AUTO_TEST_CASE(complete_from_thread)
+{
+    CoapServerFixture f;
+    std::vector<struct nabto_coap_server_request*> kept;
+    f.addResource(NABTO_COAP_CODE_GET, { "test" }, &beginAsync, &kept);
+    int c;
+    f.receive(&c, CoapPacket(NABTO_COAP_TYPE_NON, NABTO_COAP_CODE_GET, 1, 1).path("test"));
+    BOOST_REQUIRE(kept.size() == (size_t)1);
+    BOOST_TEST(f.send().size() == (size_t)0);
+
+    size_t events = f.events_;
+    std::thread worker(&complete, kept[0]);
+    worker.join();
+    BOOST_TEST(f.events_ == events + 1);
+
+    std::vector<SentPacket> sent = f.send();
+    BOOST_REQUIRE(sent.size() == (size_t)1);
+    BOOST_TEST(sent[0].code() == NABTO_COAP_CODE_CONTENT);
+    BOOST_TEST(sent[0].payload() == "done");
+    f.advance(0);
+    BOOST_TEST(f.requests_.activeRequests == (size_t)0);
+}
+
+BOOST_AUTO_TEST_CASE(many_threads)
+{
+    CoapServerFixture f;
+    std::vector<struct nabto_coap_server_request*> kept;
+    f.addResource(NABTO_COAP_CODE_GET, { "test" }, &beginAsync, &kept);
+    int c;
+    const uint16_t count = 200;
+    for (uint16_t i = 0; i < count; i++) {
+        f.receive(&c, CoapPacket(NABTO_COAP_TYPE_NON, NABTO_COAP_CODE_GET, i, (uint8_t)i).path("test"));
+    }
+    BOOST_REQUIRE(kept.size() == (size_t)count);
+
+    // The owning thread keeps sending while the workers complete.
+    std::vector<std::thread> workers;
+    for (size_t w = 0; w < 4; w++) {
+        workers.push_back(std::thread([&kept, w]() {
+            for (size_t i = w; i < kept.size(); i += 4) {
+                complete(kept[i]);
+            }
+        }));
+    }
+    size_t received = 0;
+    while (received < count) {
+        received += f.send().size();
+        std::this_thread::yield();
+    }
+    for (std::thread& t : workers) {
+        t.join();
+    }
+    BOOST_TEST(f.send().size() == (size_t)0);
+    f.advance(0);
+    BOOST_TEST(f.requests_.activeRequests == (size_t)0);
+}
+
+BOOST_AUTO_TEST_CASE(sync_api_refused)
+{
+    CoapServerFixture f;
+    std::vector<struct nabto_coap_server_request*> kept;
+    f.addResource(NABTO_COAP_CODE_GET, { "test" }, &beginAsync, &kept);
+    int c;
+    f.receive(&c, CoapPacket(NABTO_COAP_TYPE_NON, NABTO_COAP_CODE_GET, 1, 1).path("test"));
+    BOOST_REQUIRE(kept.size() == (size_t)1);
+    struct nabto_coap_server_request* request = kept[0];
+
+    BOOST_TEST(nabto_coap_server_response_set_payload(request, "x", 1) == NABTO_COAP_ERROR_INVALID_PARAMETER);
+    BOOST_TEST(nabto_coap_server_response_ready(request) == NABTO_COAP_ERROR_INVALID_PARAMETER);
+    nabto_coap_server_request_free(request);
+    BOOST_TEST(f.send().size() == (size_t)0);
+    BOOST_TEST(f.requests_.activeRequests == (size_t)1);
+
+    complete(request);
+    std::vector<SentPacket> sent = f.send();
+    BOOST_REQUIRE(sent.size() == (size_t)1);
+    BOOST_TEST(sent[0].payload() == "done");
+}
+
+BOOST_AUTO_TEST_SUITE_END()
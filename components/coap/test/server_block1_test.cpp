@@ -0,0 +1,115 @@
+#include "coap_server_fixture.hpp"
+
+using namespace nabto::test;
+
+namespace {
+
+// Keep the reassembled payload in the std::string given as userData.
+void storePayload(struct nabto_coap_server_request* request, void* userData)
+{
+    void* payload;
+    size_t payloadLength;
+    BOOST_REQUIRE(nabto_coap_server_request_get_payload(request, &payload, &payloadLength));
+    *(std::string*)userData = std::string((const char*)payload, payloadLength);
+    nabto_coap_server_response_set_code(request, NABTO_COAP_CODE_CHANGED);
+    nabto_coap_server_response_ready(request);
+    nabto_coap_server_request_free(request);
+}
+
+// A block1 value with 16 byte blocks.
+uint32_t block1(uint32_t num, bool more)
+{
+    return (num << 4) | (more ? (1 << 3) : 0);
+}
+
+CoapPacket block(uint16_t messageId, uint32_t num, bool more, const std::string& payload)
+{
+    return CoapPacket(NABTO_COAP_TYPE_CON, NABTO_COAP_CODE_PUT, messageId, 1)
+        .path("upload")
+        .option(NABTO_COAP_OPTION_BLOCK1, block1(num, more))
+        .payload(payload);
+}
+
+} // namespace
+
+BOOST_AUTO_TEST_SUITE(server_block1)
+
+BOOST_AUTO_TEST_CASE(reassemble)
+{
+    CoapServerFixture f;
+    std::string received;
+    f.addResource(NABTO_COAP_CODE_PUT, { "upload" }, &storePayload, &received);
+    int c;
+    std::string body;
+    for (uint32_t i = 0; i < 4; i++) {
+        std::string payload(16, (char)('a' + i));
+        body += payload;
+        f.receive(&c, block((uint16_t)i, i, true, payload));
+        std::vector<SentPacket> sent = f.send();
+        BOOST_REQUIRE(sent.size() == (size_t)1);
+        BOOST_TEST(sent[0].code() == NABTO_COAP_CODE_CONTINUE);
+        BOOST_TEST(sent[0].messageId() == i);
+    }
+    f.receive(&c, block(4, 4, false, "end"));
+    body += "end";
+    std::vector<SentPacket> sent = f.send();
+    // The empty ACK of the last block and the response.
+    BOOST_REQUIRE(sent.size() == (size_t)2);
+    BOOST_TEST(sent[0].type() == NABTO_COAP_TYPE_ACK);
+    BOOST_TEST(sent[1].code() == NABTO_COAP_CODE_CHANGED);
+    BOOST_TEST(received == body);
+}
+
+BOOST_AUTO_TEST_CASE(size1_over_limit)
+{
+    CoapServerFixture f;
+    std::string received;
+    f.addResource(NABTO_COAP_CODE_PUT, { "upload" }, &storePayload, &received);
+    nabto_coap_server_limit_request_body_size(&f.requests_, 40);
+    int c;
+    f.receive(&c, block(1, 0, true, std::string(16, 'a')).option(NABTO_COAP_OPTION_SIZE1, 100));
+    std::vector<SentPacket> sent = f.send();
+    BOOST_REQUIRE(sent.size() == (size_t)1);
+    BOOST_TEST(sent[0].code() == NABTO_COAP_CODE_REQUEST_ENTITY_TOO_LARGE);
+    BOOST_TEST(sent[0].uintOption(NABTO_COAP_OPTION_SIZE1) == (uint32_t)40);
+    BOOST_TEST(f.requests_.activeRequests == (size_t)0);
+}
+
+BOOST_AUTO_TEST_CASE(blocks_over_limit)
+{
+    CoapServerFixture f;
+    std::string received;
+    f.addResource(NABTO_COAP_CODE_PUT, { "upload" }, &storePayload, &received);
+    nabto_coap_server_limit_request_body_size(&f.requests_, 40);
+    int c;
+    f.receive(&c, block(1, 0, true, std::string(16, 'a')));
+    BOOST_TEST(f.send().size() == (size_t)1);
+    f.receive(&c, block(2, 1, true, std::string(16, 'b')));
+    BOOST_TEST(f.send().size() == (size_t)1);
+    f.receive(&c, block(3, 2, true, std::string(16, 'c')));
+    std::vector<SentPacket> sent = f.send();
+    BOOST_REQUIRE(sent.size() == (size_t)1);
+    BOOST_TEST(sent[0].code() == NABTO_COAP_CODE_REQUEST_ENTITY_TOO_LARGE);
+    BOOST_TEST(sent[0].uintOption(NABTO_COAP_OPTION_SIZE1) == (uint32_t)40);
+    BOOST_TEST(received.empty());
+}
+
+BOOST_AUTO_TEST_CASE(size1_is_a_hint)
+{
+    // Without a body size limit a huge Size1 must not be reserved up
+    // front.
+    CoapServerFixture f;
+    std::string received;
+    f.addResource(NABTO_COAP_CODE_PUT, { "upload" }, &storePayload, &received);
+    int c;
+    f.receive(&c, block(1, 0, true, std::string(16, 'a')).option(NABTO_COAP_OPTION_SIZE1, 0xFFFFFFFFu));
+    std::vector<SentPacket> sent = f.send();
+    BOOST_REQUIRE(sent.size() == (size_t)1);
+    BOOST_TEST(sent[0].code() == NABTO_COAP_CODE_CONTINUE);
+    BOOST_TEST(nabto_coap_server_get_memory_usage(&f.requests_) < (size_t)4096);
+    f.receive(&c, block(2, 1, false, "end"));
+    BOOST_TEST(f.send().size() == (size_t)2);
+    BOOST_TEST(received == std::string(16, 'a') + "end");
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,101 @@
+#include "coap_server_fixture.hpp"
+
+#include "nabto_coap_server_impl.h"
+
+using namespace nabto::test;
+
+namespace {
+
+const char* body = "0123456789abcdef0123456789abcdef0123456789";
+
+size_t expiredResponses(CoapServerFixture& f)
+{
+#ifdef NABTO_COAP_SERVER_METRICS
+    struct nabto_coap_server_metrics metrics;
+    nabto_coap_server_get_metrics(&f.requests_, &metrics);
+    return (size_t)metrics.expired;
+#else
+    (void)f;
+    return 0;
+#endif
+}
+
+} // namespace
+
+BOOST_AUTO_TEST_SUITE(server_block2)
+
+BOOST_AUTO_TEST_CASE(wait_for_next_block)
+{
+    // A Block2 response whose block has been acked waits for the
+    // request of the next block. It is freed if the client never asks,
+    // without being counted as expired.
+    CoapServerFixture f;
+    f.addResource(NABTO_COAP_CODE_GET, { "test" }, &respondWithText, (void*)body);
+    int c;
+    f.receive(&c, CoapPacket(NABTO_COAP_TYPE_CON, NABTO_COAP_CODE_GET, 1, 1).path("test").option(NABTO_COAP_OPTION_BLOCK2, 0));
+    std::vector<SentPacket> sent = f.send();
+    BOOST_REQUIRE(sent.size() == (size_t)2);
+    BOOST_TEST(sent[1].payload() == std::string(body, 16));
+    f.receive(&c, CoapPacket(NABTO_COAP_TYPE_ACK, NABTO_COAP_CODE_EMPTY, sent[1].messageId(), 0));
+
+    f.advance(NABTO_COAP_SERVER_BLOCK2_WAIT - 1);
+    BOOST_TEST(f.send().empty());
+    BOOST_TEST(f.requests_.activeRequests == (size_t)1);
+
+    f.advance(1);
+    BOOST_TEST(f.send().empty());
+    BOOST_TEST(f.requests_.activeRequests == (size_t)0);
+    BOOST_TEST(expiredResponses(f) == (size_t)0);
+}
+
+BOOST_AUTO_TEST_CASE(next_block_after_wait)
+{
+    CoapServerFixture f;
+    f.addResource(NABTO_COAP_CODE_GET, { "test" }, &respondWithText, (void*)body);
+    int c;
+    f.receive(&c, CoapPacket(NABTO_COAP_TYPE_CON, NABTO_COAP_CODE_GET, 1, 1).path("test").option(NABTO_COAP_OPTION_BLOCK2, 0));
+    std::vector<SentPacket> sent = f.send();
+    BOOST_REQUIRE(sent.size() == (size_t)2);
+    f.receive(&c, CoapPacket(NABTO_COAP_TYPE_ACK, NABTO_COAP_CODE_EMPTY, sent[1].messageId(), 0));
+    f.advance(NABTO_COAP_SERVER_BLOCK2_WAIT / 2);
+
+    // The next block is an ordinary exchange again, it is retransmitted
+    // until acked.
+    f.receive(&c, CoapPacket(NABTO_COAP_TYPE_CON, NABTO_COAP_CODE_GET, 2, 1).path("test").option(NABTO_COAP_OPTION_BLOCK2, 1 << 4));
+    sent = f.send();
+    BOOST_REQUIRE(sent.size() == (size_t)1);
+    BOOST_TEST(sent[0].payload() == std::string(body + 16, 16));
+    f.advance(NABTO_COAP_SERVER_BLOCK2_WAIT / 2);
+    sent = f.send();
+    BOOST_REQUIRE(sent.size() == (size_t)1);
+    BOOST_TEST(sent[0].payload() == std::string(body + 16, 16));
+    BOOST_TEST(f.requests_.activeRequests == (size_t)1);
+}
+
+BOOST_AUTO_TEST_CASE(qblock2_linger)
+{
+    // After the last block of a Q-Block2 burst the response is kept for
+    // requests for missing blocks, and then freed without being counted
+    // as expired.
+    CoapServerFixture f;
+    f.addResource(NABTO_COAP_CODE_GET, { "test" }, &respondWithText, (void*)body);
+    int c;
+    f.receive(&c, CoapPacket(NABTO_COAP_TYPE_NON, NABTO_COAP_CODE_GET, 1, 1).path("test").option(NABTO_COAP_OPTION_QBLOCK2, 0));
+    std::vector<SentPacket> sent = f.send();
+    BOOST_REQUIRE(sent.size() == (size_t)3);
+    BOOST_TEST(sent[2].payload() == std::string(body + 32));
+
+    f.advance(NABTO_COAP_SERVER_QBLOCK_LINGER - 1);
+    // A missing block is sent again.
+    f.receive(&c, CoapPacket(NABTO_COAP_TYPE_NON, NABTO_COAP_CODE_GET, 2, 1).path("test").option(NABTO_COAP_OPTION_QBLOCK2, 1 << 4));
+    sent = f.send();
+    BOOST_REQUIRE(sent.size() == (size_t)1);
+    BOOST_TEST(sent[0].payload() == std::string(body + 16, 16));
+
+    f.advance(NABTO_COAP_SERVER_QBLOCK_LINGER);
+    BOOST_TEST(f.send().empty());
+    BOOST_TEST(f.requests_.activeRequests == (size_t)0);
+    BOOST_TEST(expiredResponses(f) == (size_t)0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,108 @@
+#include "coap_server_fixture.hpp"
+
+using namespace nabto::test;
+
+namespace {
+
+CoapPacket put(uint16_t messageId, size_t size)
+{
+    return CoapPacket(NABTO_COAP_TYPE_NON, NABTO_COAP_CODE_PUT, messageId, (uint8_t)messageId).path("test").payload(std::string(size, 'x'));
+}
+
+void requireBusy(const std::vector<SentPacket>& sent, uint16_t messageId, uint32_t maxAge)
+{
+    BOOST_REQUIRE(sent.size() == (size_t)1);
+    BOOST_TEST(sent[0].code() == NABTO_COAP_CODE_SERVICE_UNAVAILABLE);
+    BOOST_TEST(sent[0].messageId() == messageId);
+    BOOST_TEST(sent[0].uintOption(NABTO_COAP_OPTION_MAX_AGE) == maxAge);
+}
+
+} // namespace
+
+BOOST_AUTO_TEST_SUITE(server_budget)
+
+BOOST_AUTO_TEST_CASE(request_bodies)
+{
+    CoapServerFixture f;
+    std::vector<struct nabto_coap_server_request*> kept;
+    f.addResource(NABTO_COAP_CODE_PUT, { "test" }, &keepRequest, &kept);
+    nabto_coap_server_limit_memory(&f.requests_, 100, 60, 7);
+    int a;
+    int b;
+
+    f.receive(&a, put(1, 50));
+    BOOST_REQUIRE(kept.size() == (size_t)1);
+    BOOST_TEST(nabto_coap_server_get_connection_memory_usage(&f.requests_, &a) == (size_t)50);
+
+    // Over the budget of the connection.
+    f.receive(&a, put(2, 20));
+    BOOST_TEST(kept.size() == (size_t)1);
+    requireBusy(f.send(), 2, 7);
+
+    // Another connection has its own budget.
+    f.receive(&b, put(3, 40));
+    BOOST_TEST(kept.size() == (size_t)2);
+    BOOST_TEST(nabto_coap_server_get_memory_usage(&f.requests_) == (size_t)90);
+
+    // Over the total budget.
+    f.receive(&b, put(4, 20));
+    BOOST_TEST(kept.size() == (size_t)2);
+    requireBusy(f.send(), 4, 7);
+
+    // Freeing a request gives its bytes back.
+    nabto_coap_server_send_error_response(kept[0], NABTO_COAP_CODE_CHANGED, NULL);
+    nabto_coap_server_request_free(kept[0]);
+    f.send();
+    f.advance(0);
+    BOOST_TEST(nabto_coap_server_get_connection_memory_usage(&f.requests_, &a) == (size_t)0);
+    f.receive(&a, put(5, 20));
+    BOOST_TEST(kept.size() == (size_t)3);
+    BOOST_TEST(f.send().size() == (size_t)0);
+
+    for (size_t i = 1; i < kept.size(); i++) {
+        nabto_coap_server_send_error_response(kept[i], NABTO_COAP_CODE_CHANGED, NULL);
+        nabto_coap_server_request_free(kept[i]);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(announced_block1_body)
+{
+    CoapServerFixture f;
+    std::vector<struct nabto_coap_server_request*> kept;
+    f.addResource(NABTO_COAP_CODE_PUT, { "test" }, &keepRequest, &kept);
+    nabto_coap_server_limit_memory(&f.requests_, 100, 100, 3);
+    int c;
+    // Size1 tells the body will not fit, rejected at the first block.
+    f.receive(&c, CoapPacket(NABTO_COAP_TYPE_CON, NABTO_COAP_CODE_PUT, 1, 1)
+              .path("test")
+              .option(NABTO_COAP_OPTION_BLOCK1, (0 << 4) | (1 << 3))
+              .option(NABTO_COAP_OPTION_SIZE1, 200)
+              .payload(std::string(16, 'x')));
+    requireBusy(f.send(), 1, 3);
+    BOOST_TEST(f.requests_.activeRequests == (size_t)0);
+    BOOST_TEST(nabto_coap_server_get_memory_usage(&f.requests_) == (size_t)0);
+}
+
+BOOST_AUTO_TEST_CASE(response_payload)
+{
+    CoapServerFixture f;
+    std::vector<struct nabto_coap_server_request*> kept;
+    f.addResource(NABTO_COAP_CODE_GET, { "test" }, &keepRequest, &kept);
+    nabto_coap_server_limit_memory(&f.requests_, 100, 100, 3);
+    int c;
+    f.receive(&c, CoapPacket(NABTO_COAP_TYPE_NON, NABTO_COAP_CODE_GET, 1, 1).path("test"));
+    BOOST_REQUIRE(kept.size() == (size_t)1);
+    std::string large(200, 'x');
+    BOOST_TEST(nabto_coap_server_response_set_payload(kept[0], large.data(), large.size()) == NABTO_COAP_ERROR_OUT_OF_MEMORY);
+    std::string small(50, 'x');
+    BOOST_TEST(nabto_coap_server_response_set_payload(kept[0], small.data(), small.size()) == NABTO_COAP_ERROR_OK);
+    BOOST_TEST(nabto_coap_server_get_memory_usage(&f.requests_) == (size_t)50);
+    nabto_coap_server_response_set_code(kept[0], NABTO_COAP_CODE_CONTENT);
+    nabto_coap_server_response_ready(kept[0]);
+    nabto_coap_server_request_free(kept[0]);
+    BOOST_TEST(f.send().size() == (size_t)1);
+    f.advance(0);
+    BOOST_TEST(nabto_coap_server_get_memory_usage(&f.requests_) == (size_t)0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
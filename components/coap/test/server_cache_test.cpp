@@ -0,0 +1,125 @@
+#include "coap_server_fixture.hpp"
+
+using namespace nabto::test;
+
+namespace {
+
+struct Handler {
+    size_t calls = 0;
+    std::string text = "state";
+};
+
+// Answer with the text and the id parameter if the route has one.
+void respondCounting(struct nabto_coap_server_request* request, void* userData)
+{
+    Handler* handler = (Handler*)userData;
+    handler->calls++;
+    std::string text = handler->text;
+    const char* id = nabto_coap_server_request_get_parameter(request, "id");
+    if (id != NULL) {
+        text += std::string(":") + id;
+    }
+    nabto_coap_server_response_set_code(request, NABTO_COAP_CODE_CONTENT);
+    nabto_coap_server_response_set_payload(request, text.data(), text.size());
+    nabto_coap_server_response_ready(request);
+    nabto_coap_server_request_free(request);
+}
+
+bool denyAll(struct nabto_coap_server_request* request, void* userData)
+{
+    (void)request;
+    (*(size_t*)userData)++;
+    return false;
+}
+
+CoapPacket get(uint16_t messageId, const std::string& path)
+{
+    return CoapPacket(NABTO_COAP_TYPE_NON, NABTO_COAP_CODE_GET, messageId, (uint8_t)messageId).path(path);
+}
+
+SentPacket getOne(CoapServerFixture& f, const CoapPacket& packet)
+{
+    int c;
+    f.receive(&c, packet);
+    std::vector<SentPacket> sent = f.send();
+    BOOST_REQUIRE(sent.size() == (size_t)1);
+    // NON responses are freed at the next timeout.
+    f.advance(0);
+    return sent[0];
+}
+
+} // namespace
+
+BOOST_AUTO_TEST_SUITE(server_cache)
+
+BOOST_AUTO_TEST_CASE(hit_and_valid)
+{
+    CoapServerFixture f;
+    Handler handler;
+    struct nabto_coap_server_resource* resource = f.addResource(NABTO_COAP_CODE_GET, { "state" }, &respondCounting, &handler);
+    nabto_coap_server_resource_enable_cache(&f.server_, resource, 4);
+
+    SentPacket first = getOne(f, get(1, "state"));
+    BOOST_TEST(first.code() == NABTO_COAP_CODE_CONTENT);
+    BOOST_TEST(first.payload() == "state");
+    BOOST_REQUIRE(first.hasOption(NABTO_COAP_OPTION_ETAG));
+    std::vector<uint8_t> etag = first.optionValue(NABTO_COAP_OPTION_ETAG);
+
+    SentPacket second = getOne(f, get(2, "state"));
+    BOOST_TEST(handler.calls == (size_t)1);
+    BOOST_TEST(second.payload() == "state");
+    BOOST_TEST(second.optionValue(NABTO_COAP_OPTION_ETAG) == etag, boost::test_tools::per_element());
+
+    SentPacket valid = getOne(f, get(3, "state").option(NABTO_COAP_OPTION_ETAG, etag));
+    BOOST_TEST(handler.calls == (size_t)1);
+    BOOST_TEST(valid.code() == NABTO_COAP_CODE_VALID);
+    BOOST_TEST(valid.payload() == "");
+    BOOST_TEST(valid.optionValue(NABTO_COAP_OPTION_ETAG) == etag, boost::test_tools::per_element());
+
+    // A changed representation gets a new ETag.
+    nabto_coap_server_resource_invalidate_cache(&f.server_, resource);
+    handler.text = "changed";
+    SentPacket changed = getOne(f, get(4, "state").option(NABTO_COAP_OPTION_ETAG, etag));
+    BOOST_TEST(handler.calls == (size_t)2);
+    BOOST_TEST(changed.code() == NABTO_COAP_CODE_CONTENT);
+    BOOST_TEST(changed.payload() == "changed");
+    BOOST_TEST(changed.optionValue(NABTO_COAP_OPTION_ETAG) != etag);
+}
+
+BOOST_AUTO_TEST_CASE(keyed_by_parameters)
+{
+    CoapServerFixture f;
+    Handler handler;
+    struct nabto_coap_server_resource* resource = f.addResource(NABTO_COAP_CODE_GET, { "items", "{id}" }, &respondCounting, &handler);
+    nabto_coap_server_resource_enable_cache(&f.server_, resource, 4);
+
+    BOOST_TEST(getOne(f, get(1, "items/a")).payload() == "state:a");
+    BOOST_TEST(getOne(f, get(2, "items/b")).payload() == "state:b");
+    BOOST_TEST(getOne(f, get(3, "items/a")).payload() == "state:a");
+    BOOST_TEST(handler.calls == (size_t)2);
+
+    // A value with a zero byte is not the value before the zero.
+    std::vector<uint8_t> withZero = { 'a', 0, 'b' };
+    CoapPacket packet = CoapPacket(NABTO_COAP_TYPE_NON, NABTO_COAP_CODE_GET, 4, 4)
+        .option(NABTO_COAP_OPTION_URI_PATH, std::vector<uint8_t>{ 'i', 't', 'e', 'm', 's' })
+        .option(NABTO_COAP_OPTION_URI_PATH, withZero);
+    getOne(f, packet);
+    BOOST_TEST(handler.calls == (size_t)3);
+}
+
+BOOST_AUTO_TEST_CASE(check_denies_hit)
+{
+    CoapServerFixture f;
+    Handler handler;
+    size_t checks = 0;
+    struct nabto_coap_server_resource* resource = f.addResource(NABTO_COAP_CODE_GET, { "state" }, &respondCounting, &handler);
+    nabto_coap_server_resource_enable_cache(&f.server_, resource, 4);
+    nabto_coap_server_resource_set_cache_check(resource, &denyAll, &checks);
+
+    getOne(f, get(1, "state"));
+    getOne(f, get(2, "state"));
+    BOOST_TEST(checks == (size_t)1);
+    BOOST_TEST(handler.calls == (size_t)2);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
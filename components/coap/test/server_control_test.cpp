@@ -0,0 +1,78 @@
+#include "coap_server_fixture.hpp"
+
+using namespace nabto::test;
+
+namespace {
+
+void answer(struct nabto_coap_server_request* request, const std::string& text)
+{
+    nabto_coap_server_response_set_code(request, NABTO_COAP_CODE_CONTENT);
+    nabto_coap_server_response_set_payload(request, text.data(), text.size());
+    nabto_coap_server_response_ready(request);
+    nabto_coap_server_request_free(request);
+}
+
+} // namespace
+
+BOOST_AUTO_TEST_SUITE(server_control)
+
+BOOST_AUTO_TEST_CASE(full_ring_drops)
+{
+    CoapServerFixture f;
+    int c;
+    const uint16_t count = NABTO_COAP_SERVER_MAX_CONTROL_MESSAGES + 1;
+    for (uint16_t i = 0; i < count; i++) {
+        f.receive(&c, CoapPacket(NABTO_COAP_TYPE_CON, NABTO_COAP_CODE_GET, i, (uint8_t)i).path("missing"));
+    }
+    BOOST_TEST(f.requests_.controlDropped == (size_t)1);
+    std::vector<SentPacket> sent = f.send();
+    BOOST_REQUIRE(sent.size() == (size_t)NABTO_COAP_SERVER_MAX_CONTROL_MESSAGES);
+    for (uint16_t i = 0; i < NABTO_COAP_SERVER_MAX_CONTROL_MESSAGES; i++) {
+        BOOST_TEST(sent[i].messageId() == i);
+        BOOST_TEST(sent[i].code() == NABTO_COAP_CODE_NOT_FOUND);
+    }
+
+    // The dropped request is answered when the client retransmits it.
+    f.receive(&c, CoapPacket(NABTO_COAP_TYPE_CON, NABTO_COAP_CODE_GET, count - 1, (uint8_t)(count - 1)).path("missing"));
+    sent = f.send();
+    BOOST_REQUIRE(sent.size() == (size_t)1);
+    BOOST_TEST(sent[0].messageId() == count - 1);
+    BOOST_TEST(f.requests_.controlDropped == (size_t)1);
+}
+
+BOOST_AUTO_TEST_CASE(removed_connection)
+{
+    CoapServerFixture f;
+    int a;
+    int b;
+    for (uint16_t i = 0; i < 4; i++) {
+        f.receive(&a, CoapPacket(NABTO_COAP_TYPE_CON, NABTO_COAP_CODE_GET, i, 1).path("missing"));
+        f.receive(&b, CoapPacket(NABTO_COAP_TYPE_CON, NABTO_COAP_CODE_GET, i, 2).path("missing"));
+    }
+    nabto_coap_server_remove_connection(&f.requests_, &a);
+    std::vector<SentPacket> sent = f.send();
+    BOOST_REQUIRE(sent.size() == (size_t)4);
+    for (uint16_t i = 0; i < 4; i++) {
+        BOOST_TEST(sent[i].connection == (void*)&b);
+        BOOST_TEST(sent[i].messageId() == i);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(control_messages_first)
+{
+    CoapServerFixture f;
+    std::vector<struct nabto_coap_server_request*> kept;
+    f.addResource(NABTO_COAP_CODE_GET, { "test" }, &keepRequest, &kept);
+    int c;
+    f.receive(&c, CoapPacket(NABTO_COAP_TYPE_NON, NABTO_COAP_CODE_GET, 1, 1).path("test"));
+    BOOST_REQUIRE(kept.size() == (size_t)1);
+    answer(kept[0], "response");
+    // Queued after the response but sent before it.
+    f.receive(&c, CoapPacket(NABTO_COAP_TYPE_CON, NABTO_COAP_CODE_GET, 2, 2).path("missing"));
+    std::vector<SentPacket> sent = f.send();
+    BOOST_REQUIRE(sent.size() == (size_t)2);
+    BOOST_TEST(sent[0].code() == NABTO_COAP_CODE_NOT_FOUND);
+    BOOST_TEST(sent[1].payload() == "response");
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,104 @@
+#include "coap_server_fixture.hpp"
+
+using namespace nabto::test;
+
+BOOST_AUTO_TEST_SUITE(server_index)
+
+BOOST_AUTO_TEST_CASE(same_token_on_two_connections)
+{
+    CoapServerFixture f;
+    std::vector<struct nabto_coap_server_request*> kept;
+    f.addResource(NABTO_COAP_CODE_GET, { "test" }, &keepRequest, &kept);
+    int c1;
+    int c2;
+    f.receive(&c1, CoapPacket(NABTO_COAP_TYPE_NON, NABTO_COAP_CODE_GET, 1, 42).path("test"));
+    f.receive(&c2, CoapPacket(NABTO_COAP_TYPE_NON, NABTO_COAP_CODE_GET, 1, 42).path("test"));
+    BOOST_REQUIRE(kept.size() == (size_t)2);
+    BOOST_TEST(nabto_coap_server_request_get_connection(kept[0]) == (void*)&c1);
+    BOOST_TEST(nabto_coap_server_request_get_connection(kept[1]) == (void*)&c2);
+
+    // Answer the second first, each response goes to its own connection.
+    nabto_coap_server_response_set_payload(kept[1], "two", 3);
+    nabto_coap_server_response_ready(kept[1]);
+    nabto_coap_server_request_free(kept[1]);
+    nabto_coap_server_response_set_payload(kept[0], "one", 3);
+    nabto_coap_server_response_ready(kept[0]);
+    nabto_coap_server_request_free(kept[0]);
+    std::vector<SentPacket> sent = f.send();
+    BOOST_REQUIRE(sent.size() == (size_t)2);
+    for (const SentPacket& p : sent) {
+        BOOST_TEST(p.payload() == ((p.connection == &c1) ? "one" : "two"));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(retransmitted_request)
+{
+    CoapServerFixture f;
+    std::vector<struct nabto_coap_server_request*> kept;
+    f.addResource(NABTO_COAP_CODE_GET, { "test" }, &keepRequest, &kept);
+    int c;
+    f.receive(&c, CoapPacket(NABTO_COAP_TYPE_CON, NABTO_COAP_CODE_GET, 7, 1).path("test"));
+    f.receive(&c, CoapPacket(NABTO_COAP_TYPE_CON, NABTO_COAP_CODE_GET, 7, 1).path("test"));
+    // The second transmission finds the request, the handler sees it once.
+    BOOST_TEST(kept.size() == (size_t)1);
+    std::vector<SentPacket> sent = f.send();
+    BOOST_REQUIRE(sent.size() >= (size_t)1);
+    BOOST_TEST(sent[0].type() == NABTO_COAP_TYPE_ACK);
+    BOOST_TEST(sent[0].messageId() == 7);
+    nabto_coap_server_request_free(kept[0]);
+}
+
+BOOST_AUTO_TEST_CASE(acks_match_responses)
+{
+    CoapServerFixture f;
+    std::vector<struct nabto_coap_server_request*> kept;
+    f.addResource(NABTO_COAP_CODE_GET, { "test" }, &keepRequest, &kept);
+    int connections[4];
+    for (uint16_t i = 0; i < 100; i++) {
+        f.receive(&connections[i % 4], CoapPacket(NABTO_COAP_TYPE_CON, NABTO_COAP_CODE_GET, i, (uint8_t)(i / 4)).path("test"));
+    }
+    BOOST_REQUIRE(kept.size() == (size_t)100);
+    f.send();
+    for (struct nabto_coap_server_request* request : kept) {
+        nabto_coap_server_response_set_code(request, NABTO_COAP_CODE_CONTENT);
+        nabto_coap_server_response_ready(request);
+        nabto_coap_server_request_free(request);
+    }
+    std::vector<SentPacket> sent = f.send();
+    BOOST_REQUIRE(sent.size() == (size_t)100);
+    BOOST_TEST(f.requests_.activeRequests == (size_t)100);
+
+    // An ACK on the wrong connection matches nothing.
+    f.receive(&connections[1], CoapPacket(NABTO_COAP_TYPE_ACK, NABTO_COAP_CODE_EMPTY, sent[0].messageId(), 0));
+    BOOST_TEST(f.requests_.activeRequests == (size_t)100);
+
+    for (const SentPacket& p : sent) {
+        BOOST_TEST(p.type() == NABTO_COAP_TYPE_CON);
+        f.receive(p.connection, CoapPacket(NABTO_COAP_TYPE_ACK, NABTO_COAP_CODE_EMPTY, p.messageId(), 0));
+    }
+    BOOST_TEST(f.requests_.activeRequests == (size_t)0);
+    BOOST_TEST(nabto_coap_server_next_event(&f.requests_) == NABTO_COAP_SERVER_NEXT_EVENT_NOTHING);
+}
+
+BOOST_AUTO_TEST_CASE(removed_connection)
+{
+    CoapServerFixture f;
+    std::vector<struct nabto_coap_server_request*> kept;
+    f.addResource(NABTO_COAP_CODE_GET, { "test" }, &keepRequest, &kept);
+    int c;
+    f.receive(&c, CoapPacket(NABTO_COAP_TYPE_NON, NABTO_COAP_CODE_GET, 1, 1).path("test"));
+    BOOST_REQUIRE(kept.size() == (size_t)1);
+    nabto_coap_server_remove_connection(&f.requests_, &c);
+
+    // The request can no longer be found, a new one with the same token
+    // is a new request.
+    f.receive(&c, CoapPacket(NABTO_COAP_TYPE_NON, NABTO_COAP_CODE_GET, 2, 1).path("test"));
+    BOOST_TEST(kept.size() == (size_t)2);
+
+    BOOST_TEST(nabto_coap_server_response_ready(kept[0]) == NABTO_COAP_ERROR_NO_CONNECTION);
+    nabto_coap_server_request_free(kept[0]);
+    nabto_coap_server_request_free(kept[1]);
+    f.send();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
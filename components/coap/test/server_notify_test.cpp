@@ -0,0 +1,132 @@
+#include "coap_server_fixture.hpp"
+
+using namespace nabto::test;
+
+namespace {
+
+void acceptObserve(struct nabto_coap_server_request* request, void* userData)
+{
+    (void)userData;
+    BOOST_REQUIRE(nabto_coap_server_request_is_observe(request));
+    BOOST_REQUIRE(nabto_coap_server_request_accept_observe(request) == NABTO_COAP_ERROR_OK);
+    nabto_coap_server_response_set_code(request, NABTO_COAP_CODE_CONTENT);
+    nabto_coap_server_response_set_payload(request, "0", 1);
+    nabto_coap_server_response_ready(request);
+    nabto_coap_server_request_free(request);
+}
+
+class ObserveFixture : public CoapServerFixture {
+ public:
+    ObserveFixture(const struct nabto_coap_server_notify_policy& policy)
+    {
+        resource_ = addResource(NABTO_COAP_CODE_GET, { "state" }, &acceptObserve, NULL);
+        nabto_coap_server_resource_set_notify_policy(resource_, &policy);
+        receive(&connection_, CoapPacket(NABTO_COAP_TYPE_NON, NABTO_COAP_CODE_GET, 1, 1)
+                .path("state")
+                .option(NABTO_COAP_OPTION_OBSERVE, std::vector<uint8_t>()));
+        std::vector<SentPacket> sent = send();
+        BOOST_REQUIRE(sent.size() == (size_t)1);
+        BOOST_REQUIRE(sent[0].payload() == "0");
+        BOOST_REQUIRE(sent[0].hasOption(NABTO_COAP_OPTION_OBSERVE));
+    }
+
+    void notify(const std::string& state)
+    {
+        BOOST_REQUIRE(nabto_coap_server_resource_notify(&requests_, resource_, NABTO_COAP_CODE_CONTENT, 0, state.data(), state.size()) == NABTO_COAP_ERROR_OK);
+    }
+
+    // Send and ACK what is ready.
+    std::vector<SentPacket> deliver()
+    {
+        std::vector<SentPacket> sent = send();
+        for (const SentPacket& p : sent) {
+            if (p.type() == NABTO_COAP_TYPE_CON) {
+                receive(&connection_, CoapPacket(NABTO_COAP_TYPE_ACK, NABTO_COAP_CODE_EMPTY, p.messageId(), 0));
+            }
+        }
+        return sent;
+    }
+
+    struct nabto_coap_server_resource* resource_;
+    int connection_;
+};
+
+} // namespace
+
+BOOST_AUTO_TEST_SUITE(server_notify)
+
+BOOST_AUTO_TEST_CASE(every_notification_by_default)
+{
+    struct nabto_coap_server_notify_policy policy = { 0, 0, 0 };
+    ObserveFixture f(policy);
+    for (int i = 1; i <= 3; i++) {
+        f.notify(std::to_string(i));
+        std::vector<SentPacket> sent = f.deliver();
+        BOOST_REQUIRE(sent.size() == (size_t)1);
+        BOOST_TEST(sent[0].type() == NABTO_COAP_TYPE_CON);
+        BOOST_TEST(sent[0].payload() == std::to_string(i));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(min_interval_coalesces)
+{
+    struct nabto_coap_server_notify_policy policy = { 1000, 0, 0 };
+    ObserveFixture f(policy);
+    f.advance(1000);
+    f.notify("1");
+    std::vector<SentPacket> sent = f.deliver();
+    BOOST_REQUIRE(sent.size() == (size_t)1);
+    BOOST_TEST(sent[0].payload() == "1");
+
+    f.advance(100);
+    f.notify("2");
+    f.advance(100);
+    f.notify("3");
+    BOOST_TEST(f.deliver().size() == (size_t)0);
+    f.advance(799);
+    BOOST_TEST(f.deliver().size() == (size_t)0);
+    f.advance(1);
+    sent = f.deliver();
+    BOOST_REQUIRE(sent.size() == (size_t)1);
+    BOOST_TEST(sent[0].payload() == "3");
+}
+
+BOOST_AUTO_TEST_CASE(con_every)
+{
+    struct nabto_coap_server_notify_policy policy = { 0, 0, 3 };
+    ObserveFixture f(policy);
+    size_t con = 0;
+    size_t non = 0;
+    for (int i = 1; i <= 6; i++) {
+        f.notify(std::to_string(i));
+        std::vector<SentPacket> sent = f.deliver();
+        BOOST_REQUIRE(sent.size() == (size_t)1);
+        BOOST_TEST(sent[0].payload() == std::to_string(i));
+        if (sent[0].type() == NABTO_COAP_TYPE_CON) {
+            con++;
+        } else {
+            BOOST_TEST(sent[0].type() == NABTO_COAP_TYPE_NON);
+            non++;
+        }
+    }
+    BOOST_TEST(con == (size_t)2);
+    BOOST_TEST(non == (size_t)4);
+}
+
+BOOST_AUTO_TEST_CASE(max_interval_keepalive)
+{
+    struct nabto_coap_server_notify_policy policy = { 0, 5000, 10 };
+    ObserveFixture f(policy);
+    f.notify("1");
+    std::vector<SentPacket> sent = f.deliver();
+    BOOST_REQUIRE(sent.size() == (size_t)1);
+    f.advance(4999);
+    BOOST_TEST(f.deliver().size() == (size_t)0);
+    f.advance(1);
+    sent = f.deliver();
+    BOOST_REQUIRE(sent.size() == (size_t)1);
+    BOOST_TEST(sent[0].type() == NABTO_COAP_TYPE_CON);
+    BOOST_TEST(sent[0].payload() == "1");
+}
+
+BOOST_AUTO_TEST_SUITE_END()
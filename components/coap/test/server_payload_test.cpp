@@ -0,0 +1,146 @@
+#include "coap_server_fixture.hpp"
+
+using namespace nabto::test;
+
+namespace {
+
+size_t allocations = 0;
+
+void* countingCalloc(size_t n, size_t size)
+{
+    allocations++;
+    return calloc(n, size);
+}
+
+struct Seen {
+    std::string view;
+    size_t viewAllocations = 0;
+    std::string copy;
+    bool copyTerminated = false;
+    size_t copyAllocations = 0;
+    bool keep = false;
+    struct nabto_coap_server_request* kept = NULL;
+};
+
+void readPayload(struct nabto_coap_server_request* request, void* userData)
+{
+    Seen* seen = (Seen*)userData;
+    size_t before = allocations;
+    const void* view;
+    size_t viewLength;
+    BOOST_REQUIRE(nabto_coap_server_request_get_payload_view(request, &view, &viewLength));
+    seen->view = std::string((const char*)view, viewLength);
+    seen->viewAllocations = allocations - before;
+
+    before = allocations;
+    void* copy;
+    size_t copyLength;
+    BOOST_REQUIRE(nabto_coap_server_request_get_payload(request, &copy, &copyLength));
+    seen->copy = std::string((const char*)copy, copyLength);
+    seen->copyTerminated = (((const char*)copy)[copyLength] == 0);
+    seen->copyAllocations = allocations - before;
+
+    if (seen->keep) {
+        seen->kept = request;
+        return;
+    }
+    nabto_coap_server_response_set_code(request, NABTO_COAP_CODE_CHANGED);
+    nabto_coap_server_response_ready(request);
+    nabto_coap_server_request_free(request);
+}
+
+void viewOnly(struct nabto_coap_server_request* request, void* userData)
+{
+    Seen* seen = (Seen*)userData;
+    size_t before = allocations;
+    const void* view;
+    size_t viewLength;
+    BOOST_REQUIRE(nabto_coap_server_request_get_payload_view(request, &view, &viewLength));
+    seen->view = std::string((const char*)view, viewLength);
+    seen->viewAllocations = allocations - before;
+    if (seen->keep) {
+        seen->kept = request;
+        return;
+    }
+    nabto_coap_server_response_set_code(request, NABTO_COAP_CODE_CHANGED);
+    nabto_coap_server_response_ready(request);
+    nabto_coap_server_request_free(request);
+}
+
+CoapPacket put(const std::string& payload)
+{
+    return CoapPacket(NABTO_COAP_TYPE_NON, NABTO_COAP_CODE_PUT, 1, 1).path("test").payload(payload);
+}
+
+} // namespace
+
+BOOST_AUTO_TEST_SUITE(server_payload)
+
+BOOST_AUTO_TEST_CASE(copy_by_default)
+{
+    CoapServerFixture f;
+    Seen seen;
+    f.addResource(NABTO_COAP_CODE_PUT, { "test" }, &readPayload, &seen);
+    f.server_.allocator.calloc = &countingCalloc;
+    int c;
+    f.receive(&c, put("hello"));
+    BOOST_TEST(seen.view == "hello");
+    BOOST_TEST(seen.copy == "hello");
+    BOOST_TEST(seen.copyTerminated);
+    BOOST_TEST(seen.copyAllocations == (size_t)0);
+}
+
+BOOST_AUTO_TEST_CASE(borrowed_view)
+{
+    CoapServerFixture f;
+    nabto_coap_server_borrow_request_payloads(&f.requests_, true);
+    Seen seen;
+    f.addResource(NABTO_COAP_CODE_PUT, { "test" }, &viewOnly, &seen);
+    f.server_.allocator.calloc = &countingCalloc;
+    int c;
+    f.receive(&c, put("hello"));
+    BOOST_TEST(seen.view == "hello");
+    BOOST_TEST(seen.viewAllocations == (size_t)0);
+    BOOST_TEST(f.send().size() == (size_t)1);
+    // A NON response is freed at the next timeout.
+    f.advance(0);
+    BOOST_TEST(f.requests_.activeRequests == (size_t)0);
+    BOOST_TEST(nabto_coap_server_get_memory_usage(&f.requests_) == (size_t)0);
+}
+
+BOOST_AUTO_TEST_CASE(borrowed_payload_is_copied_when_asked_for)
+{
+    // A handler which is unaware of borrowing still gets a zero
+    // terminated copy.
+    CoapServerFixture f;
+    nabto_coap_server_borrow_request_payloads(&f.requests_, true);
+    Seen seen;
+    f.addResource(NABTO_COAP_CODE_PUT, { "test" }, &readPayload, &seen);
+    f.server_.allocator.calloc = &countingCalloc;
+    int c;
+    f.receive(&c, put("hello"));
+    BOOST_TEST(seen.view == "hello");
+    BOOST_TEST(seen.copy == "hello");
+    BOOST_TEST(seen.copyTerminated);
+    BOOST_TEST(seen.copyAllocations == (size_t)1);
+}
+
+BOOST_AUTO_TEST_CASE(kept_request_gets_a_copy)
+{
+    CoapServerFixture f;
+    nabto_coap_server_borrow_request_payloads(&f.requests_, true);
+    Seen seen;
+    seen.keep = true;
+    f.addResource(NABTO_COAP_CODE_PUT, { "test" }, &viewOnly, &seen);
+    int c;
+    f.receive(&c, put("hello"));
+    BOOST_REQUIRE(seen.kept != (struct nabto_coap_server_request*)NULL);
+    void* payload;
+    size_t payloadLength;
+    BOOST_REQUIRE(nabto_coap_server_request_get_payload(seen.kept, &payload, &payloadLength));
+    BOOST_TEST(std::string((const char*)payload) == "hello");
+    BOOST_TEST(payloadLength == (size_t)5);
+    nabto_coap_server_request_free(seen.kept);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,58 @@
+#include "coap_server_fixture.hpp"
+
+using namespace nabto::test;
+
+BOOST_AUTO_TEST_SUITE(server_pool)
+
+BOOST_AUTO_TEST_CASE(requests_pool_limit)
+{
+    CoapServerFixture f;
+    std::vector<struct nabto_coap_server_request*> kept;
+    f.addResource(NABTO_COAP_CODE_GET, { "test" }, &keepRequest, &kept);
+    nabto_coap_server_limit_pool(&f.server_, NABTO_COAP_SERVER_POOL_REQUESTS, 2);
+    int c;
+    for (uint8_t i = 0; i < 3; i++) {
+        f.receive(&c, CoapPacket(NABTO_COAP_TYPE_NON, NABTO_COAP_CODE_GET, i, i).path("test"));
+    }
+    BOOST_TEST(kept.size() == (size_t)2);
+    std::vector<SentPacket> sent = f.send();
+    BOOST_REQUIRE(sent.size() == (size_t)1);
+    BOOST_TEST(sent[0].code() == NABTO_COAP_CODE_SERVICE_UNAVAILABLE);
+    BOOST_TEST(sent[0].messageId() == 2);
+
+    struct nabto_coap_server_pool_stats stats;
+    nabto_coap_server_get_pool_stats(&f.server_, NABTO_COAP_SERVER_POOL_REQUESTS, &stats);
+    BOOST_TEST(stats.inUse == (size_t)2);
+    BOOST_TEST(stats.peak == (size_t)2);
+    BOOST_TEST(stats.failures == (size_t)1);
+
+    // A freed request makes room for the next one.
+    nabto_coap_server_send_error_response(kept[0], NABTO_COAP_CODE_NOT_FOUND, NULL);
+    nabto_coap_server_request_free(kept[0]);
+    BOOST_TEST(f.send().size() == (size_t)1);
+    f.advance(0);
+    nabto_coap_server_get_pool_stats(&f.server_, NABTO_COAP_SERVER_POOL_REQUESTS, &stats);
+    BOOST_TEST(stats.inUse == (size_t)1);
+    f.receive(&c, CoapPacket(NABTO_COAP_TYPE_NON, NABTO_COAP_CODE_GET, 3, 3).path("test"));
+    BOOST_TEST(kept.size() == (size_t)3);
+    BOOST_TEST(f.send().size() == (size_t)0);
+}
+
+BOOST_AUTO_TEST_CASE(parameters_pool_limit)
+{
+    CoapServerFixture f;
+    std::vector<struct nabto_coap_server_request*> kept;
+    f.addResource(NABTO_COAP_CODE_GET, { "items", "{id}" }, &keepRequest, &kept);
+    nabto_coap_server_limit_pool(&f.server_, NABTO_COAP_SERVER_POOL_PARAMETERS, 1);
+    int c;
+    f.receive(&c, CoapPacket(NABTO_COAP_TYPE_NON, NABTO_COAP_CODE_GET, 1, 1).path("items/a"));
+    f.receive(&c, CoapPacket(NABTO_COAP_TYPE_NON, NABTO_COAP_CODE_GET, 2, 2).path("items/b"));
+    BOOST_REQUIRE(kept.size() == (size_t)1);
+    BOOST_TEST(std::string(nabto_coap_server_request_get_parameter(kept[0], "id")) == "a");
+    std::vector<SentPacket> sent = f.send();
+    BOOST_REQUIRE(sent.size() == (size_t)1);
+    BOOST_TEST(sent[0].code() == NABTO_COAP_CODE_SERVICE_UNAVAILABLE);
+    BOOST_TEST(sent[0].messageId() == 2);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
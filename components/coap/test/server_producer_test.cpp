@@ -0,0 +1,97 @@
+#include "coap_server_fixture.hpp"
+
+using namespace nabto::test;
+
+namespace {
+
+// Produce a body of bodySize bytes, byte i is 'a' + i % 26.
+struct Body {
+    size_t bodySize;
+    size_t calls = 0;
+};
+
+nabto_coap_error produce(void* userData, size_t offset, uint8_t* buffer, size_t bufferSize, size_t* written, bool* more)
+{
+    Body* body = (Body*)userData;
+    body->calls++;
+    size_t n = 0;
+    while (n < bufferSize && offset + n < body->bodySize) {
+        buffer[n] = (uint8_t)('a' + (offset + n) % 26);
+        n++;
+    }
+    *written = n;
+    *more = (offset + n < body->bodySize);
+    return NABTO_COAP_ERROR_OK;
+}
+
+void respondWithProducer(struct nabto_coap_server_request* request, void* userData)
+{
+    nabto_coap_server_response_set_code(request, NABTO_COAP_CODE_CONTENT);
+    nabto_coap_server_response_set_payload_producer(request, &produce, NULL, userData);
+    nabto_coap_server_response_ready(request);
+    nabto_coap_server_request_free(request);
+}
+
+std::string expectedBody(size_t offset, size_t length)
+{
+    std::string s;
+    for (size_t i = offset; i < offset + length; i++) {
+        s.push_back((char)('a' + i % 26));
+    }
+    return s;
+}
+
+} // namespace
+
+BOOST_AUTO_TEST_SUITE(server_producer)
+
+BOOST_AUTO_TEST_CASE(blocks)
+{
+    CoapServerFixture f;
+    Body body{ 100 };
+    f.addResource(NABTO_COAP_CODE_GET, { "test" }, &respondWithProducer, &body);
+    int c;
+    f.receive(&c, CoapPacket(NABTO_COAP_TYPE_CON, NABTO_COAP_CODE_GET, 1, 1).path("test").option(NABTO_COAP_OPTION_BLOCK2, 2)); // 64 byte blocks
+    std::vector<SentPacket> sent = f.send();
+    BOOST_REQUIRE(sent.size() == (size_t)2);
+    BOOST_TEST(sent[1].payload() == expectedBody(0, 64));
+    BOOST_TEST(sent[1].uintOption(NABTO_COAP_OPTION_BLOCK2) == (uint32_t)((0 << 4) | (1 << 3) | 2));
+    f.receive(&c, CoapPacket(NABTO_COAP_TYPE_ACK, NABTO_COAP_CODE_EMPTY, sent[1].messageId(), 0));
+    f.receive(&c, CoapPacket(NABTO_COAP_TYPE_CON, NABTO_COAP_CODE_GET, 2, 1).path("test").option(NABTO_COAP_OPTION_BLOCK2, (1 << 4) | 2));
+    sent = f.send();
+    BOOST_REQUIRE(sent.size() == (size_t)1);
+    BOOST_TEST(sent[0].payload() == expectedBody(64, 36));
+    BOOST_TEST(sent[0].uintOption(NABTO_COAP_OPTION_BLOCK2) == (uint32_t)((1 << 4) | 2));
+}
+
+BOOST_AUTO_TEST_CASE(buffer_too_small)
+{
+    CoapServerFixture f;
+    Body body{ 2000 };
+    f.addResource(NABTO_COAP_CODE_GET, { "test" }, &respondWithProducer, &body);
+    int c;
+    f.receive(&c, CoapPacket(NABTO_COAP_TYPE_CON, NABTO_COAP_CODE_GET, 1, 1).path("test"));
+
+    // The empty ACK goes first.
+    std::vector<uint8_t> buffer(1500);
+    BOOST_REQUIRE(nabto_coap_server_handle_send(&f.requests_, buffer.data(), buffer.data() + buffer.size()) != (uint8_t*)NULL);
+
+    // No room for a block, the response is neither sent nor considered
+    // sent.
+    BOOST_REQUIRE(nabto_coap_server_next_event(&f.requests_) == NABTO_COAP_SERVER_NEXT_EVENT_SEND);
+    BOOST_TEST(nabto_coap_server_handle_send(&f.requests_, buffer.data(), buffer.data() + 20) == (uint8_t*)NULL);
+    uint32_t next;
+    BOOST_TEST(!nabto_coap_server_get_next_timeout(&f.requests_, &next));
+    BOOST_TEST(nabto_coap_server_next_event(&f.requests_) == NABTO_COAP_SERVER_NEXT_EVENT_SEND);
+
+    std::vector<SentPacket> sent = f.send();
+    BOOST_REQUIRE(sent.size() == (size_t)1);
+    std::string payload = sent[0].payload();
+    BOOST_TEST(payload.size() > (size_t)20);
+    BOOST_TEST(payload == expectedBody(0, payload.size()));
+    // The first retransmission is after the initial timeout.
+    BOOST_REQUIRE(nabto_coap_server_get_next_timeout(&f.requests_, &next));
+    BOOST_TEST(next == f.now_ + NABTO_COAP_ACK_TIMEOUT);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
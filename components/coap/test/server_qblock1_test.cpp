@@ -0,0 +1,123 @@
+#include "coap_server_fixture.hpp"
+
+using namespace nabto::test;
+
+namespace {
+
+void storePayload(struct nabto_coap_server_request* request, void* userData)
+{
+    void* payload;
+    size_t payloadLength;
+    BOOST_REQUIRE(nabto_coap_server_request_get_payload(request, &payload, &payloadLength));
+    *(std::string*)userData = std::string((const char*)payload, payloadLength);
+    nabto_coap_server_response_set_code(request, NABTO_COAP_CODE_CHANGED);
+    nabto_coap_server_response_ready(request);
+    nabto_coap_server_request_free(request);
+}
+
+CoapPacket qblock(uint16_t messageId, uint32_t num, bool more, uint32_t szx, const std::string& payload)
+{
+    return CoapPacket(NABTO_COAP_TYPE_NON, NABTO_COAP_CODE_PUT, messageId, 1)
+        .path("upload")
+        .option(NABTO_COAP_OPTION_QBLOCK1, (num << 4) | (more ? (1 << 3) : 0) | szx)
+        .payload(payload);
+}
+
+std::vector<uint32_t> missingBlocks(const SentPacket& packet)
+{
+    std::string payload = packet.payload();
+    const uint8_t* ptr = (const uint8_t*)payload.data();
+    const uint8_t* end = ptr + payload.size();
+    std::vector<uint32_t> missing;
+    uint32_t num;
+    while (ptr < end && (ptr = nabto_coap_decode_cbor_uint(ptr, end, &num)) != NULL) {
+        missing.push_back(num);
+    }
+    return missing;
+}
+
+} // namespace
+
+BOOST_AUTO_TEST_SUITE(server_qblock1)
+
+BOOST_AUTO_TEST_CASE(reassemble_out_of_order)
+{
+    CoapServerFixture f;
+    std::string received;
+    f.addResource(NABTO_COAP_CODE_PUT, { "upload" }, &storePayload, &received);
+    int c;
+    f.receive(&c, qblock(1, 2, false, 0, "end"));
+    f.receive(&c, qblock(2, 0, true, 0, std::string(16, 'a')));
+    // The last block has been seen, block 1 is asked for.
+    std::vector<SentPacket> sent = f.send();
+    BOOST_REQUIRE(sent.size() == (size_t)1);
+    BOOST_TEST(sent[0].code() == NABTO_COAP_CODE_REQUEST_ENTITY_INCOMPLETE);
+    BOOST_TEST((missingBlocks(sent[0]) == std::vector<uint32_t>{ 1 }));
+
+    f.receive(&c, qblock(3, 1, true, 0, std::string(16, 'b')));
+    sent = f.send();
+    BOOST_REQUIRE(sent.size() == (size_t)1);
+    BOOST_TEST(sent[0].code() == NABTO_COAP_CODE_CHANGED);
+    BOOST_TEST(received == std::string(16, 'a') + std::string(16, 'b') + "end");
+    f.advance(0);
+}
+
+BOOST_AUTO_TEST_CASE(size1_is_a_hint)
+{
+    CoapServerFixture f;
+    std::string received;
+    f.addResource(NABTO_COAP_CODE_PUT, { "upload" }, &storePayload, &received);
+    int c;
+    f.receive(&c, qblock(1, 0, true, 0, std::string(16, 'a')).option(NABTO_COAP_OPTION_SIZE1, 1000 * 1000));
+    BOOST_TEST(f.send().empty());
+    BOOST_TEST(nabto_coap_server_get_memory_usage(&f.requests_) < (size_t)4096);
+    f.receive(&c, qblock(2, 1, false, 0, "end"));
+    BOOST_TEST(f.send().size() == (size_t)1);
+    BOOST_TEST(received == std::string(16, 'a') + "end");
+    f.advance(0);
+}
+
+BOOST_AUTO_TEST_CASE(far_block_is_dropped)
+{
+    CoapServerFixture f;
+    std::string received;
+    f.addResource(NABTO_COAP_CODE_PUT, { "upload" }, &storePayload, &received);
+    int c;
+    f.receive(&c, qblock(1, 0, true, 0, std::string(16, 'a')));
+    BOOST_TEST(f.send().empty());
+    // Nothing is reserved for block 1000, the blocks after block 0 are
+    // asked for instead.
+    f.receive(&c, qblock(2, 1000, true, 0, std::string(16, 'x')));
+    BOOST_TEST(nabto_coap_server_get_memory_usage(&f.requests_) < (size_t)4096);
+    std::vector<SentPacket> sent = f.send();
+    BOOST_REQUIRE(sent.size() == (size_t)1);
+    BOOST_TEST(sent[0].code() == NABTO_COAP_CODE_REQUEST_ENTITY_INCOMPLETE);
+    std::vector<uint32_t> missing = missingBlocks(sent[0]);
+    BOOST_REQUIRE(missing.size() == (size_t)NABTO_COAP_QBLOCK_MAX_PAYLOADS);
+    BOOST_TEST(missing[0] == (uint32_t)1);
+    BOOST_TEST(missing.back() == (uint32_t)NABTO_COAP_QBLOCK_MAX_PAYLOADS);
+
+    // The body arrives when the client has caught up.
+    f.receive(&c, qblock(3, 1, false, 0, "end"));
+    BOOST_TEST(f.send().size() == (size_t)1);
+    BOOST_TEST(received == std::string(16, 'a') + "end");
+    f.advance(0);
+}
+
+BOOST_AUTO_TEST_CASE(default_limit)
+{
+    // Without a request body limit a Q-Block1 body is still bounded.
+    CoapServerFixture f;
+    std::string received;
+    f.addResource(NABTO_COAP_CODE_PUT, { "upload" }, &storePayload, &received);
+    int c;
+    f.receive(&c, qblock(1, 0, true, 6, std::string(1024, 'a')).option(NABTO_COAP_OPTION_SIZE1, NABTO_COAP_QBLOCK_DEFAULT_MAX_BODY_SIZE + 1));
+    std::vector<SentPacket> sent = f.send();
+    BOOST_REQUIRE(sent.size() == (size_t)1);
+    BOOST_TEST(sent[0].code() == NABTO_COAP_CODE_REQUEST_ENTITY_TOO_LARGE);
+    BOOST_TEST(sent[0].uintOption(NABTO_COAP_OPTION_SIZE1) == (uint32_t)NABTO_COAP_QBLOCK_DEFAULT_MAX_BODY_SIZE);
+    BOOST_TEST(f.requests_.activeRequests == (size_t)0);
+    BOOST_TEST(received.empty());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
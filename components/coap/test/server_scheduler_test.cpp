@@ -0,0 +1,69 @@
+#include "coap_server_fixture.hpp"
+
+using namespace nabto::test;
+
+namespace {
+
+// Answer a kept request with the given text as payload.
+void answer(struct nabto_coap_server_request* request, const std::string& text)
+{
+    nabto_coap_server_response_set_code(request, NABTO_COAP_CODE_CONTENT);
+    nabto_coap_server_response_set_payload(request, text.data(), text.size());
+    nabto_coap_server_response_ready(request);
+    nabto_coap_server_request_free(request);
+}
+
+// Receive three NON requests on each of two connections and answer
+// all of the first connection's requests before the second's.
+std::vector<SentPacket> answerTwoConnections(CoapServerFixture& f)
+{
+    std::vector<struct nabto_coap_server_request*> kept;
+    f.addResource(NABTO_COAP_CODE_GET, { "test" }, &keepRequest, &kept);
+    int a;
+    int b;
+    for (uint8_t i = 0; i < 3; i++) {
+        f.receive(&a, CoapPacket(NABTO_COAP_TYPE_NON, NABTO_COAP_CODE_GET, i, i).path("test"));
+        f.receive(&b, CoapPacket(NABTO_COAP_TYPE_NON, NABTO_COAP_CODE_GET, i, i).path("test"));
+    }
+    BOOST_REQUIRE(kept.size() == (size_t)6);
+    for (size_t i = 0; i < 6; i += 2) {
+        answer(kept[i], "a" + std::to_string(i / 2));
+    }
+    for (size_t i = 1; i < 6; i += 2) {
+        answer(kept[i], "b" + std::to_string(i / 2));
+    }
+    std::vector<SentPacket> sent = f.send();
+    BOOST_REQUIRE(sent.size() == (size_t)6);
+    return sent;
+}
+
+std::vector<std::string> payloads(const std::vector<SentPacket>& sent)
+{
+    std::vector<std::string> result;
+    for (const SentPacket& p : sent) {
+        result.push_back(p.payload());
+    }
+    return result;
+}
+
+} // namespace
+
+BOOST_AUTO_TEST_SUITE(server_scheduler)
+
+BOOST_AUTO_TEST_CASE(fifo_order)
+{
+    CoapServerFixture f;
+    nabto_coap_server_set_send_policy(&f.requests_, NABTO_COAP_SERVER_SEND_POLICY_FIFO);
+    std::vector<std::string> expected = { "a0", "a1", "a2", "b0", "b1", "b2" };
+    BOOST_TEST(payloads(answerTwoConnections(f)) == expected, boost::test_tools::per_element());
+}
+
+BOOST_AUTO_TEST_CASE(fair_interleaves_connections)
+{
+    CoapServerFixture f;
+    nabto_coap_server_set_send_policy(&f.requests_, NABTO_COAP_SERVER_SEND_POLICY_FAIR);
+    std::vector<std::string> expected = { "a0", "b0", "a1", "b1", "a2", "b2" };
+    BOOST_TEST(payloads(answerTwoConnections(f)) == expected, boost::test_tools::per_element());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,118 @@
+#include "coap_server_fixture.hpp"
+
+using namespace nabto::test;
+
+// Answer a request and free it, such that only the response is left.
+static void answer(struct nabto_coap_server_request* request)
+{
+    nabto_coap_server_response_set_code(request, NABTO_COAP_CODE_CONTENT);
+    nabto_coap_server_response_ready(request);
+    nabto_coap_server_request_free(request);
+}
+
+BOOST_AUTO_TEST_SUITE(server_timers)
+
+BOOST_AUTO_TEST_CASE(retransmit_until_expired)
+{
+    CoapServerFixture f;
+    std::vector<struct nabto_coap_server_request*> kept;
+    f.addResource(NABTO_COAP_CODE_GET, { "test" }, &keepRequest, &kept);
+    int c;
+    f.receive(&c, CoapPacket(NABTO_COAP_TYPE_CON, NABTO_COAP_CODE_GET, 1, 1).path("test"));
+    BOOST_REQUIRE(kept.size() == (size_t)1);
+    answer(kept[0]);
+    std::vector<SentPacket> sent = f.send();
+    BOOST_REQUIRE(sent.size() == (size_t)2); // the empty ACK and the response
+    uint16_t messageId = sent[1].messageId();
+
+    // The timeout doubles from the initial 2 s.
+    uint32_t timeout = NABTO_COAP_ACK_TIMEOUT;
+    for (int i = 0; i < NABTO_COAP_MAX_RETRANSMITS; i++) {
+        uint32_t next;
+        BOOST_REQUIRE(nabto_coap_server_get_next_timeout(&f.requests_, &next));
+        BOOST_TEST(next == f.now_ + timeout);
+        f.advance(timeout - 1);
+        BOOST_TEST(f.send().size() == (size_t)0);
+        f.advance(1);
+        sent = f.send();
+        BOOST_REQUIRE(sent.size() == (size_t)1);
+        BOOST_TEST(sent[0].messageId() == messageId);
+        timeout *= 2;
+    }
+    BOOST_TEST(f.requests_.activeRequests == (size_t)1);
+    f.advance(timeout);
+    BOOST_TEST(f.send().size() == (size_t)0);
+    BOOST_TEST(f.requests_.activeRequests == (size_t)0);
+    BOOST_TEST(nabto_coap_server_next_event(&f.requests_) == NABTO_COAP_SERVER_NEXT_EVENT_NOTHING);
+}
+
+BOOST_AUTO_TEST_CASE(earliest_deadline_first)
+{
+    CoapServerFixture f;
+    std::vector<struct nabto_coap_server_request*> kept;
+    f.addResource(NABTO_COAP_CODE_GET, { "test" }, &keepRequest, &kept);
+    int c;
+    // Responses sent 100 ms apart, in reverse order of their tokens.
+    std::vector<uint16_t> messageIds;
+    for (uint16_t i = 0; i < 20; i++) {
+        f.receive(&c, CoapPacket(NABTO_COAP_TYPE_CON, NABTO_COAP_CODE_GET, i, (uint8_t)(20 - i)).path("test"));
+        answer(kept.back());
+        std::vector<SentPacket> sent = f.send();
+        BOOST_REQUIRE(sent.size() == (size_t)2);
+        messageIds.push_back(sent[1].messageId());
+        f.now_ += 100;
+    }
+
+    // ACK every other response, the rest time out in the order they
+    // were sent.
+    for (size_t i = 0; i < messageIds.size(); i += 2) {
+        f.receive(&c, CoapPacket(NABTO_COAP_TYPE_ACK, NABTO_COAP_CODE_EMPTY, messageIds[i], 0));
+    }
+    BOOST_TEST(f.requests_.activeRequests == (size_t)10);
+    uint32_t next;
+    BOOST_REQUIRE(nabto_coap_server_get_next_timeout(&f.requests_, &next));
+    f.now_ = next;
+    nabto_coap_server_handle_timeout(&f.requests_);
+    for (size_t i = 1; i < messageIds.size(); i += 2) {
+        std::vector<SentPacket> sent = f.send();
+        BOOST_REQUIRE(sent.size() == (size_t)1);
+        BOOST_TEST(sent[0].messageId() == messageIds[i]);
+        f.advance(200);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(measured_round_trip)
+{
+    CoapServerFixture f;
+    std::vector<struct nabto_coap_server_request*> kept;
+    f.addResource(NABTO_COAP_CODE_GET, { "test" }, &keepRequest, &kept);
+    int c;
+    // Responses acked after 100 ms give the connection a shorter
+    // timeout than the initial 2 s.
+    for (uint16_t i = 0; i < 4; i++) {
+        f.receive(&c, CoapPacket(NABTO_COAP_TYPE_CON, NABTO_COAP_CODE_GET, i, (uint8_t)i).path("test"));
+        answer(kept.back());
+        std::vector<SentPacket> sent = f.send();
+        BOOST_REQUIRE(sent.size() == (size_t)2);
+        f.now_ += 100;
+        f.receive(&c, CoapPacket(NABTO_COAP_TYPE_ACK, NABTO_COAP_CODE_EMPTY, sent[1].messageId(), 0));
+    }
+    f.receive(&c, CoapPacket(NABTO_COAP_TYPE_CON, NABTO_COAP_CODE_GET, 10, 10).path("test"));
+    answer(kept.back());
+    BOOST_REQUIRE(f.send().size() == (size_t)2);
+    uint32_t next;
+    BOOST_REQUIRE(nabto_coap_server_get_next_timeout(&f.requests_, &next));
+    BOOST_TEST(next - f.now_ < (uint32_t)NABTO_COAP_ACK_TIMEOUT);
+
+    // Another connection still starts from the initial timeout.
+    int other;
+    f.now_ += 10;
+    f.receive(&other, CoapPacket(NABTO_COAP_TYPE_CON, NABTO_COAP_CODE_GET, 11, 11).path("test"));
+    answer(kept.back());
+    BOOST_REQUIRE(f.send().size() == (size_t)2);
+    nabto_coap_server_remove_connection(&f.requests_, &c);
+    BOOST_REQUIRE(nabto_coap_server_get_next_timeout(&f.requests_, &next));
+    BOOST_TEST(next == f.now_ + NABTO_COAP_ACK_TIMEOUT);
+}
+
+BOOST_AUTO_TEST_SUITE_END()